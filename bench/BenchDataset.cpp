@@ -0,0 +1,261 @@
+#include "BenchDataset.h"
+#include "../include/SimulatedIoBackend.h"
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Bytes written per call while generating
+static const uint32_t WRITE_CHUNK = 1024 * 1024;
+
+// Sparse files hold one data extent of this size per SPARSE_STRIDE
+static const long long SPARSE_EXTENT = 1024 * 1024;
+static const long long SPARSE_STRIDE = 4 * 1024 * 1024;
+
+// Small files are spread over this many directories
+static const int SMALL_DIRECTORIES = 16;
+
+// Next value of an xorshift64 generator
+static uint64_t NextRandom(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Generator state for one file (never zero)
+static uint64_t FileSeed(uint64_t seed, uint64_t file)
+{
+    uint64_t state = (seed + 1) * 0x9E3779B97F4A7C15ULL ^ (file + 1) * 0xBF58476D1CE4E5B9ULL;
+    return state ? state : 1;
+}
+
+// Join a directory and a relative path
+static std::string JoinPath(const std::string& directory, const std::string& name)
+{
+    return directory.empty() || directory.back() == '/' ? directory + name : directory + "/" + name;
+}
+
+// Write a file of pseudo-random data; only the ranges listed hold data,
+// the rest of size is left as holes
+static bool WriteFile(const std::string& path, long long size, const std::vector<FileRange>& ranges, uint64_t seed)
+{
+    std::wstring widePath = FileIo::FromNativePath(path);
+    size_t separator = path.find_last_of('/');
+    if (separator != std::string::npos && !DatasetGenerator::CreateTree(path.substr(0, separator)))
+        return false;
+
+    FileHandle handle = FileIo::CreateForWrite(widePath);
+    if (handle == INVALID_FILE_HANDLE)
+        return false;
+
+    bool success = FileIo::SetSize(handle, size);
+    std::vector<uint64_t> buffer(WRITE_CHUNK / sizeof(uint64_t));
+    uint64_t state = seed;
+    for (size_t i = 0; success && i < ranges.size(); i++)
+    {
+        long long end = (std::min)(ranges[i].offset + ranges[i].length, size);
+        for (long long offset = ranges[i].offset; success && offset < end; offset += WRITE_CHUNK)
+        {
+            for (uint64_t& word : buffer)
+                word = NextRandom(state);
+            uint32_t length = static_cast<uint32_t>((std::min)(static_cast<long long>(WRITE_CHUNK), end - offset));
+            uint32_t written = 0;
+            success = FileIo::WriteAt(handle, offset, buffer.data(), length, &written) && written == length;
+        }
+    }
+    FileIo::Close(handle);
+    return success;
+}
+
+// A file that is data from end to end
+static DatasetFile DenseFile(const std::string& path, long long size, uint64_t seed)
+{
+    DatasetFile file;
+    file.path = path;
+    file.size = size;
+    file.ranges.push_back({ 0, size });
+    file.seed = seed;
+    return file;
+}
+
+// Names of the datasets
+const std::vector<std::string>& DatasetGenerator::GetNames()
+{
+    static const std::vector<std::string> names = { "huge", "small", "sparse", "replicas" };
+    return names;
+}
+
+// Lay a dataset out under directory
+bool DatasetGenerator::Plan(const std::string& name, const std::string& directory, const DatasetOptions& options, BenchDataset& dataset)
+{
+    dataset = BenchDataset();
+    dataset.name = name;
+    dataset.logicalBytes = 0;
+    dataset.physicalBytes = 0;
+
+    std::string root = JoinPath(directory, name);
+
+    if (name == "huge")
+    {
+        // One file, as large as asked
+        dataset.roots.push_back(root);
+        dataset.files.push_back(DenseFile("huge.bin", options.hugeSize, FileSeed(options.seed, 0)));
+        dataset.logicalBytes = dataset.physicalBytes = options.hugeSize;
+        return true;
+    }
+
+    if (name == "small")
+    {
+        // Many files of 1KB to 64KB, spread over a few directories
+        dataset.roots.push_back(root);
+        uint64_t sizes = FileSeed(options.seed, 1);
+        for (int i = 0; i < options.smallCount; i++)
+        {
+            char relative[64];
+            snprintf(relative, sizeof(relative), "d%02d/f%05d.bin", i % SMALL_DIRECTORIES, i);
+            long long size = 1024 + static_cast<long long>(NextRandom(sizes) % (63 * 1024 + 1));
+            dataset.files.push_back(DenseFile(relative, size, FileSeed(options.seed, 1000 + i)));
+            dataset.logicalBytes += size;
+            dataset.physicalBytes += size;
+        }
+        return true;
+    }
+
+    if (name == "sparse")
+    {
+        // One data extent at the start of every stride, holes in between
+        DatasetFile file;
+        file.path = "sparse.bin";
+        file.size = options.sparseSize;
+        file.seed = FileSeed(options.seed, 2);
+        for (long long offset = 0; offset < options.sparseSize; offset += SPARSE_STRIDE)
+        {
+            FileRange range;
+            range.offset = offset;
+            range.length = (std::min)(SPARSE_EXTENT, options.sparseSize - offset);
+            file.ranges.push_back(range);
+            dataset.physicalBytes += range.length;
+        }
+        dataset.roots.push_back(root);
+        dataset.files.push_back(file);
+        dataset.logicalBytes = options.sparseSize;
+        return true;
+    }
+
+    if (name == "replicas")
+    {
+        // The same huge file under several roots
+        for (int i = 0; i < options.replicaCount; i++)
+            dataset.roots.push_back(JoinPath(root, "r" + std::to_string(i + 1)));
+        dataset.files.push_back(DenseFile("huge.bin", options.hugeSize, FileSeed(options.seed, 3)));
+        dataset.logicalBytes = dataset.physicalBytes = options.hugeSize;
+        return true;
+    }
+
+    return false;
+}
+
+// Write a dataset under directory
+bool DatasetGenerator::Generate(const std::string& name, const std::string& directory, const DatasetOptions& options, BenchDataset& dataset)
+{
+    if (!Plan(name, directory, options, dataset))
+        return false;
+
+    RemoveTree(JoinPath(directory, name));
+    for (const std::string& root : dataset.roots)
+    {
+        for (const DatasetFile& file : dataset.files)
+        {
+            if (!WriteFile(JoinPath(root, file.path), file.size, file.ranges, file.seed))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Add a dataset's files to a simulated backend
+bool DatasetGenerator::Simulate(const BenchDataset& dataset, SimulatedIoBackend& backend)
+{
+    for (const std::string& root : dataset.roots)
+    {
+        for (const DatasetFile& file : dataset.files)
+        {
+            if (!backend.AddFile(FileIo::FromNativePath(JoinPath(root, file.path)), file.size, file.seed, &file.ranges))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Drop the files of a dataset from the page cache
+void DatasetGenerator::DropCache(const BenchDataset& dataset)
+{
+    // Clean pages only; the files were flushed when they were generated
+    for (const std::string& root : dataset.roots)
+    {
+        for (const DatasetFile& file : dataset.files)
+        {
+            int fd = open(JoinPath(root, file.path).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+// Whether a copy holds exactly the files of a dataset
+bool DatasetGenerator::Verify(const BenchDataset& dataset, const std::string& destination, IoBackend& backend)
+{
+    std::vector<char> expected(WRITE_CHUNK);
+    std::vector<char> actual(WRITE_CHUNK);
+    for (const DatasetFile& file : dataset.files)
+    {
+        std::wstring sourcePath = FileIo::FromNativePath(JoinPath(dataset.roots[0], file.path));
+        std::wstring copyPath = FileIo::FromNativePath(JoinPath(destination, file.path));
+        long long size = 0;
+        long long copySize = -1;
+        if (!backend.GetSize(sourcePath, &size) || !backend.GetSize(copyPath, &copySize) || size != copySize)
+            return false;
+
+        FileHandle source = backend.OpenForRead(sourcePath);
+        FileHandle copy = backend.OpenForRead(copyPath);
+        bool same = source != INVALID_FILE_HANDLE && copy != INVALID_FILE_HANDLE;
+        for (long long offset = 0; same && offset < size; offset += WRITE_CHUNK)
+        {
+            uint32_t length = static_cast<uint32_t>((std::min)(static_cast<long long>(WRITE_CHUNK), size - offset));
+            uint32_t expectedRead = 0;
+            uint32_t actualRead = 0;
+            same = backend.ReadAt(source, offset, expected.data(), length, &expectedRead) &&
+                backend.ReadAt(copy, offset, actual.data(), length, &actualRead) &&
+                expectedRead == length && actualRead == length &&
+                memcmp(expected.data(), actual.data(), length) == 0;
+        }
+        if (source != INVALID_FILE_HANDLE)
+            backend.Close(source);
+        if (copy != INVALID_FILE_HANDLE)
+            backend.Close(copy);
+        if (!same)
+            return false;
+    }
+    return true;
+}
+
+// Create a directory and any missing parents
+bool DatasetGenerator::CreateTree(const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::create_directories(path, error);
+    return !error;
+}
+
+// Delete a directory tree
+void DatasetGenerator::RemoveTree(const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::remove_all(path, error);
+}
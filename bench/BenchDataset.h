@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "../include/FileIo.h"
+
+class IoBackend;
+class SimulatedIoBackend;
+
+// Sizes of the generated datasets
+struct DatasetOptions {
+    long long hugeSize;       // The one huge file, and each replica
+    int smallCount;           // Small files (1KB to 64KB each)
+    long long sparseSize;     // Sparse file; a quarter of it is data
+    int replicaCount;         // Copies of the huge file, each under its own root
+    uint64_t seed;            // Content and small file sizes follow from it
+};
+
+// One file of a dataset
+struct DatasetFile {
+    std::string path;                    // Path under a root
+    long long size;
+    std::vector<FileRange> ranges;       // Where the data is; the rest is holes
+    uint64_t seed;                       // Seed of the content
+};
+
+// A set of source files, on disk or in a simulated backend
+struct BenchDataset {
+    std::string name;                    // "huge", "small", "sparse" or "replicas"
+    std::vector<std::string> roots;      // Source root directories; a file has the same path under each
+    std::vector<DatasetFile> files;      // The files under a root
+    long long logicalBytes;              // Sizes of the files under one root
+    long long physicalBytes;             // Of that, data (holes excluded)
+};
+
+// Writes the benchmark's source datasets: the same options and seed always
+// give the same files, byte for byte
+class DatasetGenerator {
+public:
+    // Names of the datasets, in report order
+    static const std::vector<std::string>& GetNames();
+
+    // Lay a dataset out under directory without writing anything
+    static bool Plan(const std::string& name, const std::string& directory, const DatasetOptions& options, BenchDataset& dataset);
+
+    // Write a dataset under directory (replacing what was there)
+    static bool Generate(const std::string& name, const std::string& directory, const DatasetOptions& options, BenchDataset& dataset);
+
+    // Add a planned dataset's files to a simulated backend; they hold the
+    // same layout and holes, with the simulator's own pattern as content
+    static bool Simulate(const BenchDataset& dataset, SimulatedIoBackend& backend);
+
+    // Drop the files of a dataset from the page cache, so the next copy
+    // reads them from the device
+    static void DropCache(const BenchDataset& dataset);
+
+    // Whether a copy under destination holds exactly the files under the
+    // first root of a dataset, both read through backend
+    static bool Verify(const BenchDataset& dataset, const std::string& destination, IoBackend& backend);
+
+    // Create a directory and any missing parents
+    static bool CreateTree(const std::string& path);
+
+    // Delete a directory tree
+    static void RemoveTree(const std::string& path);
+};
@@ -0,0 +1,543 @@
+// copybench: copies generated datasets with FileCopier across packet sizes,
+// thread counts, copy modes and simulated source devices, and prints one
+// tab-separated line per configuration: throughput, CPU time and p50/p99
+// read and write latency. Rows come out in a fixed order with fixed
+// formatting, so reports from two versions can be diffed line by line.
+// With --backend sim the datasets live in a SimulatedIoBackend instead of
+// on disk, and times and latencies are the simulator's virtual ones.
+
+#include "../include/FileCopier.h"
+#include "../include/SimulatedIoBackend.h"
+#include "BenchDataset.h"
+#include "ThrottleShim.h"
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+
+// Version of the report layout; bump it when columns change
+static const int REPORT_FORMAT = 1;
+
+// Simulated source devices; "mixed" gives each replica root the next one
+// of ssd, hdd and nas, and "none" leaves the sources at full speed
+static const ThrottleProfile PROFILES[] = {
+    { "none", 0.0, 0.0, 0.0 },
+    { "ssd", 500e6, 0.0001, 0.00005 },
+    { "hdd", 120e6, 0.008, 0.002 },
+    { "nas", 60e6, 0.002, 0.005 },
+};
+static const size_t PROFILE_COUNT = sizeof(PROFILES) / sizeof(PROFILES[0]);
+
+// Faults only the simulated backend can play, on top of a device profile
+struct FaultProfile {
+    const char* name;
+    const char* device;       // Profile of the device underneath
+    double failureRate;       // Share of blocks reads fail on
+    double stallRate;         // Share of requests that stall the device
+    double stallSeconds;
+};
+static const FaultProfile FAULT_PROFILES[] = {
+    { "flaky", "nas", 0.01, 0.0, 0.0 },
+    { "stalling", "hdd", 0.0, 0.002, 0.5 },
+};
+static const size_t FAULT_PROFILE_COUNT = sizeof(FAULT_PROFILES) / sizeof(FAULT_PROFILES[0]);
+
+// Copy modes
+static const char* const MODES[] = { "kernel", "buffered", "direct" };
+
+// What to run
+struct BenchOptions {
+    std::string directory;
+    std::string output;
+    std::vector<std::string> datasets;
+    std::vector<std::string> profiles;
+    std::vector<std::string> modes;
+    std::vector<int> packetSizes;        // AUTO_PACKET_SIZE = automatic
+    std::vector<int> threadCounts;       // 0 = one per source device
+    int repeat;
+    bool keep;
+    bool simulated;                      // Run against SimulatedIoBackend
+    DatasetOptions sizes;
+};
+
+// Measurements of one copy
+struct RunResult {
+    std::string status;                  // "ok", "mismatch" or "failed"
+    std::string backend;
+    long long files;
+    long long logicalBytes;
+    long long physicalBytes;
+    double seconds;
+    double userSeconds;
+    double systemSeconds;
+    LatencySnapshot readLatency;
+    LatencySnapshot writeLatency;
+};
+
+// Print the command line help
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "usage: copybench [options]\n"
+        "  --dir PATH          where datasets and copies go (default copybench-data)\n"
+        "  --output FILE       write the report here instead of to stdout\n"
+        "  --datasets LIST     huge,small,sparse,replicas\n"
+        "  --profiles LIST     none,ssd,hdd,nas,mixed, and with --backend sim flaky,stalling\n"
+        "                      (default none,nas)\n"
+        "  --modes LIST        kernel,buffered,direct (default kernel,buffered)\n"
+        "  --packets LIST      packet sizes, e.g. 64K,1M,auto (default 64K,1M,auto)\n"
+        "  --threads LIST      copy threads, e.g. auto,4 (default auto,4)\n"
+        "  --repeat N          runs per configuration; the median is reported (default 3)\n"
+        "  --huge SIZE         size of the huge file and of each replica (default 64M)\n"
+        "  --small N           number of small files (default 1000)\n"
+        "  --sparse SIZE       size of the sparse file (default 64M)\n"
+        "  --replicas N        replicas of the huge file (default 3)\n"
+        "  --seed N            seed of the generated data (default 1)\n"
+        "  --backend NAME      real: datasets on disk; sim: in the simulated backend (default real)\n"
+        "  --quick             small datasets, automatic packet size and threads, one run each\n"
+        "  --keep              leave the datasets on disk\n");
+}
+
+// Split a comma-separated list
+static std::vector<std::string> SplitList(const std::string& text)
+{
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+            end = text.size();
+        if (end > start)
+            items.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
+// Parse a size with an optional K, M or G suffix; -1 if it isn't one
+static long long ParseSize(const std::string& text)
+{
+    char* end = nullptr;
+    long long value = strtoll(text.c_str(), &end, 10);
+    if (end == text.c_str() || value < 0)
+        return -1;
+    switch (*end)
+    {
+    case 'K': case 'k': value <<= 10; end++; break;
+    case 'M': case 'm': value <<= 20; end++; break;
+    case 'G': case 'g': value <<= 30; end++; break;
+    }
+    return *end ? -1 : value;
+}
+
+// Parse a list of sizes or counts, where "auto" stands for 0
+static bool ParseNumbers(const std::string& text, std::vector<int>& numbers)
+{
+    numbers.clear();
+    for (const std::string& item : SplitList(text))
+    {
+        long long value = item == "auto" ? 0 : ParseSize(item);
+        if (value < 0 || value > 1 << 30)
+            return false;
+        numbers.push_back(static_cast<int>(value));
+    }
+    return !numbers.empty();
+}
+
+// Whether every item of a list is one of the names allowed
+static bool CheckNames(const std::vector<std::string>& items, const std::vector<std::string>& allowed)
+{
+    for (const std::string& item : items)
+    {
+        if (std::find(allowed.begin(), allowed.end(), item) == allowed.end())
+            return false;
+    }
+    return !items.empty();
+}
+
+// Read the command line; false on anything unknown
+static bool ParseOptions(int argc, char** argv, BenchOptions& options)
+{
+    options.directory = "copybench-data";
+    options.datasets = DatasetGenerator::GetNames();
+    options.profiles = { "none", "nas" };
+    options.modes = { "kernel", "buffered" };
+    options.packetSizes = { 64 * 1024, 1024 * 1024, AUTO_PACKET_SIZE };
+    options.threadCounts = { 0, 4 };
+    options.repeat = 3;
+    options.keep = false;
+    options.simulated = false;
+    options.sizes.hugeSize = 64LL << 20;
+    options.sizes.smallCount = 1000;
+    options.sizes.sparseSize = 64LL << 20;
+    options.sizes.replicaCount = 3;
+    options.sizes.seed = 1;
+
+    // --quick first, so options after it can still override it
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            options.packetSizes = { AUTO_PACKET_SIZE };
+            options.threadCounts = { 0 };
+            options.repeat = 1;
+            options.sizes.hugeSize = 8LL << 20;
+            options.sizes.smallCount = 200;
+            options.sizes.sparseSize = 16LL << 20;
+        }
+    }
+
+    std::vector<std::string> profileNames = { "mixed" };
+    for (size_t i = 0; i < PROFILE_COUNT; i++)
+        profileNames.push_back(PROFILES[i].name);
+    for (size_t i = 0; i < FAULT_PROFILE_COUNT; i++)
+        profileNames.push_back(FAULT_PROFILES[i].name);
+    std::vector<std::string> modeNames(MODES, MODES + sizeof(MODES) / sizeof(MODES[0]));
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option = argv[i];
+        if (option == "--quick")
+            continue;
+        if (option == "--keep")
+        {
+            options.keep = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+
+        std::string value = argv[++i];
+        bool valid = true;
+        if (option == "--dir")
+            options.directory = value;
+        else if (option == "--output")
+            options.output = value;
+        else if (option == "--datasets")
+            valid = CheckNames(options.datasets = SplitList(value), DatasetGenerator::GetNames());
+        else if (option == "--profiles")
+            valid = CheckNames(options.profiles = SplitList(value), profileNames);
+        else if (option == "--modes")
+            valid = CheckNames(options.modes = SplitList(value), modeNames);
+        else if (option == "--packets")
+            valid = ParseNumbers(value, options.packetSizes);
+        else if (option == "--threads")
+            valid = ParseNumbers(value, options.threadCounts);
+        else if (option == "--repeat")
+            valid = (options.repeat = atoi(value.c_str())) > 0;
+        else if (option == "--huge")
+            valid = (options.sizes.hugeSize = ParseSize(value)) > 0;
+        else if (option == "--small")
+            valid = (options.sizes.smallCount = atoi(value.c_str())) > 0;
+        else if (option == "--sparse")
+            valid = (options.sizes.sparseSize = ParseSize(value)) > 0;
+        else if (option == "--replicas")
+            valid = (options.sizes.replicaCount = atoi(value.c_str())) > 1;
+        else if (option == "--seed")
+            options.sizes.seed = strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--backend")
+            valid = (options.simulated = value == "sim") || value == "real";
+        else
+            valid = false;
+        if (!valid)
+            return false;
+    }
+
+    // Faults need the simulator
+    for (size_t i = 0; i < FAULT_PROFILE_COUNT && !options.simulated; i++)
+    {
+        if (std::find(options.profiles.begin(), options.profiles.end(), FAULT_PROFILES[i].name) != options.profiles.end())
+            return false;
+    }
+    return true;
+}
+
+// Profile of the i-th source root of a dataset
+static const ThrottleProfile& GetProfile(const std::string& name, size_t root)
+{
+    // mixed cycles through the profiles after "none"
+    if (name == "mixed")
+        return PROFILES[1 + root % (PROFILE_COUNT - 1)];
+    for (size_t i = 0; i < PROFILE_COUNT; i++)
+    {
+        if (name == PROFILES[i].name)
+            return PROFILES[i];
+    }
+    return PROFILES[0];
+}
+
+// Simulated device of the i-th source root of a dataset
+static SimulatedDeviceProfile GetSimulatedProfile(const std::string& name, size_t root)
+{
+    const FaultProfile* fault = nullptr;
+    for (size_t i = 0; i < FAULT_PROFILE_COUNT; i++)
+    {
+        if (name == FAULT_PROFILES[i].name)
+            fault = &FAULT_PROFILES[i];
+    }
+
+    const ThrottleProfile& device = GetProfile(fault ? fault->device : name, root);
+    SimulatedDeviceProfile profile = SimulatedDeviceProfile();
+    profile.bytesPerSecond = device.bytesPerSecond;
+    profile.latency = device.latency;
+    profile.jitter = device.jitter;
+    profile.kind = strcmp(device.name, "hdd") == 0 ? DEVICE_KIND_ROTATIONAL :
+        strcmp(device.name, "nas") == 0 ? DEVICE_KIND_UNKNOWN : DEVICE_KIND_SOLID_STATE;
+    if (fault)
+    {
+        profile.failureRate = fault->failureRate;
+        profile.stallRate = fault->stallRate;
+        profile.stallSeconds = fault->stallSeconds;
+    }
+    return profile;
+}
+
+// Throttle the sources of a dataset, one simulated device per root
+static void ApplyProfile(const BenchDataset& dataset, const std::string& profile, uint64_t seed)
+{
+    ThrottleShim::Clear();
+    for (size_t i = 0; i < dataset.roots.size(); i++)
+    {
+        const ThrottleProfile& device = GetProfile(profile, i);
+        if (device.bytesPerSecond <= 0 && device.latency <= 0 && device.jitter <= 0)
+            continue;
+        int index = ThrottleShim::AddDevice(device, seed * 31 + i + 1);
+        for (const DatasetFile& file : dataset.files)
+            ThrottleShim::AddFile(dataset.roots[i] + "/" + file.path, index);
+    }
+}
+
+// Seconds of CPU time used by the process so far, in user and system mode
+static void GetCpuTime(double* user, double* system)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    *system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Add up one latency histogram of several sources or devices
+template <typename Metrics>
+static LatencySnapshot MergeLatency(const std::vector<Metrics>& list, LatencySnapshot Metrics::* member)
+{
+    LatencySnapshot merged;
+    merged.count = 0;
+    merged.sum = 0.0;
+    merged.max = 0.0;
+    merged.buckets.assign(LatencyHistogram::BUCKET_COUNT, 0);
+    for (const Metrics& metrics : list)
+    {
+        const LatencySnapshot& latency = metrics.*member;
+        merged.count += latency.count;
+        merged.sum += latency.sum;
+        merged.max = (std::max)(merged.max, latency.max);
+        for (size_t i = 0; i < latency.buckets.size() && i < merged.buckets.size(); i++)
+            merged.buckets[i] += latency.buckets[i];
+    }
+    return merged;
+}
+
+// Copy a dataset once and measure it
+static RunResult RunCopy(const BenchOptions& options, const BenchDataset& dataset,
+    const std::string& profile, const std::string& mode, int packetSize, int threadCount)
+{
+    RunResult result = RunResult();
+    result.status = "failed";
+    std::string destination = options.directory + "/copy";
+
+    // A simulated copy gets a fresh backend: every device idle, no copy yet
+    std::shared_ptr<SimulatedIoBackend> simulated;
+    if (options.simulated)
+    {
+        simulated = std::make_shared<SimulatedIoBackend>(options.sizes.seed);
+        for (size_t i = 0; i < dataset.roots.size(); i++)
+            simulated->AddDevice(FileIo::FromNativePath(dataset.roots[i]), GetSimulatedProfile(profile, i));
+        if (!DatasetGenerator::Simulate(dataset, *simulated) || !simulated->CreateDirectoryPath(FileIo::FromNativePath(destination)))
+            return result;
+    }
+    else
+    {
+        DatasetGenerator::RemoveTree(destination);
+        DatasetGenerator::DropCache(dataset);
+    }
+
+    // Every copy starts from scratch: no journal, no clones
+    FileCopier copier;
+    if (simulated)
+        copier.SetIoBackend(simulated);
+    for (const std::string& root : dataset.roots)
+        copier.AddSourceDirectory(FileIo::FromNativePath(root));
+    copier.SetReplicaMode(dataset.roots.size() > 1);
+    copier.SetThreadCount(threadCount);
+    copier.SetResume(false);
+    copier.SetCloneFiles(false);
+    copier.SetZeroCopy(mode == "kernel");
+    copier.SetDirectIo(mode == "direct");
+
+    if (!simulated)
+        ApplyProfile(dataset, profile, options.sizes.seed);
+    double userStart, systemStart;
+    GetCpuTime(&userStart, &systemStart);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double virtualStart = simulated ? simulated->GetTime() : 0.0;
+
+    bool started = copier.StartCopy(FileIo::FromNativePath(destination), nullptr, nullptr, packetSize);
+    while (started && copier.IsOperationInProgress())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (simulated)
+        result.seconds = simulated->GetTime() - virtualStart;
+    double userEnd, systemEnd;
+    GetCpuTime(&userEnd, &systemEnd);
+    result.userSeconds = userEnd - userStart;
+    result.systemSeconds = systemEnd - systemStart;
+    ThrottleShim::Clear();
+
+    CopyProgress progress = copier.GetProgress();
+    MetricsSnapshot metrics = copier.GetMetrics();
+    result.backend = FileIo::ToNativePath(copier.GetIoBackendName());
+    std::replace(result.backend.begin(), result.backend.end(), ' ', '_');
+    result.files = progress.filesDone;
+    result.logicalBytes = progress.logicalBytes;
+    result.physicalBytes = progress.physicalBytes;
+    result.readLatency = MergeLatency(metrics.sources, &IoMetricsSnapshot::readLatency);
+    result.writeLatency = MergeLatency(metrics.devices, &IoMetricsSnapshot::writeLatency);
+    if (simulated)
+    {
+        // The engine times requests in real time; the devices know the
+        // virtual latencies. Sources sit on devices 1..n, the copy on 0
+        std::vector<SimulatedDeviceStats> sources;
+        for (size_t i = 0; i < dataset.roots.size(); i++)
+            sources.push_back(simulated->GetDeviceStats(static_cast<int>(i + 1)));
+        std::vector<SimulatedDeviceStats> destination(1, simulated->GetDeviceStats(0));
+        result.readLatency = MergeLatency(sources, &SimulatedDeviceStats::readLatency);
+        result.writeLatency = MergeLatency(destination, &SimulatedDeviceStats::writeLatency);
+    }
+
+    // A copy that stopped on an error stays "failed"; only a finished one
+    // is checked against its dataset
+    bool finished = started && copier.LastJobSucceeded();
+    if (finished && simulated)
+    {
+        // Unmount the devices, so checking the copy takes no virtual time
+        simulated->ClearDevices();
+        result.status = DatasetGenerator::Verify(dataset, destination, *simulated) ? "ok" : "mismatch";
+    }
+    else if (finished)
+    {
+        result.status = DatasetGenerator::Verify(dataset, destination, *IoBackend::GetNative()) ? "ok" : "mismatch";
+    }
+    if (started && !simulated)
+        DatasetGenerator::RemoveTree(destination);
+    return result;
+}
+
+// Print the column names
+static void PrintHeader(FILE* report, const BenchOptions& options)
+{
+    fprintf(report, "# copybench format=%d seed=%llu repeat=%d huge=%lld small=%d sparse=%lld replicas=%d io=%s",
+        REPORT_FORMAT, static_cast<unsigned long long>(options.sizes.seed), options.repeat,
+        options.sizes.hugeSize, options.sizes.smallCount, options.sizes.sparseSize, options.sizes.replicaCount,
+        options.simulated ? "sim" : "real");
+    fprintf(report, "\n");
+    fprintf(report, "dataset\tprofile\tmode\tpacket\tthreads\tbackend\tfiles\tlogical_bytes\tphysical_bytes\t"
+        "seconds\tmb_per_s\tcpu_user_s\tcpu_sys_s\tread_p50_ms\tread_p99_ms\twrite_p50_ms\twrite_p99_ms\tstatus\n");
+}
+
+// Print one configuration
+static void PrintRow(FILE* report, const BenchDataset& dataset, const std::string& profile, const std::string& mode,
+    int packetSize, int threadCount, const RunResult& result)
+{
+    std::string packet = packetSize == AUTO_PACKET_SIZE ? "auto" : std::to_string(packetSize);
+    std::string threads = threadCount == 0 ? "auto" : std::to_string(threadCount);
+    double megabytesPerSecond = result.seconds > 0 ? result.logicalBytes / 1e6 / result.seconds : 0.0;
+    fprintf(report, "%s\t%s\t%s\t%s\t%s\t%s\t%lld\t%lld\t%lld\t%.3f\t%.1f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%s\n",
+        dataset.name.c_str(), profile.c_str(), mode.c_str(), packet.c_str(), threads.c_str(), result.backend.c_str(),
+        result.files, result.logicalBytes, result.physicalBytes, result.seconds, megabytesPerSecond,
+        result.userSeconds, result.systemSeconds,
+        result.readLatency.GetPercentile(0.5) * 1000, result.readLatency.GetPercentile(0.99) * 1000,
+        result.writeLatency.GetPercentile(0.5) * 1000, result.writeLatency.GetPercentile(0.99) * 1000,
+        result.status.c_str());
+    fflush(report);
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 2;
+    }
+
+    FILE* report = stdout;
+    if (!options.output.empty() && !(report = fopen(options.output.c_str(), "w")))
+    {
+        fprintf(stderr, "copybench: can't write %s\n", options.output.c_str());
+        return 1;
+    }
+    if (!DatasetGenerator::CreateTree(options.directory))
+    {
+        fprintf(stderr, "copybench: can't create %s\n", options.directory.c_str());
+        return 1;
+    }
+
+    PrintHeader(report, options);
+    bool allPassed = true;
+    for (const std::string& name : options.datasets)
+    {
+        BenchDataset dataset;
+        fprintf(stderr, "copybench: generating %s\n", name.c_str());
+        std::string sources = options.directory + "/source";
+        bool generated = options.simulated ? DatasetGenerator::Plan(name, sources, options.sizes, dataset) :
+            DatasetGenerator::Generate(name, sources, options.sizes, dataset);
+        if (!generated)
+        {
+            fprintf(stderr, "copybench: can't generate %s under %s\n", name.c_str(), options.directory.c_str());
+            return 1;
+        }
+
+        for (const std::string& profile : options.profiles)
+        {
+            for (const std::string& mode : options.modes)
+            {
+                for (int packetSize : options.packetSizes)
+                {
+                    for (int threadCount : options.threadCounts)
+                    {
+                        // Report the run with the median time
+                        std::vector<RunResult> runs;
+                        for (int i = 0; i < options.repeat; i++)
+                            runs.push_back(RunCopy(options, dataset, profile, mode, packetSize, threadCount));
+                        std::sort(runs.begin(), runs.end(), [](const RunResult& a, const RunResult& b) {
+                            return a.seconds < b.seconds;
+                        });
+                        const RunResult& median = runs[runs.size() / 2];
+                        for (const RunResult& run : runs)
+                            allPassed = allPassed && run.status == "ok";
+
+                        PrintRow(report, dataset, profile, mode, packetSize, threadCount, median);
+                        fprintf(stderr, "copybench: %s %s %s packet=%d threads=%d %.3f s %s\n", name.c_str(), profile.c_str(),
+                            mode.c_str(), packetSize, threadCount, median.seconds, median.status.c_str());
+                    }
+                }
+            }
+        }
+
+        if (!options.keep)
+            DatasetGenerator::RemoveTree(dataset.roots.size() > 1 ? options.directory + "/source/" + name : dataset.roots[0]);
+    }
+
+    if (!options.keep)
+        DatasetGenerator::RemoveTree(options.directory);
+    if (report != stdout)
+        fclose(report);
+    return allPassed ? 0 : 1;
+}
@@ -0,0 +1,325 @@
+// copytests: checks of the copy engine that need a real run to show, each
+// a separate ctest case. Run one by name; exits non-zero on failure.
+//
+//   copytests throttle-cpu        A rate-limited copy sleeps while it waits
+//   copytests sim-throughput      A simulated copy runs at its device's rate
+//   copytests sim-tail-latency    Simulated reads have the modelled latency tail
+//   copytests sim-determinism     Simulated copies with one seed agree
+
+#include "../include/FileCopier.h"
+#include "../include/FileIo.h"
+#include "../include/SimulatedIoBackend.h"
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+// Seconds of CPU time used by the process so far, user and system
+static double GetCpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Report a failed check
+static bool Check(bool condition, const char* what)
+{
+    if (!condition)
+        fprintf(stderr, "FAILED: %s\n", what);
+    return condition;
+}
+
+// A copy held back by a read rate limit should spend the time the limit
+// adds asleep, not polling for its next request
+static bool TestThrottleCpu()
+{
+    static const long long FILE_SIZE = 8 * 1024 * 1024;
+    static const long long RATE = 4 * 1024 * 1024;     // Two seconds of copying
+    static const double MAX_CPU_SHARE = 0.2;
+
+    char directory[] = "/tmp/copytests.XXXXXX";
+    if (!Check(mkdtemp(directory) != nullptr, "create a scratch directory"))
+        return false;
+    std::string source = std::string(directory) + "/source";
+    std::string destination = std::string(directory) + "/destination";
+    FileIo::CreateDirectoryPath(FileIo::FromNativePath(source));
+    FileIo::CreateDirectoryPath(FileIo::FromNativePath(destination));
+
+    FILE* file = fopen((source + "/data.bin").c_str(), "wb");
+    if (!Check(file != nullptr, "create the source file"))
+        return false;
+    std::vector<char> block(1024 * 1024);
+    for (long long written = 0; written < FILE_SIZE; written += block.size())
+    {
+        for (size_t i = 0; i < block.size(); i++)
+            block[i] = static_cast<char>((written + i) * 2654435761u >> 13);
+        fwrite(block.data(), 1, block.size(), file);
+    }
+    fclose(file);
+
+    FileCopier copier;
+    copier.AddSourceDirectory(FileIo::FromNativePath(source));
+    copier.SetResume(false);
+    copier.SetCloneFiles(false);
+    copier.SetZeroCopy(false);
+    copier.SetReadRateLimit(RATE);
+
+    double cpuStart = GetCpuSeconds();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool started = copier.StartCopy(FileIo::FromNativePath(destination), nullptr, nullptr);
+    while (started && copier.IsOperationInProgress())
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = GetCpuSeconds() - cpuStart;
+
+    long long copied = -1;
+    FileIo::GetSize(FileIo::FromNativePath(destination + "/data.bin"), &copied);
+    std::string command = std::string("rm -rf ") + directory;
+    if (system(command.c_str()) != 0)
+        fprintf(stderr, "couldn't remove %s\n", directory);
+
+    printf("throttle-cpu: %.2f s wall, %.2f s CPU\n", wall, cpu);
+    bool passed = Check(started, "the copy starts");
+    passed = Check(copied == FILE_SIZE, "the whole file is copied") && passed;
+    passed = Check(wall >= 0.5 * FILE_SIZE / RATE, "the rate limit holds the copy back") && passed;
+    passed = Check(cpu <= MAX_CPU_SHARE * wall, "the copy mostly sleeps while throttled") && passed;
+    return passed;
+}
+
+// A simulated source device: 100 MB/s, 1 ms latency, 0.5 ms mean jitter
+static SimulatedDeviceProfile GetSimulatedProfile(double failureRate)
+{
+    SimulatedDeviceProfile profile = SimulatedDeviceProfile();
+    profile.bytesPerSecond = 100e6;
+    profile.latency = 0.001;
+    profile.jitter = 0.0005;
+    profile.failureRate = failureRate;
+    profile.kind = DEVICE_KIND_SOLID_STATE;
+    return profile;
+}
+
+// What a simulated copy did
+struct SimulatedRun {
+    bool started;
+    bool verified;                 // Every file copied matches its source
+    long long filesDone;
+    long long bytesDone;
+    double seconds;                // Virtual
+    long long failures;            // Reads the sources failed
+};
+
+// Copy files from replicas roots of a simulated device to its default one
+static SimulatedRun RunSimulatedCopy(uint64_t seed, double failureRate, int replicas, int fileCount, long long fileSize, int packetSize)
+{
+    SimulatedRun run = SimulatedRun();
+    SimulatedIoBackend backend(seed);
+    std::shared_ptr<SimulatedIoBackend> shared(&backend, [](SimulatedIoBackend*) {});
+
+    FileCopier copier;
+    copier.SetIoBackend(shared);
+    for (int replica = 0; replica < replicas; replica++)
+    {
+        std::wstring root = L"/sim/replica" + std::to_wstring(replica);
+        backend.AddDevice(root, GetSimulatedProfile(failureRate));
+        for (int i = 0; i < fileCount; i++)
+            backend.AddFile(root + L"/file" + std::to_wstring(i), fileSize + i * 4099, i + 1);
+        copier.AddSourceDirectory(root);
+    }
+    backend.CreateDirectoryPath(L"/copy");
+    copier.SetReplicaMode(replicas > 1);
+    copier.SetResume(false);
+    copier.SetCloneFiles(false);
+
+    double start = backend.GetTime();
+    run.started = copier.StartCopy(L"/copy", nullptr, nullptr, packetSize);
+    while (run.started && copier.IsOperationInProgress())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    run.seconds = backend.GetTime() - start;
+
+    CopyProgress progress = copier.GetProgress();
+    run.filesDone = progress.filesDone;
+    run.bytesDone = progress.logicalBytes;
+    for (int replica = 0; replica < replicas; replica++)
+        run.failures += backend.GetDeviceStats(replica + 1).failures;
+
+    // Unmount the devices, so reading the copy back takes no virtual time
+    backend.ClearDevices();
+    run.verified = true;
+    std::vector<uint8_t> expected(fileSize + fileCount * 4099);
+    std::vector<uint8_t> copied(expected.size());
+    for (int i = 0; i < fileCount; i++)
+    {
+        long long size = -1;
+        std::wstring name = L"/file" + std::to_wstring(i);
+        if (!backend.GetSize(L"/copy" + name, &size))
+            continue;
+        uint32_t expectedBytes = 0, copiedBytes = 0;
+        backend.Peek(L"/sim/replica0" + name, 0, expected.data(), static_cast<uint32_t>(expected.size()), &expectedBytes);
+        backend.Peek(L"/copy" + name, 0, copied.data(), static_cast<uint32_t>(copied.size()), &copiedBytes);
+        if (expectedBytes != copiedBytes || memcmp(expected.data(), copied.data(), copiedBytes) != 0)
+            run.verified = false;
+    }
+    return run;
+}
+
+// A copy from one simulated device keeps it near its transfer rate
+static bool TestSimulatedThroughput()
+{
+    static const double MIN_SHARE = 0.8;
+
+    SimulatedRun run = RunSimulatedCopy(1, 0.0, 1, 4, 8 * 1024 * 1024, AUTO_PACKET_SIZE);
+    double rate = run.seconds > 0.0 ? run.bytesDone / run.seconds : 0.0;
+    printf("sim-throughput: %lld bytes in %.3f virtual s, %.1f MB/s\n", run.bytesDone, run.seconds, rate / 1e6);
+
+    double deviceRate = GetSimulatedProfile(0.0).bytesPerSecond;
+    bool passed = Check(run.started && run.filesDone == 4 && run.verified, "every file is copied intact");
+    passed = Check(rate >= MIN_SHARE * deviceRate, "the device is kept busy") && passed;
+    passed = Check(rate <= deviceRate, "the device's rate is never exceeded") && passed;
+    return passed;
+}
+
+// One request at a time: each read takes its transfer, the latency and an
+// exponential jitter, whose median and 99th percentile are known
+static bool TestSimulatedTailLatency()
+{
+    static const int READS = 2000;
+    static const uint32_t READ_SIZE = 64 * 1024;
+    static const double TOLERANCE = 0.1;
+
+    SimulatedDeviceProfile profile = GetSimulatedProfile(0.0);
+    SimulatedIoBackend backend(1);
+    int device = backend.AddDevice(L"/sim", profile);
+    backend.AddFile(L"/sim/file", static_cast<long long>(READS) * READ_SIZE, 1);
+
+    std::vector<uint8_t> buffer(READ_SIZE);
+    FileHandle file = backend.OpenForRead(L"/sim/file");
+    bool allRead = file != INVALID_FILE_HANDLE;
+    for (int i = 0; i < READS && allRead; i++)
+    {
+        uint32_t bytesRead = 0;
+        allRead = backend.ReadAt(file, static_cast<long long>(i) * READ_SIZE, buffer.data(), READ_SIZE, &bytesRead) &&
+            bytesRead == READ_SIZE;
+    }
+    backend.Close(file);
+
+    LatencySnapshot latency = backend.GetDeviceStats(device).readLatency;
+    double base = READ_SIZE / profile.bytesPerSecond + profile.latency;
+    double expectedMedian = base + profile.jitter * std::log(2.0);
+    double expectedTail = base + profile.jitter * std::log(100.0);
+    double median = latency.GetPercentile(0.5);
+    double tail = latency.GetPercentile(0.99);
+    printf("sim-tail-latency: p50 %.3f ms (model %.3f), p99 %.3f ms (model %.3f), %.3f virtual s\n",
+        median * 1000, expectedMedian * 1000, tail * 1000, expectedTail * 1000, backend.GetTime());
+
+    bool passed = Check(allRead && latency.count == READS, "every read succeeds");
+    passed = Check(std::fabs(median - expectedMedian) <= TOLERANCE * expectedMedian, "the median latency matches the model") && passed;
+    passed = Check(std::fabs(tail - expectedTail) <= TOLERANCE * expectedTail, "the 99th percentile matches the model") && passed;
+    passed = Check(std::fabs(backend.GetTime() - READS * (base + profile.jitter)) <= TOLERANCE * READS * (base + profile.jitter),
+        "the clock advances by the requests' latencies alone") && passed;
+    return passed;
+}
+
+// Read a simulated file from start to end on one thread, retrying every
+// failed read, and return the device's counters
+static SimulatedDeviceStats ReadSimulatedFile(uint64_t seed, double* seconds)
+{
+    static const long long FILE_SIZE = 32 * 1024 * 1024;
+    static const uint32_t READ_SIZE = 256 * 1024;
+
+    SimulatedDeviceProfile profile = GetSimulatedProfile(0.02);
+    profile.stallRate = 0.01;
+    profile.stallSeconds = 0.05;
+    SimulatedIoBackend backend(seed);
+    int device = backend.AddDevice(L"/sim", profile);
+    backend.AddFile(L"/sim/file", FILE_SIZE, seed);
+
+    std::vector<uint8_t> buffer(READ_SIZE);
+    FileHandle file = backend.OpenForRead(L"/sim/file");
+    for (long long offset = 0; offset < FILE_SIZE && file != INVALID_FILE_HANDLE; offset += READ_SIZE)
+    {
+        uint32_t bytesRead = 0;
+        while (!backend.ReadAt(file, offset, buffer.data(), READ_SIZE, &bytesRead))
+        {
+        }
+    }
+    backend.Close(file);
+
+    *seconds = backend.GetTime();
+    return backend.GetDeviceStats(device);
+}
+
+// The same requests with the same seed give the same times and faults:
+// exactly so from one thread, and copies agree on what they copied and
+// nearly on how long it took (the engine still picks replicas and orders
+// its requests by real time)
+static bool TestSimulatedDeterminism()
+{
+    static const int RUNS = 3;
+    static const double TOLERANCE = 0.1;
+
+    bool passed = true;
+    double firstSeconds = 0.0;
+    SimulatedDeviceStats first = ReadSimulatedFile(7, &firstSeconds);
+    printf("sim-determinism: reads: %lld failures, %lld stalls, %.6f virtual s\n", first.failures, first.stalls, firstSeconds);
+    passed = Check(first.failures > 0 && first.stalls > 0, "the device fails and stalls some reads") && passed;
+    for (int i = 1; i < RUNS; i++)
+    {
+        double seconds = 0.0;
+        SimulatedDeviceStats stats = ReadSimulatedFile(7, &seconds);
+        passed = Check(stats.failures == first.failures && stats.stalls == first.stalls &&
+            stats.readLatency.sum == first.readLatency.sum && seconds == firstSeconds,
+            "every run of the reads is the same") && passed;
+    }
+
+    SimulatedRun runs[RUNS];
+    for (int i = 0; i < RUNS; i++)
+    {
+        runs[i] = RunSimulatedCopy(7, 0.01, 2, 40, 256 * 1024, 64 * 1024);
+        printf("sim-determinism: copy %d: %lld files, %lld bytes, %lld failures, %.3f virtual s\n",
+            i + 1, runs[i].filesDone, runs[i].bytesDone, runs[i].failures, runs[i].seconds);
+        passed = Check(runs[i].started && runs[i].verified, "every file copied is intact") && passed;
+    }
+    for (int i = 1; i < RUNS; i++)
+    {
+        passed = Check(runs[i].filesDone == runs[0].filesDone && runs[i].bytesDone == runs[0].bytesDone,
+            "every copy copies the same files") && passed;
+        passed = Check(std::fabs(runs[i].seconds - runs[0].seconds) <= TOLERANCE * runs[0].seconds,
+            "every copy takes about the same virtual time") && passed;
+    }
+    return passed;
+}
+
+int main(int argc, char** argv)
+{
+    struct Test {
+        const char* name;
+        bool (*run)();
+    };
+    static const Test TESTS[] = {
+        { "throttle-cpu", TestThrottleCpu },
+        { "sim-throughput", TestSimulatedThroughput },
+        { "sim-tail-latency", TestSimulatedTailLatency },
+        { "sim-determinism", TestSimulatedDeterminism },
+    };
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: copytests TEST\n");
+        return 2;
+    }
+    for (const Test& test : TESTS)
+    {
+        if (strcmp(argv[1], test.name) == 0)
+            return test.run() ? 0 : 1;
+    }
+    fprintf(stderr, "unknown test: %s\n", argv[1]);
+    return 2;
+}
@@ -0,0 +1,199 @@
+#include "ThrottleShim.h"
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <stdarg.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// A simulated device and where its timeline stands
+struct ThrottleDevice {
+    ThrottleProfile profile;
+    double ready;            // When the transfers reserved so far are done, in seconds
+    uint64_t random;         // xorshift64 state for the jitter
+};
+
+// Everything the shim knows; the interposed calls only read it under the lock
+static boost::mutex s_mutex;
+static std::vector<ThrottleDevice> s_devices;
+static std::map<std::pair<dev_t, ino_t>, int> s_files;
+static std::atomic<bool> s_active(false);
+
+// Seconds on a monotonic clock
+static double Now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Uniform number in [0, 1)
+static double NextRandom(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return static_cast<double>(state >> 11) / 9007199254740992.0;
+}
+
+// Forget every device and file
+void ThrottleShim::Clear()
+{
+    boost::mutex::scoped_lock lock(s_mutex);
+    s_active = false;
+    s_devices.clear();
+    s_files.clear();
+}
+
+// Add a simulated device
+int ThrottleShim::AddDevice(const ThrottleProfile& profile, uint64_t seed)
+{
+    boost::mutex::scoped_lock lock(s_mutex);
+    ThrottleDevice device;
+    device.profile = profile;
+    device.ready = 0.0;
+    device.random = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    s_devices.push_back(device);
+    return static_cast<int>(s_devices.size() - 1);
+}
+
+// Throttle the reads of a file to a device
+bool ThrottleShim::AddFile(const std::string& path, int device)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+
+    boost::mutex::scoped_lock lock(s_mutex);
+    if (device < 0 || device >= static_cast<int>(s_devices.size()))
+        return false;
+    s_files[std::make_pair(info.st_dev, info.st_ino)] = device;
+    s_active = true;
+    return true;
+}
+
+// Whether any file is throttled
+bool ThrottleShim::IsActive()
+{
+    return s_active;
+}
+
+// Hold a read for as long as its device would take
+void ThrottleShim::OnRead(int fd, long long bytes)
+{
+    if (!s_active || bytes <= 0)
+        return;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+        return;
+
+    double finish;
+    {
+        boost::mutex::scoped_lock lock(s_mutex);
+        auto it = s_files.find(std::make_pair(info.st_dev, info.st_ino));
+        if (it == s_files.end())
+            return;
+
+        // The transfer waits for the ones before it; the latency doesn't
+        ThrottleDevice& device = s_devices[it->second];
+        double now = Now();
+        double start = (std::max)(device.ready, now);
+        if (device.profile.bytesPerSecond > 0)
+            device.ready = start + static_cast<double>(bytes) / device.profile.bytesPerSecond;
+        else
+            device.ready = start;
+        finish = device.ready + device.profile.latency;
+        if (device.profile.jitter > 0)
+            finish -= device.profile.jitter * std::log(1.0 - NextRandom(device.random));
+    }
+
+    // Not a boost sleep: that is an interruption point, and this runs
+    // inside C library calls
+    double wait = finish - Now();
+    if (wait > 0)
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+}
+
+// Look up the C library's version of an interposed call
+template <typename Function>
+static Function RealFunction(const char* name)
+{
+    return reinterpret_cast<Function>(dlsym(RTLD_NEXT, name));
+}
+
+// The calls the copy engine reads with, throttled
+extern "C" {
+
+ssize_t pread(int fd, void* buffer, size_t count, off_t offset)
+{
+    typedef ssize_t (*Function)(int, void*, size_t, off_t);
+    static Function real = RealFunction<Function>("pread");
+    ssize_t result = real(fd, buffer, count, offset);
+    if (result > 0)
+        ThrottleShim::OnRead(fd, result);
+    return result;
+}
+
+ssize_t pread64(int fd, void* buffer, size_t count, off64_t offset)
+{
+    typedef ssize_t (*Function)(int, void*, size_t, off64_t);
+    static Function real = RealFunction<Function>("pread64");
+    ssize_t result = real(fd, buffer, count, offset);
+    if (result > 0)
+        ThrottleShim::OnRead(fd, result);
+    return result;
+}
+
+ssize_t copy_file_range(int inFd, off64_t* inOffset, int outFd, off64_t* outOffset, size_t length, unsigned int flags)
+{
+    typedef ssize_t (*Function)(int, off64_t*, int, off64_t*, size_t, unsigned int);
+    static Function real = RealFunction<Function>("copy_file_range");
+    ssize_t result = real(inFd, inOffset, outFd, outOffset, length, flags);
+    if (result > 0)
+        ThrottleShim::OnRead(inFd, result);
+    return result;
+}
+
+ssize_t splice(int inFd, off64_t* inOffset, int outFd, off64_t* outOffset, size_t length, unsigned int flags)
+{
+    typedef ssize_t (*Function)(int, off64_t*, int, off64_t*, size_t, unsigned int);
+    static Function real = RealFunction<Function>("splice");
+    ssize_t result = real(inFd, inOffset, outFd, outOffset, length, flags);
+
+    // Only the file-to-pipe half reads a file; the pipe isn't throttled
+    if (result > 0)
+        ThrottleShim::OnRead(inFd, result);
+    return result;
+}
+
+long syscall(long number, ...) noexcept
+{
+    // Every Linux system call takes at most six arguments
+    va_list list;
+    va_start(list, number);
+    long arguments[6];
+    for (long& argument : arguments)
+        argument = va_arg(list, long);
+    va_end(list);
+
+    // io_uring reads never pass through pread; make the engine fall back
+    if (number == __NR_io_uring_setup && ThrottleShim::IsActive())
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    typedef long (*Function)(long, ...);
+    static Function real = RealFunction<Function>("syscall");
+    return real(number, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4], arguments[5]);
+}
+
+}
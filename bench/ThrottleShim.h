@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+// Throughput and latency of a simulated source device
+struct ThrottleProfile {
+    const char* name;
+    double bytesPerSecond;   // Transfer rate (0 = unlimited)
+    double latency;          // Seconds added to every read
+    double jitter;           // Mean of an exponentially distributed extra delay, in seconds
+};
+
+// Slows the reads of chosen files down to a device profile, so a benchmark
+// on one local disk can stand in for a mix of SSDs, spinning disks and NAS
+// mounts. The benchmark interposes the calls the copy engine reads with
+// (pread, copy_file_range and splice): each read is done for real, then
+// held until the simulated device would have delivered it. A device moves
+// one transfer at a time at its rate, while latencies overlap, as they do
+// on a deep queue. Jitter is drawn from a per-device generator, so runs
+// are repeatable. While any file is throttled io_uring is reported as
+// unavailable, since its reads bypass the interposed calls and the engine
+// falls back to its thread pool.
+// Linux only.
+class ThrottleShim {
+public:
+    // Forget every device and file; reads run at full speed again
+    static void Clear();
+
+    // Add a simulated device; returns its index
+    static int AddDevice(const ThrottleProfile& profile, uint64_t seed);
+
+    // Throttle the reads of a file (by inode, so any path or handle to it
+    // counts) to a device; returns false if the file can't be found
+    static bool AddFile(const std::string& path, int device);
+
+    // Whether any file is throttled
+    static bool IsActive();
+
+    // Hold a read of bytes from a descriptor for as long as its device
+    // would take (returns at once for files that aren't throttled)
+    static void OnRead(int fd, long long bytes);
+};
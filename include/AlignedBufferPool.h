@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <boost/thread/mutex.hpp>
+
+// Pool of equally sized, aligned I/O buffers shared by the copy workers.
+// Unbuffered I/O (O_DIRECT / FILE_FLAG_NO_BUFFERING) needs buffers aligned
+// to the device's logical block size; buffered I/O is happy with them too.
+// Buffers are reused for the life of the pool and freed with it.
+class AlignedBufferPool {
+public:
+    // alignment must be a power of two; bufferSize is rounded up to it
+    AlignedBufferPool(size_t bufferSize, size_t alignment);
+    ~AlignedBufferPool();
+
+    // Get a buffer, allocating a new one if none is free
+    // Returns nullptr if out of memory
+    uint8_t* Acquire();
+
+    // Give a buffer back for reuse
+    void Release(uint8_t* buffer);
+
+    // Buffers allocated so far, and those of them handed out
+    size_t GetAllocatedCount() const;
+    size_t GetInUseCount() const;
+
+    // Size and alignment of every buffer
+    size_t GetBufferSize() const { return m_bufferSize; }
+    size_t GetAlignment() const { return m_alignment; }
+
+    // Round a size up to a multiple of a power-of-two alignment
+    static long long AlignUp(long long value, size_t alignment);
+
+private:
+    AlignedBufferPool(const AlignedBufferPool&) = delete;
+    AlignedBufferPool& operator=(const AlignedBufferPool&) = delete;
+
+    size_t m_bufferSize;
+    size_t m_alignment;
+    std::vector<uint8_t*> m_free;    // Buffers ready for reuse
+    std::vector<uint8_t*> m_all;     // Every buffer allocated, freed by the destructor
+    mutable boost::mutex m_mutex;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include "FileIo.h"
+#include "IoBackend.h"
+
+// Kind of asynchronous operation
+enum AsyncOpType {
+    ASYNC_READ,
+    ASYNC_WRITE
+};
+
+// A positional read or write to be queued on an engine
+struct AsyncRequest {
+    AsyncOpType type;         // Read or write
+    FileHandle handle;        // File to read from or write to
+    long long offset;         // Absolute file offset
+    void* buffer;             // Data buffer (must stay valid until completion)
+    uint32_t length;          // Bytes to transfer
+    void* userData;           // Returned unchanged in the completion
+};
+
+// Result of a finished request
+struct AsyncCompletion {
+    void* userData;           // userData of the request
+    bool success;             // False on I/O error
+    uint32_t bytes;           // Bytes transferred (0 at end of file)
+};
+
+// Asynchronous I/O backend that keeps several requests in flight at once
+class AsyncIoEngine {
+public:
+    virtual ~AsyncIoEngine() {}
+
+    // Queue a request; returns false if the engine is full or the request
+    // couldn't be started (in which case no completion is produced)
+    virtual bool Submit(const AsyncRequest& request) = 0;
+
+    // Wait until at least minCompletions requests have finished (or
+    // timeoutMs milliseconds have passed, -1 = no limit) and collect up to
+    // maxCompletions of them
+    // Returns the number collected, or -1 on error
+    virtual int Wait(AsyncCompletion* completions, int maxCompletions, int minCompletions, int timeoutMs = -1) = 0;
+
+    // Ask for an in-flight request to be abandoned (best effort)
+    // Its completion is still delivered, unsuccessful if the cancel won
+    virtual void Cancel(void* userData) = 0;
+
+    // Maximum number of requests in flight
+    virtual int GetQueueDepth() const = 0;
+
+    // Backend name for reporting (e.g. "io_uring")
+    virtual const wchar_t* GetName() const = 0;
+
+    // Create the best engine for this platform: io_uring on Linux,
+    // overlapped I/O on Windows, a thread pool anywhere else or as a fallback
+    // Handles of a backend that isn't native always get the thread pool,
+    // which does its I/O through the backend (null = the native one)
+    static std::unique_ptr<AsyncIoEngine> Create(int queueDepth, const std::shared_ptr<IoBackend>& backend = nullptr);
+
+    // Create the portable thread-pool engine
+    static std::unique_ptr<AsyncIoEngine> CreateThreadPool(int queueDepth, const std::shared_ptr<IoBackend>& backend = nullptr);
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include "FileIo.h"
+#include "IoBackend.h"
+
+// Identity of the source data a journal was written for
+struct JournalSource {
+    long long fileSize;       // Size of the file
+    long long modifiedTime;   // Newest modification time among the replicas
+    uint64_t sampleHash;      // Hash of a sample of the data (0 if it couldn't be read)
+};
+
+// Sidecar journal of the packets of one destination file that are done, so
+// an interrupted copy can be resumed instead of started over.
+// The journal is a header (source identity and packet layout) followed by a
+// bitmap with one bit per packet. Packets are marked in memory as they
+// finish and written out in batches by Flush, which makes the destination
+// durable first so the journal never claims data that could still be lost.
+// Bits only ever go from 0 to 1, so a torn bitmap write can only forget
+// packets, never invent them.
+class CopyJournal {
+public:
+    // The journal is kept through backend (null = the native one), the
+    // same one the destination is written through
+    explicit CopyJournal(const std::shared_ptr<IoBackend>& backend = nullptr);
+    ~CopyJournal();
+
+    // Open the journal at path, resuming it if resume is set and it was
+    // written for the same source and packet layout; otherwise start an
+    // empty one
+    // Returns false if the journal can't be written
+    bool Open(const std::wstring& path, const JournalSource& source, uint32_t packetSize, int packetCount, bool resume);
+
+    // Number of packets recorded as done (by the interrupted copy, after Open)
+    int GetCompletedCount() const;
+
+    // Check if a packet is recorded as done
+    bool IsComplete(int packet) const;
+
+    // Record a packet as written; it is saved by the next Flush
+    void MarkComplete(int packet);
+
+    // True if packets were marked since the last flush and FLUSH_INTERVAL has passed
+    bool IsFlushDue() const;
+
+    // Save the packets marked so far, flushing destination (if open) first
+    bool Flush(FileHandle destination);
+
+    // Close the journal, keeping it for a later resume
+    void Close();
+
+    // Close and delete the journal once the copy is complete
+    void Remove();
+
+    // Journal path of a destination file
+    static std::wstring GetPath(const std::wstring& destinationPath);
+
+    // Seconds between batched flushes
+    static constexpr double FLUSH_INTERVAL = 2.0;
+
+private:
+    CopyJournal(const CopyJournal&) = delete;
+    CopyJournal& operator=(const CopyJournal&) = delete;
+
+    // On-disk header, followed by the bitmap
+    struct Header {
+        char magic[8];            // JOURNAL_MAGIC
+        uint32_t version;         // JOURNAL_VERSION
+        uint32_t packetSize;      // Packet size of the copy
+        long long fileSize;       // Source identity
+        long long modifiedTime;
+        uint64_t sampleHash;
+        int32_t packetCount;      // Bits in the bitmap
+        uint32_t reserved;
+        uint64_t checksum;        // Hash of everything above
+    };
+
+    // Read a journal and check it matches; loads the bitmap on success
+    bool Load(const Header& expected);
+
+    // Write an empty journal
+    bool Create(const Header& header);
+
+    // Seconds on a monotonic clock
+    static double Now();
+
+    std::shared_ptr<IoBackend> m_backend;
+    std::wstring m_path;
+    FileHandle m_handle;
+    int m_packetCount;
+    size_t m_wordCount;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_bits;   // One bit per packet
+    std::atomic<bool> m_dirty;                          // Marked since the last flush
+    std::atomic<double> m_lastFlush;                    // Time of the last flush (Now)
+
+    static const uint32_t JOURNAL_VERSION = 1;
+};
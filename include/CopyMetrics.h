@@ -0,0 +1,191 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+
+// A snapshot of a LatencyHistogram
+struct LatencySnapshot {
+    long long count;                 // Latencies recorded
+    double sum;                      // Their total, in seconds
+    double max;                      // The longest, in seconds
+    std::vector<long long> buckets;  // Latencies per LatencyHistogram bucket
+
+    // Latency a share (0..1) of the samples took at most, in seconds, to
+    // within the width of its bucket (0 if there are no samples)
+    double GetPercentile(double percentile) const;
+
+    // Latencies shorter than a power of two of microseconds
+    long long CountBelow(int power) const;
+};
+
+// Latencies in HDR-style log-linear buckets: each power of two of
+// microseconds is split into 16 buckets, so a latency is known to within
+// 1/16 of its value from a microsecond up to days, in fixed memory.
+// Lock-free: recording is a few atomic adds.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+    ~LatencyHistogram();
+
+    // Add a latency
+    void Record(double seconds);
+
+    // Copy the counts out; latencies recorded meanwhile may be left out
+    LatencySnapshot GetSnapshot() const;
+
+    // Bucket of a latency, and the bounds of a bucket (in microseconds)
+    static size_t GetBucket(uint64_t microseconds);
+    static uint64_t GetBucketLowerBound(size_t bucket);
+    static uint64_t GetBucketUpperBound(size_t bucket);
+
+    // Sub-buckets per power of two, as bits
+    static const int SUB_BUCKET_BITS = 4;
+
+    // Latencies from 2^MAX_POWER microseconds (12.7 days) up share the last bucket
+    static const int MAX_POWER = 40;
+
+    static const size_t BUCKET_COUNT = static_cast<size_t>(MAX_POWER - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+private:
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    std::atomic<long long> m_buckets[BUCKET_COUNT];
+    std::atomic<long long> m_sum;        // Microseconds
+    std::atomic<long long> m_max;        // Microseconds
+};
+
+// A snapshot of an IoMetrics
+struct IoMetricsSnapshot {
+    std::wstring name;                   // Source root directory, or device ID
+    long long opens;                     // Files opened (or tried)
+    long long reads;                     // Reads issued, failed ones included
+    long long writes;                    // Writes issued, failed ones included
+    long long bytesRead;
+    long long bytesWritten;
+    long long errors;                    // Opens, reads and writes that failed
+    long long retries;                   // Packets sent to another replica after a failure here
+    LatencySnapshot openLatency;         // Successful operations only
+    LatencySnapshot readLatency;
+    LatencySnapshot writeLatency;
+};
+
+// I/O counters and latencies of a source or a device
+// Lock-free: the copy threads update them with atomics only
+class IoMetrics {
+public:
+    IoMetrics();
+    ~IoMetrics();
+
+    // An operation finished
+    void OnOpen(bool success, double seconds);
+    void OnRead(bool success, long long bytes, double seconds);
+    void OnWrite(bool success, long long bytes, double seconds);
+
+    // A packet read here has to be read from another replica
+    void OnRetry();
+
+    // Copy the counts out (name is left empty)
+    IoMetricsSnapshot GetSnapshot() const;
+
+private:
+    IoMetrics(const IoMetrics&) = delete;
+    IoMetrics& operator=(const IoMetrics&) = delete;
+
+    std::atomic<long long> m_opens;
+    std::atomic<long long> m_reads;
+    std::atomic<long long> m_writes;
+    std::atomic<long long> m_bytesRead;
+    std::atomic<long long> m_bytesWritten;
+    std::atomic<long long> m_errors;
+    std::atomic<long long> m_retries;
+    LatencyHistogram m_openLatency;
+    LatencyHistogram m_readLatency;
+    LatencyHistogram m_writeLatency;
+};
+
+// Why a copy thread had I/O it couldn't issue
+enum StallKind {
+    STALL_RATE_LIMIT,        // Waiting for a bandwidth cap
+    STALL_STREAM_ADMISSION,  // Idle while files wait for a device stream
+    STALL_KIND_COUNT
+};
+
+// File formats metrics are exported in
+enum MetricsFormat {
+    METRICS_JSON,
+    METRICS_PROMETHEUS       // Prometheus text format, e.g. for node_exporter's textfile collector
+};
+
+// A snapshot of CopyMetrics, plus the gauges FileCopier adds to it
+struct MetricsSnapshot {
+    long long time;                          // Seconds since 1970 when it was taken
+    std::vector<IoMetricsSnapshot> sources;  // Per source root directory
+    std::vector<IoMetricsSnapshot> devices;  // Per device, sources and destination
+    long long requestsInFlight;              // I/O requests queued by the copy workers
+    long long peakRequestsInFlight;          // Most ever queued at once
+    long long buffersAllocated;              // Packet buffers in the pool
+    long long buffersInUse;                  // Of those, held by a copy thread
+    long long bufferSize;                    // Bytes per buffer
+    long long stalls[STALL_KIND_COUNT];      // Times I/O was held up, per reason
+    double stallSeconds[STALL_KIND_COUNT];   // Time it was held up, summed over the requests held
+};
+
+// Metrics of a FileCopier, kept for its lifetime so the counters only grow:
+// I/O counters and latency histograms per source root and per device,
+// requests in flight and stalls. The copy threads update them without
+// locks; only creating the metrics of a new source or device takes one.
+class CopyMetrics {
+public:
+    CopyMetrics();
+    ~CopyMetrics();
+
+    // Metrics of a source root directory or a device, created on first use;
+    // the pointer stays valid for the life of the CopyMetrics
+    IoMetrics* GetSourceMetrics(const std::wstring& root);
+    IoMetrics* GetDeviceMetrics(bool known, unsigned long long deviceId);
+
+    // I/O requests were queued (positive) or completed (negative)
+    void AddRequestsInFlight(long long count);
+
+    // A copy thread was held up
+    void OnStall(StallKind kind, double seconds);
+
+    // Copy everything out (the buffer gauges are left at 0)
+    MetricsSnapshot GetSnapshot() const;
+
+    // Render a snapshot
+    static std::string FormatJson(const MetricsSnapshot& snapshot);
+    static std::string FormatPrometheus(const MetricsSnapshot& snapshot);
+    static std::string Format(const MetricsSnapshot& snapshot, MetricsFormat format);
+
+    // Write text to a file, replacing it in one step so a reader never sees
+    // half of it
+    static bool WriteFile(const std::wstring& path, const std::string& text);
+
+private:
+    CopyMetrics(const CopyMetrics&) = delete;
+    CopyMetrics& operator=(const CopyMetrics&) = delete;
+
+    // Metrics with the name they are reported under
+    struct NamedMetrics {
+        std::wstring name;
+        IoMetrics metrics;
+    };
+
+    std::vector<std::unique_ptr<NamedMetrics>> m_sources;     // In the order first seen
+    std::vector<std::unique_ptr<NamedMetrics>> m_devices;
+    std::unordered_map<std::wstring, NamedMetrics*> m_sourceIndex;   // FileIo::GetPathKey -> metrics
+    std::unordered_map<unsigned long long, NamedMetrics*> m_deviceIndex;
+    NamedMetrics* m_unknownDevice;
+    std::atomic<long long> m_requestsInFlight;
+    std::atomic<long long> m_peakRequestsInFlight;
+    std::atomic<long long> m_stalls[STALL_KIND_COUNT];
+    std::atomic<long long> m_stallMicroseconds[STALL_KIND_COUNT];
+    mutable boost::mutex m_mutex;        // Guards the lists and maps
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <cstddef>
+#include <boost/thread/mutex.hpp>
+
+// A file let into the copy and the source devices it may read from
+struct StreamAdmission {
+    size_t file;                     // Index of the file in the job
+    std::vector<size_t> devices;     // Source devices it holds a stream on
+};
+
+// Lets the files of a copy job in so that no device serves more files at
+// once than its stream limit: one for a spinning disk, whose head would
+// otherwise seek back and forth between files, many for SSDs and NVMe.
+// A file needs a stream on its destination device and on at least one of
+// its source devices; it is granted every source device that has a free
+// stream when it is let in, and holds them until it is done. Files wait
+// in one queue per source device and are let in first come, first served.
+class DeviceStreamLimiter {
+public:
+    // limits[d] is the most files device d may serve at once (at least 1);
+    // files are numbered below fileCount
+    DeviceStreamLimiter(const std::vector<int>& limits, size_t fileCount);
+    ~DeviceStreamLimiter();
+
+    // Queue a file; it is let in by the next Admit or Release
+    void Add(size_t file, size_t destinationDevice, const std::vector<size_t>& sourceDevices);
+
+    // Let queued files in while their devices have free streams
+    // Appends the files let in to admitted
+    void Admit(std::vector<StreamAdmission>& admitted);
+
+    // A file is done: free its streams and let in the files waiting on them
+    // (files that were never let in are ignored)
+    void Release(size_t file, std::vector<StreamAdmission>& admitted);
+
+    // Number of files queued and not let in yet
+    size_t GetWaitingCount() const;
+
+private:
+    DeviceStreamLimiter(const DeviceStreamLimiter&) = delete;
+    DeviceStreamLimiter& operator=(const DeviceStreamLimiter&) = delete;
+
+    // Where a file stands
+    struct FileEntry {
+        size_t destination;              // Destination device
+        std::vector<size_t> sources;     // Source devices it could read from
+        std::vector<size_t> granted;     // Source devices it holds streams on
+        bool queued;                     // Waiting to be let in
+        bool admitted;                   // Let in and not released yet
+    };
+
+    // Check if a device has a free stream
+    bool IsFree(size_t device) const;
+
+    // Let a file in if its destination and one of its sources are free
+    bool TryAdmit(size_t file, std::vector<StreamAdmission>& admitted);
+
+    // Let in files from the head of every device's queue (lock held)
+    void AdmitLocked(std::vector<StreamAdmission>& admitted);
+
+    std::vector<int> m_limits;                  // Per device: stream limit
+    std::vector<int> m_active;                  // Per device: streams in use
+    std::vector<std::deque<size_t>> m_queues;   // Per device: files waiting on it
+    std::vector<FileEntry> m_files;
+    size_t m_waiting;
+    mutable boost::mutex m_mutex;
+};
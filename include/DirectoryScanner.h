@@ -0,0 +1,112 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "IoBackend.h"
+
+// Add forward declarations for Boost
+namespace boost {
+    class thread_group;
+}
+
+// Receives a batch of file paths found by a scan; batches are delivered
+// one at a time, from the scanner's threads
+typedef void (*ScanBatchFunc)(const std::vector<std::wstring>& paths, void* userData);
+
+// Walks a directory tree on a pool of threads and streams the files it
+// finds to a callback in batches, so the caller can start on the first
+// files while the rest of the tree is still being read.
+// Every thread owns a deque of directories to read; subdirectories go on
+// the finder's own deque and idle threads steal the oldest ones from the
+// others, so wide and deep trees both spread across the pool.
+// Directories are read with getdents64 on Linux and FindFirstFileEx
+// (large fetch) on Windows. Symbolic links and reparse points to
+// directories are not followed. A backend that isn't native is listed
+// with its ListDirectory instead.
+class DirectoryScanner {
+public:
+    // threadCount 0 picks one thread per core (up to MAX_THREADS)
+    // backend null (or native) reads the real filesystem
+    explicit DirectoryScanner(int threadCount = 0, const std::shared_ptr<IoBackend>& backend = nullptr);
+    ~DirectoryScanner();
+
+    // Start scanning root in the background; returns false if a scan is
+    // already running or the threads couldn't be started
+    bool Start(const std::wstring& root, bool recursive, ScanBatchFunc callback, void* userData);
+
+    // Wait until the scan has finished and every batch was delivered
+    void Wait();
+
+    // Stop the scan early; batches already delivered stay delivered
+    void Cancel();
+
+    // Check if the scan has finished (or was cancelled)
+    bool IsFinished() const;
+
+    // Number of files and directories found so far
+    long long GetFileCount() const;
+    long long GetDirectoryCount() const;
+
+    // Number of directories that couldn't be read
+    long long GetErrorCount() const;
+
+    // Files delivered per callback (fewer when a thread runs out of work)
+    static const size_t BATCH_SIZE = 1024;
+
+    // Most threads picked automatically; more rarely helps a single device
+    static constexpr int MAX_THREADS = 16;
+
+private:
+    DirectoryScanner(const DirectoryScanner&) = delete;
+    DirectoryScanner& operator=(const DirectoryScanner&) = delete;
+
+    // One thread's deque of directories to read
+    struct WorkerQueue {
+        boost::mutex mutex;
+        std::deque<std::wstring> directories;
+    };
+
+    // Thread body: read directories until the whole tree is done
+    void RunWorker(int worker);
+
+    // Queue a directory on a worker's own deque
+    void Push(int worker, const std::wstring& directory);
+
+    // Get the next directory for a worker, stealing if its own deque is empty
+    bool Pop(int worker, std::wstring* directory);
+
+    // Read one directory, queueing its subdirectories and batching its files
+    void ReadDirectory(int worker, const std::wstring& directory, std::vector<std::wstring>& batch);
+
+    // The same through a backend's ListDirectory
+    void ReadBackendDirectory(int worker, const std::wstring& directory, std::vector<std::wstring>& batch);
+
+    // Hand a batch to the callback and empty it
+    void Deliver(std::vector<std::wstring>& batch);
+
+    std::shared_ptr<IoBackend> m_backend;        // Null for the real filesystem
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::unique_ptr<boost::thread_group> m_threads;
+    int m_threadCount;
+    bool m_recursive;
+    ScanBatchFunc m_callback;
+    void* m_userData;
+    boost::mutex m_callbackMutex;                // Delivers one batch at a time
+
+    // Directories queued or being read; the scan is over when it reaches zero
+    std::atomic<long long> m_pending;
+    boost::mutex m_idleMutex;
+    boost::condition_variable m_idle;            // Signalled on new work and at the end
+    std::atomic<bool> m_cancelled;
+    std::atomic<int> m_activeThreads;            // Threads still scanning
+    std::atomic<bool> m_finished;
+
+    std::atomic<long long> m_fileCount;
+    std::atomic<long long> m_directoryCount;
+    std::atomic<long long> m_errorCount;
+};
@@ -2,8 +2,25 @@
 
 #include <string>
 #include <vector>
+#include <unordered_set>
 #include <memory>
-#include <windows.h>
+#include <atomic>
+#include <cstdint>
+#include "FileIo.h"
+#include "SourceHandlePool.h"
+#include "AsyncIo.h"
+#include "IoBackend.h"
+#include "PacketScheduler.h"
+#include "ReplicaSelector.h"
+#include "IoSizeTuner.h"
+#include "AlignedBufferPool.h"
+#include "ReplicaVerifier.h"
+#include "CopyJournal.h"
+#include "DeviceStreamLimiter.h"
+#include "ReplicaCatalog.h"
+#include "RateLimiter.h"
+#include "ProgressCounters.h"
+#include "CopyMetrics.h"
 
 // Add forward declarations for Boost
 namespace boost {
@@ -11,24 +28,53 @@ namespace boost {
     class thread_group;
     class mutex;
     class condition_variable;
-    template <typename T> class atomic;
 }
 
 // Progress callback function type
-typedef void (*ProgressCallbackFunc)(int completed, int total, void* userData);
+// Called from a reporter thread about ten times a second while the count
+// changes, and once more when the copy ends
+typedef void (*ProgressCallbackFunc)(long long completed, long long total, void* userData);
 
 // Source file information
 struct SourceInfo {
     std::wstring path;        // File path
     std::wstring status;      // Current status (e.g., "Ready", "Copying", etc.)
     long long speed;          // Measured speed in Kbps
+    std::wstring group;       // Explicit replica group (empty = group by relative path and size)
+    std::wstring relativePath;  // Path under the directory it was added from (empty = file name)
 };
 
-// Thread parameter structure
-struct CopyThreadParam {
-    class FileCopier* pCopier;
+// How one file of the last copy was copied
+struct FileCopyResult {
+    std::wstring fileName;    // Destination path, relative to the destination directory
+    std::wstring method;      // Copy paths used, e.g. "clone", "copy_file_range" or "splice+buffered"
+    bool complete;            // Every packet was written
+    int resumedPackets;       // Packets already written by an interrupted copy
+    long long unchangedBytes; // Bytes delta sync found already in place
+    long long zeroBytes;      // Bytes of all-zero blocks left as holes instead of written
 };
 
+// Bytes and files of the current (or last) copy
+// Logical bytes are file sizes, holes included; physical bytes are the
+// data actually read and written, so holes in sparse files don't count
+struct CopyProgress {
+    long long logicalBytes;   // Bytes of the files accounted for
+    long long logicalTotal;   // Total size of the files
+    long long physicalBytes;  // Data bytes copied
+    long long physicalTotal;  // Data bytes to copy
+    long long filesDone;      // Files finished (copied, cloned or already in place)
+    long long filesTotal;     // Files found so far
+    long long packetsDone;    // Packets finished (copied, cloned, skipped or already in place)
+    long long packetsTotal;   // Packets of the files found so far
+    double filesPerSecond;    // Files finished per second since the copy started
+};
+
+// Pass as the packet size to tune the read size per source while copying
+#define AUTO_PACKET_SIZE 0
+
+// Per-file state shared by the copy workers (defined in FileCopier.cpp)
+struct CopyFileState;
+
 class FileCopier {
 public:
     FileCopier();
@@ -43,16 +89,155 @@ public:
 	//Add a source file with additional information
     void AddSourceWithInfo(const SourceInfo& info);
 
-    // Recursively add files from a directory
+    // Add the files of a directory (and its subdirectories if recursive),
+    // scanning it on several threads; returns the number of files found
+    // Each file keeps its path under the directory, which is where it is
+    // written and what matches it with its replicas under other directories
     int AddSourceDirectory(const std::wstring& directoryPath, bool recursive = true);
 
     // Clear all sources
     void ClearSources();
 
+    // Put a source into an explicit replica group
+    void SetSourceGroup(size_t index, const std::wstring& group);
+
+    // Treat sources with the same relative path and size (or group) as
+    // replicas of one file
+    void SetReplicaMode(bool enable);
+    bool GetReplicaMode() const;
+
+    // In replica mode, also match replicas by a fingerprint of sampled
+    // content, so a mirror whose copy of a file differs is left out of it
+    // before the copy starts (default off)
+    void SetFingerprintReplicas(bool enable);
+    bool GetFingerprintReplicas() const;
+
+    // Number of packets kept in flight (reads and writes) per worker
+    void SetQueueDepth(int queueDepth);
+    int GetQueueDepth() const;
+
+    // Number of copy worker threads (0 = one per distinct source device)
+    void SetThreadCount(int threadCount);
+    int GetThreadCount() const;
+
+    // Most memory the packet buffers may use when the packet size is automatic
+    void SetMemoryBudget(long long bytes);
+    long long GetMemoryBudget() const;
+
+    // Share of reads that may be hedged: a read running past its device's
+    // recent p95 latency is issued again on another replica and the first
+    // result wins (default 0.05, 0 disables hedging)
+    void SetHedgeRate(double rate);
+    double GetHedgeRate() const;
+
+    // Files a device may serve at once: spinning disks default to one, so
+    // the head isn't dragged back and forth between files, SSDs to many.
+    // Devices whose kind can't be told get UNKNOWN_DEVICE_STREAMS
+    void SetRotationalStreams(int streams);
+    int GetRotationalStreams() const;
+    void SetSolidStateStreams(int streams);
+    int GetSolidStateStreams() const;
+
+    // Bandwidth caps in bytes per second (0 = unlimited), enforced with
+    // token buckets in the I/O path; they can be changed while a copy runs
+    // Every read and every write
+    void SetReadRateLimit(long long bytesPerSecond);
+    long long GetReadRateLimit() const;
+    void SetWriteRateLimit(long long bytesPerSecond);
+    long long GetWriteRateLimit() const;
+
+    // Reads from a source file, or from all the files under a source
+    // directory together; a limit on a source that had none when the copy
+    // started applies to the files the copy sets up after it
+    void SetSourceRateLimit(const std::wstring& path, long long bytesPerSecond);
+    long long GetSourceRateLimit(const std::wstring& path) const;
+
+    // Reads and writes on the device holding path
+    // Returns false if the device can't be determined
+    bool SetDeviceRateLimit(const std::wstring& path, long long bytesPerSecond);
+    long long GetDeviceRateLimit(const std::wstring& path) const;
+
+    // Number of hedged reads issued by the last copy
+    long long GetHedgedReadCount() const;
+
+    // Check that the replicas of a file hold the same data before copying
+    // it, and ignore the ones that disagree with the majority (default on)
+    void SetVerifyReplicas(bool enable);
+    bool GetVerifyReplicas() const;
+
+    // Keep a journal of finished packets next to each large destination
+    // file, so a copy that is interrupted resumes where it stopped instead
+    // of starting over (default on)
+    void SetResume(bool enable);
+    bool GetResume() const;
+
+    // Update an existing destination in place: compare each block read
+    // from the sources with the destination and write only the ones that
+    // differ (default off)
+    void SetDeltaSync(bool enable);
+    bool GetDeltaSync() const;
+
+    // Copy only the data ranges of sparse sources and leave holes in the
+    // destination (default on)
+    void SetSparseFiles(bool enable);
+    bool GetSparseFiles() const;
+
+    // Scan each buffer before it is written and leave all-zero blocks as
+    // holes in the destination instead of writing them, punching holes
+    // over old data where needed; turns off kernel copies, which never
+    // show the data (default off)
+    void SetSkipZeroBlocks(bool enable);
+    bool GetSkipZeroBlocks() const;
+
+    // Byte and file counts of the copy in progress (or the last one)
+    CopyProgress GetProgress() const;
+
+    // I/O counters and latency histograms per source root directory and
+    // per device, requests in flight, buffer pool occupancy and stalls,
+    // added up over every copy this FileCopier has run
+    MetricsSnapshot GetMetrics() const;
+
+    // Write the metrics to a file every intervalMs while a copy runs and
+    // once more when it ends (an empty path turns this off)
+    void SetMetricsFile(const std::wstring& path, MetricsFormat format, int intervalMs = 10000);
+
+    // Write the metrics to a file now
+    bool WriteMetricsFile(const std::wstring& path, MetricsFormat format) const;
+
+    // Bypass the page cache for sources and destinations (O_DIRECT /
+    // FILE_FLAG_NO_BUFFERING), for huge copies that would otherwise evict
+    // everything else from memory (default off)
+    void SetDirectIo(bool enable);
+    bool GetDirectIo() const;
+
+    // Clone files that are on the same copy-on-write filesystem as the
+    // destination (btrfs, XFS, ReFS) instead of copying them (default on)
+    void SetCloneFiles(bool enable);
+    bool GetCloneFiles() const;
+
+    // Copy inside the kernel (copy_file_range, then splice) where possible,
+    // falling back to reading into a buffer when the kernel refuses (default on)
+    void SetZeroCopy(bool enable);
+    bool GetZeroCopy() const;
+
+    // Do every file operation through backend instead of the real
+    // filesystem, e.g. a SimulatedIoBackend (null = the native one); paths
+    // are the backend's, and kernel copies and clones only happen where
+    // it offers them. Can't be changed while a copy runs
+    void SetIoBackend(const std::shared_ptr<IoBackend>& backend);
+    std::shared_ptr<IoBackend> GetIoBackend() const;
+
+    // How each file of the last copy was copied
+    std::vector<FileCopyResult> GetFileResults() const;
+
+    // Name of the asynchronous I/O backend used by the last copy (e.g. "io_uring")
+    std::wstring GetIoBackendName() const;
+
     // Get list of sources
     const std::vector<SourceInfo>& GetSources() const;
 
     // Start copying files
+    // packetSize AUTO_PACKET_SIZE tunes the read size per source device
     bool StartCopy(
         const std::wstring& destinationPath,
         ProgressCallbackFunc progressCallback,
@@ -60,52 +245,221 @@ public:
         int packetSize = 65536    // 64KB default
     );
 
+    // Copy every file under a directory, along with the sources already
+    // added, starting on the first files while the rest of the tree is
+    // still being scanned. The files found go straight to the copy, not
+    // into the source list. In replica mode the scan finishes first, since
+    // any file found later could be a replica of one found earlier
+    bool StartDirectoryCopy(
+        const std::wstring& sourceDirectory,
+        const std::wstring& destinationPath,
+        ProgressCallbackFunc progressCallback,
+        void* userData,
+        int packetSize = 65536
+    );
+
     // Cancel the copy operation
     void Cancel();
 
     // Check if a copy is in progress
     bool IsOperationInProgress() const;
 
-    // Friend function for thread procedure
-    friend DWORD WINAPI CopyThreadProc(LPVOID lpParameter);
+    // Whether the last copy finished: false if it stopped on an error or
+    // was cancelled. Meaningful once IsOperationInProgress() is false
+    bool LastJobSucceeded() const;
 
 private:
     // Copy operation function
     void DoCopyOperation();
 
-    // Copy a single packet from source to destination
-    bool CopyPacket(
-        const std::wstring& sourcePath,
-        HANDLE hDestFile,
-        LARGE_INTEGER offset,
-        DWORD packetSize,
-        int packetIndex,
-        BYTE* buffer
-    );
+    // Group sources into the logical files to be written
+    std::vector<ReplicaGroup> BuildReplicaGroups(const std::vector<SourceInfo>& sources);
+
+    // Copy one batch of files: set up their state, split them into packets
+    // and run the workers until they are done, adding to the job's progress
+    void CopyFiles(const std::vector<ReplicaGroup>& groups, std::vector<FileCopyResult>& results);
+
+    // Map every replica of the current job to the device it lives on
+    // Returns the number of distinct devices
+    size_t AssignSourceDevices();
+
+    // Look up the kind of every source device and the destination's, and
+    // build the per-device stream limits; the destination shares a source
+    // device's index when it lives on it, or gets the next one
+    std::vector<int> GetDeviceStreamLimits(size_t deviceCount, size_t* destinationDevice) const;
+
+    // Hand the files let in by the stream limiter to the workers
+    void ScheduleAdmitted(const std::vector<StreamAdmission>& admitted);
+
+    // Queue the packet runs of a file that still need copying
+    void ScheduleFile(size_t index);
+
+    // Worker thread: copy packets from its own deque, stealing when it runs dry
+    void RunCopyWorker(PacketScheduler& scheduler, int worker);
+
+    // Open (once) and pre-allocate a file's destination, verifying the
+    // file's replicas first
+    bool OpenDestination(CopyFileState& file);
+
+    // Hash sampled blocks of a file's replicas and stop using the ones
+    // that disagree with the majority
+    void VerifyReplicas(CopyFileState& file);
+
+    // Find the data ranges of a file's source and count the packets that
+    // fall entirely in holes; returns the number of such packets
+    int MapSparseFile(CopyFileState& file);
+
+    // Report a replica whose data differs from the others in its source status
+    void MarkReplicaDiverged(const std::wstring& path);
+
+    // Get the unbuffered I/O alignment every source and the destination accept
+    uint32_t GetJobIoAlignment() const;
+
+    // Charge a read of a replica, a write to the destination or a read of
+    // the destination to the rate limits
+    // Returns the seconds to wait before the transfer may start
+    double ReserveRead(const CopyFileState& file, size_t replica, long long bytes);
+    double ReserveWrite(long long bytes);
+    double ReserveDestinationRead(long long bytes);
+
+    // Seconds until the rate limits would let a read of a replica, or a
+    // write to the destination, through
+    double GetReadWait(const CopyFileState& file, size_t replica);
+    double GetWriteWait();
+
+    // Sleep off a rate limit wait, returning early if the copy is cancelled
+    void WaitForRate(double seconds);
+
+    // Record an open or read of a replica (in its source root's and its
+    // device's metrics), or a packet taken off a replica to be read again
+    void RecordOpen(const CopyFileState& file, size_t replica, bool success, double seconds);
+    void RecordRead(const CopyFileState& file, size_t replica, bool success, long long bytes, double seconds);
+    void RecordRetry(const CopyFileState& file, size_t replica);
+
+    // Account for a finished packet, closing the destination after its last one
+    // (shard is the calling thread's progress shard)
+    void FinishPacket(CopyFileState& file, int packet, size_t shard);
+
+    // Small-file thread: copy whole files, one read and one write each,
+    // taking the next file from files until there are none left
+    void RunSmallFileWorker(const std::vector<size_t>& files, std::atomic<size_t>& next, size_t shard);
+
+    // Copy a file that fits in buffer; returns false if the destination
+    // couldn't be written
+    bool CopySmallFile(CopyFileState& file, uint8_t* buffer, uint8_t*& compareBuffer, size_t shard);
+
+    // Reporter thread: pass the progress to the callback every
+    // PROGRESS_INTERVAL_MS, and write the metrics file when due, until interrupted
+    void RunProgressReporter();
+
+    // Write the metrics file, if one is set
+    void DumpMetrics();
+
+    // Pass the progress to the callback if it changed since the last report
+    void ReportProgress();
 
     // Member variables
     std::vector<SourceInfo> m_sources;
+    std::unordered_set<std::wstring> m_sourceKeys;   // FileIo::GetPathKey of every source
+    std::wstring m_scanDirectory;                    // Directory to scan while copying (StartDirectoryCopy)
     std::wstring m_destinationPath;
     std::wstring m_destinationFilename;
     int m_packetSize;
+    bool m_replicaMode;
+    bool m_fingerprintReplicas;
+    int m_queueDepth;
+    int m_threadCount;
+    bool m_autoPacketSize;
+    long long m_memoryBudget;
+    bool m_zeroCopy;
+    bool m_cloneFiles;
+    bool m_directIo;
+    double m_hedgeRate;
+    bool m_verifyReplicas;
+    bool m_resume;
+    bool m_deltaSync;
+    bool m_sparseFiles;
+    bool m_skipZeroBlocks;
+    int m_rotationalStreams;
+    int m_solidStateStreams;
+    uint32_t m_ioAlignment;              // Alignment of offsets and lengths (1 unless direct I/O)
+    std::vector<FileCopyResult> m_fileResults;
+    std::wstring m_ioBackendName;
+    std::shared_ptr<IoBackend> m_backend;  // Every file operation goes through it
     ProgressCallbackFunc m_progressCallback;
     void* m_userData;
 
     // Threading
-    HANDLE m_thread;
-    HANDLE m_cancelEvent;
-    CopyThreadParam m_threadParam;
+    std::unique_ptr<boost::thread> m_thread;
+    std::atomic<bool> m_cancelRequested;
+    std::atomic<bool> m_jobFailed;
     bool m_operationInProgress;
 
-    // Progress tracking
-    int m_totalPackets;
-    int m_completedPackets;
-    CRITICAL_SECTION m_cs;  // For thread synchronization
+    // Files of the current job, shared by the workers
+    std::vector<std::unique_ptr<CopyFileState>> m_files;
 
-    // Optimizations
-    std::unique_ptr<BYTE[]> m_buffer;  // Reusable buffer for copying
-    static const DWORD BUFFER_SIZE = 1024 * 1024;  // 1MB buffer
-};
+    // Per source device of the current job: its device ID, if known
+    std::vector<std::pair<bool, unsigned long long>> m_sourceDevices;
+
+    // Bandwidth caps, and the device buckets of the current job
+    RateLimiter m_rateLimiter;
+    std::vector<std::shared_ptr<TokenBucket>> m_deviceRates;   // Per source device
+    std::shared_ptr<TokenBucket> m_destinationRate;
+
+    // Per source device of the current job: kernel copy method still worth
+    // trying to the destination
+    std::unique_ptr<std::atomic<int>[]> m_deviceCopyMethods;
 
-// Thread procedure (declared outside of class for Win32 API compatibility)
-DWORD WINAPI CopyThreadProc(LPVOID lpParameter);
\ No newline at end of file
+    // Metrics, and those of the current job's devices
+    CopyMetrics m_metrics;
+    std::vector<IoMetrics*> m_deviceMetrics;     // Per source device
+    IoMetrics* m_destinationMetrics;
+    std::wstring m_metricsPath;                  // File the metrics are written to (empty = none)
+    MetricsFormat m_metricsFormat;
+    int m_metricsIntervalMs;
+
+    // Live per-device throughput, used to pick the replica for each packet
+    std::unique_ptr<ReplicaSelector> m_selector;
+
+    // Reads issued and reads hedged by the current job, to bound the hedges
+    std::atomic<long long> m_readsIssued;
+    std::atomic<long long> m_hedgedReads;
+
+    // Packet runs of the admitted files, and the limiter admitting them
+    PacketScheduler* m_scheduler;
+    std::unique_ptr<DeviceStreamLimiter> m_streamLimiter;
+
+    // Aligned packet buffers shared by the workers
+    std::unique_ptr<AlignedBufferPool> m_bufferPool;
+
+    // Per-device read size tuning (empty unless the packet size is automatic)
+    std::vector<std::unique_ptr<IoSizeTuner>> m_tuners;
+
+    // Progress tracking: the workers count what they finish in their own
+    // shards; the totals only change between batches
+    ProgressCounters m_progress;
+    std::atomic<long long> m_totalPackets;
+    std::atomic<long long> m_logicalTotal;
+    std::atomic<long long> m_physicalTotal;
+    std::atomic<long long> m_filesTotal;
+    long long m_reportedPackets;         // Last packet counts passed to the callback
+    long long m_reportedTotal;
+    std::atomic<double> m_startTime;     // When the copy started (steady clock seconds)
+    std::atomic<double> m_finishTime;    // When it finished (0 while it runs); read by GetProgress from other threads
+    mutable boost::mutex m_mutex;  // For thread synchronization
+
+    // Optimizations
+    static constexpr uint32_t BUFFER_SIZE = 1024 * 1024;  // 1MB max buffer per packet in flight
+    static constexpr uint32_t MIN_AUTO_IO_SIZE = 16 * 1024;     // Smallest tuned read
+    static constexpr uint32_t INITIAL_AUTO_IO_SIZE = 128 * 1024; // First tuned read size
+    static constexpr uint32_t DELTA_BLOCK_SIZE = 4096;   // Granularity of delta sync comparisons and zero blocks
+    static const long long JOURNAL_MIN_FILE_SIZE = 16LL * 1024 * 1024;  // Smaller files are just copied again
+    static constexpr long long SMALL_FILE_SIZE = 256 * 1024;   // Files up to this size take the small-file path
+    static constexpr int SMALL_FILE_THREADS = 16;                // Small files copied at once
+    static constexpr int UNKNOWN_DEVICE_STREAMS = 4;             // Files at once on a device of unknown kind
+    static constexpr int PROGRESS_INTERVAL_MS = 100;             // Progress reports at most 10 times a second
+    static constexpr double HEDGE_PERCENTILE = 0.95;   // Latency percentile a read must exceed to be hedged
+    static constexpr double MIN_HEDGE_DELAY = 0.001;   // Never hedge a read younger than this (seconds)
+    static constexpr double DEFAULT_HEDGE_DELAY = 1.0; // Hedge delay until a device has enough samples
+    SourceHandlePool m_sourceHandles;     // Source handles kept open while their files are copied
+};
\ No newline at end of file
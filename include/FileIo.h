@@ -0,0 +1,174 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Native file handle type
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+#define INVALID_FILE_HANDLE INVALID_HANDLE_VALUE
+#define PATH_SEPARATOR L'\\'
+#else
+typedef int FileHandle;
+#define INVALID_FILE_HANDLE (-1)
+#define PATH_SEPARATOR L'/'
+#endif
+
+// Entry returned when listing a directory
+struct DirectoryEntry {
+    std::wstring name;        // File or directory name (no path)
+    bool isDirectory;         // True for subdirectories
+};
+
+// A range of bytes in a file
+struct FileRange {
+    long long offset;         // Start of the range
+    long long length;         // Bytes in the range
+};
+
+// Ways of copying a range inside the kernel, in the order they are tried
+enum KernelCopyMethod {
+    KERNEL_COPY_FILE_RANGE,   // copy_file_range (may also be offloaded by the filesystem)
+    KERNEL_COPY_SPLICE,       // splice through a pipe
+    KERNEL_COPY_NONE          // Not available: read into a buffer and write it out
+};
+
+// Result of a kernel-side copy
+enum KernelCopyResult {
+    KERNEL_COPY_OK,           // Copied (a short count means end of file)
+    KERNEL_COPY_UNSUPPORTED,  // The kernel refused this method for these files
+    KERNEL_COPY_ERROR         // I/O error
+};
+
+// Kind of storage a file lives on, for sizing concurrency
+enum DeviceKind {
+    DEVICE_KIND_UNKNOWN,      // Network share, virtual filesystem, or couldn't tell
+    DEVICE_KIND_ROTATIONAL,   // Spinning disk: seeks between files are expensive
+    DEVICE_KIND_SOLID_STATE   // SSD or NVMe
+};
+
+// Thin portable wrappers around the platform file API (Win32 or POSIX)
+class FileIo {
+public:
+    // Open an existing file for reading
+    // unbuffered bypasses the page cache (O_DIRECT / FILE_FLAG_NO_BUFFERING);
+    // offsets, lengths and buffers must then be aligned to GetIoAlignment
+    // Returns INVALID_FILE_HANDLE on error
+    static FileHandle OpenForRead(const std::wstring& path, bool unbuffered = false);
+
+    // Create (or truncate) a file for writing
+    // Returns INVALID_FILE_HANDLE on error
+    static FileHandle CreateForWrite(const std::wstring& path, bool unbuffered = false);
+
+    // Open a file for reading and writing, creating it if needed but
+    // keeping any existing contents (used to resume a copy)
+    // Returns INVALID_FILE_HANDLE on error
+    static FileHandle OpenForUpdate(const std::wstring& path, bool unbuffered = false);
+
+    // Get the alignment unbuffered I/O needs for a file or directory
+    // (the device's logical block size)
+    static bool GetIoAlignment(const std::wstring& path, uint32_t* alignment);
+
+    // Close a handle opened by this class
+    static void Close(FileHandle handle);
+
+    // Read at an absolute offset without using the handle's file pointer
+    // A short read (including 0 bytes) means end of file
+    static bool ReadAt(FileHandle handle, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead);
+
+    // Write at an absolute offset without using the handle's file pointer
+    static bool WriteAt(FileHandle handle, long long offset, const void* buffer, uint32_t length, uint32_t* bytesWritten);
+
+    // Make everything written to a file so far durable (fdatasync / FlushFileBuffers)
+    static bool Flush(FileHandle handle);
+
+    // Evict a range of a file from the page cache, so the next read of it
+    // comes from the device (posix_fadvise DONTNEED; dirty pages stay)
+    // Returns false where that can't be done (Windows: open unbuffered instead)
+    static bool DropCache(FileHandle handle, long long offset, long long length);
+
+    // First kernel-side copy method to try on this platform
+    // (KERNEL_COPY_NONE where there is none, e.g. Windows)
+    static KernelCopyMethod GetKernelCopyMethod();
+
+    // Copy a range from one file to another without going through user space
+    // Neither handle's file pointer is used or changed
+    static KernelCopyResult CopyRange(KernelCopyMethod method,
+        FileHandle source, long long sourceOffset,
+        FileHandle destination, long long destinationOffset,
+        uint32_t length, uint32_t* bytesCopied);
+
+    // Create destinationPath as a copy-on-write clone of sourcePath
+    // (FICLONE on btrfs/XFS, block cloning on ReFS); no data is copied
+    // Returns false if the filesystem can't clone these files
+    static bool CloneFile(const std::wstring& sourcePath, const std::wstring& destinationPath);
+
+    // Name of a kernel copy method for reporting ("buffered" for none)
+    static const wchar_t* GetKernelCopyMethodName(KernelCopyMethod method);
+
+    // Set the size of an open file (used to pre-allocate the destination)
+    static bool SetSize(FileHandle handle, long long size);
+
+    // List the ranges of a file that hold data; everything else is a hole
+    // that reads as zeros (SEEK_DATA/SEEK_HOLE, FSCTL_QUERY_ALLOCATED_RANGES)
+    // Returns false if the platform or filesystem can't tell
+    static bool GetDataRanges(const std::wstring& path, long long fileSize, std::vector<FileRange>& ranges);
+
+    // Let a file have holes (NTFS needs this before holes can be made;
+    // elsewhere files are always allowed to be sparse)
+    static bool SetSparse(FileHandle handle);
+
+    // Turn a range of a file into a hole that reads as zeros, keeping its size
+    // Returns false if the filesystem can't
+    static bool PunchHole(FileHandle handle, long long offset, long long length);
+
+    // Get the size of a file by path
+    static bool GetSize(const std::wstring& path, long long* size);
+
+    // Get the last modification time of a file by path, in platform units
+    // (only meant for comparing against a value read earlier)
+    static bool GetModifiedTime(const std::wstring& path, long long* time);
+
+    // Delete a file
+    static bool Delete(const std::wstring& path);
+
+    // Rename a file, atomically replacing any file already at the new path
+    static bool Rename(const std::wstring& from, const std::wstring& to);
+
+    // Get an identifier for the device (volume) a file lives on
+    // (st_dev on POSIX, the volume serial number on Windows)
+    static bool GetDeviceId(const std::wstring& path, unsigned long long* deviceId);
+
+    // Find out whether the device a file lives on is a spinning disk
+    // (sysfs queue/rotational on Linux, the seek penalty property on Windows)
+    static DeviceKind GetDeviceKind(const std::wstring& path);
+
+    // Create a directory, succeeding if it already exists
+    static bool CreateDirectoryPath(const std::wstring& path);
+
+    // List the entries of a directory (without . and ..)
+    static bool ListDirectory(const std::wstring& path, std::vector<DirectoryEntry>& entries);
+
+    // Get the file name part of a path
+    static std::wstring GetFileName(const std::wstring& path);
+
+    // Compare two paths the way the platform does (case-insensitive on Windows)
+    static bool SamePath(const std::wstring& a, const std::wstring& b);
+
+    // Key that is equal for two paths exactly when SamePath says they are,
+    // for hashing paths
+    static std::wstring GetPathKey(const std::wstring& path);
+
+#ifndef _WIN32
+    // Convert a wide path to the UTF-8 form the POSIX API expects
+    static std::string ToNativePath(const std::wstring& path);
+
+    // Convert a UTF-8 name from the POSIX API back to a wide string
+    static std::wstring FromNativePath(const std::string& path);
+#endif
+};
@@ -3,6 +3,7 @@
 #include <commctrl.h>
 #include <string>
 #include <vector>
+#include <memory>
 #include "../include/FileCopier.h"
 #include "../include/SpeedMeasure.h"
 
@@ -19,14 +20,28 @@
 #define ID_PROGRESS_BAR        1009
 #define ID_STATUS_BAR          1010
 #define ID_PACKET_SIZE_COMBO   1011
+#define ID_REPLICA_CHECK       1013
+#define ID_QUEUE_DEPTH_COMBO   1014
+#define ID_THREAD_COUNT_COMBO  1015
+#define ID_DIRECT_IO_CHECK     1016
+#define ID_DELTA_SYNC_CHECK    1017
+#define ID_ZERO_BLOCKS_CHECK   1018
 
 // Window class name
 #define WINDOW_CLASS_NAME L"MultiSourceFileCopierClass"
 
 // Message for updating the progress bar (to avoid cross-thread UI updates)
+// lParam is a ProgressSample the message owns
 #define WM_UPDATE_PROGRESS (WM_USER + 1)
 #define WM_COPY_COMPLETE   (WM_USER + 2)
 
+// Progress as the reporter thread sampled it, for the UI thread to show
+struct ProgressSample {
+    long long completed;      // Packets done
+    long long total;          // Packets in all
+    CopyProgress progress;
+};
+
 // Main application window class
 class MainWindow {
 public:
@@ -61,9 +76,10 @@ private:
     void OnStartCopy();
     void OnCancelOperation();
     void OnCopyComplete(bool success);
+    void OnProgress(const ProgressSample& sample);
 
     // Progress callback
-    static void ProgressCallback(int completed, int total, void* userData);
+    static void ProgressCallback(long long completed, long long total, void* userData);
 
     // Member variables
     HWND m_hwnd;                // Main window handle
@@ -72,6 +88,12 @@ private:
     HWND m_progressBar;         // Progress bar
     HWND m_statusBar;           // Status bar
     HWND m_packetSizeCombo;     // Packet size combo box
+    HWND m_replicaCheck;        // Combine replicas check box
+    HWND m_queueDepthCombo;     // Queue depth combo box
+    HWND m_threadCountCombo;    // Worker thread count combo box
+    HWND m_directIoCheck;       // Bypass the page cache check box
+    HWND m_deltaSyncCheck;      // Write only changed blocks check box
+    HWND m_zeroBlocksCheck;     // Leave zero blocks as holes check box
     HINSTANCE m_hInstance;      // Application instance
 
     FileCopier m_fileCopier;    // File copier instance
@@ -79,4 +101,6 @@ private:
 
     // Helper methods
     int GetSelectedPacketSize();
+    int GetSelectedQueueDepth();
+    int GetSelectedThreadCount();
 };
\ No newline at end of file
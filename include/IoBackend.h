@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "FileIo.h"
+
+// The file operations the copy engine performs, behind one interface, so
+// the engine can run against something other than the real filesystem.
+// The native backend forwards to FileIo (Win32 or POSIX); the simulated
+// one (SimulatedIoBackend) serves files from memory through modelled
+// devices, for benchmarks of the scheduling without real hardware.
+// Handles are FileHandle values, but only mean something to the backend
+// that returned them. Every method may be called from several threads.
+class IoBackend {
+public:
+    virtual ~IoBackend() {}
+
+    // Backend name for reporting (e.g. "posix")
+    virtual const wchar_t* GetName() const = 0;
+
+    // Whether handles are the platform's own, so native asynchronous I/O
+    // (io_uring, overlapped) can be used on them
+    virtual bool IsNative() const = 0;
+
+    // Seconds on the clock requests are timed by: the steady clock
+    // natively, the virtual one in a simulation
+    virtual double GetTime() const = 0;
+
+    // Open
+    // unbuffered bypasses the page cache; offsets, lengths and buffers
+    // must then be aligned to GetIoAlignment
+    virtual FileHandle OpenForRead(const std::wstring& path, bool unbuffered = false) = 0;
+    virtual FileHandle CreateForWrite(const std::wstring& path, bool unbuffered = false) = 0;
+    virtual FileHandle OpenForUpdate(const std::wstring& path, bool unbuffered = false) = 0;
+    virtual void Close(FileHandle handle) = 0;
+    virtual bool GetIoAlignment(const std::wstring& path, uint32_t* alignment) = 0;
+
+    // Positional read and write
+    virtual bool ReadAt(FileHandle handle, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead) = 0;
+    virtual bool WriteAt(FileHandle handle, long long offset, const void* buffer, uint32_t length, uint32_t* bytesWritten) = 0;
+    virtual bool Flush(FileHandle handle) = 0;
+    virtual bool DropCache(FileHandle handle, long long offset, long long length) = 0;
+
+    // Preallocate: set a file's length up front; holes and sparse files
+    virtual bool SetSize(FileHandle handle, long long size) = 0;
+    virtual bool SetSparse(FileHandle handle) = 0;
+    virtual bool PunchHole(FileHandle handle, long long offset, long long length) = 0;
+    virtual bool GetDataRanges(const std::wstring& path, long long fileSize, std::vector<FileRange>& ranges) = 0;
+
+    // Stat
+    virtual bool GetSize(const std::wstring& path, long long* size) = 0;
+    virtual bool GetModifiedTime(const std::wstring& path, long long* time) = 0;
+    virtual bool GetDeviceId(const std::wstring& path, unsigned long long* deviceId) = 0;
+    virtual DeviceKind GetDeviceKind(const std::wstring& path) = 0;
+
+    // Enumerate and change the directory tree
+    virtual bool ListDirectory(const std::wstring& path, std::vector<DirectoryEntry>& entries) = 0;
+    virtual bool CreateDirectoryPath(const std::wstring& path) = 0;
+    virtual bool Delete(const std::wstring& path) = 0;
+    virtual bool Rename(const std::wstring& from, const std::wstring& to) = 0;
+
+    // Copies that never pass through the engine's buffers; backends without
+    // them return KERNEL_COPY_NONE and false, and the engine reads and writes
+    virtual KernelCopyMethod GetKernelCopyMethod() = 0;
+    virtual KernelCopyResult CopyRange(KernelCopyMethod method,
+        FileHandle source, long long sourceOffset,
+        FileHandle destination, long long destinationOffset,
+        uint32_t length, uint32_t* bytesCopied) = 0;
+    virtual bool CloneFile(const std::wstring& sourcePath, const std::wstring& destinationPath) = 0;
+
+    // The platform's filesystem, through FileIo (shared, never null)
+    static std::shared_ptr<IoBackend> GetNative();
+};
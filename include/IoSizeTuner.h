@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <boost/thread/mutex.hpp>
+
+// Tunes the read size for one source device while a copy runs.
+// Hill climb on measured throughput over power-of-two sizes: keep doubling
+// (or halving) while each window of reads is faster than the last, turn
+// around when it gets slower, and halve straight away on a read error.
+class IoSizeTuner {
+public:
+    // Sizes stay within [minSize, maxSize]; both are rounded to powers of two
+    IoSizeTuner(uint32_t minSize, uint32_t maxSize, uint32_t initialSize);
+    ~IoSizeTuner();
+
+    // Size to use for the next read
+    uint32_t GetIoSize() const;
+
+    // Report a finished read (seconds is the time it was in flight)
+    void OnReadFinished(bool success, uint32_t bytes, double seconds);
+
+private:
+    // Move to the next size in the current direction, turning at the bounds
+    void Step();
+
+    mutable boost::mutex m_mutex;
+    uint32_t m_size;
+    uint32_t m_minSize;
+    uint32_t m_maxSize;
+    bool m_growing;               // Direction of the next step
+
+    // Current measurement window
+    int m_windowReads;
+    double m_windowBytes;
+    double m_windowSeconds;
+
+    double m_lastThroughput;      // Throughput of the previous window (0 = none)
+    int m_flatWindows;            // Windows in a row without a clear change
+
+    // Reads per measurement window
+    static const int WINDOW_READS = 16;
+
+    // Change in throughput that counts as better or worse (5%)
+    static constexpr double THRESHOLD = 0.05;
+
+    // Probe again after this many flat windows, in case conditions changed
+    static const int FLAT_WINDOWS_BEFORE_PROBE = 8;
+};
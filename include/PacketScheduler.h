@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <boost/thread/mutex.hpp>
+
+// A run of consecutive packets of one file
+struct PacketRange {
+    size_t fileIndex;         // Index of the file in the copy job
+    int firstPacket;          // First packet number in the range
+    int packetCount;          // Number of packets in the range
+};
+
+// Work-stealing scheduler: every worker owns a deque of packet ranges.
+// Owners take small bites from the newest range in their own deque; idle
+// workers steal the oldest range from someone else's, splitting large
+// ranges in half.
+// Each deque has its own lock, so there's no job-wide lock per packet.
+class PacketScheduler {
+public:
+    // grain is the most packets an owner takes from its deque at once
+    PacketScheduler(int workerCount, int grain);
+    ~PacketScheduler();
+
+    // Add a range to a worker's own deque
+    void Push(int worker, const PacketRange& range);
+
+    // Get the next range for a worker, stealing if its own deque is empty
+    // Returns false when there's no work left anywhere
+    bool Pop(int worker, PacketRange* range);
+
+    // Number of workers
+    int GetWorkerCount() const;
+
+    // Number of successful steals (for reporting)
+    long long GetStealCount() const;
+
+private:
+    // Take work from another worker's deque
+    bool Steal(int thief, PacketRange* range);
+
+    // One worker's deque
+    struct WorkerQueue {
+        boost::mutex mutex;
+        std::deque<PacketRange> ranges;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    int m_grain;
+    std::atomic<long long> m_steals;
+};
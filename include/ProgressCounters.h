@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Copy progress counted per thread and summed when sampled.
+// Every thread adds to its own shard with relaxed atomic adds, so counting
+// a packet never takes a lock or bounces a cache line between threads;
+// a reader sums the shards whenever it wants a snapshot. Threads beyond
+// SHARD_COUNT share shards, which stays correct, just less cheap.
+class ProgressCounters {
+public:
+    ProgressCounters();
+    ~ProgressCounters();
+
+    // A snapshot of the counts
+    struct Totals {
+        long long packets;         // Packets done
+        long long logicalBytes;    // File bytes accounted for, holes included
+        long long physicalBytes;   // Data bytes copied
+        long long files;           // Files finished
+    };
+
+    // Zero every count (while no thread is adding)
+    void Reset();
+
+    // Add to the counts of a thread's shard
+    void Add(size_t shard, long long packets, long long logicalBytes, long long physicalBytes, long long files);
+
+    // Sum the shards; counts added while summing may or may not be included
+    Totals Sample() const;
+
+    static const size_t SHARD_COUNT = 64;
+
+private:
+    ProgressCounters(const ProgressCounters&) = delete;
+    ProgressCounters& operator=(const ProgressCounters&) = delete;
+
+    // Padded to two cache lines, so the counts of two shards never share
+    // a line however the array happens to be aligned
+    struct Shard {
+        std::atomic<long long> packets;
+        std::atomic<long long> logicalBytes;
+        std::atomic<long long> physicalBytes;
+        std::atomic<long long> files;
+        char padding[128 - 4 * sizeof(std::atomic<long long>)];
+    };
+
+    Shard m_shards[SHARD_COUNT];
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+
+// A bandwidth cap in bytes per second, as a token bucket that can go into
+// debt: a transfer takes its bytes up front and waits until the bucket has
+// paid them off, so the bytes let through never run ahead of the rate by
+// more than one transfer plus BURST_SECONDS of saved-up credit.
+// The rate can be changed at any time; 0 means unlimited.
+class TokenBucket {
+public:
+    explicit TokenBucket(long long bytesPerSecond = 0);
+    ~TokenBucket();
+
+    // Set the rate (0 = unlimited)
+    void SetRate(long long bytesPerSecond);
+    long long GetRate() const;
+
+    // Take bytes from the bucket
+    // Returns the seconds to wait before the transfer may start (0 = now)
+    double Reserve(long long bytes);
+
+    // Seconds until the bucket has paid off its debt (0 = a transfer may start now)
+    double GetWait() const;
+
+    // Credit an idle bucket saves up, in seconds of its rate
+    static constexpr double BURST_SECONDS = 0.1;
+
+private:
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    std::atomic<long long> m_rate;     // Read without the lock on the unlimited fast path
+    double m_ready;                    // When the bytes taken so far are paid off (steady clock seconds)
+    mutable boost::mutex m_mutex;
+};
+
+// The token buckets of a FileCopier: a global cap on reads and on writes,
+// one bucket per source (a file, or a directory whose files share it) and
+// one per device, keyed by device ID. Buckets are created when a limit is
+// first set and then shared with every copy that uses them, so changing a
+// rate takes effect on the transfers still to come.
+class RateLimiter {
+public:
+    RateLimiter();
+    ~RateLimiter();
+
+    // Caps on every read and on every write
+    TokenBucket& GetReadBucket();
+    TokenBucket& GetWriteBucket();
+    const TokenBucket& GetReadBucket() const;
+    const TokenBucket& GetWriteBucket() const;
+
+    // Set the cap of a source file or directory (0 = unlimited)
+    void SetSourceRate(const std::wstring& path, long long bytesPerSecond);
+    long long GetSourceRate(const std::wstring& path) const;
+
+    // Bucket of the closest limited source holding path (path itself or
+    // one of its parent directories); null if none has a limit
+    std::shared_ptr<TokenBucket> FindSourceBucket(const std::wstring& path) const;
+
+    // Set the cap of a device (0 = unlimited)
+    void SetDeviceRate(unsigned long long deviceId, long long bytesPerSecond);
+    long long GetDeviceRate(unsigned long long deviceId) const;
+
+    // Bucket of a device, created unlimited if it has none yet so a cap set
+    // later still applies
+    std::shared_ptr<TokenBucket> GetDeviceBucket(unsigned long long deviceId);
+
+    // Take bytes from several buckets (null ones are skipped)
+    // Returns the seconds to wait before the transfer may start
+    static double Reserve(TokenBucket* const* buckets, size_t count, long long bytes);
+
+    // Seconds until every one of several buckets lets a transfer through
+    static double GetWait(TokenBucket* const* buckets, size_t count);
+
+private:
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    TokenBucket m_readBucket;
+    TokenBucket m_writeBucket;
+    std::unordered_map<std::wstring, std::shared_ptr<TokenBucket>> m_sourceBuckets;   // FileIo::GetPathKey -> bucket
+    std::unordered_map<unsigned long long, std::shared_ptr<TokenBucket>> m_deviceBuckets;
+    mutable boost::mutex m_mutex;      // Guards the maps
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+class IoBackend;
+
+// A logical destination file and the replicas it can be read from
+struct ReplicaGroup {
+    std::wstring fileName;             // Destination path, relative to the destination directory
+    long long fileSize;                // Size shared by every replica
+    std::vector<std::wstring> paths;   // Replica source paths
+};
+
+// Index that groups source files into the logical files to be written.
+// Files with the same relative path (under the root they were added from),
+// the same size and, when given, the same content fingerprint are replicas
+// of one file; files in an explicit group are replicas whatever their path.
+// Adding a file is a hash lookup, so cataloguing a large tree stays linear.
+// When mirrors disagree about a path (a stale copy with another size or
+// content), the version held by the most replicas is the one written.
+class ReplicaCatalog {
+public:
+    ReplicaCatalog();
+    ~ReplicaCatalog();
+
+    // Add a source file; fingerprint 0 means it wasn't fingerprinted and
+    // group, when set, overrides the relative path for grouping
+    // Returns false if the file can't join its explicit group (its size differs)
+    bool Add(const std::wstring& path, const std::wstring& relativePath, long long size,
+        uint64_t fingerprint = 0, const std::wstring& group = std::wstring());
+
+    // Take the logical files, one per destination path, in the order they
+    // were first seen; the paths of the versions that lost to another
+    // version of the same destination are appended to rejected
+    std::vector<ReplicaGroup> TakeGroups(std::vector<std::wstring>* rejected);
+
+    // Forget every file
+    void Clear();
+
+    // Number of files added
+    size_t GetFileCount() const;
+
+    // Fingerprint a file's content from the blocks the replica verifier
+    // samples; returns 0 if the file can't be read
+    static uint64_t Fingerprint(IoBackend& backend, const std::wstring& path, long long size);
+
+private:
+    ReplicaCatalog(const ReplicaCatalog&) = delete;
+    ReplicaCatalog& operator=(const ReplicaCatalog&) = delete;
+
+    std::vector<ReplicaGroup> m_groups;
+    std::unordered_map<std::wstring, size_t> m_groupIndex;     // Group key -> index in m_groups
+    std::unordered_map<std::wstring, size_t> m_destinations;   // Destination key -> index of its first group
+    std::vector<size_t> m_nextVersion;                        // Per group: next group with the same destination
+    size_t m_fileCount;
+};
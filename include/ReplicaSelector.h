@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+// Online source selection for the copy workers.
+// Tracks an EWMA of read throughput and latency for every source (one per
+// source device) from the packets actually being copied, and routes each
+// packet to the source expected to serve it soonest. A small share of the
+// packets is spent re-probing demoted sources so a source that recovers
+// (or a NAS that stops being congested) wins its traffic back.
+// Lock-free: workers update and read the statistics with atomics only.
+class ReplicaSelector {
+public:
+    ReplicaSelector(size_t sourceCount);
+    ~ReplicaSelector();
+
+    // Seed a source's throughput estimate (e.g. from "Measure Speeds")
+    // Only used until the source's first packet completes
+    void SetPrior(size_t source, double bytesPerSecond);
+
+    // Choose a source for the next packet from the candidates (the sources
+    // of the healthy replicas of a file)
+    // Returns an index into candidates, or candidates.size() if it's empty
+    size_t Select(const std::vector<size_t>& candidates);
+
+    // A read was queued on a source
+    void OnReadStarted(size_t source);
+
+    // A read finished; a failed read only drops the in-flight count
+    void OnReadFinished(size_t source, bool success, uint32_t bytes, double seconds);
+
+    // Current estimates for reporting (bytes/sec and seconds, 0 if unknown)
+    double GetThroughput(size_t source) const;
+    double GetLatency(size_t source) const;
+
+    // Latency percentile (0..1) of a source's recent reads, in seconds
+    // Returns 0 until enough reads have completed to say
+    double GetLatencyPercentile(size_t source, double percentile) const;
+
+    // Number of packets routed to a source other than the best one to probe it
+    long long GetProbeCount() const;
+
+private:
+    // Fold a sample into an EWMA
+    static void Update(std::atomic<double>& average, double sample, bool first);
+
+    // Latencies kept per source for percentiles
+    static const size_t RECENT_LATENCIES = 64;
+
+    // Live statistics of one source
+    struct SourceStats {
+        std::atomic<double> throughput;        // EWMA of bytes/sec per read
+        std::atomic<double> latency;           // EWMA of seconds per read
+        std::atomic<int> inFlight;             // Reads queued right now
+        std::atomic<long long> samples;        // Reads completed
+        std::atomic<long long> lastChosen;     // Selection number when last chosen
+        std::atomic<float> recent[RECENT_LATENCIES];  // Latencies of the most recent reads
+        std::atomic<unsigned> recentNext;      // Next entry of recent to overwrite
+    };
+
+    // Reads needed before a latency percentile is trusted
+    static const long long MIN_PERCENTILE_SAMPLES = 16;
+
+    std::unique_ptr<SourceStats[]> m_sources;
+    size_t m_sourceCount;
+    std::atomic<long long> m_selections;
+    std::atomic<long long> m_probes;
+
+    // Weight of a new sample; 0.2 follows a change within about ten packets
+    static constexpr double EWMA_WEIGHT = 0.2;
+
+    // One selection in PROBE_INTERVAL re-probes the least recently used source
+    static const long long PROBE_INTERVAL = 32;
+};
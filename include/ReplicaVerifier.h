@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+class IoBackend;
+
+// Detects replicas that don't hold the same data as the others.
+// Before a file is copied, the blocks the speed test samples are hashed on
+// every replica and the replicas that disagree with the majority are
+// reported, so a stale or corrupted mirror can't splice bad packets into
+// the output. During the copy, reads that cover a sampled block are checked
+// against the majority's hashes to catch a replica that changes mid-copy.
+class ReplicaVerifier {
+public:
+    explicit ReplicaVerifier(long long fileSize);
+    ~ReplicaVerifier();
+
+    // Hash the sampled blocks of every replica and keep the majority's
+    // hashes; without a majority the first replica listed wins
+    // Returns per replica whether it disagrees (unreadable replicas aren't flagged)
+    std::vector<bool> Verify(IoBackend& backend, const std::vector<std::wstring>& paths);
+
+    // Check data read during the copy against the majority's hashes
+    // Returns false if a sampled block fully inside the range differs
+    bool CheckRange(long long offset, const uint8_t* data, uint32_t length) const;
+
+    // Offset of one of the SAMPLE_COUNT samples of a file (the positions
+    // the speed test reads from)
+    static long long GetSampleOffset(long long fileSize, int sample);
+
+    // 64-bit non-cryptographic hash (xxHash64 algorithm)
+    static uint64_t Hash(const void* data, size_t length);
+
+    static const uint32_t SAMPLE_SIZE = 64 * 1024;   // Bytes read per sample
+    static const int SAMPLE_COUNT = 3;               // Samples per file
+
+private:
+    // Hash the sampled blocks of one replica
+    bool HashReplica(IoBackend& backend, const std::wstring& path, std::vector<uint64_t>& hashes, std::vector<uint8_t>& buffer) const;
+
+    // A hashed piece of a sample
+    struct Block {
+        long long offset;
+        uint32_t length;
+    };
+
+    // Samples are hashed in blocks so reads that cover only part of a sample can still be checked
+    static const uint32_t BLOCK_SIZE = 4096;
+
+    long long m_fileSize;
+    std::vector<Block> m_blocks;       // Sampled blocks, in file order
+    std::vector<uint64_t> m_hashes;    // Majority's hash of each block (empty until verified)
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "IoBackend.h"
+#include "CopyMetrics.h"
+
+// How a simulated device behaves
+struct SimulatedDeviceProfile {
+    double bytesPerSecond;    // Transfer rate, one transfer at a time (0 = unlimited)
+    double latency;           // Seconds every request takes on top of its transfer
+    double jitter;            // Mean of an exponentially distributed extra latency, the tail (0 = none)
+    double failureRate;       // Share of FAULT_BLOCK_SIZE blocks a read or write fails on, per attempt (0..1)
+    double stallRate;         // Share of requests that hold the whole device up (0..1)
+    double stallSeconds;      // How long such a stall lasts
+    DeviceKind kind;          // What GetDeviceKind reports
+};
+
+// Counters of a simulated device
+struct SimulatedDeviceStats {
+    long long reads;
+    long long writes;
+    long long bytesRead;
+    long long bytesWritten;
+    long long failures;       // Requests failed on purpose
+    long long stalls;         // Random and scheduled stalls that held a request up
+    LatencySnapshot readLatency;   // Virtual time from each read's arrival to its completion
+    LatencySnapshot writeLatency;
+};
+
+// An IoBackend that keeps files in memory and serves them through modelled
+// devices, so the copy engine's scheduling can be measured against slow,
+// failing or stalling sources without the hardware.
+// Devices are mounted at root paths. Each moves one transfer at a time at
+// its rate while latencies overlap, as on a deep queue; on top come a
+// jittered latency tail, failures, random stalls that hold the device up,
+// scheduled stalls and outright death. Every random draw is a hash of the
+// seed, the device, the file, the FAULT_BLOCK_SIZE block a request starts
+// in and how often that block failed before, so what happens to a block
+// doesn't depend on how the engine's timing sized and ordered its requests.
+// Time is virtual and discrete: the clock stands still while the engine
+// works, and once every request is waiting on the backend and none has
+// come or gone for QUIET_SECONDS of real time, it jumps to the earliest
+// completion. How fast the engine runs on the host doesn't change the
+// virtual times, so runs can be compared across machines; the engine's
+// own timers (rate limits, hedging, read sizing) still run on real time.
+// Source files can be patterns of a seed, which take no memory; files the
+// engine writes are kept in full.
+class SimulatedIoBackend : public IoBackend {
+public:
+    explicit SimulatedIoBackend(uint64_t seed = 1);
+    ~SimulatedIoBackend();
+
+    // Mount a device: every path under root lives on it (the longest root
+    // wins; paths under none are on an unlimited default device)
+    // Returns its index
+    int AddDevice(const std::wstring& root, const SimulatedDeviceProfile& profile);
+
+    // Change a device's behaviour, e.g. while a copy runs
+    void SetDeviceProfile(int device, const SimulatedDeviceProfile& profile);
+
+    // Hold every request on a device for seconds, from a virtual time on
+    void AddStall(int device, double start, double seconds);
+
+    // Fail every request on a device from a virtual time on
+    void FailDevice(int device, double time);
+
+    // Unmount every device; their files move to the default device
+    void ClearDevices();
+
+    // Counters of a device since it was mounted
+    SimulatedDeviceStats GetDeviceStats(int device) const;
+
+    // Add a file whose content is a pseudo-random pattern of seed, holding
+    // nothing in memory; with dataRanges only those ranges hold data and
+    // the rest are holes. Missing directories are created
+    bool AddFile(const std::wstring& path, long long size, uint64_t seed, const std::vector<FileRange>* dataRanges = nullptr);
+
+    // Read a file's data at once, without going through its device
+    bool Peek(const std::wstring& path, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead);
+
+    // Virtual seconds since the backend was created
+    double GetTime() const override;
+
+
+    // IoBackend
+    const wchar_t* GetName() const override;
+    bool IsNative() const override;
+    FileHandle OpenForRead(const std::wstring& path, bool unbuffered = false) override;
+    FileHandle CreateForWrite(const std::wstring& path, bool unbuffered = false) override;
+    FileHandle OpenForUpdate(const std::wstring& path, bool unbuffered = false) override;
+    void Close(FileHandle handle) override;
+    bool GetIoAlignment(const std::wstring& path, uint32_t* alignment) override;
+    bool ReadAt(FileHandle handle, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead) override;
+    bool WriteAt(FileHandle handle, long long offset, const void* buffer, uint32_t length, uint32_t* bytesWritten) override;
+    bool Flush(FileHandle handle) override;
+    bool DropCache(FileHandle handle, long long offset, long long length) override;
+    bool SetSize(FileHandle handle, long long size) override;
+    bool SetSparse(FileHandle handle) override;
+    bool PunchHole(FileHandle handle, long long offset, long long length) override;
+    bool GetDataRanges(const std::wstring& path, long long fileSize, std::vector<FileRange>& ranges) override;
+    bool GetSize(const std::wstring& path, long long* size) override;
+    bool GetModifiedTime(const std::wstring& path, long long* time) override;
+    bool GetDeviceId(const std::wstring& path, unsigned long long* deviceId) override;
+    DeviceKind GetDeviceKind(const std::wstring& path) override;
+    bool ListDirectory(const std::wstring& path, std::vector<DirectoryEntry>& entries) override;
+    bool CreateDirectoryPath(const std::wstring& path) override;
+    bool Delete(const std::wstring& path) override;
+    bool Rename(const std::wstring& from, const std::wstring& to) override;
+    KernelCopyMethod GetKernelCopyMethod() override;
+    KernelCopyResult CopyRange(KernelCopyMethod method,
+        FileHandle source, long long sourceOffset,
+        FileHandle destination, long long destinationOffset,
+        uint32_t length, uint32_t* bytesCopied) override;
+    bool CloneFile(const std::wstring& sourcePath, const std::wstring& destinationPath) override;
+
+    // Alignment reported for direct I/O
+    static const uint32_t IO_ALIGNMENT = 4096;
+
+    // Failures are drawn per block of this size, so a read fails alike
+    // whatever size the engine picked for it
+    static const uint32_t FAULT_BLOCK_SIZE = 64 * 1024;
+
+    // Real time without a request coming or going after which every
+    // thread is taken to be waiting on the backend
+    static constexpr double QUIET_SECONDS = 0.001;
+
+private:
+    SimulatedIoBackend(const SimulatedIoBackend&) = delete;
+    SimulatedIoBackend& operator=(const SimulatedIoBackend&) = delete;
+
+    // A file's content and identity
+    struct File {
+        long long size;
+        bool pattern;                    // Content is the pattern of seed (data is unused)
+        uint64_t seed;
+        std::vector<FileRange> ranges;   // Data ranges of a sparse pattern (empty = all data)
+        std::vector<uint8_t> data;       // Content once written
+        long long modifiedTime;          // Virtual microseconds
+        uint64_t key;                    // Hash of the path it was created at, for the random draws
+        boost::mutex mutex;              // Guards the content
+    };
+
+    // A mounted device and where its timeline stands
+    struct Device {
+        std::wstring root;
+        SimulatedDeviceProfile profile;
+        double ready;                    // When the transfers reserved so far are done
+        double failTime;                 // Requests from then on fail
+        std::vector<std::pair<double, double>> stalls;  // Scheduled stalls: start and end
+        SimulatedDeviceStats stats;
+        std::shared_ptr<LatencyHistogram> readLatency;
+        std::shared_ptr<LatencyHistogram> writeLatency;
+    };
+
+    // An open handle
+    struct OpenFile {
+        std::shared_ptr<File> file;
+        std::wstring path;
+        bool open;
+    };
+
+    // Kind of request, for the random draws
+    enum RequestKind { REQUEST_OPEN, REQUEST_READ, REQUEST_WRITE };
+
+    // Path without trailing separators
+    static std::wstring Normalize(const std::wstring& path);
+
+    // Directory holding a path (empty at the top)
+    static std::wstring GetParent(const std::wstring& path);
+
+    // Uniform number in [0, 1) drawn from a hash of the inputs
+    static double Draw(uint64_t a, uint64_t b, uint64_t c, uint64_t d);
+
+    // Fill a buffer with the content of a pattern file
+    static void FillPattern(const File& file, long long offset, uint8_t* buffer, uint32_t length);
+
+    // Turn a pattern file into stored data, before it is changed (file lock held)
+    static void Materialize(File& file);
+
+    // Copy a file's content out; returns the bytes copied (file lock held)
+    static uint32_t ReadContent(const File& file, long long offset, void* buffer, uint32_t length);
+
+    // Index of the device a path is on (0 = default; m_mutex held)
+    size_t FindDevice(const std::wstring& path) const;
+
+    // Create a directory and its parents (m_mutex held)
+    void AddDirectory(const std::wstring& path);
+
+    // Hand out a handle to a file (m_mutex held)
+    FileHandle AddHandle(const std::shared_ptr<File>& file, const std::wstring& path);
+
+    // File and path behind a handle, or null
+    std::shared_ptr<File> GetFile(FileHandle handle, std::wstring* path);
+
+    // Open a file, creating or truncating it as asked
+    FileHandle Open(const std::wstring& path, bool create, bool truncate);
+
+    // Wait for as long as the device of path takes to serve a request,
+    // moving its data with transfer once the device has accepted it (so
+    // the time that takes doesn't hold the clock up); returns false if
+    // the request fails, without calling transfer
+    bool Serve(const std::wstring& path, const File& file, RequestKind kind, long long offset, long long bytes,
+        const std::function<void()>& transfer = nullptr);
+
+    // A fresh device with a profile
+    static Device MakeDevice(const std::wstring& root, const SimulatedDeviceProfile& profile);
+
+    // Block until the virtual clock reaches a time, moving it on when the
+    // backend goes quiet (lock holds m_mutex)
+    void WaitUntil(boost::mutex::scoped_lock& lock, double time);
+
+    uint64_t m_seed;
+    std::atomic<double> m_now;                                 // The virtual clock; changed with m_mutex held
+    std::multiset<double> m_pending;                           // Completion times of the requests waiting
+    uint64_t m_activity;                                       // Requests come and gone so far
+    boost::condition_variable m_clockChanged;                  // The clock, m_pending or m_activity changed
+    std::map<std::wstring, std::shared_ptr<File>> m_files;     // By normalized path
+    std::set<std::wstring> m_directories;
+    std::vector<Device> m_devices;                             // [0] = the default device
+    std::vector<OpenFile> m_handles;                           // By handle number
+    std::vector<size_t> m_freeHandles;
+    std::map<std::pair<uint64_t, long long>, uint64_t> m_failedAttempts;  // (file, block) -> failures so far
+    mutable boost::mutex m_mutex;                              // Guards everything but file content
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <boost/thread/mutex.hpp>
+#include "FileIo.h"
+#include "IoBackend.h"
+
+// An open source handle, closed when the last user lets go of it
+class PooledHandle {
+public:
+    PooledHandle(FileHandle handle, const std::shared_ptr<IoBackend>& backend);
+    ~PooledHandle();
+
+    FileHandle Get() const { return m_handle; }
+    const std::shared_ptr<IoBackend>& GetBackend() const { return m_backend; }
+
+private:
+    PooledHandle(const PooledHandle&) = delete;
+    PooledHandle& operator=(const PooledHandle&) = delete;
+
+    FileHandle m_handle;
+    std::shared_ptr<IoBackend> m_backend;    // Backend the handle came from
+};
+
+// Keeps one open handle per source path while its file is being copied, so
+// packets are read with positional reads instead of an open/seek/close per packet
+class SourceHandlePool {
+public:
+    SourceHandlePool();
+    ~SourceHandlePool();
+
+    // Open sources bypassing the page cache (takes effect for new handles)
+    void SetUnbuffered(bool unbuffered);
+
+    // Open and read sources through a backend (null = the native one);
+    // takes effect for new handles
+    void SetBackend(const std::shared_ptr<IoBackend>& backend);
+
+    // Get the open handle for a source, opening it on first use
+    // Returns nullptr if the source can't be opened; opened (if given) is
+    // set to whether this call opened or tried to open it
+    std::shared_ptr<PooledHandle> Acquire(const std::wstring& path, bool* opened = nullptr);
+
+    // Read from a source at an absolute offset
+    // On error the source's handle is invalidated so the next read reopens it
+    bool ReadAt(const std::wstring& path, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead);
+
+    // Drop a source's handle (after an error, or once its file is copied);
+    // readers still using it keep it alive
+    void Invalidate(const std::wstring& path);
+
+    // Drop every handle (at the end of a job)
+    void CloseAll();
+
+    // Number of times a source has been opened since the last CloseAll
+    long long GetOpenCount() const;
+
+private:
+    std::map<std::wstring, std::shared_ptr<PooledHandle>> m_handles;
+    std::shared_ptr<IoBackend> m_backend;
+    long long m_openCount;
+    bool m_unbuffered;
+    mutable boost::mutex m_mutex;
+};
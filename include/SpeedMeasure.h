@@ -2,30 +2,70 @@
 #include <string>
 #include <vector>
 #include <memory>
-#include <windows.h>
+#include <cstdint>
+#include "IoBackend.h"
+#include "ReplicaVerifier.h"
 
+// What probing one source found
+struct SourceSpeed {
+    long long speed;          // Median read throughput in Kbps (-1 on error)
+    long long speedSpread;    // Interquartile range of the throughput, in Kbps
+    double latency;           // Median time until the first bytes of a read arrive, seconds
+    double latencySpread;     // Interquartile range of the latency, seconds
+    uint32_t sampleSize;      // Bytes per throughput read the figures come from
+    int sampleCount;          // Reads the medians are taken over
+    bool uncached;            // Every read bypassed the cache (unbuffered, or evicted first)
+};
+
+// Probes how fast sources can be read, through an IoBackend and on its clock.
+// Reads bypass the cache, opening unbuffered or evicting each range before
+// it is read, so a source read before isn't mistaken for a fast one. Each
+// sample is a one-block read for the first-byte latency followed by a
+// larger read for throughput; reads double in size until their timings
+// agree. Sources on different devices are probed at the same time
 class SpeedMeasure {
 public:
     SpeedMeasure();
     ~SpeedMeasure();
 
+    // Probe a single source file
+    SourceSpeed ProbeSource(const std::wstring& sourcePath);
+
     // Measure speed of a single source file
     // Returns speed in Kbps, or -1 on error
     long long MeasureSourceSpeed(const std::wstring& sourcePath);
 
-    // Measure speeds of a list of sources and sort by speed (descending)
-    // Returns true if successful, false otherwise
-    // The input vector is modified to contain paths sorted by speed
-    bool MeasureAndSortSources(std::vector<std::wstring>& sources);
+    // Probe a list of sources and sort them by speed (descending)
+    // Returns false if no source could be read
+    // sources is sorted in place; speeds receives each one's results, in the same order
+    bool MeasureAndSortSources(std::vector<std::wstring>& sources, std::vector<SourceSpeed>& speeds);
 
-private:
-    // Read a sample of data to measure speed
-    // Returns speed in Kbps, or -1 on error
-    long long MeasureFileSpeed(HANDLE hFile);
+    // Backend the sources are read through (null = the native filesystem)
+    void SetIoBackend(const std::shared_ptr<IoBackend>& backend);
+
+    // Throughput reads start at the replica verification sample size and
+    // double up to the maximum until the timings are stable
+    static const uint32_t MIN_SAMPLE_SIZE = ReplicaVerifier::SAMPLE_SIZE;
+    static const uint32_t MAX_SAMPLE_SIZE = 16 * 1024 * 1024;
 
-    // Sample buffer size for measurement (64KB is a good starting point)
-    static const DWORD SAMPLE_SIZE = 64 * 1024;
+    // Reads per round; the medians and spreads are over the last round
+    static const int SAMPLES_PER_ROUND = 5;
+
+    // Timings are stable once every read takes at least MIN_READ_SECONDS
+    // and LATENCY_SHARE times the first-byte latency (so the device's
+    // response time hardly counts against its throughput), and the
+    // throughput's spread is within MAX_SPREAD of its median
+    static constexpr double MIN_READ_SECONDS = 0.01;
+    static constexpr double LATENCY_SHARE = 8.0;
+    static constexpr double MAX_SPREAD = 0.25;
+
+    // Stop growing the reads of a source after this long
+    static constexpr double TIME_BUDGET = 3.0;
+
+private:
+    // Probe an open file
+    SourceSpeed ProbeFile(FileHandle file, long long fileSize, uint32_t alignment, bool unbuffered);
 
-    // Reusable buffer to avoid repeated allocations
-    std::unique_ptr<BYTE[]> m_buffer;
-};
\ No newline at end of file
+    // Where the sources are read from
+    std::shared_ptr<IoBackend> m_backend;
+};
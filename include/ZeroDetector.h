@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+
+// Tests buffers for all-zero content with the widest vector unit the CPU
+// has: AVX2 or SSE2 on x64 (AVX2 is picked at run time), NEON on ARM64,
+// and a 64-bit word loop elsewhere.
+class ZeroDetector {
+public:
+    // Check if every byte of a buffer is zero
+    static bool IsZero(const void* data, size_t length);
+
+    // Name of the implementation in use (e.g. "avx2"), for reporting
+    static const wchar_t* GetImplementationName();
+};
@@ -0,0 +1,93 @@
+#include "../include/AlignedBufferPool.h"
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Allocate memory at an alignment
+static uint8_t* AllocateAligned(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+    return static_cast<uint8_t*>(_aligned_malloc(size, alignment));
+#else
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignment, size) != 0)
+        return nullptr;
+    return static_cast<uint8_t*>(memory);
+#endif
+}
+
+// Free memory from AllocateAligned
+static void FreeAligned(uint8_t* memory)
+{
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+// Constructor
+AlignedBufferPool::AlignedBufferPool(size_t bufferSize, size_t alignment)
+    : m_alignment(alignment < sizeof(void*) ? sizeof(void*) : alignment)
+{
+    m_bufferSize = static_cast<size_t>(AlignUp(bufferSize, m_alignment));
+}
+
+// Destructor
+AlignedBufferPool::~AlignedBufferPool()
+{
+    for (uint8_t* buffer : m_all)
+    {
+        FreeAligned(buffer);
+    }
+}
+
+// Get a buffer
+uint8_t* AlignedBufferPool::Acquire()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (!m_free.empty())
+    {
+        uint8_t* buffer = m_free.back();
+        m_free.pop_back();
+        return buffer;
+    }
+
+    uint8_t* buffer = AllocateAligned(m_bufferSize, m_alignment);
+    if (buffer)
+        m_all.push_back(buffer);
+    return buffer;
+}
+
+// Give a buffer back
+void AlignedBufferPool::Release(uint8_t* buffer)
+{
+    if (!buffer)
+        return;
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_free.push_back(buffer);
+}
+
+// Buffers allocated so far
+size_t AlignedBufferPool::GetAllocatedCount() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_all.size();
+}
+
+// Buffers handed out
+size_t AlignedBufferPool::GetInUseCount() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_all.size() - m_free.size();
+}
+
+// Round up to a multiple of a power-of-two alignment
+long long AlignedBufferPool::AlignUp(long long value, size_t alignment)
+{
+    long long mask = static_cast<long long>(alignment) - 1;
+    return (value + mask) & ~mask;
+}
@@ -0,0 +1,722 @@
+#include "../include/AsyncIo.h"
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <deque>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+// Upper bound on queue depth, to keep buffer memory and worker counts sane
+static const int MAX_QUEUE_DEPTH = 256;
+
+// Thread-pool engine: blocking positional I/O on a set of worker threads
+class ThreadPoolAsyncEngine : public AsyncIoEngine {
+public:
+    ThreadPoolAsyncEngine(int queueDepth, const std::shared_ptr<IoBackend>& backend)
+        : m_backend(backend),
+        m_queueDepth(queueDepth),
+        m_inFlight(0),
+        m_shutdown(false)
+    {
+        // One worker per outstanding request, so none of them waits on another
+        for (int i = 0; i < m_queueDepth; i++)
+        {
+            m_workers.create_thread([this]() { WorkerLoop(); });
+        }
+    }
+
+    ~ThreadPoolAsyncEngine()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_shutdown = true;
+        }
+        m_requestReady.notify_all();
+        m_workers.join_all();
+    }
+
+    bool Submit(const AsyncRequest& request) override
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            if (m_inFlight >= m_queueDepth)
+                return false;
+
+            m_requests.push_back(request);
+            m_inFlight++;
+        }
+        m_requestReady.notify_one();
+        return true;
+    }
+
+    int Wait(AsyncCompletion* completions, int maxCompletions, int minCompletions, int timeoutMs) override
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        // Don't wait for more than can ever arrive
+        int needed = (std::min)((std::min)(minCompletions, maxCompletions), static_cast<int>(m_completions.size()) + m_inFlight);
+        boost::chrono::steady_clock::time_point deadline =
+            boost::chrono::steady_clock::now() + boost::chrono::milliseconds(timeoutMs);
+        while (static_cast<int>(m_completions.size()) < needed)
+        {
+            if (timeoutMs < 0)
+                m_completionReady.wait(lock);
+            else if (m_completionReady.wait_until(lock, deadline) == boost::cv_status::timeout)
+                break;
+        }
+
+        int count = 0;
+        while (count < maxCompletions && !m_completions.empty())
+        {
+            completions[count++] = m_completions.front();
+            m_completions.pop_front();
+        }
+        return count;
+    }
+
+    void Cancel(void* userData) override
+    {
+        // Only requests no worker has picked up yet can be dropped
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            auto it = std::find_if(m_requests.begin(), m_requests.end(),
+                [userData](const AsyncRequest& request) { return request.userData == userData; });
+            if (it == m_requests.end())
+                return;
+
+            m_requests.erase(it);
+
+            AsyncCompletion completion;
+            completion.userData = userData;
+            completion.success = false;
+            completion.bytes = 0;
+            m_completions.push_back(completion);
+            m_inFlight--;
+        }
+        m_completionReady.notify_one();
+    }
+
+    int GetQueueDepth() const override
+    {
+        return m_queueDepth;
+    }
+
+    const wchar_t* GetName() const override
+    {
+        return L"thread pool";
+    }
+
+private:
+    // Run queued requests until the engine shuts down
+    void WorkerLoop()
+    {
+        while (true)
+        {
+            AsyncRequest request;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                while (m_requests.empty() && !m_shutdown)
+                    m_requestReady.wait(lock);
+
+                if (m_requests.empty())
+                    return;  // Shutting down
+
+                request = m_requests.front();
+                m_requests.pop_front();
+            }
+
+            AsyncCompletion completion;
+            completion.userData = request.userData;
+            completion.bytes = 0;
+            if (request.type == ASYNC_READ)
+                completion.success = m_backend->ReadAt(request.handle, request.offset, request.buffer, request.length, &completion.bytes);
+            else
+                completion.success = m_backend->WriteAt(request.handle, request.offset, request.buffer, request.length, &completion.bytes);
+
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_completions.push_back(completion);
+                m_inFlight--;
+            }
+            m_completionReady.notify_one();
+        }
+    }
+
+    std::shared_ptr<IoBackend> m_backend;
+    int m_queueDepth;
+    int m_inFlight;                          // Submitted and not yet finished
+    bool m_shutdown;
+    std::deque<AsyncRequest> m_requests;     // Waiting for a worker
+    std::deque<AsyncCompletion> m_completions;  // Finished, waiting for Wait()
+    boost::mutex m_mutex;
+    boost::condition_variable m_requestReady;
+    boost::condition_variable m_completionReady;
+    boost::thread_group m_workers;
+};
+
+#ifdef __linux__
+
+// io_uring engine: requests go straight to the kernel's submission ring
+// Uses the raw system calls, so there's no dependency on liburing
+class IoUringAsyncEngine : public AsyncIoEngine {
+public:
+    IoUringAsyncEngine()
+        : m_ringFd(-1),
+        m_queueDepth(0),
+        m_inFlight(0),
+        m_unsubmitted(0),
+        m_sqRing(nullptr),
+        m_cqRing(nullptr),
+        m_sqes(nullptr),
+        m_sqRingSize(0),
+        m_cqRingSize(0),
+        m_sqesSize(0)
+    {
+    }
+
+    ~IoUringAsyncEngine()
+    {
+        // The kernel writes into the buffers of requests still in flight,
+        // and the caller frees them once the engine is gone
+        if (m_ringFd >= 0 && m_sqes)
+            Drain();
+
+        if (m_sqes)
+            munmap(m_sqes, m_sqesSize);
+        if (m_cqRing && m_cqRing != m_sqRing)
+            munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing)
+            munmap(m_sqRing, m_sqRingSize);
+        if (m_ringFd >= 0)
+            close(m_ringFd);
+    }
+
+    // Set up the rings; returns false if io_uring isn't usable here
+    bool Initialize(int queueDepth)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        // Room for a cancel request next to every read and write
+        m_ringFd = static_cast<int>(syscall(__NR_io_uring_setup, queueDepth * 2, &params));
+        if (m_ringFd < 0)
+            return false;
+
+        // Single mmap for both rings is needed to keep this simple, and timed
+        // waits need the extended io_uring_enter argument (5.11+)
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+            return false;
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        m_sqRingSize = (std::max)(m_sqRingSize, m_cqRingSize);
+        m_cqRingSize = m_sqRingSize;
+
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED)
+        {
+            m_sqRing = nullptr;
+            return false;
+        }
+        m_cqRing = m_sqRing;
+
+        m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+        char* sq = static_cast<char*>(m_sqRing);
+        m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        char* cq = static_cast<char*>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // The ring may be rounded up to a power of two, keep the depth asked for
+        m_queueDepth = (std::min)(queueDepth, static_cast<int>(params.sq_entries) / 2);
+
+        // IORING_OP_READ/WRITE need 5.6+; the probe call itself is 5.6+ too
+        return SupportsReadWrite();
+    }
+
+    bool Submit(const AsyncRequest& request) override
+    {
+        if (m_inFlight >= m_queueDepth)
+            return false;
+
+        struct io_uring_sqe* sqe = NextSqe();
+        sqe->opcode = request.type == ASYNC_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = request.handle;
+        sqe->off = static_cast<__u64>(request.offset);
+        sqe->addr = reinterpret_cast<__u64>(request.buffer);
+        sqe->len = request.length;
+        sqe->user_data = reinterpret_cast<__u64>(request.userData);
+        QueueSqe();
+
+        m_inFlight++;
+        return true;
+    }
+
+    int Wait(AsyncCompletion* completions, int maxCompletions, int minCompletions, int timeoutMs) override
+    {
+        int needed = (std::min)((std::min)(minCompletions, maxCompletions), m_inFlight);
+
+        // Timed waits pass the timeout through the extended argument
+        struct __kernel_timespec timeout;
+        struct io_uring_getevents_arg waitArg;
+        memset(&waitArg, 0, sizeof(waitArg));
+        if (timeoutMs >= 0)
+        {
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+            waitArg.ts = reinterpret_cast<__u64>(&timeout);
+        }
+
+        int count = Reap(completions, maxCompletions);
+        while (m_unsubmitted > 0 || count < needed)
+        {
+            unsigned flags = count < needed ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : IORING_ENTER_EXT_ARG;
+            unsigned waitFor = count < needed ? static_cast<unsigned>(needed - count) : 0;
+
+            int result = static_cast<int>(syscall(__NR_io_uring_enter, m_ringFd, m_unsubmitted, waitFor, flags, &waitArg, sizeof(waitArg)));
+            if (result < 0)
+            {
+                if (errno == ETIME)
+                {
+                    // Timed out; whatever did complete is still collected
+                    count += Reap(completions + count, maxCompletions - count);
+                    if (m_unsubmitted == 0)
+                        break;
+                    continue;
+                }
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                return -1;
+            }
+            m_unsubmitted -= result;
+
+            count += Reap(completions + count, maxCompletions - count);
+        }
+
+        return count;
+    }
+
+    void Cancel(void* userData) override
+    {
+        // The cancel's own completion is tagged so Reap() can drop it
+        struct io_uring_sqe* sqe = NextSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<__u64>(userData);
+        sqe->user_data = CANCEL_TAG;
+        QueueSqe();
+    }
+
+    int GetQueueDepth() const override
+    {
+        return m_queueDepth;
+    }
+
+    const wchar_t* GetName() const override
+    {
+        return L"io_uring";
+    }
+
+private:
+    // user_data of cancel requests, which have no caller to report to
+    static const __u64 CANCEL_TAG = ~0ULL;
+
+    // Cancel every request in flight and reap them all, so none is left
+    // pointing at memory about to be freed
+    void Drain()
+    {
+#ifdef IORING_ASYNC_CANCEL_ANY
+        // One request cancels them all (5.19+); older kernels fail it, and
+        // the requests are waited for instead
+        if (m_inFlight > 0)
+        {
+            struct io_uring_sqe* sqe = NextSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data = CANCEL_TAG;
+            QueueSqe();
+        }
+#endif
+
+        AsyncCompletion completions[64];
+        while (m_inFlight > 0 || m_unsubmitted > 0)
+        {
+            if (Wait(completions, 64, 1, -1) < 0)
+                break;
+        }
+    }
+
+    // Get a cleared entry at the tail of the submission ring
+    struct io_uring_sqe* NextSqe()
+    {
+        struct io_uring_sqe* sqe = &m_sqes[*m_sqTail & m_sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Publish the entry from NextSqe(); submission to the kernel is batched
+    // until the next Wait()
+    void QueueSqe()
+    {
+        unsigned tail = *m_sqTail;
+        unsigned index = tail & m_sqMask;
+        m_sqArray[index] = index;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        m_unsubmitted++;
+    }
+
+    // Collect whatever is on the completion ring
+    int Reap(AsyncCompletion* completions, int maxCompletions)
+    {
+        int count = 0;
+        unsigned head = *m_cqHead;
+
+        while (count < maxCompletions && head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &m_cqes[head & m_cqMask];
+            if (cqe->user_data == CANCEL_TAG)
+            {
+                head++;
+                continue;
+            }
+
+            AsyncCompletion& completion = completions[count++];
+            completion.userData = reinterpret_cast<void*>(cqe->user_data);
+            completion.success = cqe->res >= 0;
+            completion.bytes = cqe->res >= 0 ? static_cast<uint32_t>(cqe->res) : 0;
+
+            head++;
+            m_inFlight--;
+        }
+
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Check that the kernel knows the plain read and write opcodes
+    bool SupportsReadWrite()
+    {
+        const unsigned opCount = 64;
+        std::vector<char> storage(sizeof(struct io_uring_probe) + opCount * sizeof(struct io_uring_probe_op), 0);
+        struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(storage.data());
+
+        if (syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_PROBE, probe, opCount) < 0)
+            return false;
+
+        if (probe->last_op < IORING_OP_WRITE)
+            return false;
+
+        return (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    int m_ringFd;
+    int m_queueDepth;
+    int m_inFlight;        // Submitted and not yet reaped
+    int m_unsubmitted;     // Queued on the ring but not yet passed to io_uring_enter
+
+    void* m_sqRing;
+    void* m_cqRing;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqRingSize;
+    size_t m_cqRingSize;
+    size_t m_sqesSize;
+
+    unsigned* m_sqHead;
+    unsigned* m_sqTail;
+    unsigned m_sqMask;
+    unsigned* m_sqArray;
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned m_cqMask;
+    struct io_uring_cqe* m_cqes;
+};
+
+#endif
+
+#ifdef _WIN32
+
+// NTSTATUS left in OVERLAPPED::Internal when a read hits the end of the file
+#ifndef STATUS_END_OF_FILE
+#define STATUS_END_OF_FILE ((DWORD)0xC0000011L)
+#endif
+
+// OVERLAPPED plus the caller's tag, owned by the kernel while in flight
+struct OverlappedOp {
+    OVERLAPPED overlapped;
+    void* userData;
+    HANDLE handle;
+    HANDLE port;              // Port of the engine that submitted it
+};
+
+// The completion port every overlapped handle is bound to. A handle can be
+// bound to only one port, and a job's source and destination handles are
+// shared by all its workers, each with an engine of its own; a thread
+// takes the completions off this port and posts each one on to the port
+// of the engine that submitted the request.
+class CompletionRouter {
+public:
+    // The process-wide router
+    static CompletionRouter& Get()
+    {
+        static CompletionRouter router;
+        return router;
+    }
+
+    bool IsValid() const
+    {
+        return m_port != NULL;
+    }
+
+    // Bind a handle to the shared port; a handle that's already bound
+    // (to this port, the only one handles go to) fails harmlessly
+    void Bind(HANDLE handle)
+    {
+        CreateIoCompletionPort(handle, m_port, 0, 0);
+    }
+
+private:
+    CompletionRouter()
+    {
+        m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        if (m_port)
+            m_thread = boost::thread([this]() { RouteLoop(); });
+    }
+
+    ~CompletionRouter()
+    {
+        // A completion without an OVERLAPPED tells the thread to stop
+        if (m_port)
+        {
+            PostQueuedCompletionStatus(m_port, 0, 0, NULL);
+            m_thread.join();
+            CloseHandle(m_port);
+        }
+    }
+
+    CompletionRouter(const CompletionRouter&) = delete;
+    CompletionRouter& operator=(const CompletionRouter&) = delete;
+
+    // Router thread: pass each completion on to its engine's port
+    void RouteLoop()
+    {
+        OVERLAPPED_ENTRY entries[64];
+        while (true)
+        {
+            ULONG removed = 0;
+            if (!GetQueuedCompletionStatusEx(m_port, entries, 64, &removed, INFINITE, FALSE))
+                continue;
+
+            for (ULONG i = 0; i < removed; i++)
+            {
+                if (!entries[i].lpOverlapped)
+                    return;
+
+                // The status stays in the OVERLAPPED, only the byte count needs passing on
+                OverlappedOp* op = CONTAINING_RECORD(entries[i].lpOverlapped, OverlappedOp, overlapped);
+                PostQueuedCompletionStatus(op->port, entries[i].dwNumberOfBytesTransferred,
+                    entries[i].lpCompletionKey, entries[i].lpOverlapped);
+            }
+        }
+    }
+
+    HANDLE m_port;
+    boost::thread m_thread;
+};
+
+// Overlapped engine: requests complete on the shared completion port and
+// are handed to the engine's own port by the CompletionRouter
+// Requires handles opened with FILE_FLAG_OVERLAPPED, which FileIo does
+class OverlappedAsyncEngine : public AsyncIoEngine {
+public:
+    explicit OverlappedAsyncEngine(int queueDepth)
+        : m_queueDepth(queueDepth),
+        m_inFlight(0)
+    {
+        // No handle is bound to this port, only routed completions arrive on it
+        m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    }
+
+    ~OverlappedAsyncEngine()
+    {
+        // Wait for anything still in flight, the kernel owns those OVERLAPPEDs
+        std::vector<AsyncCompletion> drained(m_queueDepth);
+        while (m_inFlight > 0 && Wait(drained.data(), m_queueDepth, 1, -1) >= 0)
+        {
+        }
+
+        if (m_port)
+            CloseHandle(m_port);
+    }
+
+    bool IsValid() const
+    {
+        return m_port != NULL && CompletionRouter::Get().IsValid();
+    }
+
+    bool Submit(const AsyncRequest& request) override
+    {
+        if (m_inFlight >= m_queueDepth)
+            return false;
+
+        CompletionRouter::Get().Bind(request.handle);
+
+        std::unique_ptr<OverlappedOp> op = std::make_unique<OverlappedOp>();
+        ZeroMemory(&op->overlapped, sizeof(op->overlapped));
+        op->overlapped.Offset = static_cast<DWORD>(request.offset & 0xFFFFFFFF);
+        op->overlapped.OffsetHigh = static_cast<DWORD>(request.offset >> 32);
+        op->userData = request.userData;
+        op->handle = request.handle;
+        op->port = m_port;
+
+        BOOL started;
+        if (request.type == ASYNC_READ)
+            started = ReadFile(request.handle, request.buffer, request.length, NULL, &op->overlapped);
+        else
+            started = WriteFile(request.handle, request.buffer, request.length, NULL, &op->overlapped);
+
+        if (!started)
+        {
+            DWORD error = GetLastError();
+            if (error != ERROR_IO_PENDING)
+            {
+                // Failed before reaching the port, report it from Wait()
+                AsyncCompletion completion;
+                completion.userData = request.userData;
+                completion.bytes = 0;
+                completion.success = (request.type == ASYNC_READ && error == ERROR_HANDLE_EOF);
+                m_immediate.push_back(completion);
+                m_inFlight++;
+                return true;
+            }
+        }
+
+        // Completion (even a synchronous one) is queued to the shared port and routed here
+        m_pending[request.userData] = op.release();
+        m_inFlight++;
+        return true;
+    }
+
+    int Wait(AsyncCompletion* completions, int maxCompletions, int minCompletions, int timeoutMs) override
+    {
+        int count = 0;
+        int needed = (std::min)((std::min)(minCompletions, maxCompletions), m_inFlight);
+
+        // Requests that failed at submit time first
+        while (count < maxCompletions && !m_immediate.empty())
+        {
+            completions[count++] = m_immediate.front();
+            m_immediate.pop_front();
+            m_inFlight--;
+        }
+
+        std::vector<OVERLAPPED_ENTRY> entries(maxCompletions);
+        while (count < maxCompletions && m_inFlight > 0)
+        {
+            DWORD timeout = count < needed ? (timeoutMs < 0 ? INFINITE : static_cast<DWORD>(timeoutMs)) : 0;
+            ULONG removed = 0;
+            if (!GetQueuedCompletionStatusEx(m_port, entries.data(), static_cast<ULONG>(maxCompletions - count), &removed, timeout, FALSE))
+            {
+                if (GetLastError() == WAIT_TIMEOUT)
+                    break;
+                return -1;
+            }
+
+            for (ULONG i = 0; i < removed; i++)
+            {
+                std::unique_ptr<OverlappedOp> op(CONTAINING_RECORD(entries[i].lpOverlapped, OverlappedOp, overlapped));
+                DWORD status = static_cast<DWORD>(op->overlapped.Internal);
+                m_pending.erase(op->userData);
+
+                AsyncCompletion& completion = completions[count++];
+                completion.userData = op->userData;
+                completion.bytes = entries[i].dwNumberOfBytesTransferred;
+                completion.success = (status == 0 || status == STATUS_END_OF_FILE);
+                m_inFlight--;
+            }
+        }
+
+        return count;
+    }
+
+    void Cancel(void* userData) override
+    {
+        // The cancelled request still completes on the port
+        auto it = m_pending.find(userData);
+        if (it != m_pending.end())
+            CancelIoEx(it->second->handle, &it->second->overlapped);
+    }
+
+    int GetQueueDepth() const override
+    {
+        return m_queueDepth;
+    }
+
+    const wchar_t* GetName() const override
+    {
+        return L"overlapped";
+    }
+
+private:
+    // Requests in flight, by caller tag (for Cancel)
+    std::map<void*, OverlappedOp*> m_pending;
+
+    HANDLE m_port;
+    int m_queueDepth;
+    int m_inFlight;
+    std::deque<AsyncCompletion> m_immediate;
+};
+
+#endif
+
+// Create the best engine for this platform
+std::unique_ptr<AsyncIoEngine> AsyncIoEngine::Create(int queueDepth, const std::shared_ptr<IoBackend>& backend)
+{
+    queueDepth = (std::max)(1, (std::min)(queueDepth, MAX_QUEUE_DEPTH));
+    if (backend && !backend->IsNative())
+        return CreateThreadPool(queueDepth, backend);
+
+#ifdef __linux__
+    std::unique_ptr<IoUringAsyncEngine> ring = std::make_unique<IoUringAsyncEngine>();
+    if (ring->Initialize(queueDepth))
+        return ring;
+#endif
+
+#ifdef _WIN32
+    std::unique_ptr<OverlappedAsyncEngine> overlapped = std::make_unique<OverlappedAsyncEngine>(queueDepth);
+    if (overlapped->IsValid())
+        return overlapped;
+#endif
+
+    return CreateThreadPool(queueDepth);
+}
+
+// Create the portable thread-pool engine
+std::unique_ptr<AsyncIoEngine> AsyncIoEngine::CreateThreadPool(int queueDepth, const std::shared_ptr<IoBackend>& backend)
+{
+    queueDepth = (std::max)(1, (std::min)(queueDepth, MAX_QUEUE_DEPTH));
+    return std::make_unique<ThreadPoolAsyncEngine>(queueDepth, backend ? backend : IoBackend::GetNative());
+}
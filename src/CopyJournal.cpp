@@ -0,0 +1,199 @@
+#include "../include/CopyJournal.h"
+#include "../include/ReplicaVerifier.h"
+#include <boost/chrono.hpp>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+
+// Marks a file as a copy journal
+static const char JOURNAL_MAGIC[8] = { 'M', 'S', 'F', 'C', 'J', 'R', 'N', 'L' };
+
+// Constructor
+CopyJournal::CopyJournal(const std::shared_ptr<IoBackend>& backend)
+    : m_backend(backend ? backend : IoBackend::GetNative()),
+    m_handle(INVALID_FILE_HANDLE),
+    m_packetCount(0),
+    m_wordCount(0),
+    m_dirty(false),
+    m_lastFlush(0.0)
+{
+}
+
+// Destructor
+CopyJournal::~CopyJournal()
+{
+    Close();
+}
+
+// Journal path of a destination file
+std::wstring CopyJournal::GetPath(const std::wstring& destinationPath)
+{
+    return destinationPath + L".copyjournal";
+}
+
+// Open the journal, resuming it if it matches
+bool CopyJournal::Open(const std::wstring& path, const JournalSource& source, uint32_t packetSize, int packetCount, bool resume)
+{
+    Close();
+
+    m_path = path;
+    m_packetCount = packetCount;
+    m_wordCount = (static_cast<size_t>(packetCount) + 63) / 64;
+    m_bits = std::make_unique<std::atomic<uint64_t>[]>(m_wordCount);
+    for (size_t i = 0; i < m_wordCount; i++)
+    {
+        m_bits[i] = 0;
+    }
+    m_dirty = false;
+    m_lastFlush = Now();
+
+    m_handle = m_backend->OpenForUpdate(path);
+    if (m_handle == INVALID_FILE_HANDLE)
+        return false;
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.packetSize = packetSize;
+    header.fileSize = source.fileSize;
+    header.modifiedTime = source.modifiedTime;
+    header.sampleHash = source.sampleHash;
+    header.packetCount = packetCount;
+    header.checksum = ReplicaVerifier::Hash(&header, offsetof(Header, checksum));
+
+    if (resume && Load(header))
+        return true;
+
+    if (!Create(header))
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+// Read a journal and check it matches
+bool CopyJournal::Load(const Header& expected)
+{
+    Header header;
+    uint32_t bytesRead = 0;
+    if (!m_backend->ReadAt(m_handle, 0, &header, sizeof(header), &bytesRead) || bytesRead != sizeof(header))
+        return false;
+    if (memcmp(&header, &expected, sizeof(header)) != 0)
+        return false;
+
+    std::vector<uint64_t> words(m_wordCount);
+    uint32_t length = static_cast<uint32_t>(m_wordCount * sizeof(uint64_t));
+    if (!m_backend->ReadAt(m_handle, sizeof(header), words.data(), length, &bytesRead) || bytesRead != length)
+        return false;
+
+    for (size_t i = 0; i < m_wordCount; i++)
+    {
+        m_bits[i] = words[i];
+    }
+
+    // Ignore stray bits past the last packet
+    if (m_packetCount % 64 != 0)
+        m_bits[m_wordCount - 1] &= (1ULL << (m_packetCount % 64)) - 1;
+    return true;
+}
+
+// Write an empty journal
+bool CopyJournal::Create(const Header& header)
+{
+    // Drop any old bitmap before the new header can vouch for it
+    std::vector<uint8_t> data(sizeof(header) + m_wordCount * sizeof(uint64_t), 0);
+    memcpy(data.data(), &header, sizeof(header));
+
+    uint32_t written = 0;
+    return m_backend->SetSize(m_handle, 0) &&
+        m_backend->WriteAt(m_handle, 0, data.data(), static_cast<uint32_t>(data.size()), &written) &&
+        written == data.size() &&
+        m_backend->Flush(m_handle);
+}
+
+// Number of packets recorded as done
+int CopyJournal::GetCompletedCount() const
+{
+    int count = 0;
+    for (size_t i = 0; i < m_wordCount; i++)
+    {
+        uint64_t word = m_bits[i];
+        while (word)
+        {
+            word &= word - 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Check if a packet is recorded as done
+bool CopyJournal::IsComplete(int packet) const
+{
+    return (m_bits[packet / 64].load() >> (packet % 64)) & 1;
+}
+
+// Record a packet as written
+void CopyJournal::MarkComplete(int packet)
+{
+    m_bits[packet / 64].fetch_or(1ULL << (packet % 64));
+    m_dirty = true;
+}
+
+// Check if a batch is ready to be saved
+bool CopyJournal::IsFlushDue() const
+{
+    return m_dirty && Now() - m_lastFlush >= FLUSH_INTERVAL;
+}
+
+// Save the packets marked so far
+bool CopyJournal::Flush(FileHandle destination)
+{
+    if (m_handle == INVALID_FILE_HANDLE)
+        return false;
+
+    // Snapshot the bits first: packets marked later may not be durable yet
+    m_dirty = false;
+    m_lastFlush = Now();
+    std::vector<uint64_t> words(m_wordCount);
+    for (size_t i = 0; i < m_wordCount; i++)
+    {
+        words[i] = m_bits[i];
+    }
+
+    // The data must be on disk before the journal says so
+    if (destination != INVALID_FILE_HANDLE && !m_backend->Flush(destination))
+        return false;
+
+    uint32_t length = static_cast<uint32_t>(m_wordCount * sizeof(uint64_t));
+    uint32_t written = 0;
+    return m_backend->WriteAt(m_handle, sizeof(Header), words.data(), length, &written) &&
+        written == length &&
+        m_backend->Flush(m_handle);
+}
+
+// Close the journal, keeping it
+void CopyJournal::Close()
+{
+    if (m_handle != INVALID_FILE_HANDLE)
+    {
+        m_backend->Close(m_handle);
+        m_handle = INVALID_FILE_HANDLE;
+    }
+}
+
+// Close and delete the journal
+void CopyJournal::Remove()
+{
+    Close();
+    if (!m_path.empty())
+        m_backend->Delete(m_path);
+}
+
+// Seconds on a monotonic clock
+double CopyJournal::Now()
+{
+    return boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,589 @@
+#include "../include/CopyMetrics.h"
+#include "../include/FileIo.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+
+// Sub-buckets per power of two
+static const uint64_t SUB_BUCKETS = 1ULL << LatencyHistogram::SUB_BUCKET_BITS;
+
+// Prometheus histogram bounds: every second power of two of microseconds,
+// 1 us to 268 s
+static const int PROMETHEUS_MAX_POWER = 28;
+
+// Names of the stall kinds in the exported files
+static const char* const STALL_NAMES[STALL_KIND_COUNT] = { "rateLimit", "streamAdmission" };
+static const char* const STALL_LABELS[STALL_KIND_COUNT] = { "rate_limit", "stream_admission" };
+
+// Raise an atomic maximum
+static void RaiseMax(std::atomic<long long>& max, long long value)
+{
+    long long current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+// Latency a share of the samples took at most
+double LatencySnapshot::GetPercentile(double percentile) const
+{
+    if (count <= 0)
+        return 0.0;
+
+    // The sample at the percentile's rank, reported as its bucket's upper bound
+    long long rank = static_cast<long long>(percentile * count + 0.5);
+    rank = (std::min)((std::max)(rank, 1LL), count);
+    long long seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return (std::min)(LatencyHistogram::GetBucketUpperBound(i) / 1e6, max);
+    }
+    return max;
+}
+
+// Latencies shorter than a power of two of microseconds
+long long LatencySnapshot::CountBelow(int power) const
+{
+    // Powers of two always start a bucket
+    size_t end = power >= LatencyHistogram::MAX_POWER ? buckets.size() : LatencyHistogram::GetBucket(1ULL << power);
+    long long below = 0;
+    for (size_t i = 0; i < end && i < buckets.size(); i++)
+    {
+        below += buckets[i];
+    }
+    return below;
+}
+
+// Constructor
+LatencyHistogram::LatencyHistogram()
+    : m_sum(0),
+    m_max(0)
+{
+    for (std::atomic<long long>& bucket : m_buckets)
+    {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+// Destructor
+LatencyHistogram::~LatencyHistogram()
+{
+}
+
+// Add a latency
+void LatencyHistogram::Record(double seconds)
+{
+    double microseconds = seconds * 1e6;
+    uint64_t value = 0;
+    if (microseconds >= static_cast<double>(1ULL << MAX_POWER))
+        value = (1ULL << MAX_POWER);
+    else if (microseconds > 0.0)
+        value = static_cast<uint64_t>(microseconds);
+
+    m_buckets[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(static_cast<long long>(value), std::memory_order_relaxed);
+    RaiseMax(m_max, static_cast<long long>(value));
+}
+
+// Copy the counts out
+LatencySnapshot LatencyHistogram::GetSnapshot() const
+{
+    // Counted from the buckets so the percentiles add up
+    LatencySnapshot snapshot;
+    snapshot.buckets.resize(BUCKET_COUNT);
+    snapshot.count = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; i++)
+    {
+        snapshot.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.buckets[i];
+    }
+
+    snapshot.sum = m_sum.load(std::memory_order_relaxed) / 1e6;
+    snapshot.max = m_max.load(std::memory_order_relaxed) / 1e6;
+    return snapshot;
+}
+
+// Bucket of a latency in microseconds
+size_t LatencyHistogram::GetBucket(uint64_t microseconds)
+{
+    // Below SUB_BUCKETS every microsecond has its own bucket
+    if (microseconds < SUB_BUCKETS)
+        return static_cast<size_t>(microseconds);
+    if (microseconds >= (1ULL << MAX_POWER))
+        return BUCKET_COUNT - 1;
+
+    // Then each power of two is split SUB_BUCKETS ways by its next bits
+    int power = SUB_BUCKET_BITS;
+    while (microseconds >> (power + 1))
+        power++;
+    size_t block = static_cast<size_t>(power - SUB_BUCKET_BITS + 1);
+    return (block << SUB_BUCKET_BITS) + static_cast<size_t>((microseconds >> (power - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Smallest latency in a bucket, in microseconds
+uint64_t LatencyHistogram::GetBucketLowerBound(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    size_t block = bucket >> SUB_BUCKET_BITS;
+    uint64_t sub = bucket & (SUB_BUCKETS - 1);
+    return (SUB_BUCKETS + sub) << (block - 1);
+}
+
+// First latency past a bucket, in microseconds
+uint64_t LatencyHistogram::GetBucketUpperBound(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket + 1;
+
+    size_t block = bucket >> SUB_BUCKET_BITS;
+    uint64_t sub = bucket & (SUB_BUCKETS - 1);
+    return (SUB_BUCKETS + sub + 1) << (block - 1);
+}
+
+// Constructor
+IoMetrics::IoMetrics()
+    : m_opens(0),
+    m_reads(0),
+    m_writes(0),
+    m_bytesRead(0),
+    m_bytesWritten(0),
+    m_errors(0),
+    m_retries(0)
+{
+}
+
+// Destructor
+IoMetrics::~IoMetrics()
+{
+}
+
+// An open finished
+void IoMetrics::OnOpen(bool success, double seconds)
+{
+    m_opens.fetch_add(1, std::memory_order_relaxed);
+    if (success)
+        m_openLatency.Record(seconds);
+    else
+        m_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A read finished
+void IoMetrics::OnRead(bool success, long long bytes, double seconds)
+{
+    m_reads.fetch_add(1, std::memory_order_relaxed);
+    if (bytes > 0)
+        m_bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+    if (success)
+        m_readLatency.Record(seconds);
+    else
+        m_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A write finished
+void IoMetrics::OnWrite(bool success, long long bytes, double seconds)
+{
+    m_writes.fetch_add(1, std::memory_order_relaxed);
+    if (bytes > 0)
+        m_bytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+    if (success)
+        m_writeLatency.Record(seconds);
+    else
+        m_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A packet read here has to be read from another replica
+void IoMetrics::OnRetry()
+{
+    m_retries.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Copy the counts out
+IoMetricsSnapshot IoMetrics::GetSnapshot() const
+{
+    IoMetricsSnapshot snapshot;
+    snapshot.opens = m_opens.load(std::memory_order_relaxed);
+    snapshot.reads = m_reads.load(std::memory_order_relaxed);
+    snapshot.writes = m_writes.load(std::memory_order_relaxed);
+    snapshot.bytesRead = m_bytesRead.load(std::memory_order_relaxed);
+    snapshot.bytesWritten = m_bytesWritten.load(std::memory_order_relaxed);
+    snapshot.errors = m_errors.load(std::memory_order_relaxed);
+    snapshot.retries = m_retries.load(std::memory_order_relaxed);
+    snapshot.openLatency = m_openLatency.GetSnapshot();
+    snapshot.readLatency = m_readLatency.GetSnapshot();
+    snapshot.writeLatency = m_writeLatency.GetSnapshot();
+    return snapshot;
+}
+
+// Constructor
+CopyMetrics::CopyMetrics()
+    : m_unknownDevice(nullptr),
+    m_requestsInFlight(0),
+    m_peakRequestsInFlight(0)
+{
+    for (int kind = 0; kind < STALL_KIND_COUNT; kind++)
+    {
+        m_stalls[kind] = 0;
+        m_stallMicroseconds[kind] = 0;
+    }
+}
+
+// Destructor
+CopyMetrics::~CopyMetrics()
+{
+}
+
+// Metrics of a source root directory
+IoMetrics* CopyMetrics::GetSourceMetrics(const std::wstring& root)
+{
+    std::wstring key = FileIo::GetPathKey(root);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    NamedMetrics*& metrics = m_sourceIndex[key];
+    if (!metrics)
+    {
+        m_sources.push_back(std::make_unique<NamedMetrics>());
+        metrics = m_sources.back().get();
+        metrics->name = root;
+    }
+    return &metrics->metrics;
+}
+
+// Metrics of a device; devices that can't be identified share one entry
+IoMetrics* CopyMetrics::GetDeviceMetrics(bool known, unsigned long long deviceId)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    NamedMetrics** metrics = known ? &m_deviceIndex[deviceId] : &m_unknownDevice;
+    if (!*metrics)
+    {
+        m_devices.push_back(std::make_unique<NamedMetrics>());
+        *metrics = m_devices.back().get();
+        (*metrics)->name = known ? std::to_wstring(deviceId) : L"unknown";
+    }
+    return &(*metrics)->metrics;
+}
+
+// I/O requests were queued or completed
+void CopyMetrics::AddRequestsInFlight(long long count)
+{
+    long long inFlight = m_requestsInFlight.fetch_add(count, std::memory_order_relaxed) + count;
+    RaiseMax(m_peakRequestsInFlight, inFlight);
+}
+
+// A copy thread was held up
+void CopyMetrics::OnStall(StallKind kind, double seconds)
+{
+    m_stalls[kind].fetch_add(1, std::memory_order_relaxed);
+    m_stallMicroseconds[kind].fetch_add(static_cast<long long>(seconds * 1e6), std::memory_order_relaxed);
+}
+
+// Copy everything out
+MetricsSnapshot CopyMetrics::GetSnapshot() const
+{
+    MetricsSnapshot snapshot;
+    snapshot.time = static_cast<long long>(std::time(nullptr));
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (const auto& source : m_sources)
+        {
+            snapshot.sources.push_back(source->metrics.GetSnapshot());
+            snapshot.sources.back().name = source->name;
+        }
+        for (const auto& device : m_devices)
+        {
+            snapshot.devices.push_back(device->metrics.GetSnapshot());
+            snapshot.devices.back().name = device->name;
+        }
+    }
+
+    snapshot.requestsInFlight = m_requestsInFlight.load(std::memory_order_relaxed);
+    snapshot.peakRequestsInFlight = m_peakRequestsInFlight.load(std::memory_order_relaxed);
+    snapshot.buffersAllocated = 0;
+    snapshot.buffersInUse = 0;
+    snapshot.bufferSize = 0;
+    for (int kind = 0; kind < STALL_KIND_COUNT; kind++)
+    {
+        snapshot.stalls[kind] = m_stalls[kind].load(std::memory_order_relaxed);
+        snapshot.stallSeconds[kind] = m_stallMicroseconds[kind].load(std::memory_order_relaxed) / 1e6;
+    }
+    return snapshot;
+}
+
+// Convert a wide string to UTF-8 (UTF-16 surrogate pairs included)
+static std::string ToUtf8(const std::wstring& text)
+{
+    std::string result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        uint32_t c = static_cast<uint32_t>(text[i]);
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.size())
+        {
+            uint32_t low = static_cast<uint32_t>(text[i + 1]);
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+
+        if (c < 0x80)
+        {
+            result += static_cast<char>(c);
+        }
+        else if (c < 0x800)
+        {
+            result += static_cast<char>(0xC0 | (c >> 6));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            result += static_cast<char>(0xE0 | (c >> 12));
+            result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            result += static_cast<char>(0xF0 | (c >> 18));
+            result += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+    return result;
+}
+
+// Format a number the way both JSON and Prometheus read it
+static std::string FormatNumber(double value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", value);
+    return text;
+}
+
+// Quote a string for JSON
+static std::string JsonString(const std::wstring& text)
+{
+    std::string result = "\"";
+    for (char c : ToUtf8(text))
+    {
+        if (c == '"' || c == '\\')
+        {
+            result += '\\';
+            result += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned>(c));
+            result += escape;
+        }
+        else
+        {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+// JSON object of a latency histogram's summary
+static std::string JsonLatency(const LatencySnapshot& latency)
+{
+    std::string json = "{\"count\": " + std::to_string(latency.count);
+    json += ", \"mean\": " + FormatNumber(latency.count > 0 ? latency.sum / latency.count : 0.0);
+    json += ", \"p50\": " + FormatNumber(latency.GetPercentile(0.5));
+    json += ", \"p90\": " + FormatNumber(latency.GetPercentile(0.9));
+    json += ", \"p99\": " + FormatNumber(latency.GetPercentile(0.99));
+    json += ", \"p999\": " + FormatNumber(latency.GetPercentile(0.999));
+    json += ", \"max\": " + FormatNumber(latency.max) + "}";
+    return json;
+}
+
+// JSON array of sources or devices
+static std::string JsonIoMetrics(const std::vector<IoMetricsSnapshot>& list)
+{
+    std::string json = "[";
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        const IoMetricsSnapshot& io = list[i];
+        json += i > 0 ? ",\n    {" : "\n    {";
+        json += "\"name\": " + JsonString(io.name);
+        json += ", \"opens\": " + std::to_string(io.opens);
+        json += ", \"reads\": " + std::to_string(io.reads);
+        json += ", \"writes\": " + std::to_string(io.writes);
+        json += ", \"bytesRead\": " + std::to_string(io.bytesRead);
+        json += ", \"bytesWritten\": " + std::to_string(io.bytesWritten);
+        json += ", \"errors\": " + std::to_string(io.errors);
+        json += ", \"retries\": " + std::to_string(io.retries);
+        json += ",\n     \"openLatency\": " + JsonLatency(io.openLatency);
+        json += ",\n     \"readLatency\": " + JsonLatency(io.readLatency);
+        json += ",\n     \"writeLatency\": " + JsonLatency(io.writeLatency) + "}";
+    }
+    return json + (list.empty() ? "]" : "\n  ]");
+}
+
+// Render a snapshot as JSON (latencies in seconds)
+std::string CopyMetrics::FormatJson(const MetricsSnapshot& snapshot)
+{
+    std::string json = "{\n";
+    json += "  \"time\": " + std::to_string(snapshot.time) + ",\n";
+    json += "  \"requestsInFlight\": " + std::to_string(snapshot.requestsInFlight) + ",\n";
+    json += "  \"peakRequestsInFlight\": " + std::to_string(snapshot.peakRequestsInFlight) + ",\n";
+    json += "  \"buffers\": {\"allocated\": " + std::to_string(snapshot.buffersAllocated) +
+        ", \"inUse\": " + std::to_string(snapshot.buffersInUse) +
+        ", \"size\": " + std::to_string(snapshot.bufferSize) + "},\n";
+    json += "  \"stalls\": {";
+    for (int kind = 0; kind < STALL_KIND_COUNT; kind++)
+    {
+        json += kind > 0 ? ", \"" : "\"";
+        json += std::string(STALL_NAMES[kind]) + "\": {\"count\": " + std::to_string(snapshot.stalls[kind]) +
+            ", \"seconds\": " + FormatNumber(snapshot.stallSeconds[kind]) + "}";
+    }
+    json += "},\n";
+    json += "  \"sources\": " + JsonIoMetrics(snapshot.sources) + ",\n";
+    json += "  \"devices\": " + JsonIoMetrics(snapshot.devices) + "\n";
+    return json + "}\n";
+}
+
+// Quote a Prometheus label value
+static std::string PrometheusLabel(const std::wstring& text)
+{
+    std::string result = "\"";
+    for (char c : ToUtf8(text))
+    {
+        if (c == '"' || c == '\\')
+        {
+            result += '\\';
+            result += c;
+        }
+        else if (c == '\n')
+        {
+            result += "\\n";
+        }
+        else
+        {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+// Render a snapshot in the Prometheus text format
+std::string CopyMetrics::FormatPrometheus(const MetricsSnapshot& snapshot)
+{
+    // Every source and device, with its labels
+    std::vector<std::pair<std::string, const IoMetricsSnapshot*>> entries;
+    for (const IoMetricsSnapshot& source : snapshot.sources)
+        entries.push_back(std::make_pair("scope=\"source\",name=" + PrometheusLabel(source.name), &source));
+    for (const IoMetricsSnapshot& device : snapshot.devices)
+        entries.push_back(std::make_pair("scope=\"device\",name=" + PrometheusLabel(device.name), &device));
+
+    std::string text;
+    auto header = [&](const char* name, const char* type, const char* help) {
+        text += std::string("# HELP ") + name + " " + help + "\n";
+        text += std::string("# TYPE ") + name + " " + type + "\n";
+    };
+
+    // Counters per source and device
+    struct Counter {
+        const char* name;
+        const char* help;
+        long long IoMetricsSnapshot::* value;
+    };
+    static const Counter counters[] = {
+        { "filecopier_opens_total", "Files opened.", &IoMetricsSnapshot::opens },
+        { "filecopier_reads_total", "Reads issued.", &IoMetricsSnapshot::reads },
+        { "filecopier_writes_total", "Writes issued.", &IoMetricsSnapshot::writes },
+        { "filecopier_read_bytes_total", "Bytes read.", &IoMetricsSnapshot::bytesRead },
+        { "filecopier_written_bytes_total", "Bytes written.", &IoMetricsSnapshot::bytesWritten },
+        { "filecopier_errors_total", "Opens, reads and writes that failed.", &IoMetricsSnapshot::errors },
+        { "filecopier_retries_total", "Packets sent to another replica after a failure.", &IoMetricsSnapshot::retries },
+    };
+    for (const Counter& counter : counters)
+    {
+        header(counter.name, "counter", counter.help);
+        for (const auto& entry : entries)
+            text += std::string(counter.name) + "{" + entry.first + "} " + std::to_string(entry.second->*counter.value) + "\n";
+    }
+
+    // Latency histograms per source and device
+    struct Histogram {
+        const char* name;
+        const char* help;
+        LatencySnapshot IoMetricsSnapshot::* value;
+    };
+    static const Histogram histograms[] = {
+        { "filecopier_open_seconds", "Latency of successful opens.", &IoMetricsSnapshot::openLatency },
+        { "filecopier_read_seconds", "Latency of successful reads.", &IoMetricsSnapshot::readLatency },
+        { "filecopier_write_seconds", "Latency of successful writes.", &IoMetricsSnapshot::writeLatency },
+    };
+    for (const Histogram& histogram : histograms)
+    {
+        header(histogram.name, "histogram", histogram.help);
+        for (const auto& entry : entries)
+        {
+            const LatencySnapshot& latency = entry.second->*histogram.value;
+            for (int power = 0; power <= PROMETHEUS_MAX_POWER; power += 2)
+            {
+                text += std::string(histogram.name) + "_bucket{" + entry.first + ",le=\"" +
+                    FormatNumber(static_cast<double>(1ULL << power) / 1e6) + "\"} " + std::to_string(latency.CountBelow(power)) + "\n";
+            }
+            text += std::string(histogram.name) + "_bucket{" + entry.first + ",le=\"+Inf\"} " + std::to_string(latency.count) + "\n";
+            text += std::string(histogram.name) + "_sum{" + entry.first + "} " + FormatNumber(latency.sum) + "\n";
+            text += std::string(histogram.name) + "_count{" + entry.first + "} " + std::to_string(latency.count) + "\n";
+        }
+    }
+
+    // Job-wide gauges and stalls
+    header("filecopier_requests_in_flight", "gauge", "I/O requests queued by the copy workers.");
+    text += "filecopier_requests_in_flight " + std::to_string(snapshot.requestsInFlight) + "\n";
+    header("filecopier_requests_in_flight_peak", "gauge", "Most I/O requests ever queued at once.");
+    text += "filecopier_requests_in_flight_peak " + std::to_string(snapshot.peakRequestsInFlight) + "\n";
+    header("filecopier_buffers", "gauge", "Packet buffers in the pool.");
+    text += "filecopier_buffers{state=\"allocated\"} " + std::to_string(snapshot.buffersAllocated) + "\n";
+    text += "filecopier_buffers{state=\"in_use\"} " + std::to_string(snapshot.buffersInUse) + "\n";
+    header("filecopier_buffer_size_bytes", "gauge", "Bytes per packet buffer.");
+    text += "filecopier_buffer_size_bytes " + std::to_string(snapshot.bufferSize) + "\n";
+    header("filecopier_stalls_total", "counter", "Times a copy thread had I/O it couldn't issue.");
+    for (int kind = 0; kind < STALL_KIND_COUNT; kind++)
+        text += std::string("filecopier_stalls_total{reason=\"") + STALL_LABELS[kind] + "\"} " + std::to_string(snapshot.stalls[kind]) + "\n";
+    header("filecopier_stall_seconds_total", "counter", "Time I/O was held up, summed over the requests held.");
+    for (int kind = 0; kind < STALL_KIND_COUNT; kind++)
+        text += std::string("filecopier_stall_seconds_total{reason=\"") + STALL_LABELS[kind] + "\"} " + FormatNumber(snapshot.stallSeconds[kind]) + "\n";
+    return text;
+}
+
+// Render a snapshot in a format
+std::string CopyMetrics::Format(const MetricsSnapshot& snapshot, MetricsFormat format)
+{
+    return format == METRICS_PROMETHEUS ? FormatPrometheus(snapshot) : FormatJson(snapshot);
+}
+
+// Write text to a file, replacing it in one step
+bool CopyMetrics::WriteFile(const std::wstring& path, const std::string& text)
+{
+    std::wstring temporary = path + L".tmp";
+    FileHandle handle = FileIo::CreateForWrite(temporary);
+    if (handle == INVALID_FILE_HANDLE)
+        return false;
+
+    bool success = true;
+    uint32_t done = 0;
+    while (success && done < text.size())
+    {
+        uint32_t written = 0;
+        success = FileIo::WriteAt(handle, done, text.data() + done, static_cast<uint32_t>(text.size() - done), &written) && written > 0;
+        done += written;
+    }
+    FileIo::Close(handle);
+
+    if (!success || !FileIo::Rename(temporary, path))
+    {
+        FileIo::Delete(temporary);
+        return false;
+    }
+    return true;
+}
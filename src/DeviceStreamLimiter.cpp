@@ -0,0 +1,151 @@
+#include "../include/DeviceStreamLimiter.h"
+#include <algorithm>
+
+// Constructor
+DeviceStreamLimiter::DeviceStreamLimiter(const std::vector<int>& limits, size_t fileCount)
+    : m_limits(limits),
+    m_active(limits.size(), 0),
+    m_queues(limits.size()),
+    m_files(fileCount),
+    m_waiting(0)
+{
+    // A device that can't serve anything would hold its files forever
+    for (int& limit : m_limits)
+    {
+        limit = (std::max)(limit, 1);
+    }
+
+    for (FileEntry& entry : m_files)
+    {
+        entry.destination = 0;
+        entry.queued = false;
+        entry.admitted = false;
+    }
+}
+
+// Destructor
+DeviceStreamLimiter::~DeviceStreamLimiter()
+{
+}
+
+// Queue a file
+void DeviceStreamLimiter::Add(size_t file, size_t destinationDevice, const std::vector<size_t>& sourceDevices)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    FileEntry& entry = m_files[file];
+    if (entry.queued || entry.admitted)
+        return;
+
+    entry.destination = destinationDevice;
+    entry.sources = sourceDevices;
+    std::sort(entry.sources.begin(), entry.sources.end());
+    entry.sources.erase(std::unique(entry.sources.begin(), entry.sources.end()), entry.sources.end());
+    entry.queued = true;
+    m_waiting++;
+
+    // Wait on every device it could read from; the first to free up lets it in
+    for (size_t device : entry.sources)
+    {
+        m_queues[device].push_back(file);
+    }
+}
+
+// Let queued files in while streams are free
+void DeviceStreamLimiter::Admit(std::vector<StreamAdmission>& admitted)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    AdmitLocked(admitted);
+}
+
+// A file is done: free its streams
+void DeviceStreamLimiter::Release(size_t file, std::vector<StreamAdmission>& admitted)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    FileEntry& entry = m_files[file];
+    if (!entry.admitted)
+        return;
+    entry.admitted = false;
+
+    // Reading and writing the same device takes a single stream
+    m_active[entry.destination]--;
+    for (size_t device : entry.granted)
+    {
+        if (device != entry.destination)
+            m_active[device]--;
+    }
+    entry.granted.clear();
+
+    AdmitLocked(admitted);
+}
+
+// Number of files queued and not let in yet
+size_t DeviceStreamLimiter::GetWaitingCount() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_waiting;
+}
+
+// Check if a device has a free stream
+bool DeviceStreamLimiter::IsFree(size_t device) const
+{
+    return m_active[device] < m_limits[device];
+}
+
+// Let a file in if its destination and one of its sources are free
+bool DeviceStreamLimiter::TryAdmit(size_t file, std::vector<StreamAdmission>& admitted)
+{
+    FileEntry& entry = m_files[file];
+    if (!IsFree(entry.destination))
+        return false;
+
+    // Take every free source device; one shared with the destination rides
+    // on the destination's stream
+    for (size_t device : entry.sources)
+    {
+        if (device == entry.destination || IsFree(device))
+            entry.granted.push_back(device);
+    }
+    if (entry.granted.empty())
+        return false;
+
+    m_active[entry.destination]++;
+    for (size_t device : entry.granted)
+    {
+        if (device != entry.destination)
+            m_active[device]++;
+    }
+
+    entry.queued = false;
+    entry.admitted = true;
+    m_waiting--;
+
+    StreamAdmission admission;
+    admission.file = file;
+    admission.devices = entry.granted;
+    admitted.push_back(admission);
+    return true;
+}
+
+// Let in files from the head of every device's queue
+void DeviceStreamLimiter::AdmitLocked(std::vector<StreamAdmission>& admitted)
+{
+    for (size_t device = 0; device < m_queues.size(); device++)
+    {
+        std::deque<size_t>& queue = m_queues[device];
+        while (!queue.empty())
+        {
+            // Files let in through another device's queue are dropped here
+            if (!m_files[queue.front()].queued)
+            {
+                queue.pop_front();
+                continue;
+            }
+
+            if (!IsFree(device) || !TryAdmit(queue.front(), admitted))
+                break;
+            queue.pop_front();
+        }
+    }
+}
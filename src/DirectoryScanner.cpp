@@ -0,0 +1,410 @@
+#include "../include/DirectoryScanner.h"
+#include "../include/FileIo.h"
+#include <boost/thread.hpp>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+
+// Entry layout returned by getdents64
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+// Bytes of entries fetched per getdents64 call
+static const size_t GETDENTS_BUFFER_SIZE = 64 * 1024;
+#endif
+
+// Append a name to a directory path
+static std::wstring JoinPath(const std::wstring& directory, const std::wstring& name)
+{
+    if (!directory.empty() && directory.back() == PATH_SEPARATOR)
+        return directory + name;
+    return directory + PATH_SEPARATOR + name;
+}
+
+// Constructor
+DirectoryScanner::DirectoryScanner(int threadCount, const std::shared_ptr<IoBackend>& backend)
+    : m_backend(backend && !backend->IsNative() ? backend : nullptr),
+    m_threadCount(threadCount),
+    m_recursive(true),
+    m_callback(nullptr),
+    m_userData(nullptr),
+    m_pending(0),
+    m_cancelled(false),
+    m_activeThreads(0),
+    m_finished(true),
+    m_fileCount(0),
+    m_directoryCount(0),
+    m_errorCount(0)
+{
+    if (m_threadCount <= 0)
+        m_threadCount = (std::min)((std::max)(1, static_cast<int>(boost::thread::hardware_concurrency())), MAX_THREADS);
+
+    for (int i = 0; i < m_threadCount; i++)
+    {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+}
+
+// Destructor
+DirectoryScanner::~DirectoryScanner()
+{
+    Cancel();
+    Wait();
+}
+
+// Start scanning a directory tree in the background
+bool DirectoryScanner::Start(const std::wstring& root, bool recursive, ScanBatchFunc callback, void* userData)
+{
+    if (!m_finished)
+        return false;
+
+    // Reap the threads of a previous scan
+    Wait();
+
+    m_recursive = recursive;
+    m_callback = callback;
+    m_userData = userData;
+    m_cancelled = false;
+    m_finished = false;
+    m_fileCount = 0;
+    m_directoryCount = 0;
+    m_errorCount = 0;
+
+    // The root is the first directory to read
+    m_pending = 1;
+    m_queues[0]->directories.push_back(root);
+
+    m_activeThreads = m_threadCount;
+    m_threads = std::make_unique<boost::thread_group>();
+    for (int w = 0; w < m_threadCount; w++)
+    {
+        try
+        {
+            m_threads->create_thread([this, w]() { RunWorker(w); });
+        }
+        catch (const boost::thread_resource_error&)
+        {
+            // Threads that did start leave once they see the cancel
+            m_activeThreads -= m_threadCount - w;
+            Cancel();
+            Wait();
+            m_finished = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Wait until the scan has finished
+void DirectoryScanner::Wait()
+{
+    if (m_threads)
+    {
+        m_threads->join_all();
+        m_threads.reset();
+    }
+
+    // Drop whatever a cancelled scan left queued
+    for (auto& queue : m_queues)
+    {
+        boost::mutex::scoped_lock lock(queue->mutex);
+        queue->directories.clear();
+    }
+}
+
+// Stop the scan early
+void DirectoryScanner::Cancel()
+{
+    m_cancelled = true;
+    boost::mutex::scoped_lock lock(m_idleMutex);
+    m_idle.notify_all();
+}
+
+// Check if the scan has finished
+bool DirectoryScanner::IsFinished() const
+{
+    return m_finished;
+}
+
+// Number of files found so far
+long long DirectoryScanner::GetFileCount() const
+{
+    return m_fileCount;
+}
+
+// Number of directories read so far
+long long DirectoryScanner::GetDirectoryCount() const
+{
+    return m_directoryCount;
+}
+
+// Number of directories that couldn't be read
+long long DirectoryScanner::GetErrorCount() const
+{
+    return m_errorCount;
+}
+
+// Thread body: read directories until the whole tree is done
+void DirectoryScanner::RunWorker(int worker)
+{
+    std::vector<std::wstring> batch;
+    while (!m_cancelled)
+    {
+        std::wstring directory;
+        if (Pop(worker, &directory))
+        {
+            if (m_backend)
+                ReadBackendDirectory(worker, directory, batch);
+            else
+                ReadDirectory(worker, directory, batch);
+
+            // The last directory ends the scan; wake the idle threads to leave
+            if (--m_pending == 0)
+            {
+                boost::mutex::scoped_lock lock(m_idleMutex);
+                m_idle.notify_all();
+            }
+            continue;
+        }
+
+        // Nothing to take: hand over what we have rather than sit on it
+        Deliver(batch);
+
+        boost::mutex::scoped_lock lock(m_idleMutex);
+        if (m_pending == 0 || m_cancelled)
+            break;
+
+        // Another thread is still reading and may find more directories
+        m_idle.timed_wait(lock, boost::posix_time::milliseconds(10));
+    }
+
+    Deliver(batch);
+    if (--m_activeThreads == 0)
+        m_finished = true;
+}
+
+// Queue a directory on a worker's own deque
+void DirectoryScanner::Push(int worker, const std::wstring& directory)
+{
+    m_pending++;
+    {
+        WorkerQueue& queue = *m_queues[worker];
+        boost::mutex::scoped_lock lock(queue.mutex);
+        queue.directories.push_back(directory);
+    }
+
+    boost::mutex::scoped_lock lock(m_idleMutex);
+    m_idle.notify_one();
+}
+
+// Get the next directory for a worker
+bool DirectoryScanner::Pop(int worker, std::wstring* directory)
+{
+    // Newest first from our own deque, so a deep branch stays on one thread
+    {
+        WorkerQueue& queue = *m_queues[worker];
+        boost::mutex::scoped_lock lock(queue.mutex);
+        if (!queue.directories.empty())
+        {
+            directory->swap(queue.directories.back());
+            queue.directories.pop_back();
+            return true;
+        }
+    }
+
+    // Steal the oldest (usually the largest subtree) from another thread
+    for (int i = 1; i < m_threadCount; i++)
+    {
+        WorkerQueue& victim = *m_queues[(worker + i) % m_threadCount];
+        boost::mutex::scoped_lock lock(victim.mutex);
+        if (!victim.directories.empty())
+        {
+            directory->swap(victim.directories.front());
+            victim.directories.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hand a batch to the callback and empty it
+void DirectoryScanner::Deliver(std::vector<std::wstring>& batch)
+{
+    if (batch.empty())
+        return;
+
+    m_fileCount += batch.size();
+    {
+        boost::mutex::scoped_lock lock(m_callbackMutex);
+        if (m_callback)
+            m_callback(batch, m_userData);
+    }
+    batch.clear();
+}
+
+// Read one directory through the backend
+void DirectoryScanner::ReadBackendDirectory(int worker, const std::wstring& directory, std::vector<std::wstring>& batch)
+{
+    std::vector<DirectoryEntry> entries;
+    if (!m_backend->ListDirectory(directory, entries))
+    {
+        m_errorCount++;
+        return;
+    }
+
+    m_directoryCount++;
+    for (size_t i = 0; i < entries.size() && !m_cancelled; i++)
+    {
+        if (entries[i].isDirectory)
+        {
+            if (m_recursive)
+                Push(worker, JoinPath(directory, entries[i].name));
+            continue;
+        }
+
+        batch.push_back(JoinPath(directory, entries[i].name));
+        if (batch.size() >= BATCH_SIZE)
+            Deliver(batch);
+    }
+}
+
+#ifdef _WIN32
+
+// Read one directory with a large-fetch FindFirstFileEx
+void DirectoryScanner::ReadDirectory(int worker, const std::wstring& directory, std::vector<std::wstring>& batch)
+{
+    // Skip the short names and ask for bigger batches of entries per call
+    WIN32_FIND_DATA findData;
+    HANDLE find = FindFirstFileEx(JoinPath(directory, L"*").c_str(), FindExInfoBasic, &findData,
+        FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        m_errorCount++;
+        return;
+    }
+
+    m_directoryCount++;
+    do {
+        // Skip . and .. directories
+        if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
+            continue;
+
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            // Don't follow junctions and directory links, they can loop
+            if (m_recursive && !(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                Push(worker, JoinPath(directory, findData.cFileName));
+            continue;
+        }
+
+        batch.push_back(JoinPath(directory, findData.cFileName));
+        if (batch.size() >= BATCH_SIZE)
+            Deliver(batch);
+    } while (!m_cancelled && FindNextFile(find, &findData));
+
+    FindClose(find);
+}
+
+#else
+
+// Read one directory with getdents64 (readdir where there's no such call)
+void DirectoryScanner::ReadDirectory(int worker, const std::wstring& directory, std::vector<std::wstring>& batch)
+{
+    int fd = openat(AT_FDCWD, FileIo::ToNativePath(directory).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        m_errorCount++;
+        return;
+    }
+
+    m_directoryCount++;
+
+    // Sort an entry into a subdirectory, a file or something to leave out
+    auto addEntry = [&](const char* name, unsigned char type) {
+        // Skip . and .. directories
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            return;
+
+        // Some filesystems don't fill d_type, fall back to stat
+        struct stat st;
+        if (type == DT_UNKNOWN)
+        {
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                return;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+        }
+
+        // Links are followed only to files
+        if (type == DT_LNK)
+            type = fstatat(fd, name, &st, 0) == 0 && S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+
+        if (type == DT_DIR)
+        {
+            if (m_recursive)
+                Push(worker, JoinPath(directory, FileIo::FromNativePath(name)));
+        }
+        else if (type == DT_REG)
+        {
+            // Devices, pipes and sockets can't be copied as files
+            batch.push_back(JoinPath(directory, FileIo::FromNativePath(name)));
+            if (batch.size() >= BATCH_SIZE)
+                Deliver(batch);
+        }
+    };
+
+#ifdef __linux__
+    // Many entries per system call, straight into our buffer
+    std::vector<char> buffer(GETDENTS_BUFFER_SIZE);
+    while (!m_cancelled)
+    {
+        long bytes = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (bytes <= 0)
+        {
+            if (bytes < 0)
+                m_errorCount++;
+            break;
+        }
+
+        for (long position = 0; position < bytes;)
+        {
+            const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + position);
+            position += entry->d_reclen;
+            addEntry(entry->d_name, entry->d_type);
+        }
+    }
+    close(fd);
+#else
+    DIR* dir = fdopendir(fd);
+    if (!dir)
+    {
+        close(fd);
+        m_errorCount++;
+        return;
+    }
+
+    while (!m_cancelled)
+    {
+        struct dirent* entry = readdir(dir);
+        if (!entry)
+            break;
+        addEntry(entry->d_name, entry->d_type);
+    }
+    closedir(dir);
+#endif
+}
+
+#endif
@@ -1,48 +1,105 @@
 #include "../include/FileCopier.h"
-#include <C:/temp/boost_1_88_0/boost/thread.hpp>
-#include <C:/temp/boost_1_88_0/boost/thread/mutex.hpp>
-#include <C:/temp/boost_1_88_0/boost/thread/condition_variable.hpp>
-#include <C:/temp/boost_1_88_0/boost/chrono.hpp>
-#include <shlwapi.h>
+#include "../include/ZeroDetector.h"
+#include "../include/DirectoryScanner.h"
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/chrono.hpp>
 #include <algorithm>
-#include <strsafe.h>
 #include <queue>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <deque>
+#include <cwctype>
+#include <cstring>
 
-#pragma comment(lib, "shlwapi.lib")
+// Most threads used to look up file metadata for a batch of files
+static const size_t SETUP_THREADS = 16;
 
+// Fewest files per setup thread; smaller batches are looked up inline
+static const size_t SETUP_FILES_PER_THREAD = 64;
 
+// Seconds on a monotonic clock
+static double SteadySeconds()
+{
+    return boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-// Thread procedure implementation
-DWORD WINAPI CopyThreadProc(LPVOID lpParameter)
+// Call body(i) for every i below count, on several threads when there are
+// enough items for the per-file system calls to be worth spreading out
+template <typename Body>
+static void ParallelFor(size_t count, const Body& body)
 {
-    CopyThreadParam* pParam = static_cast<CopyThreadParam*>(lpParameter);
-    if (pParam && pParam->pCopier)
+    std::atomic<size_t> next(0);
+    auto run = [&]() {
+        for (size_t i = next++; i < count; i = next++)
+        {
+            body(i);
+        }
+    };
+
+    boost::thread_group threads;
+    size_t threadCount = (std::min)(SETUP_THREADS, count / SETUP_FILES_PER_THREAD);
+    for (size_t t = 1; t < threadCount; t++)
     {
-        pParam->pCopier->DoCopyOperation();
+        try
+        {
+            threads.create_thread(run);
+        }
+        catch (const boost::thread_resource_error&)
+        {
+            // The threads we have (and this one) share the rest
+            break;
+        }
     }
-    return 0;
+
+    run();
+    threads.join_all();
 }
 
 // Constructor
 FileCopier::FileCopier()
     : m_packetSize(65536),
-    m_thread(NULL),
+    m_replicaMode(false),
+    m_fingerprintReplicas(false),
+    m_queueDepth(8),
+    m_threadCount(0),
+    m_autoPacketSize(false),
+    m_memoryBudget(256LL * 1024 * 1024),
+    m_zeroCopy(true),
+    m_cloneFiles(true),
+    m_directIo(false),
+    m_hedgeRate(0.05),
+    m_verifyReplicas(true),
+    m_resume(true),
+    m_deltaSync(false),
+    m_sparseFiles(true),
+    m_skipZeroBlocks(false),
+    m_rotationalStreams(1),
+    m_solidStateStreams(64),
+    m_ioAlignment(1),
+    m_backend(IoBackend::GetNative()),
+    m_progressCallback(nullptr),
+    m_userData(nullptr),
+    m_cancelRequested(false),
+    m_jobFailed(false),
     m_operationInProgress(false),
+    m_destinationMetrics(nullptr),
+    m_metricsFormat(METRICS_JSON),
+    m_metricsIntervalMs(10000),
+    m_readsIssued(0),
+    m_hedgedReads(0),
+    m_scheduler(nullptr),
     m_totalPackets(0),
-    m_completedPackets(0),
-    m_progressCallback(nullptr),
-    m_userData(nullptr)
+    m_logicalTotal(0),
+    m_physicalTotal(0),
+    m_filesTotal(0),
+    m_reportedPackets(0),
+    m_reportedTotal(0),
+    m_startTime(0.0),
+    m_finishTime(0.0)
 {
-    // Create cancel event (manual reset)
-    m_cancelEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-    // Initialize critical section for thread safety
-    InitializeCriticalSection(&m_cs);
-
-    // Allocate reusable buffer
-    m_buffer = std::make_unique<BYTE[]>(BUFFER_SIZE);
 }
 
 // Destructor
@@ -52,22 +109,11 @@ FileCopier::~FileCopier()
     Cancel();
 
     // Wait for thread to exit
-    if (m_thread)
-    {
-        WaitForSingleObject(m_thread, INFINITE);
-        CloseHandle(m_thread);
-        m_thread = NULL;
-    }
-
-    // Close event handle
-    if (m_cancelEvent)
+    if (m_thread && m_thread->joinable())
     {
-        CloseHandle(m_cancelEvent);
-        m_cancelEvent = NULL;
+        m_thread->join();
     }
-
-    // Delete critical section
-    DeleteCriticalSection(&m_cs);
+    m_thread.reset();
 }
 
 // Add a source file
@@ -78,11 +124,8 @@ void FileCopier::AddSource(const std::wstring& path)
         return;
 
     // Check if source already exists
-    for (const auto& source : m_sources)
-    {
-        if (_wcsicmp(source.path.c_str(), path.c_str()) == 0)
-            return;  // Source already exists
-    }
+    if (!m_sourceKeys.insert(FileIo::GetPathKey(path)).second)
+        return;
 
     // Add the source
     SourceInfo info;
@@ -102,6 +145,7 @@ void FileCopier::RemoveSource(size_t index)
 
     if (index < m_sources.size())
     {
+        m_sourceKeys.erase(FileIo::GetPathKey(m_sources[index].path));
         m_sources.erase(m_sources.begin() + index);
     }
 }
@@ -114,6 +158,7 @@ void FileCopier::ClearSources()
         return;
 
     m_sources.clear();
+    m_sourceKeys.clear();
 }
 
 // Get list of sources
@@ -122,357 +167,2814 @@ const std::vector<SourceInfo>& FileCopier::GetSources() const
     return m_sources;
 }
 
-// Start copying files
-bool FileCopier::StartCopy(
-    const std::wstring& destinationPath,
-    ProgressCallbackFunc progressCallback,
-    void* userData,
-    int packetSize)
+// Put a source into an explicit replica group
+void FileCopier::SetSourceGroup(size_t index, const std::wstring& group)
 {
-    // Check if already in progress
+    // Don't modify sources during an operation
     if (m_operationInProgress)
-        return false;
+        return;
 
-    // Check if we have sources
-    if (m_sources.empty())
-        return false;
+    if (index < m_sources.size())
+    {
+        m_sources[index].group = group;
+    }
+}
 
-    // Set destination path
-    m_destinationPath = destinationPath;
+// Enable or disable combining replicas into one destination file
+void FileCopier::SetReplicaMode(bool enable)
+{
+    // Don't change the mode during an operation
+    if (m_operationInProgress)
+        return;
 
-    // Ensure the destination path ends with a backslash
-    if (!m_destinationPath.empty() && m_destinationPath.back() != L'\\')
-        m_destinationPath += L'\\';
+    m_replicaMode = enable;
+}
 
-    // Store parameters
-    m_packetSize = packetSize;
-    m_progressCallback = progressCallback;
-    m_userData = userData;
+// Check whether replicas are combined into one destination file
+bool FileCopier::GetReplicaMode() const
+{
+    return m_replicaMode;
+}
+
+// Enable or disable matching replicas by content fingerprint
+void FileCopier::SetFingerprintReplicas(bool enable)
+{
+    // Don't change the grouping during an operation
+    if (m_operationInProgress)
+        return;
 
-    // Reset cancel event
-    ResetEvent(m_cancelEvent);
+    m_fingerprintReplicas = enable;
+}
 
-    // Set operation as in progress
-    m_operationInProgress = true;
+// Check whether replicas are matched by content fingerprint
+bool FileCopier::GetFingerprintReplicas() const
+{
+    return m_fingerprintReplicas;
+}
 
-    // Create worker thread
-    m_threadParam.pCopier = this;
-    m_thread = CreateThread(
-        NULL,                           // Default security attributes
-        0,                              // Default stack size
-        CopyThreadProc,                 // Thread function
-        &m_threadParam,                 // Parameter to thread function
-        0,                              // Default creation flags
-        NULL);                          // Receive thread identifier
+// Set the cap on every read
+void FileCopier::SetReadRateLimit(long long bytesPerSecond)
+{
+    m_rateLimiter.GetReadBucket().SetRate(bytesPerSecond);
+}
 
-    if (!m_thread)
-    {
-        m_operationInProgress = false;
+// Get the cap on every read
+long long FileCopier::GetReadRateLimit() const
+{
+    return m_rateLimiter.GetReadBucket().GetRate();
+}
+
+// Set the cap on every write
+void FileCopier::SetWriteRateLimit(long long bytesPerSecond)
+{
+    m_rateLimiter.GetWriteBucket().SetRate(bytesPerSecond);
+}
+
+// Get the cap on every write
+long long FileCopier::GetWriteRateLimit() const
+{
+    return m_rateLimiter.GetWriteBucket().GetRate();
+}
+
+// Set the cap on reads from a source file or directory
+void FileCopier::SetSourceRateLimit(const std::wstring& path, long long bytesPerSecond)
+{
+    m_rateLimiter.SetSourceRate(path, bytesPerSecond);
+}
+
+// Get the cap on reads from a source file or directory
+long long FileCopier::GetSourceRateLimit(const std::wstring& path) const
+{
+    return m_rateLimiter.GetSourceRate(path);
+}
+
+// Set the cap on reads and writes on a device
+bool FileCopier::SetDeviceRateLimit(const std::wstring& path, long long bytesPerSecond)
+{
+    unsigned long long deviceId = 0;
+    if (!m_backend->GetDeviceId(path, &deviceId))
         return false;
-    }
 
+    m_rateLimiter.SetDeviceRate(deviceId, bytesPerSecond);
     return true;
 }
 
+// Get the cap on reads and writes on a device
+long long FileCopier::GetDeviceRateLimit(const std::wstring& path) const
+{
+    unsigned long long deviceId = 0;
+    if (!m_backend->GetDeviceId(path, &deviceId))
+        return 0;
+    return m_rateLimiter.GetDeviceRate(deviceId);
+}
 
-// Cancel the copy operation
-void FileCopier::Cancel()
+// Set the number of packets kept in flight per worker
+void FileCopier::SetQueueDepth(int queueDepth)
 {
-    if (m_operationInProgress && m_thread && m_cancelEvent)
-    {
-        // Signal the cancel event
-        SetEvent(m_cancelEvent);
+    // Don't change the depth during an operation
+    if (m_operationInProgress)
+        return;
 
-        // Wait for thread to exit (with timeout)
-        if (WaitForSingleObject(m_thread, 5000) == WAIT_TIMEOUT)
-        {
-            // Force terminate the thread if it doesn't exit gracefully
-#pragma warning(suppress: 6258) // Intentional force termination after timeout
-            TerminateThread(m_thread, 1);
-        }
+    m_queueDepth = (std::max)(1, queueDepth);
+}
 
-        // Clean up
-        CloseHandle(m_thread);
-        m_thread = NULL;
-        m_operationInProgress = false;
-    }
+// Get the number of packets kept in flight per worker
+int FileCopier::GetQueueDepth() const
+{
+    return m_queueDepth;
 }
 
-// Check if a copy is in progress
-bool FileCopier::IsOperationInProgress() const
+// Set the number of copy worker threads (0 = one per source device)
+void FileCopier::SetThreadCount(int threadCount)
 {
-    return m_operationInProgress;
+    // Don't change the thread count during an operation
+    if (m_operationInProgress)
+        return;
+
+    m_threadCount = (std::max)(0, threadCount);
 }
 
-// Copy a single packet from source to destination
-bool FileCopier::CopyPacket(
-    const std::wstring& sourcePath,
-    HANDLE hDestFile,
-    LARGE_INTEGER offset,
-    DWORD packetSize,
-    int packetIndex,
-    BYTE* buffer)
+// Get the configured number of copy worker threads
+int FileCopier::GetThreadCount() const
 {
-    // Open the source file
-    HANDLE hSrcFile = CreateFile(
-        sourcePath.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        NULL,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
-        NULL);
+    return m_threadCount;
+}
 
-    if (hSrcFile == INVALID_HANDLE_VALUE)
-    {
-        return false;
-    }
+// Set the memory budget for packet buffers in automatic mode
+void FileCopier::SetMemoryBudget(long long bytes)
+{
+    // Don't change the budget during an operation
+    if (m_operationInProgress)
+        return;
 
-    // Seek to the correct position in the source file
-    if (SetFilePointerEx(hSrcFile, offset, NULL, FILE_BEGIN) == FALSE)
-    {
-        CloseHandle(hSrcFile);
-        return false;
-    }
+    m_memoryBudget = (std::max)(static_cast<long long>(MIN_AUTO_IO_SIZE), bytes);
+}
 
-    // Seek to the correct position in the destination file
-    if (SetFilePointerEx(hDestFile, offset, NULL, FILE_BEGIN) == FALSE)
-    {
-        CloseHandle(hSrcFile);
-        return false;
-    }
+// Get the memory budget for packet buffers
+long long FileCopier::GetMemoryBudget() const
+{
+    return m_memoryBudget;
+}
 
-    // Read from source and write to destination in chunks for better memory management
-    bool success = true;
-    DWORD totalBytesRead = 0;
+// Enable or disable unbuffered I/O
+void FileCopier::SetDirectIo(bool enable)
+{
+    // Don't change the I/O mode during an operation
+    if (m_operationInProgress)
+        return;
 
-    while (totalBytesRead < packetSize)
-    {
-        // Check for cancel event
-        if (WaitForSingleObject(m_cancelEvent, 0) == WAIT_OBJECT_0)
-        {
-            success = false;
-            break;
-        }
+    m_directIo = enable;
+}
+
+// Check whether unbuffered I/O is enabled
+bool FileCopier::GetDirectIo() const
+{
+    return m_directIo;
+}
 
-        // Calculate chunk size (using our fixed buffer)
-        DWORD chunkSize = min(BUFFER_SIZE, packetSize - totalBytesRead);
+// Set the share of reads that may be hedged
+void FileCopier::SetHedgeRate(double rate)
+{
+    // Don't change the read policy during an operation
+    if (m_operationInProgress)
+        return;
 
-        // Read from source
-        DWORD bytesRead = 0;
-        if (!ReadFile(hSrcFile, buffer, chunkSize, &bytesRead, NULL) || bytesRead == 0)
-        {
-            success = false;
-            break;
-        }
+    m_hedgeRate = (std::max)(0.0, (std::min)(rate, 1.0));
+}
 
-        // Write to destination
-        DWORD bytesWritten = 0;
-        if (!WriteFile(hDestFile, buffer, bytesRead, &bytesWritten, NULL) || bytesWritten != bytesRead)
-        {
-            success = false;
-            break;
-        }
+// Get the share of reads that may be hedged
+double FileCopier::GetHedgeRate() const
+{
+    return m_hedgeRate;
+}
 
-        totalBytesRead += bytesRead;
+// Get the number of hedged reads of the last copy
+long long FileCopier::GetHedgedReadCount() const
+{
+    return m_hedgedReads;
+}
 
-        // If we read less than requested, we've reached the end of the file
-        if (bytesRead < chunkSize)
-            break;
-    }
+// Enable or disable replica verification
+void FileCopier::SetVerifyReplicas(bool enable)
+{
+    // Don't change the checks during an operation
+    if (m_operationInProgress)
+        return;
 
-    // Close the source file
-    CloseHandle(hSrcFile);
+    m_verifyReplicas = enable;
+}
 
-    return success;
+// Check if replicas are verified
+bool FileCopier::GetVerifyReplicas() const
+{
+    return m_verifyReplicas;
 }
 
-// Add a source file with additional information
-void FileCopier::AddSourceWithInfo(const SourceInfo& info)
+// Enable or disable resuming interrupted copies
+void FileCopier::SetResume(bool enable)
 {
-    // Don't modify sources during an operation
+    // Don't change the journaling during an operation
     if (m_operationInProgress)
         return;
 
-    // Check if source already exists
-    for (const auto& source : m_sources)
-    {
-        if (_wcsicmp(source.path.c_str(), info.path.c_str()) == 0)
-            return;  // Source already exists
-    }
+    m_resume = enable;
+}
 
-    // Add the source with provided info
-    m_sources.push_back(info);
+// Check if interrupted copies are resumed
+bool FileCopier::GetResume() const
+{
+    return m_resume;
 }
 
-// Recursively add files from a directory
-int FileCopier::AddSourceDirectory(const std::wstring& directoryPath, bool recursive)
+// Enable or disable delta sync
+void FileCopier::SetDeltaSync(bool enable)
 {
-    int filesAdded = 0;
-    std::wstring searchPath = directoryPath;
+    // Don't change the write policy during an operation
+    if (m_operationInProgress)
+        return;
 
-    // Ensure path ends with backslash
-    if (!searchPath.empty() && searchPath.back() != L'\\')
-        searchPath += L'\\';
+    m_deltaSync = enable;
+}
 
-    // Search for all files in the directory
-    WIN32_FIND_DATA findData;
-    HANDLE hFind = FindFirstFile((searchPath + L"*").c_str(), &findData);
+// Check if existing destinations are updated in place
+bool FileCopier::GetDeltaSync() const
+{
+    return m_deltaSync;
+}
 
-    if (hFind != INVALID_HANDLE_VALUE)
-    {
-        do {
-            // Skip . and .. directories
-            if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
-                continue;
+// Enable or disable sparse copying
+void FileCopier::SetSparseFiles(bool enable)
+{
+    // Don't change the copy plan during an operation
+    if (m_operationInProgress)
+        return;
 
-            std::wstring fullPath = searchPath + findData.cFileName;
+    m_sparseFiles = enable;
+}
 
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-            {
-                // Recursively process subdirectories if recursive flag is set
-                if (recursive)
-                    filesAdded += AddSourceDirectory(fullPath, recursive);
-            }
-            else
-            {
-                // It's a file, add it to our sources
-                AddSource(fullPath);
-                filesAdded++;
-            }
-        } while (FindNextFile(hFind, &findData));
+// Check if holes in sparse sources are kept
+bool FileCopier::GetSparseFiles() const
+{
+    return m_sparseFiles;
+}
 
-        FindClose(hFind);
-    }
+// Enable or disable zero block skipping
+void FileCopier::SetSkipZeroBlocks(bool enable)
+{
+    // Don't change the write policy during an operation
+    if (m_operationInProgress)
+        return;
 
-    return filesAdded;
+    m_skipZeroBlocks = enable;
 }
 
-void FileCopier::DoCopyOperation()
+// Check if all-zero blocks are left as holes
+bool FileCopier::GetSkipZeroBlocks() const
 {
-    // Create the destination directory if it doesn't exist
-    if (!CreateDirectory(m_destinationPath.c_str(), NULL))
-    {
-        // Check if the error was because the directory already exists
-        if (GetLastError() != ERROR_ALREADY_EXISTS)
-        {
-            // Directory creation failed and it doesn't exist
-            EnterCriticalSection(&m_cs);
-            m_operationInProgress = false;
-            LeaveCriticalSection(&m_cs);
-            return;
-        }
-    }
+    return m_skipZeroBlocks;
+}
 
-    // Process each source file
-    int totalFilesCount = static_cast<int>(m_sources.size());
-    int completedFilesCount = 0;
-    bool allSuccess = true;
+// Set the files a spinning disk may serve at once
+void FileCopier::SetRotationalStreams(int streams)
+{
+    // Don't change the limits during an operation
+    if (m_operationInProgress)
+        return;
 
-    for (size_t sourceIndex = 0; sourceIndex < m_sources.size(); sourceIndex++)
-    {
-        const std::wstring& sourcePath = m_sources[sourceIndex].path;
+    m_rotationalStreams = (std::max)(1, streams);
+}
 
-        // Extract filename from the current source
-        const wchar_t* fileName = PathFindFileName(sourcePath.c_str());
-        if (!fileName || !*fileName)
-            continue;
+// Get the files a spinning disk may serve at once
+int FileCopier::GetRotationalStreams() const
+{
+    return m_rotationalStreams;
+}
 
-        // Create destination file path for this source
-        std::wstring destinationFilename = m_destinationPath + fileName;
+// Set the files an SSD may serve at once
+void FileCopier::SetSolidStateStreams(int streams)
+{
+    // Don't change the limits during an operation
+    if (m_operationInProgress)
+        return;
 
-        // Get file size for this source
-        WIN32_FILE_ATTRIBUTE_DATA fileInfo;
-        LARGE_INTEGER fileSize = { 0 };
-        if (!GetFileAttributesEx(sourcePath.c_str(), GetFileExInfoStandard, &fileInfo))
-            continue;
+    m_solidStateStreams = (std::max)(1, streams);
+}
 
-        fileSize.HighPart = fileInfo.nFileSizeHigh;
-        fileSize.LowPart = fileInfo.nFileSizeLow;
+// Get the files an SSD may serve at once
+int FileCopier::GetSolidStateStreams() const
+{
+    return m_solidStateStreams;
+}
 
-        // Create the destination file
-        HANDLE hDestFile = CreateFile(
-            destinationFilename.c_str(),
-            GENERIC_WRITE,
-            0,  // No sharing
-            NULL,
-            CREATE_ALWAYS,
-            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
-            NULL);
+// Get the byte and file counts of the copy
+CopyProgress FileCopier::GetProgress() const
+{
+    ProgressCounters::Totals done = m_progress.Sample();
+    CopyProgress progress;
+    progress.logicalBytes = done.logicalBytes;
+    progress.logicalTotal = m_logicalTotal;
+    progress.physicalBytes = done.physicalBytes;
+    progress.physicalTotal = m_physicalTotal;
+    progress.filesDone = done.files;
+    progress.filesTotal = m_filesTotal;
+    progress.packetsDone = done.packets;
+    progress.packetsTotal = m_totalPackets;
+
+    // Rate over the whole copy, so it holds still once the copy is over
+    double startTime = m_startTime.load();
+    double finishTime = m_finishTime.load();
+    double end = finishTime > 0.0 ? finishTime : SteadySeconds();
+    double elapsed = end - startTime;
+    progress.filesPerSecond = startTime > 0.0 && elapsed > 0.0 ? progress.filesDone / elapsed : 0.0;
+    return progress;
+}
 
-        if (hDestFile == INVALID_HANDLE_VALUE)
-            continue;
+// Get the metrics of every copy so far
+MetricsSnapshot FileCopier::GetMetrics() const
+{
+    MetricsSnapshot snapshot = m_metrics.GetSnapshot();
 
-        // Pre-allocate the destination file for better performance
-        LARGE_INTEGER distPos = { 0 };
-        SetFilePointerEx(hDestFile, fileSize, NULL, FILE_BEGIN);
-        SetEndOfFile(hDestFile);
-        SetFilePointerEx(hDestFile, distPos, NULL, FILE_BEGIN);
+    // The pool of the current (or last) job
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_bufferPool)
+    {
+        snapshot.buffersAllocated = static_cast<long long>(m_bufferPool->GetAllocatedCount());
+        snapshot.buffersInUse = static_cast<long long>(m_bufferPool->GetInUseCount());
+        snapshot.bufferSize = static_cast<long long>(m_bufferPool->GetBufferSize());
+    }
+    return snapshot;
+}
 
-        // Calculate number of packets for this file
-        int filePackets = static_cast<int>((fileSize.QuadPart + m_packetSize - 1) / m_packetSize);
+// Write the metrics to a file while copying
+void FileCopier::SetMetricsFile(const std::wstring& path, MetricsFormat format, int intervalMs)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_metricsPath = path;
+    m_metricsFormat = format;
+    m_metricsIntervalMs = (std::max)(PROGRESS_INTERVAL_MS, intervalMs);
+}
 
-        // Update total packets for progress
-        m_totalPackets = filePackets;
-        m_completedPackets = 0;
+// Write the metrics to a file now
+bool FileCopier::WriteMetricsFile(const std::wstring& path, MetricsFormat format) const
+{
+    return CopyMetrics::WriteFile(path, CopyMetrics::Format(GetMetrics(), format));
+}
 
-        // Copy the file in packets
-        bool fileSuccess = true;
-        for (int i = 0; i < filePackets; i++)
-        {
-            // Check for cancel
-            if (WaitForSingleObject(m_cancelEvent, 0) == WAIT_OBJECT_0)
-            {
-                fileSuccess = false;
-                allSuccess = false;
-                break;
-            }
+// Enable or disable cloning on copy-on-write filesystems
+void FileCopier::SetCloneFiles(bool enable)
+{
+    // Don't change the copy path during an operation
+    if (m_operationInProgress)
+        return;
 
-            LARGE_INTEGER offset;
-            offset.QuadPart = static_cast<LONGLONG>(i) * static_cast<LONGLONG>(m_packetSize);
+    m_cloneFiles = enable;
+}
 
-            // Calculate actual packet size (last packet might be smaller)
-            DWORD actualPacketSize = m_packetSize;
-            if (i == filePackets - 1 && fileSize.QuadPart > 0)
-            {
-                LONGLONG remaining = fileSize.QuadPart - offset.QuadPart;
-                if (remaining < actualPacketSize)
-                    actualPacketSize = static_cast<DWORD>(remaining);
-            }
+// Check whether cloning is enabled
+bool FileCopier::GetCloneFiles() const
+{
+    return m_cloneFiles;
+}
 
-            // Copy this packet
-            if (!CopyPacket(sourcePath, hDestFile, offset, actualPacketSize, i, m_buffer.get()))
-            {
-                fileSuccess = false;
-                allSuccess = false;
-                break;
-            }
+// Enable or disable kernel-side copying
+void FileCopier::SetZeroCopy(bool enable)
+{
+    // Don't change the copy path during an operation
+    if (m_operationInProgress)
+        return;
 
-            // Update progress
-            EnterCriticalSection(&m_cs);
-            m_completedPackets++;
-            int completed = m_completedPackets;
-            LeaveCriticalSection(&m_cs);
+    m_zeroCopy = enable;
+}
 
-            // Report progress per file
-            if (m_progressCallback)
-            {
-                m_progressCallback(completed, filePackets, m_userData);
-            }
-        }
+// Check whether kernel-side copying is enabled
+bool FileCopier::GetZeroCopy() const
+{
+    return m_zeroCopy;
+}
 
-        // Close the destination file
-        CloseHandle(hDestFile);
+// Do every file operation through a backend
+void FileCopier::SetIoBackend(const std::shared_ptr<IoBackend>& backend)
+{
+    // Handles of one backend mean nothing to another
+    if (m_operationInProgress)
+        return;
 
-        if (!fileSuccess)
-            break;
+    m_backend = backend ? backend : IoBackend::GetNative();
+    m_sourceHandles.SetBackend(m_backend);
+}
 
-        // Update completed files count
-        completedFilesCount++;
-    }
+// Backend every file operation goes through
+std::shared_ptr<IoBackend> FileCopier::GetIoBackend() const
+{
+    return m_backend;
+}
 
-    // Operation completed
-    EnterCriticalSection(&m_cs);
-    m_operationInProgress = false;
-    LeaveCriticalSection(&m_cs);
-}
\ No newline at end of file
+// How each file of the last copy was copied
+std::vector<FileCopyResult> FileCopier::GetFileResults() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_fileResults;
+}
+
+// Name of the asynchronous I/O backend used by the last copy
+std::wstring FileCopier::GetIoBackendName() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_ioBackendName;
+}
+
+// Start copying files
+bool FileCopier::StartCopy(
+    const std::wstring& destinationPath,
+    ProgressCallbackFunc progressCallback,
+    void* userData,
+    int packetSize)
+{
+    // Check if already in progress
+    if (m_operationInProgress)
+        return false;
+
+    // Check if we have sources (or a directory to scan for them)
+    if (m_sources.empty() && m_scanDirectory.empty())
+        return false;
+
+    // Set destination path
+    m_destinationPath = destinationPath;
+
+    // Ensure the destination path ends with a separator
+    if (!m_destinationPath.empty() && m_destinationPath.back() != PATH_SEPARATOR)
+        m_destinationPath += PATH_SEPARATOR;
+
+    // Store parameters (an automatic packet size is resolved when the job starts)
+    m_autoPacketSize = (packetSize == AUTO_PACKET_SIZE);
+    m_packetSize = m_autoPacketSize ? static_cast<int>(BUFFER_SIZE) : packetSize;
+    m_progressCallback = progressCallback;
+    m_userData = userData;
+
+    // Reset cancel flag
+    m_cancelRequested = false;
+
+    // Reap the thread of a previous operation that finished on its own
+    if (m_thread && m_thread->joinable())
+        m_thread->join();
+
+    // Set operation as in progress
+    m_operationInProgress = true;
+
+    // Create worker thread
+    try
+    {
+        m_thread = std::make_unique<boost::thread>([this]() { DoCopyOperation(); });
+    }
+    catch (const boost::thread_resource_error&)
+    {
+        m_operationInProgress = false;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Start copying a directory tree while it is scanned
+bool FileCopier::StartDirectoryCopy(
+    const std::wstring& sourceDirectory,
+    const std::wstring& destinationPath,
+    ProgressCallbackFunc progressCallback,
+    void* userData,
+    int packetSize)
+{
+    if (m_operationInProgress || sourceDirectory.empty())
+        return false;
+
+    // The copy thread picks the directory up and starts the scan
+    m_scanDirectory = sourceDirectory;
+    if (!StartCopy(destinationPath, progressCallback, userData, packetSize))
+    {
+        m_scanDirectory.clear();
+        return false;
+    }
+    return true;
+}
+
+// Cancel the copy operation
+void FileCopier::Cancel()
+{
+    if (m_operationInProgress && m_thread)
+    {
+        // Signal the cancel flag
+        m_cancelRequested = true;
+
+        // Wait for thread to exit (with timeout)
+        if (!m_thread->try_join_for(boost::chrono::milliseconds(5000)))
+        {
+#ifdef _WIN32
+            // Force terminate the thread if it doesn't exit gracefully
+#pragma warning(suppress: 6258) // Intentional force termination after timeout
+            TerminateThread(m_thread->native_handle(), 1);
+            m_thread->detach();
+#else
+            // No safe way to kill a thread here, wait for the blocked read to return
+            m_thread->join();
+#endif
+        }
+
+        // Clean up
+        m_thread.reset();
+        m_operationInProgress = false;
+    }
+}
+
+// Check if a copy is in progress
+bool FileCopier::IsOperationInProgress() const
+{
+    return m_operationInProgress;
+}
+
+// Whether the last copy finished
+bool FileCopier::LastJobSucceeded() const
+{
+    return !m_jobFailed && !m_cancelRequested;
+}
+
+// Add a source file with additional information
+void FileCopier::AddSourceWithInfo(const SourceInfo& info)
+{
+    // Don't modify sources during an operation
+    if (m_operationInProgress)
+        return;
+
+    // Check if source already exists
+    if (!m_sourceKeys.insert(FileIo::GetPathKey(info.path)).second)
+        return;
+
+    // Add the source with provided info
+    m_sources.push_back(info);
+}
+
+// Path of a file under the directory it was found in
+static std::wstring GetRelativePath(const std::wstring& root, const std::wstring& path)
+{
+    if (root.empty() || path.compare(0, root.size(), root) != 0)
+        return FileIo::GetFileName(path);
+
+    size_t start = root.size();
+    while (start < path.size() && path[start] == PATH_SEPARATOR)
+        start++;
+    return path.substr(start);
+}
+
+// Directory a source was added from: its path without the relative path it
+// is copied to (the file's own directory for a file added on its own)
+static std::wstring GetSourceRoot(const std::wstring& path, const std::wstring& relativePath)
+{
+    size_t end = path.size() - FileIo::GetFileName(path).size();
+    if (relativePath.size() <= path.size() && path.compare(path.size() - relativePath.size(), relativePath.size(), relativePath) == 0)
+        end = path.size() - relativePath.size();
+
+    // Keep the separator of a root directory
+    while (end > 1 && path[end - 1] == PATH_SEPARATOR)
+        end--;
+    return path.substr(0, end);
+}
+
+// Directory being added by AddSourceDirectory
+struct DirectorySource {
+    FileCopier* copier;
+    std::wstring root;
+};
+
+// Add a batch of files found by AddSourceDirectory's scan
+static void AddScannedFiles(const std::vector<std::wstring>& paths, void* userData)
+{
+    DirectorySource* directory = static_cast<DirectorySource*>(userData);
+    for (const std::wstring& path : paths)
+    {
+        SourceInfo info;
+        info.path = path;
+        info.status = L"Ready";
+        info.speed = 0;
+        info.relativePath = GetRelativePath(directory->root, path);
+        directory->copier->AddSourceWithInfo(info);
+    }
+}
+
+// Add the files of a directory tree
+int FileCopier::AddSourceDirectory(const std::wstring& directoryPath, bool recursive)
+{
+    // Don't modify sources during an operation
+    if (m_operationInProgress)
+        return 0;
+
+    // Batches arrive one at a time, so the source list needs no lock
+    DirectorySource directory = { this, directoryPath };
+    DirectoryScanner scanner(0, m_backend);
+    if (!scanner.Start(directoryPath, recursive, AddScannedFiles, &directory))
+        return 0;
+
+    scanner.Wait();
+    return static_cast<int>(scanner.GetFileCount());
+}
+
+// Group sources into the logical files to be written
+std::vector<ReplicaGroup> FileCopier::BuildReplicaGroups(const std::vector<SourceInfo>& sources)
+{
+    // Look up the file sizes first, spread over threads for large batches
+    std::vector<long long> sizes(sources.size(), -1);
+    ParallelFor(sources.size(), [&](size_t i) {
+        long long size = 0;
+        if (m_backend->GetSize(sources[i].path, &size))
+            sizes[i] = size;
+    });
+
+    // Where each source is written
+    std::vector<std::wstring> relativePaths(sources.size());
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        relativePaths[i] = sources[i].relativePath.empty() ? FileIo::GetFileName(sources[i].path) : sources[i].relativePath;
+    }
+
+    // Without replica mode every source is its own file
+    std::vector<ReplicaGroup> groups;
+    if (!m_replicaMode)
+    {
+        for (size_t i = 0; i < sources.size(); i++)
+        {
+            // Skip sources whose name or size can't be read
+            if (relativePaths[i].empty() || sizes[i] < 0)
+                continue;
+
+            ReplicaGroup group;
+            group.fileName = relativePaths[i];
+            group.fileSize = sizes[i];
+            group.paths.push_back(sources[i].path);
+            groups.push_back(group);
+        }
+        return groups;
+    }
+
+    // Fingerprint only the files another source could be a replica of
+    std::vector<uint64_t> fingerprints(sources.size(), 0);
+    if (m_fingerprintReplicas)
+    {
+        std::unordered_map<std::wstring, int> candidates;
+        std::vector<std::wstring> keys(sources.size());
+        for (size_t i = 0; i < sources.size(); i++)
+        {
+            if (!sources[i].group.empty() || sizes[i] < 0)
+                continue;
+            keys[i] = FileIo::GetPathKey(relativePaths[i]) + L"|" + std::to_wstring(sizes[i]);
+            candidates[keys[i]]++;
+        }
+
+        ParallelFor(sources.size(), [&](size_t i) {
+            if (!keys[i].empty() && candidates.at(keys[i]) > 1)
+                fingerprints[i] = ReplicaCatalog::Fingerprint(*m_backend, sources[i].path, sizes[i]);
+        });
+    }
+
+    ReplicaCatalog catalog;
+    std::unordered_set<std::wstring> mismatchedKeys;
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        if (relativePaths[i].empty() || sizes[i] < 0)
+            continue;
+
+        // An explicitly grouped source with a different size can't be a replica, skip it
+        if (!catalog.Add(sources[i].path, relativePaths[i], sizes[i], fingerprints[i], sources[i].group))
+            mismatchedKeys.insert(FileIo::GetPathKey(sources[i].path));
+    }
+
+    // Copies that lost to the majority version of their file are left out
+    std::vector<std::wstring> diverged;
+    groups = catalog.TakeGroups(&diverged);
+    if (!diverged.empty() || !mismatchedKeys.empty())
+    {
+        std::unordered_set<std::wstring> divergedKeys;
+        for (const std::wstring& path : diverged)
+        {
+            divergedKeys.insert(FileIo::GetPathKey(path));
+        }
+
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (SourceInfo& source : m_sources)
+        {
+            std::wstring key = FileIo::GetPathKey(source.path);
+            if (divergedKeys.count(key))
+                source.status = L"Differs from other replicas";
+            else if (mismatchedKeys.count(key))
+                source.status = L"Size differs from its group";
+        }
+    }
+
+    return groups;
+}
+
+// Per-file state shared by the copy workers
+struct CopyFileState {
+    size_t index;                                    // Index of the file in the job
+    ReplicaGroup group;                              // Replicas and size
+    std::wstring destinationPath;                    // Full destination file path
+    int packetCount;                                 // Packets in the file
+    FileHandle destination;                          // Opened by the first worker to need it
+    bool opened;                                     // Destination has been opened
+    boost::mutex mutex;                              // Guards opening and closing the destination
+    std::atomic<int> remainingPackets;               // Destination is closed when this reaches zero
+    std::unique_ptr<std::atomic<bool>[]> replicaFailed;   // Per replica: has failed
+    std::vector<size_t> replicaSource;               // Per replica: source device in the selector
+    std::vector<char> replicaGranted;                // Per replica: device stream held (empty = all)
+    std::vector<std::shared_ptr<TokenBucket>> replicaRates;   // Per replica: rate limit of its source, if any
+    std::vector<IoMetrics*> replicaMetrics;          // Per replica: metrics of its source root
+    int copyMethod;                                  // First kernel copy method the file may use
+    std::atomic<unsigned> methodsUsed;               // Bit per KernelCopyMethod that copied data
+    bool cloned;                                     // Cloned from a replica, nothing to copy
+    bool verified;                                   // Replicas have been compared
+    std::unique_ptr<ReplicaVerifier> verifier;       // Sample hashes of the majority, if compared
+    std::unique_ptr<CopyJournal> journal;            // Finished packets, for resuming (large files only)
+    int resumedPackets;                              // Packets done by an interrupted copy
+    bool delta;                                      // Destination exists; write only changed blocks
+    std::atomic<long long> unchangedBytes;           // Bytes delta sync left in place
+    std::atomic<long long> zeroBytes;                // Bytes of all-zero blocks not written
+    bool sparse;                                     // Source has holes
+    bool small;                                      // Copied whole by a small-file thread
+    std::vector<FileRange> dataRanges;               // Data ranges of a sparse source
+};
+
+// Length of one of a file's packets
+static long long GetPacketLength(const CopyFileState& file, int packet, int packetSize)
+{
+    long long offset = static_cast<long long>(packet) * packetSize;
+    return (std::min)(static_cast<long long>(packetSize), file.group.fileSize - offset);
+}
+
+// Check if a packet overlaps a data range of a sparse file
+static bool PacketHasData(const CopyFileState& file, int packet, int packetSize)
+{
+    if (!file.sparse)
+        return true;
+
+    // First range ending after the packet starts
+    long long start = static_cast<long long>(packet) * packetSize;
+    long long end = start + GetPacketLength(file, packet, packetSize);
+    auto range = std::upper_bound(file.dataRanges.begin(), file.dataRanges.end(), start,
+        [](long long value, const FileRange& r) { return value < r.offset + r.length; });
+    return range != file.dataRanges.end() && range->offset < end;
+}
+
+struct PacketSlot;
+
+// What a block of a chunk needs before the chunk is done
+enum BlockAction {
+    BLOCK_UNCHANGED,   // Delta sync: the destination already holds it
+    BLOCK_ZERO,        // All zeros over a hole; nothing to do
+    BLOCK_PUNCH,       // All zeros over old data; punch a hole
+    BLOCK_WRITE        // Write it
+};
+
+// One read of a packet; a hedged read has two lanes racing for the same range
+struct ReadLane {
+    PacketSlot* slot;                        // Slot the lane belongs to
+    uint8_t* buffer;                         // Data read by this lane (from the pool)
+    std::shared_ptr<PooledHandle> source;    // Replica handle, kept alive while in flight
+    size_t replica;                          // Index of the replica being read
+    uint32_t length;                         // Bytes asked for
+    boost::chrono::steady_clock::time_point started;  // When the read was queued
+    bool reading;                            // True while a read is in flight
+    bool abandoned;                          // Lost a hedged race; the result is thrown away
+};
+
+// A packet moving through a worker's asynchronous copy pipeline
+struct PacketSlot {
+    ReadLane lanes[2];                       // Main read and its hedge
+    int lane;                                // Lane whose replica and data the packet uses
+    CopyFileState* file;                     // File the packet belongs to
+    size_t fileIndex;                        // Index of that file in the job
+    int packetIndex;                         // Packet number in the file
+    long long offset;                        // Packet offset in the file
+    uint32_t length;                         // Packet length
+    uint32_t done;                           // Bytes already written
+    uint32_t chunk;                          // Bytes in the buffer for the current write
+    uint32_t paddedChunk;                    // chunk padded to the I/O alignment
+    uint32_t writeLength;                    // Length of the write in flight
+    uint8_t* compareBuffer;                  // Delta sync: what the destination holds (from the pool)
+    uint32_t compareLength;                  // Delta sync: bytes of the destination read
+    uint32_t scanned;                        // Bytes of the chunk already written or skipped
+    bool hedged;                             // The current read has been hedged
+    bool comparing;                          // Delta sync: destination read in flight
+    bool writing;                            // True while the write is in flight
+    bool releasing;                          // Finished with, waiting for an abandoned read
+    bool busy;                               // True while the slot holds a packet
+    bool deferring;                          // deferred waits for the rate limits
+    AsyncRequest deferred;                   // Read or write held back by the rate limits
+    boost::chrono::steady_clock::time_point deferredUntil;  // When deferred may be queued
+    double requestStarted;                   // When the write or destination read in flight was queued
+};
+
+// Map every replica of the current job to the device it lives on
+size_t FileCopier::AssignSourceDevices()
+{
+    // Look up every replica's device, spread over threads for large batches
+    // (a replica whose device can't be determined gets no entry)
+    std::vector<std::vector<std::pair<bool, unsigned long long>>> deviceIds(m_files.size());
+    ParallelFor(m_files.size(), [&](size_t i) {
+        for (const std::wstring& path : m_files[i]->group.paths)
+        {
+            unsigned long long deviceId = 0;
+            bool known = m_backend->GetDeviceId(path, &deviceId);
+            deviceIds[i].push_back(std::make_pair(known, deviceId));
+        }
+    });
+
+    m_sourceDevices.clear();
+    for (size_t i = 0; i < m_files.size(); i++)
+    {
+        CopyFileState& file = *m_files[i];
+        file.replicaSource.resize(file.group.paths.size());
+
+        for (size_t r = 0; r < file.group.paths.size(); r++)
+        {
+            // A replica whose device can't be determined counts as its own
+            size_t index = m_sourceDevices.size();
+            if (deviceIds[i][r].first)
+                index = std::find(m_sourceDevices.begin(), m_sourceDevices.end(), deviceIds[i][r]) - m_sourceDevices.begin();
+
+            if (index == m_sourceDevices.size())
+                m_sourceDevices.push_back(deviceIds[i][r]);
+
+            file.replicaSource[r] = index;
+        }
+    }
+
+    return m_sourceDevices.size();
+}
+
+// Get the unbuffered I/O alignment every source and the destination accept
+uint32_t FileCopier::GetJobIoAlignment() const
+{
+    // Every alignment is a power of two, so the largest satisfies them all
+    uint32_t alignment = 512;
+    uint32_t deviceAlignment = 0;
+    if (m_backend->GetIoAlignment(m_destinationPath, &deviceAlignment))
+        alignment = (std::max)(alignment, deviceAlignment);
+
+    // One file per source device is enough
+    std::vector<bool> seen;
+    for (const auto& file : m_files)
+    {
+        for (size_t r = 0; r < file->group.paths.size(); r++)
+        {
+            size_t device = file->replicaSource[r];
+            if (device >= seen.size())
+                seen.resize(device + 1, false);
+            if (seen[device])
+                continue;
+
+            seen[device] = true;
+            if (m_backend->GetIoAlignment(file->group.paths[r], &deviceAlignment))
+                alignment = (std::max)(alignment, deviceAlignment);
+        }
+    }
+
+    return alignment;
+}
+
+// Build the per-device stream limits of the current job
+std::vector<int> FileCopier::GetDeviceStreamLimits(size_t deviceCount, size_t* destinationDevice) const
+{
+    // One replica path per source device is enough to look it up
+    std::vector<const std::wstring*> devicePaths(deviceCount, nullptr);
+    for (const auto& file : m_files)
+    {
+        for (size_t r = 0; r < file->group.paths.size(); r++)
+        {
+            if (!devicePaths[file->replicaSource[r]])
+                devicePaths[file->replicaSource[r]] = &file->group.paths[r];
+        }
+    }
+
+    auto getLimit = [&](const std::wstring& path) {
+        switch (m_backend->GetDeviceKind(path))
+        {
+        case DEVICE_KIND_ROTATIONAL:
+            return m_rotationalStreams;
+        case DEVICE_KIND_SOLID_STATE:
+            return m_solidStateStreams;
+        default:
+            return UNKNOWN_DEVICE_STREAMS;
+        }
+    };
+
+    std::vector<int> limits(deviceCount, UNKNOWN_DEVICE_STREAMS);
+    for (size_t d = 0; d < deviceCount; d++)
+    {
+        if (devicePaths[d] && m_sourceDevices[d].first)
+            limits[d] = getLimit(*devicePaths[d]);
+    }
+
+    // Reading and writing the same disk is still one stream on it
+    unsigned long long destinationId = 0;
+    if (m_backend->GetDeviceId(m_destinationPath, &destinationId))
+    {
+        for (size_t d = 0; d < deviceCount; d++)
+        {
+            if (m_sourceDevices[d].first && m_sourceDevices[d].second == destinationId)
+            {
+                *destinationDevice = d;
+                return limits;
+            }
+        }
+    }
+
+    *destinationDevice = deviceCount;
+    limits.push_back(getLimit(m_destinationPath));
+    return limits;
+}
+
+// Hand the files let in by the stream limiter to the workers
+void FileCopier::ScheduleAdmitted(const std::vector<StreamAdmission>& admitted)
+{
+    for (const StreamAdmission& admission : admitted)
+    {
+        // Read only from the devices the file holds streams on
+        CopyFileState& file = *m_files[admission.file];
+        file.replicaGranted.assign(file.group.paths.size(), 0);
+        for (size_t r = 0; r < file.group.paths.size(); r++)
+        {
+            file.replicaGranted[r] = std::find(admission.devices.begin(), admission.devices.end(),
+                file.replicaSource[r]) != admission.devices.end();
+        }
+
+        ScheduleFile(admission.file);
+    }
+}
+
+// Queue the packet runs of a file that still need copying
+void FileCopier::ScheduleFile(size_t index)
+{
+    CopyFileState& file = *m_files[index];
+
+    // Only the runs of packets that hold data and that an interrupted
+    // copy didn't finish
+    auto needsCopy = [&](int packet) {
+        return !(file.journal && file.journal->IsComplete(packet)) && PacketHasData(file, packet, m_packetSize);
+    };
+
+    int first = 0;
+    while (first < file.packetCount)
+    {
+        if (!needsCopy(first))
+        {
+            first++;
+            continue;
+        }
+
+        int last = first + 1;
+        while (last < file.packetCount && needsCopy(last))
+            last++;
+
+        PacketRange range = { index, first, last - first };
+        m_scheduler->Push(static_cast<int>(index % m_scheduler->GetWorkerCount()), range);
+        first = last;
+    }
+}
+
+// Open (once) and pre-allocate a file's destination
+bool FileCopier::OpenDestination(CopyFileState& file)
+{
+    boost::mutex::scoped_lock lock(file.mutex);
+    if (file.opened)
+        return file.destination != INVALID_FILE_HANDLE;
+
+    file.opened = true;
+
+    // Rule out diverged replicas before the first packet is read
+    VerifyReplicas(file);
+
+    // Create the destination file, keeping what an interrupted copy wrote
+    // or what delta sync compares against
+    double started = SteadySeconds();
+    if (file.resumedPackets > 0 || file.delta)
+        file.destination = m_backend->OpenForUpdate(file.destinationPath, m_directIo);
+    else
+        file.destination = m_backend->CreateForWrite(file.destinationPath, m_directIo);
+    m_destinationMetrics->OnOpen(file.destination != INVALID_FILE_HANDLE, SteadySeconds() - started);
+    if (file.destination == INVALID_FILE_HANDLE)
+        return false;
+
+    // Holes skipped in a sparse source or for zero blocks must stay holes
+    // (NTFS needs telling)
+    if (file.sparse || m_skipZeroBlocks)
+        m_backend->SetSparse(file.destination);
+
+    // Pre-allocate the destination file for better performance
+    m_backend->SetSize(file.destination, file.group.fileSize);
+    return true;
+}
+
+// Identify the source data of a file for its journal
+static JournalSource GetJournalSource(IoBackend& backend, const ReplicaGroup& group)
+{
+    JournalSource source = { group.fileSize, 0, 0 };
+
+    // A replica touched since the journal was written invalidates it
+    for (const std::wstring& path : group.paths)
+    {
+        long long modifiedTime = 0;
+        if (backend.GetModifiedTime(path, &modifiedTime))
+            source.modifiedTime = (std::max)(source.modifiedTime, modifiedTime);
+    }
+
+    // Catch a same-size rewrite that kept the timestamp too
+    std::vector<uint8_t> sample(ReplicaVerifier::SAMPLE_SIZE);
+    long long offset = ReplicaVerifier::GetSampleOffset(group.fileSize, 1);
+    uint32_t length = static_cast<uint32_t>((std::min)(group.fileSize - offset, static_cast<long long>(sample.size())));
+    for (const std::wstring& path : group.paths)
+    {
+        FileHandle handle = backend.OpenForRead(path);
+        if (handle == INVALID_FILE_HANDLE)
+            continue;
+
+        uint32_t bytesRead = 0;
+        bool success = backend.ReadAt(handle, offset, sample.data(), length, &bytesRead) && bytesRead == length;
+        backend.Close(handle);
+        if (success)
+        {
+            source.sampleHash = ReplicaVerifier::Hash(sample.data(), length);
+            break;
+        }
+    }
+    return source;
+}
+
+// Hash sampled blocks of a file's replicas and drop the ones that disagree
+void FileCopier::VerifyReplicas(CopyFileState& file)
+{
+    if (file.verified)
+        return;
+    file.verified = true;
+
+    // Nothing to compare a single replica with
+    if (!m_verifyReplicas || file.group.paths.size() < 2)
+        return;
+
+    file.verifier = std::make_unique<ReplicaVerifier>(file.group.fileSize);
+    std::vector<bool> diverged = file.verifier->Verify(*m_backend, file.group.paths);
+    for (size_t r = 0; r < diverged.size(); r++)
+    {
+        if (diverged[r])
+        {
+            file.replicaFailed[r] = true;
+            MarkReplicaDiverged(file.group.paths[r]);
+        }
+    }
+}
+
+// Find the data ranges of a sparse source and count the packets in holes
+int FileCopier::MapSparseFile(CopyFileState& file)
+{
+    file.sparse = false;
+    file.dataRanges.clear();
+
+    // Replicas hold the same data, so any of them can describe the holes
+    std::vector<FileRange> ranges;
+    bool mapped = false;
+    for (size_t r = 0; r < file.group.paths.size() && !mapped; r++)
+    {
+        mapped = m_backend->GetDataRanges(file.group.paths[r], file.group.fileSize, ranges);
+    }
+
+    long long dataBytes = 0;
+    for (const FileRange& range : ranges)
+    {
+        dataBytes += range.length;
+    }
+    if (!mapped || dataBytes >= file.group.fileSize)
+        return 0;
+
+    file.sparse = true;
+    file.dataRanges.swap(ranges);
+
+    std::vector<int> holes;
+    for (int packet = 0; packet < file.packetCount; packet++)
+    {
+        if (!PacketHasData(file, packet, m_packetSize) && !(file.journal && file.journal->IsComplete(packet)))
+            holes.push_back(packet);
+    }
+
+    // Delta sync must clear the old data where the source has holes
+    if (file.delta && !holes.empty())
+    {
+        FileHandle destination = m_backend->OpenForUpdate(file.destinationPath);
+        bool punched = destination != INVALID_FILE_HANDLE && m_backend->SetSparse(destination);
+        for (size_t i = 0; punched && i < holes.size(); i++)
+        {
+            punched = m_backend->PunchHole(destination, static_cast<long long>(holes[i]) * m_packetSize,
+                GetPacketLength(file, holes[i], m_packetSize));
+        }
+        m_backend->Close(destination);
+
+        // Copy the zeros instead if the filesystem can't punch holes
+        if (!punched)
+        {
+            file.sparse = false;
+            file.dataRanges.clear();
+            return 0;
+        }
+    }
+
+    return static_cast<int>(holes.size());
+}
+
+// Report a diverged replica in its source status
+void FileCopier::MarkReplicaDiverged(const std::wstring& path)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (SourceInfo& source : m_sources)
+    {
+        if (FileIo::SamePath(source.path, path))
+            source.status = L"Differs from other replicas";
+    }
+}
+
+// Charge a read of a replica to the rate limits
+double FileCopier::ReserveRead(const CopyFileState& file, size_t replica, long long bytes)
+{
+    TokenBucket* buckets[] = { &m_rateLimiter.GetReadBucket(), file.replicaRates[replica].get(),
+        m_deviceRates[file.replicaSource[replica]].get() };
+    return RateLimiter::Reserve(buckets, 3, bytes);
+}
+
+// Charge a write to the destination to the rate limits
+double FileCopier::ReserveWrite(long long bytes)
+{
+    TokenBucket* buckets[] = { &m_rateLimiter.GetWriteBucket(), m_destinationRate.get() };
+    return RateLimiter::Reserve(buckets, 2, bytes);
+}
+
+// Charge a read of the destination (delta sync) to the rate limits
+double FileCopier::ReserveDestinationRead(long long bytes)
+{
+    TokenBucket* buckets[] = { &m_rateLimiter.GetReadBucket(), m_destinationRate.get() };
+    return RateLimiter::Reserve(buckets, 2, bytes);
+}
+
+// Seconds until the rate limits would let a read of a replica through
+double FileCopier::GetReadWait(const CopyFileState& file, size_t replica)
+{
+    TokenBucket* buckets[] = { &m_rateLimiter.GetReadBucket(), file.replicaRates[replica].get(),
+        m_deviceRates[file.replicaSource[replica]].get() };
+    return RateLimiter::GetWait(buckets, 3);
+}
+
+// Seconds until the rate limits would let a write to the destination through
+double FileCopier::GetWriteWait()
+{
+    TokenBucket* buckets[] = { &m_rateLimiter.GetWriteBucket(), m_destinationRate.get() };
+    return RateLimiter::GetWait(buckets, 2);
+}
+
+// Sleep off a rate limit wait
+void FileCopier::WaitForRate(double seconds)
+{
+    if (seconds > 0.0)
+        m_metrics.OnStall(STALL_RATE_LIMIT, seconds);
+
+    // Short steps, so a cancel isn't held up by a low limit
+    boost::chrono::steady_clock::time_point until = boost::chrono::steady_clock::now() +
+        boost::chrono::duration_cast<boost::chrono::steady_clock::duration>(boost::chrono::duration<double>(seconds));
+    while (!m_cancelRequested)
+    {
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        if (now >= until)
+            break;
+        boost::this_thread::sleep_for((std::min)(boost::chrono::duration_cast<boost::chrono::steady_clock::duration>(until - now),
+            boost::chrono::duration_cast<boost::chrono::steady_clock::duration>(boost::chrono::milliseconds(50))));
+    }
+}
+
+// Record an open of a replica
+void FileCopier::RecordOpen(const CopyFileState& file, size_t replica, bool success, double seconds)
+{
+    file.replicaMetrics[replica]->OnOpen(success, seconds);
+    m_deviceMetrics[file.replicaSource[replica]]->OnOpen(success, seconds);
+}
+
+// Record a read of a replica
+void FileCopier::RecordRead(const CopyFileState& file, size_t replica, bool success, long long bytes, double seconds)
+{
+    file.replicaMetrics[replica]->OnRead(success, bytes, seconds);
+    m_deviceMetrics[file.replicaSource[replica]]->OnRead(success, bytes, seconds);
+}
+
+// Record a packet taken off a replica to be read again
+void FileCopier::RecordRetry(const CopyFileState& file, size_t replica)
+{
+    file.replicaMetrics[replica]->OnRetry();
+    m_deviceMetrics[file.replicaSource[replica]]->OnRetry();
+}
+
+// Account for a finished packet, closing the destination after its last one
+void FileCopier::FinishPacket(CopyFileState& file, int packet, size_t shard)
+{
+    if (file.journal)
+        file.journal->MarkComplete(packet);
+
+    // Count it in this thread's shard; the reporter thread passes it on
+    long long length = GetPacketLength(file, packet, m_packetSize);
+    bool lastPacket = --file.remainingPackets == 0;
+    m_progress.Add(shard, 1, length, length, lastPacket ? 1 : 0);
+
+    if (lastPacket)
+    {
+        {
+            boost::mutex::scoped_lock lock(file.mutex);
+
+            // Unbuffered writes pad the tail to the alignment; trim it off
+            if (m_directIo)
+                m_backend->SetSize(file.destination, file.group.fileSize);
+
+            m_backend->Close(file.destination);
+            file.destination = INVALID_FILE_HANDLE;
+
+            // Nothing left to resume
+            if (file.journal)
+                file.journal->Remove();
+        }
+
+        // Its replicas aren't read again, so their handles don't count
+        // against the open file limit for the rest of the job
+        for (const std::wstring& path : file.group.paths)
+        {
+            m_sourceHandles.Invalidate(path);
+        }
+
+        // Its device streams go to the files waiting on them
+        std::vector<StreamAdmission> admitted;
+        m_streamLimiter->Release(file.index, admitted);
+        ScheduleAdmitted(admitted);
+    }
+    else if (file.journal && file.journal->IsFlushDue())
+    {
+        // Save a batch of finished packets; whoever holds the lock is
+        // either saving it already or closing the file
+        boost::mutex::scoped_lock lock(file.mutex, boost::try_to_lock);
+        if (lock.owns_lock() && file.destination != INVALID_FILE_HANDLE)
+            file.journal->Flush(file.destination);
+    }
+}
+
+// Reporter thread: pass the progress on until interrupted
+void FileCopier::RunProgressReporter()
+{
+    // The sleep is an interruption point, so stopping never waits a whole interval
+    double lastDump = SteadySeconds();
+    while (true)
+    {
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(PROGRESS_INTERVAL_MS));
+        ReportProgress();
+
+        int intervalMs;
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            intervalMs = m_metricsIntervalMs;
+        }
+        if (SteadySeconds() - lastDump >= intervalMs / 1000.0)
+        {
+            DumpMetrics();
+            lastDump = SteadySeconds();
+        }
+    }
+}
+
+// Write the metrics file, if one is set
+void FileCopier::DumpMetrics()
+{
+    std::wstring path;
+    MetricsFormat format;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        path = m_metricsPath;
+        format = m_metricsFormat;
+    }
+
+    // A file that can't be written now may be writable next time
+    if (!path.empty())
+        WriteMetricsFile(path, format);
+}
+
+// Pass the progress to the callback if it changed since the last report
+void FileCopier::ReportProgress()
+{
+    if (!m_progressCallback)
+        return;
+
+    // A batch adds to the total before its packets are done, so sampling
+    // the count first keeps it from running ahead of the total
+    long long completed = m_progress.Sample().packets;
+    long long total = m_totalPackets;
+    if (completed == m_reportedPackets && total == m_reportedTotal)
+        return;
+
+    m_reportedPackets = completed;
+    m_reportedTotal = total;
+    m_progressCallback(completed, total, m_userData);
+}
+
+// Read or write a whole range, retrying short transfers
+static bool TransferWhole(IoBackend& backend, FileHandle handle, bool write, long long offset, uint8_t* buffer, uint32_t length)
+{
+    uint32_t done = 0;
+    while (done < length)
+    {
+        uint32_t bytes = 0;
+        bool success = write ?
+            backend.WriteAt(handle, offset + done, buffer + done, length - done, &bytes) :
+            backend.ReadAt(handle, offset + done, buffer + done, length - done, &bytes);
+        if (!success || bytes == 0)
+            return false;
+        done += bytes;
+    }
+    return true;
+}
+
+// Small-file thread: copy whole files until there are none left
+void FileCopier::RunSmallFileWorker(const std::vector<size_t>& files, std::atomic<size_t>& next, size_t shard)
+{
+    uint8_t* buffer = m_bufferPool->Acquire();
+    uint8_t* compareBuffer = nullptr;
+    if (!buffer)
+    {
+        m_jobFailed = true;
+        return;
+    }
+
+    while (!m_cancelRequested && !m_jobFailed)
+    {
+        size_t i = next++;
+        if (i >= files.size())
+            break;
+
+        if (!CopySmallFile(*m_files[files[i]], buffer, compareBuffer, shard))
+            m_jobFailed = true;
+    }
+
+    m_bufferPool->Release(buffer);
+    m_bufferPool->Release(compareBuffer);
+}
+
+// Copy a file that fits in one buffer
+bool FileCopier::CopySmallFile(CopyFileState& file, uint8_t* buffer, uint8_t*& compareBuffer, size_t shard)
+{
+    uint32_t length = static_cast<uint32_t>(file.group.fileSize);
+
+    // Empty files just need creating
+    if (length == 0)
+    {
+        double started = SteadySeconds();
+        FileHandle destination = m_backend->CreateForWrite(file.destinationPath);
+        m_destinationMetrics->OnOpen(destination != INVALID_FILE_HANDLE, SteadySeconds() - started);
+        if (destination == INVALID_FILE_HANDLE)
+            return false;
+
+        m_backend->Close(destination);
+        m_progress.Add(shard, 0, 0, 0, 1);
+        return true;
+    }
+
+    // Rule out diverged replicas before reading, as the packet path does
+    VerifyReplicas(file);
+
+    // Read the whole file in one go from the replica on the device expected
+    // to answer soonest, falling back to the others
+    std::vector<size_t> healthy;
+    std::vector<size_t> candidates;
+    while (true)
+    {
+        healthy.clear();
+        candidates.clear();
+        for (size_t r = 0; r < file.group.paths.size(); r++)
+        {
+            if (!file.replicaFailed[r])
+            {
+                healthy.push_back(r);
+                candidates.push_back(file.replicaSource[r]);
+            }
+        }
+        if (healthy.empty())
+            return false;
+
+        size_t replica = healthy[m_selector->Select(candidates)];
+        size_t device = file.replicaSource[replica];
+        WaitForRate(ReserveRead(file, replica, length));
+
+        boost::chrono::steady_clock::time_point started = boost::chrono::steady_clock::now();
+        m_selector->OnReadStarted(device);
+
+        FileHandle source = m_backend->OpenForRead(file.group.paths[replica]);
+        double openSeconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - started).count();
+        RecordOpen(file, replica, source != INVALID_FILE_HANDLE, openSeconds);
+
+        bool success = source != INVALID_FILE_HANDLE && TransferWhole(*m_backend, source, false, 0, buffer, length);
+        m_backend->Close(source);
+
+        // The selector times the open too; it is part of what the device costs
+        double seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - started).count();
+        m_selector->OnReadFinished(device, success, success ? length : 0, seconds);
+        if (source != INVALID_FILE_HANDLE)
+            RecordRead(file, replica, success, success ? length : 0, seconds - openSeconds);
+
+        // A replica that changed since it was verified can't be trusted
+        if (success && file.verifier && !file.verifier->CheckRange(0, buffer, length))
+        {
+            MarkReplicaDiverged(file.group.paths[replica]);
+            success = false;
+        }
+
+        if (success)
+            break;
+        file.replicaFailed[replica] = true;
+        RecordRetry(file, replica);
+    }
+
+    // Delta sync: a destination that already holds the data is left alone
+    FileHandle destination;
+    bool unchanged = false;
+    double started = SteadySeconds();
+    if (file.delta)
+    {
+        destination = m_backend->OpenForUpdate(file.destinationPath);
+        m_destinationMetrics->OnOpen(destination != INVALID_FILE_HANDLE, SteadySeconds() - started);
+        if (!compareBuffer)
+            compareBuffer = m_bufferPool->Acquire();
+
+        long long existingSize = 0;
+        bool sameSize = destination != INVALID_FILE_HANDLE && compareBuffer &&
+            m_backend->GetSize(file.destinationPath, &existingSize) && existingSize == file.group.fileSize;
+        if (sameSize)
+        {
+            WaitForRate(ReserveDestinationRead(length));
+            started = SteadySeconds();
+            bool read = TransferWhole(*m_backend, destination, false, 0, compareBuffer, length);
+            m_destinationMetrics->OnRead(read, read ? length : 0, SteadySeconds() - started);
+            unchanged = read && memcmp(buffer, compareBuffer, length) == 0;
+        }
+    }
+    else
+    {
+        destination = m_backend->CreateForWrite(file.destinationPath);
+        m_destinationMetrics->OnOpen(destination != INVALID_FILE_HANDLE, SteadySeconds() - started);
+    }
+    if (destination == INVALID_FILE_HANDLE)
+        return false;
+
+    bool success = true;
+    if (unchanged)
+    {
+        file.unchangedBytes += length;
+    }
+    else
+    {
+        // Skipped zero blocks must read back as zeros: start from an empty
+        // file (NTFS needs telling to keep the holes)
+        if (m_skipZeroBlocks)
+        {
+            m_backend->SetSparse(destination);
+            if (file.delta)
+                success = m_backend->SetSize(destination, 0);
+        }
+
+        // Write the runs of blocks holding data
+        auto isZero = [&](uint32_t at) {
+            return m_skipZeroBlocks && ZeroDetector::IsZero(buffer + at, (std::min)(DELTA_BLOCK_SIZE, length - at));
+        };
+        for (uint32_t start = 0; success && start < length;)
+        {
+            bool zero = isZero(start);
+            uint32_t end = start + DELTA_BLOCK_SIZE;
+            while (end < length && isZero(end) == zero)
+                end += DELTA_BLOCK_SIZE;
+            end = (std::min)(end, length);
+
+            if (zero)
+            {
+                file.zeroBytes += end - start;
+            }
+            else
+            {
+                WaitForRate(ReserveWrite(end - start));
+                double writeStarted = SteadySeconds();
+                success = TransferWhole(*m_backend, destination, true, start, buffer + start, end - start);
+                m_destinationMetrics->OnWrite(success, success ? end - start : 0, SteadySeconds() - writeStarted);
+            }
+            start = end;
+        }
+
+        // Set the final size: covers trailing zeros and cuts off a longer old file
+        success = success && m_backend->SetSize(destination, file.group.fileSize);
+    }
+
+    if (!success)
+    {
+        m_backend->Close(destination);
+        return false;
+    }
+
+    // Close the file and account for it like a one-packet copy
+    file.methodsUsed |= 1u << KERNEL_COPY_NONE;
+    file.opened = true;
+    file.destination = destination;
+    FinishPacket(file, 0, shard);
+    return true;
+}
+
+// Worker thread: copy packets from its own deque, stealing when it runs dry
+void FileCopier::RunCopyWorker(PacketScheduler& scheduler, int worker)
+{
+    // Hedged reads need room for a second read per slot
+    bool hedging = m_hedgeRate > 0.0;
+    std::unique_ptr<AsyncIoEngine> engine = AsyncIoEngine::Create(hedging ? m_queueDepth * 2 : m_queueDepth, m_backend);
+    if (!engine)
+    {
+        m_jobFailed = true;
+        return;
+    }
+
+    if (worker == 0)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_ioBackendName = engine->GetName();
+    }
+
+    // One slot per packet in flight; each packet is a read followed by a write
+    int engineDepth = engine->GetQueueDepth();
+    int depth = hedging ? (std::max)(1, engineDepth / 2) : engineDepth;
+    uint32_t bufferSize = static_cast<uint32_t>(m_bufferPool->GetBufferSize());
+    std::vector<PacketSlot> slots(depth);
+    std::vector<AsyncCompletion> completions(engineDepth);
+    for (PacketSlot& slot : slots)
+    {
+        slot.lanes[0].slot = &slot;
+        slot.lanes[1].slot = &slot;
+    }
+
+    // Packets taken from the scheduler but not started yet
+    PacketRange current = { 0, 0, 0 };
+
+    // Healthy replicas of the file being scheduled and their devices
+    std::vector<size_t> healthy;
+    std::vector<size_t> candidates;
+
+    int active = 0;
+    int inFlight = 0;
+    bool stopping = false;
+
+    // Stop this worker and tell the others to stop too
+    auto fail = [&]() {
+        m_jobFailed = true;
+        stopping = true;
+    };
+
+    // Queue a request on the engine, counting it in flight
+    auto submit = [&](const AsyncRequest& request) -> bool {
+        if (!engine->Submit(request))
+            return false;
+
+        inFlight++;
+        m_metrics.AddRequestsInFlight(1);
+        return true;
+    };
+
+    // Pick the healthy replica (other than exclude) whose device is expected
+    // to serve a read soonest, going by live throughput
+    // Returns false if no replica can be opened
+    auto pickReplica = [&](CopyFileState& file, size_t exclude, size_t* replica, std::shared_ptr<PooledHandle>* source) -> bool {
+        const std::vector<std::wstring>& replicas = file.group.paths;
+        while (true)
+        {
+            healthy.clear();
+            candidates.clear();
+
+            // Only replicas on devices the file holds a stream on, so a
+            // spinning disk isn't pulled away from the file it's serving;
+            // a packet whose granted replicas all failed may use any other,
+            // but hedges never do
+            bool hedge = exclude < replicas.size();
+            for (int pass = 0; pass < (hedge ? 1 : 2) && healthy.empty(); pass++)
+            {
+                for (size_t r = 0; r < replicas.size(); r++)
+                {
+                    if (pass == 0 && !file.replicaGranted.empty() && !file.replicaGranted[r])
+                        continue;
+                    if (!file.replicaFailed[r] && r != exclude)
+                    {
+                        healthy.push_back(r);
+                        candidates.push_back(file.replicaSource[r]);
+                    }
+                }
+            }
+            if (healthy.empty())
+                return false;
+
+            *replica = healthy[m_selector->Select(candidates)];
+            bool opened = false;
+            double started = SteadySeconds();
+            *source = m_sourceHandles.Acquire(replicas[*replica], &opened);
+            if (opened)
+                RecordOpen(file, *replica, *source != nullptr, SteadySeconds() - started);
+            if (*source)
+                return true;
+
+            file.replicaFailed[*replica] = true;
+        }
+    };
+
+    // Queue a read for a lane, timing it from now
+    auto submitRead = [&](ReadLane& lane, const AsyncRequest& request) -> bool {
+        lane.started = boost::chrono::steady_clock::now();
+        if (!submit(request))
+            return false;
+
+        m_selector->OnReadStarted(lane.slot->file->replicaSource[lane.replica]);
+        return true;
+    };
+
+    // Hold a request back in its slot until the rate limits let it through
+    auto defer = [&](PacketSlot& slot, const AsyncRequest& request, double wait) {
+        slot.deferred = request;
+        slot.deferredUntil = boost::chrono::steady_clock::now() +
+            boost::chrono::duration_cast<boost::chrono::steady_clock::duration>(boost::chrono::duration<double>(wait));
+        slot.deferring = true;
+        m_metrics.OnStall(STALL_RATE_LIMIT, wait);
+    };
+
+    // Queue a read of the rest of a slot's packet on one of its lanes
+    auto issueRead = [&](PacketSlot& slot, int laneIndex) -> bool {
+        ReadLane& lane = slot.lanes[laneIndex];
+        size_t device = slot.file->replicaSource[lane.replica];
+
+        AsyncRequest request;
+        request.type = ASYNC_READ;
+        request.handle = lane.source->Get();
+        request.offset = slot.offset + slot.done;
+        request.buffer = lane.buffer;
+        request.userData = &lane;
+
+        // Use the tuned read size of the replica's device in automatic mode
+        uint32_t ioSize = bufferSize;
+        if (!m_tuners.empty())
+            ioSize = (std::min)(bufferSize, m_tuners[device]->GetIoSize());
+
+        // Only the file's tail can be unaligned; unbuffered reads round it up
+        // and come back short at end of file
+        request.length = (std::min)(ioSize, slot.length - slot.done);
+        request.length = static_cast<uint32_t>(AlignedBufferPool::AlignUp(request.length, m_ioAlignment));
+
+        lane.length = request.length;
+        lane.abandoned = false;
+
+        // A rate-limited read waits in the slot; hedges are only issued
+        // when the limits let them through at once
+        double wait = ReserveRead(*slot.file, lane.replica, request.length);
+        if (wait > 0.0 && laneIndex == slot.lane)
+        {
+            defer(slot, request, wait);
+            lane.reading = true;
+            m_readsIssued++;
+            return true;
+        }
+
+        if (!submitRead(lane, request))
+            return false;
+
+        lane.reading = true;
+        m_readsIssued++;
+        return true;
+    };
+
+    // Start (or continue) reading a slot's packet from its current replica
+    auto startRead = [&](PacketSlot& slot) -> bool {
+        slot.hedged = false;
+        slot.comparing = false;
+        slot.writing = false;
+        return issueRead(slot, slot.lane);
+    };
+
+    // Free a slot, or mark it to be freed once an abandoned read comes back
+    auto release = [&](PacketSlot& slot) {
+        if (slot.lanes[0].reading || slot.lanes[1].reading)
+        {
+            slot.releasing = true;
+            return;
+        }
+
+        slot.lanes[0].source.reset();
+        slot.lanes[1].source.reset();
+        slot.releasing = false;
+        slot.busy = false;
+        active--;
+    };
+
+    // Stop using a replica that failed
+    auto failReplica = [&](PacketSlot& slot, size_t replica) {
+        slot.file->replicaFailed[replica] = true;
+        m_sourceHandles.Invalidate(slot.file->group.paths[replica]);
+    };
+
+    // Release a slot whose read failed and hand the packet to the others
+    auto retryPacket = [&](PacketSlot& slot) {
+        RecordRetry(*slot.file, slot.lanes[slot.lane].replica);
+        PacketRange retry = { slot.fileIndex, slot.packetIndex, 1 };
+        scheduler.Push(worker, retry);
+        release(slot);
+    };
+
+    // Copy a slot's packet inside the kernel, stepping down through the
+    // methods the kernel refuses; returns false once the file (or its
+    // replica's device) has fallen back to buffered copying and the rest of
+    // the packet still needs reading
+    auto kernelCopy = [&](PacketSlot& slot) -> bool {
+        CopyFileState& file = *slot.file;
+        ReadLane& lane = slot.lanes[slot.lane];
+        size_t device = file.replicaSource[lane.replica];
+
+        while (slot.done < slot.length)
+        {
+            int method = (std::max)(file.copyMethod, m_deviceCopyMethods[device].load());
+            if (method == KERNEL_COPY_NONE)
+                return false;
+
+            // Kernel copies are synchronous; wait out the rate limits here and
+            // charge only what the kernel copied once it returns, as a refused
+            // method or a short copy moves less than was asked for
+            uint32_t length = slot.length - slot.done;
+            WaitForRate((std::max)(GetReadWait(file, lane.replica), GetWriteWait()));
+
+            boost::chrono::steady_clock::time_point started = boost::chrono::steady_clock::now();
+            m_selector->OnReadStarted(device);
+
+            uint32_t copied = 0;
+            KernelCopyResult result = m_backend->CopyRange(static_cast<KernelCopyMethod>(method),
+                lane.source->Get(), slot.offset + slot.done,
+                file.destination, slot.offset + slot.done,
+                length, &copied);
+
+            double seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - started).count();
+            m_selector->OnReadFinished(device, result == KERNEL_COPY_OK, copied, seconds);
+            if (result != KERNEL_COPY_UNSUPPORTED)
+            {
+                // One operation that both reads and writes
+                RecordRead(file, lane.replica, result == KERNEL_COPY_OK, copied, seconds);
+                m_destinationMetrics->OnWrite(result == KERNEL_COPY_OK, copied, seconds);
+            }
+
+            if (copied > 0)
+            {
+                // The debt is waited out before the next transfer starts
+                ReserveRead(file, lane.replica, copied);
+                ReserveWrite(copied);
+                file.methodsUsed |= 1u << method;
+            }
+            slot.done += copied;
+
+            if (result == KERNEL_COPY_UNSUPPORTED)
+            {
+                // The kernel refuses it between this device and the destination,
+                // so every file read from the device tries the next method
+                int current = method;
+                while (current <= method && !m_deviceCopyMethods[device].compare_exchange_weak(current, method + 1))
+                {
+                }
+                continue;
+            }
+
+            if (result != KERNEL_COPY_OK || copied == 0)
+            {
+                // Error, or the replica is shorter than it was
+                failReplica(slot, lane.replica);
+                retryPacket(slot);
+                return true;
+            }
+        }
+
+        release(slot);
+        FinishPacket(file, slot.packetIndex, worker);
+        return true;
+    };
+
+    // Write part of the chunk in a slot's active lane to the destination
+    // Returns false (and releases the slot) if the write couldn't be queued
+    auto writeRange = [&](PacketSlot& slot, uint32_t start, uint32_t end) -> bool {
+        ReadLane& lane = slot.lanes[slot.lane];
+
+        AsyncRequest request;
+        request.type = ASYNC_WRITE;
+        request.handle = slot.file->destination;
+        request.offset = slot.offset + slot.done + start;
+        request.buffer = lane.buffer + start;
+        // Only the end of the chunk carries the padding of an unbuffered tail
+        request.length = (end == slot.chunk ? slot.paddedChunk : end) - start;
+        request.userData = &lane;
+
+        slot.writeLength = request.length;
+        slot.scanned = end;
+        slot.writing = true;
+
+        double wait = ReserveWrite(request.length);
+        if (wait > 0.0)
+        {
+            defer(slot, request, wait);
+            return true;
+        }
+
+        slot.requestStarted = SteadySeconds();
+        if (!submit(request))
+        {
+            slot.writing = false;
+            fail();
+            release(slot);
+            return false;
+        }
+        return true;
+    };
+
+    // Write the next run of blocks of a chunk that need writing: with delta
+    // sync only the ones that differ from the destination, and with zero
+    // block skipping none of the all-zero ones, which become holes
+    // Returns false once the rest of the chunk is in place
+    auto writeNextRun = [&](PacketSlot& slot) -> bool {
+        CopyFileState& file = *slot.file;
+        const uint8_t* data = slot.lanes[slot.lane].buffer;
+        uint32_t blockSize = (std::max)(DELTA_BLOCK_SIZE, m_ioAlignment);
+
+        // A destination that was just created reads as zeros wherever
+        // nothing was written yet
+        bool oldData = file.delta || file.resumedPackets > 0;
+
+        auto classify = [&](uint32_t at) {
+            uint32_t length = (std::min)(blockSize, slot.chunk - at);
+            if (file.delta && at + length <= slot.compareLength &&
+                memcmp(data + at, slot.compareBuffer + at, length) == 0)
+                return BLOCK_UNCHANGED;
+            if (m_skipZeroBlocks && ZeroDetector::IsZero(data + at, length))
+                return oldData ? BLOCK_PUNCH : BLOCK_ZERO;
+            return BLOCK_WRITE;
+        };
+
+        while (slot.scanned < slot.chunk)
+        {
+            // Find the run of blocks needing the same thing
+            uint32_t start = slot.scanned;
+            BlockAction action = classify(start);
+            uint32_t end = start + blockSize;
+            while (end < slot.chunk && classify(end) == action)
+                end += blockSize;
+            end = (std::min)(end, slot.chunk);
+
+            if (action == BLOCK_PUNCH &&
+                !m_backend->PunchHole(file.destination, slot.offset + slot.done + start, end - start))
+                action = BLOCK_WRITE;
+
+            if (action == BLOCK_WRITE)
+            {
+                writeRange(slot, start, end);
+                return true;
+            }
+
+            if (action == BLOCK_UNCHANGED)
+                file.unchangedBytes += end - start;
+            else
+                file.zeroBytes += end - start;
+            slot.scanned = end;
+        }
+        return false;
+    };
+
+    // A chunk is in place: read the rest of the packet or finish it
+    auto finishChunk = [&](PacketSlot& slot) {
+        slot.done += slot.chunk;
+
+        // Large packets (or short reads) take more than one read
+        if (slot.done < slot.length && !stopping)
+        {
+            if (!startRead(slot))
+            {
+                failReplica(slot, slot.lanes[slot.lane].replica);
+                retryPacket(slot);
+            }
+            return;
+        }
+
+        CopyFileState& file = *slot.file;
+        int packetIndex = slot.packetIndex;
+        bool finished = slot.done >= slot.length;
+        release(slot);
+
+        if (finished)
+            FinishPacket(file, packetIndex, worker);
+    };
+
+    // How long a slot's read may take before it's hedged: the recent p95
+    // latency of its replica's device
+    auto hedgeDelay = [&](const PacketSlot& slot) -> double {
+        const ReadLane& lane = slot.lanes[slot.lane];
+        double latency = m_selector->GetLatencyPercentile(slot.file->replicaSource[lane.replica], HEDGE_PERCENTILE);
+        return latency > 0.0 ? (std::max)(latency, MIN_HEDGE_DELAY) : DEFAULT_HEDGE_DELAY;
+    };
+
+    while (true)
+    {
+        // Fill free slots with new packets
+        for (PacketSlot& slot : slots)
+        {
+            if (m_cancelRequested || m_jobFailed)
+                stopping = true;
+            if (stopping)
+                break;
+            if (slot.busy)
+                continue;
+
+            // Take the next packet, from our own deque or someone else's
+            if (current.packetCount == 0 && !scheduler.Pop(worker, &current))
+                break;
+
+            CopyFileState& file = *m_files[current.fileIndex];
+
+            if (!OpenDestination(file))
+            {
+                fail();
+                break;
+            }
+
+            ReadLane& lane = slot.lanes[slot.lane];
+            if (!pickReplica(file, file.group.paths.size(), &lane.replica, &lane.source))
+            {
+                // Every replica failed
+                fail();
+                break;
+            }
+
+            if (!lane.buffer)
+                lane.buffer = m_bufferPool->Acquire();
+            if (!lane.buffer)
+            {
+                fail();
+                break;
+            }
+
+            slot.file = &file;
+            slot.fileIndex = current.fileIndex;
+            slot.packetIndex = current.firstPacket;
+            slot.offset = static_cast<long long>(slot.packetIndex) * m_packetSize;
+            slot.done = 0;
+
+            current.firstPacket++;
+            current.packetCount--;
+
+            // Calculate actual packet size (last packet might be smaller)
+            slot.length = m_packetSize;
+            long long remaining = file.group.fileSize - slot.offset;
+            if (remaining < slot.length)
+                slot.length = static_cast<uint32_t>(remaining);
+
+            slot.busy = true;
+            active++;
+
+            if (kernelCopy(slot))
+                continue;
+
+            file.methodsUsed |= 1u << KERNEL_COPY_NONE;
+            if (!startRead(slot))
+            {
+                failReplica(slot, lane.replica);
+                retryPacket(slot);
+            }
+        }
+
+        if (active == 0)
+        {
+            // Packets retried onto our own deque still need a slot
+            if (!stopping && (current.packetCount > 0 || scheduler.Pop(worker, &current)))
+                continue;
+
+            // Files still waiting for a device stream are let in as the
+            // files on other workers finish
+            if (!stopping && m_streamLimiter->GetWaitingCount() > 0)
+            {
+                m_metrics.OnStall(STALL_STREAM_ADMISSION, 0.001);
+                boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+                continue;
+            }
+            break;
+        }
+
+        // Queue the requests the rate limits held back once their time
+        // comes (at once when stopping, so the slots can drain)
+        int timeoutMs = -1;
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        for (PacketSlot& slot : slots)
+        {
+            if (!slot.deferring)
+                continue;
+
+            if (!stopping && slot.deferredUntil > now)
+            {
+                int waitMs = static_cast<int>(boost::chrono::duration_cast<boost::chrono::milliseconds>(slot.deferredUntil - now).count()) + 1;
+                timeoutMs = timeoutMs < 0 ? waitMs : (std::min)(timeoutMs, waitMs);
+                continue;
+            }
+
+            slot.deferring = false;
+            slot.requestStarted = SteadySeconds();
+            ReadLane& lane = *static_cast<ReadLane*>(slot.deferred.userData);
+            if (slot.deferred.type == ASYNC_WRITE)
+            {
+                if (!submit(slot.deferred))
+                {
+                    slot.writing = false;
+                    fail();
+                    release(slot);
+                }
+            }
+            else if (slot.comparing)
+            {
+                if (!submit(slot.deferred))
+                {
+                    slot.comparing = false;
+                    fail();
+                    release(slot);
+                }
+            }
+            else if (!submitRead(lane, slot.deferred))
+            {
+                lane.reading = false;
+                failReplica(slot, lane.replica);
+                retryPacket(slot);
+            }
+        }
+
+        // Hedge reads that have run past their device's usual latency on
+        // another replica, and wake up in time for the next one that might
+        for (PacketSlot& slot : slots)
+        {
+            if (!hedging || stopping)
+                break;
+            if (!slot.busy || slot.releasing || slot.hedged || slot.deferring || slot.file->group.paths.size() < 2)
+                continue;
+
+            ReadLane& lane = slot.lanes[slot.lane];
+            ReadLane& hedge = slot.lanes[1 - slot.lane];
+            if (!lane.reading || hedge.reading)
+                continue;
+
+            double wait = hedgeDelay(slot) - boost::chrono::duration<double>(now - lane.started).count();
+            if (wait > 0.0)
+            {
+                int waitMs = static_cast<int>(wait * 1000.0) + 1;
+                timeoutMs = timeoutMs < 0 ? waitMs : (std::min)(timeoutMs, waitMs);
+                continue;
+            }
+
+            // Cap the hedges so a struggling device doesn't get its load doubled
+            if (m_hedgedReads >= m_readsIssued * m_hedgeRate)
+                continue;
+
+            slot.hedged = true;
+            if (!hedge.buffer)
+                hedge.buffer = m_bufferPool->Acquire();
+            if (!hedge.buffer || !pickReplica(*slot.file, lane.replica, &hedge.replica, &hedge.source))
+                continue;
+
+            // A hedge that would have to wait for the rate limits can't win the race
+            if (GetReadWait(*slot.file, hedge.replica) > 0.0)
+            {
+                hedge.source.reset();
+                continue;
+            }
+
+            if (issueRead(slot, 1 - slot.lane))
+                m_hedgedReads++;
+            else
+                hedge.source.reset();
+        }
+
+        // With nothing in flight the engine has nothing to wait for and
+        // returns at once; sleep until the next deferred request is due
+        // instead of spinning (in short steps, so a cancel isn't held up)
+        if (inFlight == 0 && timeoutMs > 0)
+        {
+            boost::this_thread::sleep_for(boost::chrono::milliseconds((std::min)(timeoutMs, PROGRESS_INTERVAL_MS)));
+            continue;
+        }
+
+        int count = engine->Wait(completions.data(), engineDepth, 1, timeoutMs);
+        if (count < 0)
+        {
+            // The engine is unusable; nothing more will complete
+            fail();
+            break;
+        }
+        inFlight -= count;
+        m_metrics.AddRequestsInFlight(-count);
+
+        for (int i = 0; i < count; i++)
+        {
+            ReadLane& lane = *static_cast<ReadLane*>(completions[i].userData);
+            PacketSlot& slot = *lane.slot;
+            int laneIndex = (&lane == &slot.lanes[0]) ? 0 : 1;
+
+            if (lane.reading)
+            {
+                // Read finished; feed the timing to the selector
+                lane.reading = false;
+                double seconds = boost::chrono::duration<double>(
+                    boost::chrono::steady_clock::now() - lane.started).count();
+                size_t device = slot.file->replicaSource[lane.replica];
+                bool success = completions[i].success && completions[i].bytes > 0;
+
+                if (lane.abandoned)
+                {
+                    // Lost a hedged race; even if it was cancelled, the device
+                    // took at least this long
+                    lane.abandoned = false;
+                    m_selector->OnReadFinished(device, true, success ? completions[i].bytes : lane.length, seconds);
+                    if (success)
+                        RecordRead(*slot.file, lane.replica, true, completions[i].bytes, seconds);
+                    if (slot.releasing)
+                        release(slot);
+                    continue;
+                }
+
+                m_selector->OnReadFinished(device, completions[i].success, completions[i].bytes, seconds);
+                RecordRead(*slot.file, lane.replica, success, completions[i].bytes, seconds);
+                if (!m_tuners.empty())
+                    m_tuners[device]->OnReadFinished(completions[i].success, completions[i].bytes, seconds);
+
+                ReadLane& other = slot.lanes[1 - laneIndex];
+                bool racing = other.reading && !other.abandoned;
+
+                if (!success)
+                {
+                    failReplica(slot, lane.replica);
+
+                    // The other lane of a hedged read may still deliver
+                    if (racing)
+                        slot.lane = 1 - laneIndex;
+                    else
+                        retryPacket(slot);
+                    continue;
+                }
+
+                // First result wins; cancel the other lane of a hedged read
+                slot.lane = laneIndex;
+                if (racing)
+                {
+                    other.abandoned = true;
+                    engine->Cancel(&other);
+                }
+
+                // A rounded-up tail read never returns more than the packet holds
+                uint32_t chunk = (std::min)(completions[i].bytes, slot.length - slot.done);
+                uint32_t paddedChunk = chunk;
+                if (m_ioAlignment > 1 && chunk % m_ioAlignment != 0)
+                {
+                    if (slot.offset + slot.done + chunk >= slot.file->group.fileSize)
+                    {
+                        // File tail: pad with zeros to the alignment, trimmed on close
+                        paddedChunk = static_cast<uint32_t>(AlignedBufferPool::AlignUp(chunk, m_ioAlignment));
+                        memset(lane.buffer + chunk, 0, paddedChunk - chunk);
+                    }
+                    else
+                    {
+                        // Short read mid-file: keep the aligned part, read the rest again
+                        chunk -= chunk % m_ioAlignment;
+                        paddedChunk = chunk;
+                    }
+                }
+
+                if (chunk == 0)
+                {
+                    failReplica(slot, lane.replica);
+                    retryPacket(slot);
+                    continue;
+                }
+
+                // A replica that changed since it was verified can't be trusted
+                if (slot.file->verifier && !slot.file->verifier->CheckRange(slot.offset + slot.done, lane.buffer, chunk))
+                {
+                    failReplica(slot, lane.replica);
+                    MarkReplicaDiverged(slot.file->group.paths[lane.replica]);
+                    retryPacket(slot);
+                    continue;
+                }
+
+                slot.chunk = chunk;
+                slot.paddedChunk = paddedChunk;
+                slot.scanned = 0;
+
+                if (slot.file->delta)
+                {
+                    // Read what the destination already holds there to compare
+                    if (!slot.compareBuffer)
+                        slot.compareBuffer = m_bufferPool->Acquire();
+                    if (!slot.compareBuffer)
+                    {
+                        fail();
+                        release(slot);
+                        continue;
+                    }
+
+                    AsyncRequest request;
+                    request.type = ASYNC_READ;
+                    request.handle = slot.file->destination;
+                    request.offset = slot.offset + slot.done;
+                    request.buffer = slot.compareBuffer;
+                    request.length = paddedChunk;
+                    request.userData = &lane;
+
+                    slot.comparing = true;
+                    double wait = ReserveDestinationRead(request.length);
+                    if (wait > 0.0)
+                    {
+                        defer(slot, request, wait);
+                        continue;
+                    }
+
+                    slot.requestStarted = SteadySeconds();
+                    if (!submit(request))
+                    {
+                        slot.comparing = false;
+                        fail();
+                        release(slot);
+                    }
+                    continue;
+                }
+
+                // Write it to the destination at the packet's own offset
+                if (!writeNextRun(slot))
+                    finishChunk(slot);
+                continue;
+            }
+
+            if (slot.comparing)
+            {
+                // Destination read finished; write only the blocks that differ
+                slot.comparing = false;
+                m_destinationMetrics->OnRead(completions[i].success, completions[i].bytes, SteadySeconds() - slot.requestStarted);
+                if (!completions[i].success)
+                {
+                    fail();
+                    release(slot);
+                    continue;
+                }
+
+                slot.compareLength = (std::min)(completions[i].bytes, slot.chunk);
+                if (!writeNextRun(slot))
+                    finishChunk(slot);
+                continue;
+            }
+
+            // Write finished
+            slot.writing = false;
+            bool written = completions[i].success && completions[i].bytes == slot.writeLength;
+            m_destinationMetrics->OnWrite(written, completions[i].bytes, SteadySeconds() - slot.requestStarted);
+            if (!written)
+            {
+                fail();
+                release(slot);
+                continue;
+            }
+
+            if (writeNextRun(slot))
+                continue;
+
+            finishChunk(slot);
+        }
+    }
+
+    // Requests left on an engine that failed never complete
+    m_metrics.AddRequestsInFlight(-inFlight);
+
+    // Hand the buffers back for the next job's workers
+    for (PacketSlot& slot : slots)
+    {
+        m_bufferPool->Release(slot.lanes[0].buffer);
+        m_bufferPool->Release(slot.lanes[1].buffer);
+        m_bufferPool->Release(slot.compareBuffer);
+    }
+
+    // A retry can't be lost: a worker only gives up once every deque is empty
+    if (m_cancelRequested)
+        m_jobFailed = true;
+}
+
+// Files found by a scan running alongside the copy
+struct ScannedFiles {
+    boost::mutex mutex;
+    boost::condition_variable ready;        // Signalled when files arrive
+    std::vector<std::wstring> paths;        // Found and not yet copied
+};
+
+// Queue a batch of files found by StartDirectoryCopy's scan
+static void QueueScannedFiles(const std::vector<std::wstring>& paths, void* userData)
+{
+    ScannedFiles* scanned = static_cast<ScannedFiles*>(userData);
+    boost::mutex::scoped_lock lock(scanned->mutex);
+    scanned->paths.insert(scanned->paths.end(), paths.begin(), paths.end());
+    scanned->ready.notify_one();
+}
+
+void FileCopier::DoCopyOperation()
+{
+    // A directory copy scans the tree on its own threads alongside the copy
+    std::wstring scanDirectory;
+    scanDirectory.swap(m_scanDirectory);
+
+    // Create the destination directory if it doesn't exist
+    if (!m_backend->CreateDirectoryPath(m_destinationPath))
+    {
+        // Directory creation failed and it doesn't exist
+        m_jobFailed = true;
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_operationInProgress = false;
+        return;
+    }
+
+    // Reset the job's progress; each batch of files adds to it
+    m_jobFailed = false;
+    m_readsIssued = 0;
+    m_hedgedReads = 0;
+    m_progress.Reset();
+    m_totalPackets = 0;
+    m_logicalTotal = 0;
+    m_physicalTotal = 0;
+    m_filesTotal = 0;
+    m_reportedPackets = 0;
+    m_reportedTotal = 0;
+    m_finishTime = 0.0;
+    m_startTime = SteadySeconds();
+
+    // Progress goes to the callback and metrics to their file from their
+    // own thread, at a fixed rate, so the workers never wait on either
+    std::unique_ptr<boost::thread> reporter;
+    try
+    {
+        reporter = std::make_unique<boost::thread>([this]() { RunProgressReporter(); });
+    }
+    catch (const boost::thread_resource_error&)
+    {
+        // Only the final report is made
+    }
+
+    ScannedFiles scanned;
+    DirectoryScanner scanner(0, m_backend);
+    bool scanning = !scanDirectory.empty() && scanner.Start(scanDirectory, true, QueueScannedFiles, &scanned);
+
+    // The sources added beforehand go first, then whatever the scan has
+    // found each time a batch is done
+    std::vector<SourceInfo> sources = m_sources;
+    std::vector<FileCopyResult> results;
+    while (!m_cancelRequested)
+    {
+        if (scanning)
+        {
+            // Wait for some files; replicas can only be grouped once the
+            // whole tree is known
+            boost::mutex::scoped_lock lock(scanned.mutex);
+            while (!m_cancelRequested && !scanner.IsFinished() && (scanned.paths.empty() || m_replicaMode))
+            {
+                scanned.ready.timed_wait(lock, boost::posix_time::milliseconds(50));
+            }
+
+            for (const std::wstring& path : scanned.paths)
+            {
+                // Skip files that were added as sources too
+                if (m_sourceKeys.count(FileIo::GetPathKey(path)))
+                    continue;
+
+                SourceInfo info;
+                info.path = path;
+                info.status = L"Ready";
+                info.speed = 0;
+                info.relativePath = GetRelativePath(scanDirectory, path);
+                sources.push_back(info);
+            }
+            scanned.paths.clear();
+
+            // Every batch is delivered by the time the scan is finished
+            scanning = !scanner.IsFinished();
+        }
+
+        if (!sources.empty())
+            CopyFiles(BuildReplicaGroups(sources), results);
+        sources.clear();
+
+        if (!scanning || m_jobFailed)
+            break;
+    }
+
+    scanner.Cancel();
+    scanner.Wait();
+
+    // Release the source handles still open (files that failed or were cancelled)
+    m_sourceHandles.CloseAll();
+
+    // Stop the reporter and report where the copy ended
+    if (reporter)
+    {
+        reporter->interrupt();
+        reporter->join();
+    }
+    ReportProgress();
+    DumpMetrics();
+
+    // Operation completed
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_finishTime = SteadySeconds();
+    m_fileResults.swap(results);
+    m_operationInProgress = false;
+}
+
+// Copy one batch of files
+void FileCopier::CopyFiles(const std::vector<ReplicaGroup>& groups, std::vector<FileCopyResult>& results)
+{
+    // Set up the shared per-file state
+    m_files.clear();
+
+    // Delta sync needs an existing destination to compare with
+    std::vector<char> existing(groups.size(), 0);
+    if (m_deltaSync)
+    {
+        ParallelFor(groups.size(), [&](size_t i) {
+            long long existingSize = 0;
+            existing[i] = m_backend->GetSize(m_destinationPath + groups[i].fileName, &existingSize) && existingSize > 0;
+        });
+    }
+
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        const ReplicaGroup& group = groups[i];
+        std::unique_ptr<CopyFileState> file = std::make_unique<CopyFileState>();
+        file->index = i;
+        file->group = group;
+        file->destinationPath = m_destinationPath + group.fileName;
+        file->destination = INVALID_FILE_HANDLE;
+        file->opened = false;
+        file->replicaFailed = std::make_unique<std::atomic<bool>[]>(group.paths.size());
+        file->resumedPackets = 0;
+        file->unchangedBytes = 0;
+        file->zeroBytes = 0;
+
+        file->delta = existing[i] != 0;
+
+        // Kernel copies go through the page cache, which direct I/O is meant
+        // to avoid, and never show delta sync or the zero block scan the data
+        file->copyMethod = m_zeroCopy && !m_directIo && !file->delta && !m_skipZeroBlocks ?
+            m_backend->GetKernelCopyMethod() : KERNEL_COPY_NONE;
+        file->methodsUsed = 0;
+        file->cloned = false;
+        file->verified = false;
+        file->sparse = false;
+        file->small = false;
+        for (size_t r = 0; r < group.paths.size(); r++)
+        {
+            file->replicaFailed[r] = false;
+        }
+
+        m_files.push_back(std::move(file));
+    }
+
+    // Files from a directory tree keep their subdirectories
+    std::unordered_set<std::wstring> directories;
+    for (const auto& file : m_files)
+    {
+        const std::wstring& fileName = file->group.fileName;
+        for (size_t end = fileName.find(PATH_SEPARATOR); end != std::wstring::npos; end = fileName.find(PATH_SEPARATOR, end + 1))
+        {
+            std::wstring directory = m_destinationPath + fileName.substr(0, end);
+            if (directories.insert(directory).second)
+                m_backend->CreateDirectoryPath(directory);
+        }
+    }
+
+    // Track live throughput per source device, seeded with measured speeds
+    size_t deviceCount = AssignSourceDevices();
+    m_selector = std::make_unique<ReplicaSelector>(deviceCount);
+
+    // A kernel copy method refused between a device and the destination
+    // isn't tried again for the rest of the job
+    m_deviceCopyMethods = std::make_unique<std::atomic<int>[]>(deviceCount);
+    for (size_t d = 0; d < deviceCount; d++)
+    {
+        m_deviceCopyMethods[d] = m_backend->GetKernelCopyMethod();
+    }
+
+    // Every device gets a bucket, limited or not, so a cap set during the
+    // copy still applies; sources only when they are limited
+    m_deviceRates.assign(deviceCount, std::shared_ptr<TokenBucket>());
+    for (size_t d = 0; d < deviceCount; d++)
+    {
+        if (m_sourceDevices[d].first)
+            m_deviceRates[d] = m_rateLimiter.GetDeviceBucket(m_sourceDevices[d].second);
+    }
+
+    unsigned long long destinationId = 0;
+    m_destinationRate.reset();
+    bool destinationKnown = m_backend->GetDeviceId(m_destinationPath, &destinationId);
+    if (destinationKnown)
+        m_destinationRate = m_rateLimiter.GetDeviceBucket(destinationId);
+
+    // Metrics are kept per device and per source root directory
+    m_deviceMetrics.resize(deviceCount);
+    for (size_t d = 0; d < deviceCount; d++)
+    {
+        m_deviceMetrics[d] = m_metrics.GetDeviceMetrics(m_sourceDevices[d].first, m_sourceDevices[d].second);
+    }
+    m_destinationMetrics = m_metrics.GetDeviceMetrics(destinationKnown, destinationId);
+
+    std::unordered_map<std::wstring, IoMetrics*> rootMetrics;
+    for (auto& file : m_files)
+    {
+        file->replicaRates.resize(file->group.paths.size());
+        file->replicaMetrics.resize(file->group.paths.size());
+        for (size_t r = 0; r < file->group.paths.size(); r++)
+        {
+            file->replicaRates[r] = m_rateLimiter.FindSourceBucket(file->group.paths[r]);
+
+            std::wstring root = GetSourceRoot(file->group.paths[r], file->group.fileName);
+            IoMetrics*& metrics = rootMetrics[root];
+            if (!metrics)
+                metrics = m_metrics.GetSourceMetrics(root);
+            file->replicaMetrics[r] = metrics;
+        }
+    }
+
+    std::vector<const SourceInfo*> measured;
+    for (const SourceInfo& source : m_sources)
+    {
+        if (source.speed > 0)
+            measured.push_back(&source);
+    }
+
+    for (size_t i = 0; i < m_files.size() && !measured.empty(); i++)
+    {
+        CopyFileState& file = *m_files[i];
+        for (size_t r = 0; r < file.group.paths.size(); r++)
+        {
+            for (const SourceInfo* source : measured)
+            {
+                // Measured speed is in Kbps
+                if (FileIo::SamePath(source->path, file.group.paths[r]))
+                    m_selector->SetPrior(file.replicaSource[r], source->speed * 1000.0 / 8.0);
+            }
+        }
+    }
+
+    // One worker per source device unless told otherwise
+    int workerCount = m_threadCount > 0 ? m_threadCount : (std::max)(1, static_cast<int>(deviceCount));
+
+    // Unbuffered I/O must be aligned to the largest logical block size involved
+    m_ioAlignment = m_directIo ? GetJobIoAlignment() : 1;
+    m_sourceHandles.SetUnbuffered(m_directIo);
+
+    // In automatic mode the packet is the largest read the memory budget
+    // allows for every buffer in flight; each device tunes its reads below that
+    m_tuners.clear();
+    if (m_autoPacketSize)
+    {
+        uint32_t minIoSize = (std::max)(MIN_AUTO_IO_SIZE, m_ioAlignment);
+        long long perBuffer = m_memoryBudget / (static_cast<long long>(workerCount) * m_queueDepth);
+        uint32_t maxIoSize = minIoSize;
+        while (maxIoSize < BUFFER_SIZE && maxIoSize * 2LL <= perBuffer)
+            maxIoSize *= 2;
+
+        m_packetSize = static_cast<int>(maxIoSize);
+        for (size_t d = 0; d < deviceCount; d++)
+        {
+            m_tuners.push_back(std::make_unique<IoSizeTuner>(minIoSize, maxIoSize, INITIAL_AUTO_IO_SIZE));
+        }
+    }
+    else
+    {
+        // Packets start on aligned offsets
+        m_packetSize = static_cast<int>(AlignedBufferPool::AlignUp(m_packetSize, m_ioAlignment));
+    }
+
+    // Page-aligned buffers serve both modes
+    uint32_t bufferSize = (std::min)(static_cast<uint32_t>(m_packetSize), BUFFER_SIZE);
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_bufferPool = std::make_unique<AlignedBufferPool>(bufferSize, (std::max)(m_ioAlignment, 4096u));
+    }
+
+    // Replicas on the destination's device might be cloned instead of copied
+    unsigned long long destinationDevice = 0;
+    bool canClone = m_cloneFiles && m_backend->GetDeviceId(m_destinationPath, &destinationDevice);
+
+    // Split the files into packets
+    long long totalPackets = 0;
+    long long clonedPackets = 0;
+    long long resumedPackets = 0;
+    long long skippedPackets = 0;
+    for (auto& file : m_files)
+    {
+        file->packetCount = static_cast<int>((file->group.fileSize + m_packetSize - 1) / m_packetSize);
+        totalPackets += file->packetCount;
+
+        // Large files keep a journal so an interrupted copy can pick up
+        // where it stopped; the destination must still hold its data
+        if (m_resume && file->packetCount > 0 && file->group.fileSize >= JOURNAL_MIN_FILE_SIZE)
+        {
+            long long existingSize = 0;
+            bool resume = m_backend->GetSize(file->destinationPath, &existingSize) && existingSize >= file->group.fileSize;
+
+            file->journal = std::make_unique<CopyJournal>(m_backend);
+            if (file->journal->Open(CopyJournal::GetPath(file->destinationPath), GetJournalSource(*m_backend, file->group),
+                static_cast<uint32_t>(m_packetSize), file->packetCount, resume))
+            {
+                file->resumedPackets = file->journal->GetCompletedCount();
+                resumedPackets += file->resumedPackets;
+                if (file->resumedPackets == file->packetCount)
+                {
+                    // Only the final trim of an unbuffered copy was missing
+                    if (existingSize > file->group.fileSize)
+                    {
+                        FileHandle destination = m_backend->OpenForUpdate(file->destinationPath);
+                        m_backend->SetSize(destination, file->group.fileSize);
+                        m_backend->Close(destination);
+                    }
+                    file->journal->Remove();
+                }
+            }
+            else
+            {
+                // Copy without one rather than fail
+                file->journal.reset();
+            }
+        }
+
+        // On a copy-on-write filesystem a clone replaces the whole packet loop,
+        // unless the destination holds data worth keeping (an interrupted copy
+        // or an older version for delta sync): a failed clone truncates it
+        bool keepDestination = file->resumedPackets > 0 || file->delta;
+        for (size_t r = 0; canClone && file->packetCount > 0 && !keepDestination && r < file->group.paths.size(); r++)
+        {
+            unsigned long long deviceId = 0;
+            if (!m_backend->GetDeviceId(file->group.paths[r], &deviceId) || deviceId != destinationDevice)
+                continue;
+
+            // Never clone a replica that differs from the others
+            VerifyReplicas(*file);
+            if (file->replicaFailed[r])
+                continue;
+
+            if (m_backend->CloneFile(file->group.paths[r], file->destinationPath))
+            {
+                if (file->journal)
+                {
+                    file->journal->Remove();
+                    file->journal.reset();
+                }
+                file->cloned = true;
+                clonedPackets += file->packetCount;
+                file->packetCount = 0;
+            }
+            else
+            {
+                // Not a copy-on-write filesystem; don't try again this job
+                canClone = false;
+            }
+        }
+
+        // Files that fit in one buffer are copied whole by the small-file
+        // threads instead of going through the packet pipeline
+        file->small = !file->cloned && file->group.fileSize <= (std::min)(SMALL_FILE_SIZE, static_cast<long long>(bufferSize));
+
+        // Packets entirely in holes of a sparse source are left as holes
+        int holePackets = m_sparseFiles && file->packetCount > 0 && !file->small ? MapSparseFile(*file) : 0;
+        skippedPackets += holePackets;
+        file->remainingPackets = file->packetCount - file->resumedPackets - holePackets;
+
+        // Account for the bytes already in place and the data left to copy
+        // (no worker runs yet, so this thread counts in the first shard)
+        long long logicalDone = file->cloned ? file->group.fileSize : 0;
+        long long physicalDone = 0;
+        long long physicalTotal = 0;
+        for (int packet = 0; packet < file->packetCount; packet++)
+        {
+            long long length = GetPacketLength(*file, packet, m_packetSize);
+            bool done = file->journal && file->journal->IsComplete(packet);
+            bool hasData = PacketHasData(*file, packet, m_packetSize);
+            if (hasData)
+                physicalTotal += length;
+            if (done || !hasData)
+                logicalDone += length;
+            if (done && hasData)
+                physicalDone += length;
+        }
+
+        if (holePackets > 0 && file->remainingPackets == 0)
+        {
+            // Nothing but holes left: the destination just needs its size
+            if (OpenDestination(*file))
+            {
+                m_backend->Close(file->destination);
+                file->destination = INVALID_FILE_HANDLE;
+            }
+            if (file->journal)
+                file->journal->Remove();
+        }
+
+        // Cloned files and those with nothing left to copy are done
+        // (small files, empty ones included, are counted as they are copied)
+        bool fileDone = file->remainingPackets == 0 && !file->small;
+        m_logicalTotal += file->group.fileSize;
+        m_physicalTotal += physicalTotal;
+        m_progress.Add(0, 0, logicalDone, physicalDone, fileDone ? 1 : 0);
+    }
+    m_filesTotal += static_cast<long long>(m_files.size());
+
+    // Update total packets for progress; cloned, resumed and hole packets count as done
+    m_totalPackets += totalPackets;
+    m_progress.Add(0, clonedPackets + resumedPackets + skippedPackets, 0, 0, 0);
+
+    // Files are let in as their devices have streams free, so a spinning
+    // disk serves one file at a time while SSDs serve many
+    size_t destinationStream = 0;
+    m_streamLimiter = std::make_unique<DeviceStreamLimiter>(GetDeviceStreamLimits(deviceCount, &destinationStream), m_files.size());
+
+    // Deal the admitted files out to the workers; idle workers steal from busy ones
+    PacketScheduler scheduler(workerCount, m_queueDepth);
+    m_scheduler = &scheduler;
+    std::vector<size_t> smallFiles;
+    for (size_t i = 0; i < m_files.size(); i++)
+    {
+        CopyFileState& file = *m_files[i];
+
+        // A small file is a single read and write, too short to thrash a disk
+        if (file.small)
+        {
+            smallFiles.push_back(i);
+            continue;
+        }
+
+        if (file.remainingPackets > 0)
+            m_streamLimiter->Add(i, destinationStream, file.replicaSource);
+    }
+
+    std::vector<StreamAdmission> admitted;
+    m_streamLimiter->Admit(admitted);
+    ScheduleAdmitted(admitted);
+
+    boost::thread_group workers;
+    for (int w = 0; w < workerCount; w++)
+    {
+        workers.create_thread([this, &scheduler, w]() { RunCopyWorker(scheduler, w); });
+    }
+
+    // Small files go to their own threads, many at a time, so opening and
+    // creating files overlaps instead of holding up the packet pipeline
+    std::atomic<size_t> nextSmallFile(0);
+    size_t smallThreads = (std::min)(static_cast<size_t>(SMALL_FILE_THREADS), smallFiles.size());
+    for (size_t t = 0; t < smallThreads; t++)
+    {
+        size_t shard = workerCount + t;
+        workers.create_thread([this, &smallFiles, &nextSmallFile, shard]() { RunSmallFileWorker(smallFiles, nextSmallFile, shard); });
+    }
+    workers.join_all();
+    m_scheduler = nullptr;
+    m_streamLimiter.reset();
+
+    // Close destinations left open by a failed or cancelled job
+    for (auto& file : m_files)
+    {
+        // Save the packets that did finish for the next attempt
+        if (file->journal && file->remainingPackets > 0)
+        {
+            file->journal->Flush(file->destination);
+            file->journal->Close();
+        }
+
+        m_backend->Close(file->destination);
+
+        // Report how the file was copied
+        FileCopyResult result;
+        result.fileName = file->group.fileName;
+        result.complete = file->remainingPackets == 0;
+        result.resumedPackets = file->resumedPackets;
+        result.unchangedBytes = file->unchangedBytes;
+        result.zeroBytes = file->zeroBytes;
+        if (file->cloned)
+            result.method = L"clone";
+        for (int method = KERNEL_COPY_FILE_RANGE; method <= KERNEL_COPY_NONE; method++)
+        {
+            if (file->methodsUsed & (1u << method))
+            {
+                if (!result.method.empty())
+                    result.method += L"+";
+                result.method += FileIo::GetKernelCopyMethodName(static_cast<KernelCopyMethod>(method));
+            }
+        }
+        results.push_back(result);
+    }
+    m_files.clear();
+}
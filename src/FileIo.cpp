@@ -0,0 +1,1116 @@
+#include "../include/FileIo.h"
+#include <algorithm>
+#include <cwctype>
+
+#ifdef _WIN32
+#include <winioctl.h>
+#include <shlwapi.h>
+#pragma comment(lib, "shlwapi.lib")
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <wchar.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <sys/sysmacros.h>
+#endif
+
+// Name of a kernel copy method for reporting
+const wchar_t* FileIo::GetKernelCopyMethodName(KernelCopyMethod method)
+{
+    switch (method)
+    {
+    case KERNEL_COPY_FILE_RANGE:
+        return L"copy_file_range";
+    case KERNEL_COPY_SPLICE:
+        return L"splice";
+    default:
+        return L"buffered";
+    }
+}
+
+#ifdef _WIN32
+
+// Open an existing file for reading
+FileHandle FileIo::OpenForRead(const std::wstring& path, bool unbuffered)
+{
+    return CreateFile(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        (unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN) | FILE_FLAG_OVERLAPPED,
+        NULL);
+}
+
+// Create (or truncate) a file for writing
+FileHandle FileIo::CreateForWrite(const std::wstring& path, bool unbuffered)
+{
+    return CreateFile(
+        path.c_str(),
+        GENERIC_WRITE,
+        0,  // No sharing
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | (unbuffered ? FILE_FLAG_NO_BUFFERING : 0) | FILE_FLAG_OVERLAPPED,
+        NULL);
+}
+
+// Open a file for reading and writing, keeping its contents
+FileHandle FileIo::OpenForUpdate(const std::wstring& path, bool unbuffered)
+{
+    return CreateFile(
+        path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        0,  // No sharing
+        NULL,
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | (unbuffered ? FILE_FLAG_NO_BUFFERING : 0) | FILE_FLAG_OVERLAPPED,
+        NULL);
+}
+
+// Get the alignment unbuffered I/O needs
+bool FileIo::GetIoAlignment(const std::wstring& path, uint32_t* alignment)
+{
+    WCHAR volumePath[MAX_PATH];
+    if (!GetVolumePathName(path.c_str(), volumePath, MAX_PATH))
+        return false;
+
+    DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+    if (!GetDiskFreeSpace(volumePath, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters))
+        return false;
+
+    *alignment = bytesPerSector;
+    return true;
+}
+
+// Close a handle opened by this class
+void FileIo::Close(FileHandle handle)
+{
+    if (handle != INVALID_FILE_HANDLE)
+        CloseHandle(handle);
+}
+
+// Run one overlapped read or write and wait for it
+// Handles are opened for overlapped I/O so the async engine can use them too.
+// The low bit on the event stops the result from being queued to a completion
+// port the handle may be bound to.
+static bool TransferAt(FileHandle handle, bool write, long long offset, void* buffer, uint32_t length, uint32_t* transferred)
+{
+    HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!hEvent)
+        return false;
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(hEvent) | 1);
+
+    BOOL started = write
+        ? WriteFile(handle, buffer, length, NULL, &overlapped)
+        : ReadFile(handle, buffer, length, NULL, &overlapped);
+
+    DWORD bytes = 0;
+    bool success = true;
+    if (!started && GetLastError() != ERROR_IO_PENDING)
+    {
+        // Reading at or past the end isn't an error, just an empty read
+        success = !write && GetLastError() == ERROR_HANDLE_EOF;
+    }
+    else if (!GetOverlappedResult(handle, &overlapped, &bytes, TRUE))
+    {
+        success = !write && GetLastError() == ERROR_HANDLE_EOF;
+        bytes = 0;
+    }
+
+    CloseHandle(hEvent);
+
+    *transferred = bytes;
+    return success;
+}
+
+// Read at an absolute offset
+bool FileIo::ReadAt(FileHandle handle, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead)
+{
+    return TransferAt(handle, false, offset, buffer, length, bytesRead);
+}
+
+// Write at an absolute offset
+bool FileIo::WriteAt(FileHandle handle, long long offset, const void* buffer, uint32_t length, uint32_t* bytesWritten)
+{
+    return TransferAt(handle, true, offset, const_cast<void*>(buffer), length, bytesWritten);
+}
+
+// Clone a file with ReFS block cloning
+bool FileIo::CloneFile(const std::wstring& sourcePath, const std::wstring& destinationPath)
+{
+    HANDLE hSource = CreateFile(sourcePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hSource == INVALID_HANDLE_VALUE)
+        return false;
+
+    // Only volumes with block reference counting (ReFS) can clone
+    DWORD volumeFlags = 0;
+    BY_HANDLE_FILE_INFORMATION fileInfo;
+    if (!GetVolumeInformationByHandleW(hSource, NULL, 0, NULL, NULL, &volumeFlags, NULL, 0) ||
+        !(volumeFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING) ||
+        !GetFileInformationByHandle(hSource, &fileInfo))
+    {
+        CloseHandle(hSource);
+        return false;
+    }
+
+    HANDLE hDest = CreateFile(destinationPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (hDest == INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hSource);
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    fileSize.HighPart = fileInfo.nFileSizeHigh;
+    fileSize.LowPart = fileInfo.nFileSizeLow;
+
+    // Cluster size; clone ranges must be whole clusters
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity = { 0 };
+    DWORD bytesReturned = 0;
+    bool success = DeviceIoControl(hSource, FSCTL_GET_INTEGRITY_INFORMATION, NULL, 0,
+        &integrity, sizeof(integrity), &bytesReturned, NULL) != FALSE;
+
+    // The clone must match the source's sparseness and be sized up front
+    if (success && (fileInfo.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE))
+    {
+        success = DeviceIoControl(hDest, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL) != FALSE;
+    }
+
+    if (success)
+    {
+        FILE_END_OF_FILE_INFO endOfFile;
+        endOfFile.EndOfFile = fileSize;
+        success = SetFileInformationByHandle(hDest, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)) != FALSE;
+    }
+
+    // Clone in chunks below the 4 GB limit of one request; the last chunk is
+    // rounded up to a whole cluster, which is allowed at end of file
+    const long long clusterSize = integrity.ClusterSizeInBytes ? integrity.ClusterSizeInBytes : 4096;
+    const long long chunkSize = (1024LL * 1024 * 1024 / clusterSize) * clusterSize;
+    for (long long offset = 0; success && offset < fileSize.QuadPart; offset += chunkSize)
+    {
+        long long length = (std::min)(chunkSize, fileSize.QuadPart - offset);
+        length = (length + clusterSize - 1) / clusterSize * clusterSize;
+
+        DUPLICATE_EXTENTS_DATA extents;
+        extents.FileHandle = hSource;
+        extents.SourceFileOffset.QuadPart = offset;
+        extents.TargetFileOffset.QuadPart = offset;
+        extents.ByteCount.QuadPart = length;
+        success = DeviceIoControl(hDest, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents),
+            NULL, 0, &bytesReturned, NULL) != FALSE;
+    }
+
+    CloseHandle(hDest);
+    CloseHandle(hSource);
+    return success;
+}
+
+// No kernel-side range copy on Windows
+KernelCopyMethod FileIo::GetKernelCopyMethod()
+{
+    return KERNEL_COPY_NONE;
+}
+
+// Copy a range inside the kernel (not available on Windows)
+KernelCopyResult FileIo::CopyRange(KernelCopyMethod method,
+    FileHandle source, long long sourceOffset,
+    FileHandle destination, long long destinationOffset,
+    uint32_t length, uint32_t* bytesCopied)
+{
+    *bytesCopied = 0;
+    return KERNEL_COPY_UNSUPPORTED;
+}
+
+// Set the size of an open file
+bool FileIo::SetSize(FileHandle handle, long long size)
+{
+    LARGE_INTEGER distance;
+    distance.QuadPart = size;
+    if (!SetFilePointerEx(handle, distance, NULL, FILE_BEGIN))
+        return false;
+    if (!SetEndOfFile(handle))
+        return false;
+
+    LARGE_INTEGER start = { 0 };
+    return SetFilePointerEx(handle, start, NULL, FILE_BEGIN) != FALSE;
+}
+
+// Run a file system control code on a handle opened for overlapped I/O
+static bool ControlFile(FileHandle handle, DWORD code, void* input, DWORD inputSize)
+{
+    HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!hEvent)
+        return false;
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(hEvent) | 1);
+
+    DWORD bytes = 0;
+    bool success = DeviceIoControl(handle, code, input, inputSize, NULL, 0, NULL, &overlapped) != FALSE;
+    if (!success && GetLastError() == ERROR_IO_PENDING)
+        success = GetOverlappedResult(handle, &overlapped, &bytes, TRUE) != FALSE;
+
+    CloseHandle(hEvent);
+    return success;
+}
+
+// List the ranges of a file that hold data
+bool FileIo::GetDataRanges(const std::wstring& path, long long fileSize, std::vector<FileRange>& ranges)
+{
+    ranges.clear();
+
+    HANDLE hFile = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    // Ask for the allocated ranges in batches until the whole file is covered
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = fileSize;
+
+    FILE_ALLOCATED_RANGE_BUFFER found[64];
+    bool success = true;
+    while (query.Length.QuadPart > 0)
+    {
+        DWORD bytes = 0;
+        BOOL done = DeviceIoControl(hFile, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), found, sizeof(found), &bytes, NULL);
+        if (!done && GetLastError() != ERROR_MORE_DATA)
+        {
+            success = false;
+            break;
+        }
+
+        DWORD count = bytes / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        for (DWORD i = 0; i < count; i++)
+        {
+            FileRange range = { found[i].FileOffset.QuadPart, found[i].Length.QuadPart };
+            ranges.push_back(range);
+        }
+
+        if (done || count == 0)
+            break;
+
+        // Carry on after the last range returned
+        long long next = found[count - 1].FileOffset.QuadPart + found[count - 1].Length.QuadPart;
+        query.Length.QuadPart = fileSize - next;
+        query.FileOffset.QuadPart = next;
+    }
+
+    CloseHandle(hFile);
+    return success;
+}
+
+// Let a file have holes
+bool FileIo::SetSparse(FileHandle handle)
+{
+    FILE_SET_SPARSE_BUFFER sparse;
+    sparse.SetSparse = TRUE;
+    return ControlFile(handle, FSCTL_SET_SPARSE, &sparse, sizeof(sparse));
+}
+
+// Turn a range of a file into a hole
+bool FileIo::PunchHole(FileHandle handle, long long offset, long long length)
+{
+    // Deallocates on a sparse file; otherwise just writes zeros
+    FILE_ZERO_DATA_INFORMATION zero;
+    zero.FileOffset.QuadPart = offset;
+    zero.BeyondFinalZero.QuadPart = offset + length;
+    return ControlFile(handle, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero));
+}
+
+// Get the size of a file by path
+bool FileIo::GetSize(const std::wstring& path, long long* size)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fileInfo;
+    if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &fileInfo))
+        return false;
+
+    LARGE_INTEGER fileSize;
+    fileSize.HighPart = fileInfo.nFileSizeHigh;
+    fileSize.LowPart = fileInfo.nFileSizeLow;
+    *size = fileSize.QuadPart;
+    return true;
+}
+
+// Make a file's data durable
+bool FileIo::Flush(FileHandle handle)
+{
+    return FlushFileBuffers(handle) != FALSE;
+}
+
+// Windows can't evict a range of a file from the cache
+bool FileIo::DropCache(FileHandle handle, long long offset, long long length)
+{
+    (void)handle;
+    (void)offset;
+    (void)length;
+    return false;
+}
+
+// Get the last modification time of a file by path
+bool FileIo::GetModifiedTime(const std::wstring& path, long long* time)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fileInfo;
+    if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &fileInfo))
+        return false;
+
+    ULARGE_INTEGER writeTime;
+    writeTime.HighPart = fileInfo.ftLastWriteTime.dwHighDateTime;
+    writeTime.LowPart = fileInfo.ftLastWriteTime.dwLowDateTime;
+    *time = static_cast<long long>(writeTime.QuadPart);
+    return true;
+}
+
+// Delete a file
+bool FileIo::Delete(const std::wstring& path)
+{
+    return DeleteFile(path.c_str()) != FALSE;
+}
+
+// Rename a file, replacing the target
+bool FileIo::Rename(const std::wstring& from, const std::wstring& to)
+{
+    return MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+
+// Get an identifier for the device a file lives on
+bool FileIo::GetDeviceId(const std::wstring& path, unsigned long long* deviceId)
+{
+    WCHAR volumePath[MAX_PATH];
+    if (!GetVolumePathName(path.c_str(), volumePath, MAX_PATH))
+        return false;
+
+    DWORD serialNumber = 0;
+    if (!GetVolumeInformation(volumePath, NULL, 0, &serialNumber, NULL, NULL, NULL, 0))
+        return false;
+
+    *deviceId = serialNumber;
+    return true;
+}
+
+// Check if a file's volume is on a spinning disk
+DeviceKind FileIo::GetDeviceKind(const std::wstring& path)
+{
+    WCHAR volumePath[MAX_PATH];
+    WCHAR volumeName[MAX_PATH];
+    if (!GetVolumePathName(path.c_str(), volumePath, MAX_PATH) ||
+        !GetVolumeNameForVolumeMountPoint(volumePath, volumeName, MAX_PATH))
+        return DEVICE_KIND_UNKNOWN;
+
+    // Open the volume itself ("\\?\Volume{...}" without the trailing separator)
+    std::wstring device = volumeName;
+    if (!device.empty() && device.back() == L'\\')
+        device.pop_back();
+
+    HANDLE hVolume = CreateFile(device.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE)
+        return DEVICE_KIND_UNKNOWN;
+
+    STORAGE_PROPERTY_QUERY query = {};
+    query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    query.QueryType = PropertyStandardQuery;
+
+    DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {};
+    DWORD bytes = 0;
+    BOOL success = DeviceIoControl(hVolume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+        &penalty, sizeof(penalty), &bytes, NULL);
+    CloseHandle(hVolume);
+
+    if (!success || bytes < sizeof(penalty))
+        return DEVICE_KIND_UNKNOWN;
+    return penalty.IncursSeekPenalty ? DEVICE_KIND_ROTATIONAL : DEVICE_KIND_SOLID_STATE;
+}
+
+// Create a directory, succeeding if it already exists
+bool FileIo::CreateDirectoryPath(const std::wstring& path)
+{
+    if (CreateDirectory(path.c_str(), NULL))
+        return true;
+
+    return GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// List the entries of a directory
+bool FileIo::ListDirectory(const std::wstring& path, std::vector<DirectoryEntry>& entries)
+{
+    std::wstring searchPath = path;
+    if (!searchPath.empty() && searchPath.back() != PATH_SEPARATOR)
+        searchPath += PATH_SEPARATOR;
+
+    WIN32_FIND_DATA findData;
+    HANDLE hFind = FindFirstFile((searchPath + L"*").c_str(), &findData);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return false;
+
+    do {
+        // Skip . and .. directories
+        if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
+            continue;
+
+        DirectoryEntry entry;
+        entry.name = findData.cFileName;
+        entry.isDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        entries.push_back(entry);
+    } while (FindNextFile(hFind, &findData));
+
+    FindClose(hFind);
+    return true;
+}
+
+// Get the file name part of a path
+std::wstring FileIo::GetFileName(const std::wstring& path)
+{
+    const wchar_t* fileName = PathFindFileName(path.c_str());
+    return fileName ? fileName : L"";
+}
+
+// Compare two paths (case-insensitive)
+bool FileIo::SamePath(const std::wstring& a, const std::wstring& b)
+{
+    return _wcsicmp(a.c_str(), b.c_str()) == 0;
+}
+
+// Key for hashing paths (lowercased, as _wcsicmp compares)
+std::wstring FileIo::GetPathKey(const std::wstring& path)
+{
+    std::wstring key = path;
+    std::transform(key.begin(), key.end(), key.begin(), ::towlower);
+    return key;
+}
+
+#else
+
+// Convert a wide path to UTF-8
+std::string FileIo::ToNativePath(const std::wstring& path)
+{
+    std::string result;
+    result.reserve(path.size());
+
+    for (wchar_t wc : path)
+    {
+        uint32_t c = static_cast<uint32_t>(wc);
+        if (c < 0x80)
+        {
+            result += static_cast<char>(c);
+        }
+        else if (c < 0x800)
+        {
+            result += static_cast<char>(0xC0 | (c >> 6));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            result += static_cast<char>(0xE0 | (c >> 12));
+            result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            result += static_cast<char>(0xF0 | (c >> 18));
+            result += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            result += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+
+    return result;
+}
+
+// Convert a UTF-8 name back to a wide string
+std::wstring FileIo::FromNativePath(const std::string& path)
+{
+    std::wstring result;
+    result.reserve(path.size());
+
+    size_t i = 0;
+    while (i < path.size())
+    {
+        unsigned char c = static_cast<unsigned char>(path[i]);
+        uint32_t code = c;
+        size_t extra = 0;
+
+        if (c >= 0xF0)
+        {
+            code = c & 0x07;
+            extra = 3;
+        }
+        else if (c >= 0xE0)
+        {
+            code = c & 0x0F;
+            extra = 2;
+        }
+        else if (c >= 0xC0)
+        {
+            code = c & 0x1F;
+            extra = 1;
+        }
+
+        i++;
+        for (size_t k = 0; k < extra && i < path.size(); k++, i++)
+            code = (code << 6) | (static_cast<unsigned char>(path[i]) & 0x3F);
+
+        result += static_cast<wchar_t>(code);
+    }
+
+    return result;
+}
+
+// Open with O_DIRECT if asked, falling back to a buffered open on
+// filesystems that don't support it (e.g. tmpfs); aligned I/O still works there
+static int OpenFile(const std::string& path, int flags, bool unbuffered)
+{
+#ifdef O_DIRECT
+    if (unbuffered)
+    {
+        int fd = open(path.c_str(), flags | O_DIRECT, 0644);
+        if (fd >= 0 || errno != EINVAL)
+            return fd;
+    }
+#endif
+    return open(path.c_str(), flags, 0644);
+}
+
+// Open an existing file for reading
+FileHandle FileIo::OpenForRead(const std::wstring& path, bool unbuffered)
+{
+    int fd = OpenFile(ToNativePath(path), O_RDONLY | O_CLOEXEC, unbuffered);
+    if (fd < 0)
+        return INVALID_FILE_HANDLE;
+
+    // Same hint the Win32 build gives with FILE_FLAG_SEQUENTIAL_SCAN
+    if (!unbuffered)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+// Create (or truncate) a file for writing
+FileHandle FileIo::CreateForWrite(const std::wstring& path, bool unbuffered)
+{
+    int fd = OpenFile(ToNativePath(path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, unbuffered);
+    return fd < 0 ? INVALID_FILE_HANDLE : fd;
+}
+
+// Open a file for reading and writing, keeping its contents
+FileHandle FileIo::OpenForUpdate(const std::wstring& path, bool unbuffered)
+{
+    int fd = OpenFile(ToNativePath(path), O_RDWR | O_CREAT | O_CLOEXEC, unbuffered);
+    return fd < 0 ? INVALID_FILE_HANDLE : fd;
+}
+
+// Get the alignment unbuffered I/O needs
+bool FileIo::GetIoAlignment(const std::wstring& path, uint32_t* alignment)
+{
+    std::string nativePath = ToNativePath(path);
+
+#if defined(__linux__) && defined(STATX_DIOALIGN)
+    // Linux 6.1+ reports the exact O_DIRECT requirements
+    struct statx stx;
+    if (statx(AT_FDCWD, nativePath.c_str(), 0, STATX_DIOALIGN, &stx) == 0 &&
+        (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0)
+    {
+        *alignment = (std::max)(stx.stx_dio_offset_align, stx.stx_dio_mem_align);
+        return true;
+    }
+#endif
+
+    // Otherwise the filesystem block size is a safe multiple of the
+    // logical block size
+    struct stat st;
+    if (stat(nativePath.c_str(), &st) != 0)
+        return false;
+
+    *alignment = static_cast<uint32_t>(st.st_blksize);
+    return true;
+}
+
+// Close a handle opened by this class
+void FileIo::Close(FileHandle handle)
+{
+    if (handle != INVALID_FILE_HANDLE)
+        close(handle);
+}
+
+// Read at an absolute offset
+bool FileIo::ReadAt(FileHandle handle, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead)
+{
+    ssize_t result;
+    do {
+        result = pread(handle, buffer, length, static_cast<off_t>(offset));
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0)
+        return false;
+
+    *bytesRead = static_cast<uint32_t>(result);
+    return true;
+}
+
+// Write at an absolute offset
+bool FileIo::WriteAt(FileHandle handle, long long offset, const void* buffer, uint32_t length, uint32_t* bytesWritten)
+{
+    const char* data = static_cast<const char*>(buffer);
+    uint32_t written = 0;
+
+    // pwrite may write less than asked, keep going until everything is out
+    while (written < length)
+    {
+        ssize_t result = pwrite(handle, data + written, length - written, static_cast<off_t>(offset + written));
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (result == 0)
+            break;
+        written += static_cast<uint32_t>(result);
+    }
+
+    *bytesWritten = written;
+    return true;
+}
+
+// Clone a file with FICLONE
+bool FileIo::CloneFile(const std::wstring& sourcePath, const std::wstring& destinationPath)
+{
+#ifdef FICLONE
+    int source = open(ToNativePath(sourcePath).c_str(), O_RDONLY | O_CLOEXEC);
+    if (source < 0)
+        return false;
+
+    int destination = open(ToNativePath(destinationPath).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (destination < 0)
+    {
+        close(source);
+        return false;
+    }
+
+    // Shares the source's extents; fails with EXDEV or EOPNOTSUPP when the
+    // files aren't on the same copy-on-write filesystem
+    bool success = ioctl(destination, FICLONE, source) == 0;
+
+    close(destination);
+    close(source);
+    return success;
+#else
+    return false;
+#endif
+}
+
+#ifdef __linux__
+
+// Errors that mean "not for these files" rather than an I/O failure
+static bool IsUnsupportedError(int error)
+{
+    return error == EXDEV || error == EINVAL || error == ENOSYS ||
+        error == EOPNOTSUPP || error == EBADF || error == ESPIPE;
+}
+
+// Pipe used by splice, one per thread
+struct SplicePipe {
+    int fds[2];
+
+    SplicePipe() { fds[0] = fds[1] = -1; }
+    ~SplicePipe() { Reset(); }
+
+    bool Open()
+    {
+        if (fds[0] >= 0)
+            return true;
+        if (pipe2(fds, O_CLOEXEC) != 0)
+        {
+            fds[0] = fds[1] = -1;
+            return false;
+        }
+
+        // A bigger pipe moves a whole packet per splice
+        fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+        return true;
+    }
+
+    // Drop the pipe (and anything stuck in it after an error)
+    void Reset()
+    {
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
+};
+
+static thread_local SplicePipe t_splicePipe;
+
+// Copy a range with copy_file_range
+static KernelCopyResult CopyWithCopyFileRange(int source, long long sourceOffset,
+    int destination, long long destinationOffset, uint32_t length, uint32_t* bytesCopied)
+{
+    loff_t inOffset = sourceOffset;
+    loff_t outOffset = destinationOffset;
+    uint32_t copied = 0;
+
+    while (copied < length)
+    {
+        ssize_t result = copy_file_range(source, &inOffset, destination, &outOffset, length - copied, 0);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // Only a refusal before anything was copied switches method
+            int error = errno;
+            *bytesCopied = copied;
+            return copied == 0 && IsUnsupportedError(error) ? KERNEL_COPY_UNSUPPORTED : KERNEL_COPY_ERROR;
+        }
+        if (result == 0)
+            break;  // End of file
+        copied += static_cast<uint32_t>(result);
+    }
+
+    *bytesCopied = copied;
+    return KERNEL_COPY_OK;
+}
+
+// Copy a range with splice, through a pipe so both ends keep their offsets
+// (sendfile would write at the destination's file pointer, which the
+// workers share)
+static KernelCopyResult CopyWithSplice(int source, long long sourceOffset,
+    int destination, long long destinationOffset, uint32_t length, uint32_t* bytesCopied)
+{
+    *bytesCopied = 0;
+    if (!t_splicePipe.Open())
+        return KERNEL_COPY_UNSUPPORTED;
+
+    loff_t inOffset = sourceOffset;
+    loff_t outOffset = destinationOffset;
+    uint32_t copied = 0;
+
+    while (copied < length)
+    {
+        // File into the pipe
+        ssize_t filled = splice(source, &inOffset, t_splicePipe.fds[1], NULL, length - copied, SPLICE_F_MOVE);
+        if (filled < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            int error = errno;
+            *bytesCopied = copied;
+            return copied == 0 && IsUnsupportedError(error) ? KERNEL_COPY_UNSUPPORTED : KERNEL_COPY_ERROR;
+        }
+        if (filled == 0)
+            break;  // End of file
+
+        // Pipe into the destination
+        ssize_t drained = 0;
+        while (drained < filled)
+        {
+            ssize_t result = splice(t_splicePipe.fds[0], NULL, destination, &outOffset, filled - drained, SPLICE_F_MOVE);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+            {
+                // Whatever is left in the pipe belongs to this range; discard it
+                int error = result < 0 ? errno : EIO;
+                t_splicePipe.Reset();
+                *bytesCopied = copied;
+                return copied == 0 && IsUnsupportedError(error) ? KERNEL_COPY_UNSUPPORTED : KERNEL_COPY_ERROR;
+            }
+            drained += result;
+        }
+
+        copied += static_cast<uint32_t>(filled);
+    }
+
+    *bytesCopied = copied;
+    return KERNEL_COPY_OK;
+}
+
+// copy_file_range first, then splice
+KernelCopyMethod FileIo::GetKernelCopyMethod()
+{
+    return KERNEL_COPY_FILE_RANGE;
+}
+
+// Copy a range inside the kernel
+KernelCopyResult FileIo::CopyRange(KernelCopyMethod method,
+    FileHandle source, long long sourceOffset,
+    FileHandle destination, long long destinationOffset,
+    uint32_t length, uint32_t* bytesCopied)
+{
+    switch (method)
+    {
+    case KERNEL_COPY_FILE_RANGE:
+        return CopyWithCopyFileRange(source, sourceOffset, destination, destinationOffset, length, bytesCopied);
+    case KERNEL_COPY_SPLICE:
+        return CopyWithSplice(source, sourceOffset, destination, destinationOffset, length, bytesCopied);
+    default:
+        *bytesCopied = 0;
+        return KERNEL_COPY_UNSUPPORTED;
+    }
+}
+
+#else
+
+// No kernel-side range copy on other POSIX systems
+KernelCopyMethod FileIo::GetKernelCopyMethod()
+{
+    return KERNEL_COPY_NONE;
+}
+
+// Copy a range inside the kernel (not available here)
+KernelCopyResult FileIo::CopyRange(KernelCopyMethod method,
+    FileHandle source, long long sourceOffset,
+    FileHandle destination, long long destinationOffset,
+    uint32_t length, uint32_t* bytesCopied)
+{
+    *bytesCopied = 0;
+    return KERNEL_COPY_UNSUPPORTED;
+}
+
+#endif
+
+// Set the size of an open file
+bool FileIo::SetSize(FileHandle handle, long long size)
+{
+    return ftruncate(handle, static_cast<off_t>(size)) == 0;
+}
+
+// List the ranges of a file that hold data
+bool FileIo::GetDataRanges(const std::wstring& path, long long fileSize, std::vector<FileRange>& ranges)
+{
+    ranges.clear();
+
+#ifdef SEEK_DATA
+    int fd = open(ToNativePath(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    // Filesystems without hole tracking report the whole file as data
+    bool success = true;
+    off_t position = 0;
+    while (position < fileSize)
+    {
+        off_t data = lseek(fd, position, SEEK_DATA);
+        if (data < 0)
+        {
+            // ENXIO: nothing but a hole up to the end
+            success = errno == ENXIO;
+            break;
+        }
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > fileSize)
+            hole = static_cast<off_t>(fileSize);
+        if (data >= hole)
+            break;
+
+        FileRange range = { static_cast<long long>(data), static_cast<long long>(hole - data) };
+        ranges.push_back(range);
+        position = hole;
+    }
+
+    close(fd);
+    return success;
+#else
+    return false;
+#endif
+}
+
+// Let a file have holes
+bool FileIo::SetSparse(FileHandle handle)
+{
+    // Always allowed on POSIX filesystems
+    (void)handle;
+    return true;
+}
+
+// Turn a range of a file into a hole
+bool FileIo::PunchHole(FileHandle handle, long long offset, long long length)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate(handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        static_cast<off_t>(offset), static_cast<off_t>(length)) == 0;
+#else
+    return false;
+#endif
+}
+
+// Get the size of a file by path
+bool FileIo::GetSize(const std::wstring& path, long long* size)
+{
+    struct stat st;
+    if (stat(ToNativePath(path).c_str(), &st) != 0)
+        return false;
+
+    *size = static_cast<long long>(st.st_size);
+    return true;
+}
+
+// Make a file's data durable
+bool FileIo::Flush(FileHandle handle)
+{
+    return fdatasync(handle) == 0;
+}
+
+// Evict a range of a file from the page cache
+bool FileIo::DropCache(FileHandle handle, long long offset, long long length)
+{
+    return posix_fadvise(handle, offset, length, POSIX_FADV_DONTNEED) == 0;
+}
+
+// Get the last modification time of a file by path
+bool FileIo::GetModifiedTime(const std::wstring& path, long long* time)
+{
+    struct stat st;
+    if (stat(ToNativePath(path).c_str(), &st) != 0)
+        return false;
+
+#ifdef __APPLE__
+    *time = static_cast<long long>(st.st_mtimespec.tv_sec) * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    *time = static_cast<long long>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// Delete a file
+bool FileIo::Delete(const std::wstring& path)
+{
+    return unlink(ToNativePath(path).c_str()) == 0;
+}
+
+// Rename a file, replacing the target
+bool FileIo::Rename(const std::wstring& from, const std::wstring& to)
+{
+    return rename(ToNativePath(from).c_str(), ToNativePath(to).c_str()) == 0;
+}
+
+// Get an identifier for the device a file lives on
+bool FileIo::GetDeviceId(const std::wstring& path, unsigned long long* deviceId)
+{
+    struct stat st;
+    if (stat(ToNativePath(path).c_str(), &st) != 0)
+        return false;
+
+    *deviceId = static_cast<unsigned long long>(st.st_dev);
+    return true;
+}
+
+// Check if a file's device is a spinning disk
+DeviceKind FileIo::GetDeviceKind(const std::wstring& path)
+{
+#ifdef __linux__
+    struct stat st;
+    if (stat(ToNativePath(path).c_str(), &st) != 0)
+        return DEVICE_KIND_UNKNOWN;
+
+    // A partition has no queue of its own; its disk is the parent directory.
+    // Filesystems without a block device (tmpfs, NFS, overlays) have no entry
+    std::string device = "/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev));
+    const char* queues[] = { "/queue/rotational", "/../queue/rotational" };
+    for (const char* queue : queues)
+    {
+        int fd = open((device + queue).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        char value = 0;
+        ssize_t bytes = read(fd, &value, 1);
+        close(fd);
+        if (bytes == 1 && (value == '0' || value == '1'))
+            return value == '1' ? DEVICE_KIND_ROTATIONAL : DEVICE_KIND_SOLID_STATE;
+    }
+#else
+    (void)path;
+#endif
+    return DEVICE_KIND_UNKNOWN;
+}
+
+// Create a directory, succeeding if it already exists
+bool FileIo::CreateDirectoryPath(const std::wstring& path)
+{
+    std::string nativePath = ToNativePath(path);
+    while (nativePath.size() > 1 && nativePath.back() == '/')
+        nativePath.pop_back();
+
+    if (mkdir(nativePath.c_str(), 0755) == 0)
+        return true;
+
+    return errno == EEXIST;
+}
+
+// List the entries of a directory
+bool FileIo::ListDirectory(const std::wstring& path, std::vector<DirectoryEntry>& entries)
+{
+    std::string nativePath = ToNativePath(path);
+    DIR* dir = opendir(nativePath.c_str());
+    if (!dir)
+        return false;
+
+    while (struct dirent* ent = readdir(dir))
+    {
+        // Skip . and .. directories
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        DirectoryEntry entry;
+        entry.name = FromNativePath(ent->d_name);
+
+        // Some filesystems don't fill d_type, fall back to stat
+        if (ent->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            std::string childPath = nativePath + "/" + ent->d_name;
+            entry.isDirectory = stat(childPath.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        else
+        {
+            entry.isDirectory = ent->d_type == DT_DIR;
+        }
+
+        entries.push_back(entry);
+    }
+
+    closedir(dir);
+    return true;
+}
+
+// Get the file name part of a path
+std::wstring FileIo::GetFileName(const std::wstring& path)
+{
+    size_t pos = path.find_last_of(PATH_SEPARATOR);
+    return pos == std::wstring::npos ? path : path.substr(pos + 1);
+}
+
+// Compare two paths (case-sensitive, like the filesystem)
+bool FileIo::SamePath(const std::wstring& a, const std::wstring& b)
+{
+    return a == b;
+}
+
+// Key for hashing paths (the path itself, as paths are case-sensitive)
+std::wstring FileIo::GetPathKey(const std::wstring& path)
+{
+    return path;
+}
+
+#endif
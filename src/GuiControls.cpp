@@ -12,7 +12,13 @@ MainWindow::MainWindow(HINSTANCE hInstance)
     m_destinationEdit(nullptr),
     m_progressBar(nullptr),
     m_statusBar(nullptr),
-    m_packetSizeCombo(nullptr)
+    m_packetSizeCombo(nullptr),
+    m_replicaCheck(nullptr),
+    m_queueDepthCombo(nullptr),
+    m_threadCountCombo(nullptr),
+    m_directIoCheck(nullptr),
+    m_deltaSyncCheck(nullptr),
+    m_zeroBlocksCheck(nullptr)
 {
 }
 
@@ -169,9 +175,12 @@ LRESULT MainWindow::HandleMessage(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lP
         break;
 
     case WM_UPDATE_PROGRESS:
+    {
         // Update progress from worker thread
-        SetProgress((int)wParam);
+        std::unique_ptr<ProgressSample> sample(reinterpret_cast<ProgressSample*>(lParam));
+        OnProgress(*sample);
         break;
+    }
 
     case WM_COPY_COMPLETE:
         // Copy operation completed
@@ -286,7 +295,7 @@ void MainWindow::CreateControls(HWND hwnd)
     CreateWindow(
         L"BUTTON", L"Settings",
         WS_CHILD | WS_VISIBLE | BS_GROUPBOX,
-        10, 410, 760, 60,
+        10, 410, 760, 75,
         hwnd, nullptr, m_hInstance, nullptr);
 
     // Create packet size dropdown
@@ -303,6 +312,7 @@ void MainWindow::CreateControls(HWND hwnd)
         hwnd, (HMENU)ID_PACKET_SIZE_COMBO, m_hInstance, nullptr);
 
     // Add packet size options
+    ComboBox_AddString(m_packetSizeCombo, L"Auto");
     ComboBox_AddString(m_packetSizeCombo, L"16 KB");
     ComboBox_AddString(m_packetSizeCombo, L"32 KB");
     ComboBox_AddString(m_packetSizeCombo, L"64 KB");
@@ -310,20 +320,93 @@ void MainWindow::CreateControls(HWND hwnd)
     ComboBox_AddString(m_packetSizeCombo, L"256 KB");
     ComboBox_AddString(m_packetSizeCombo, L"512 KB");
     ComboBox_AddString(m_packetSizeCombo, L"1 MB");
-    ComboBox_SetCurSel(m_packetSizeCombo, 2);  // Default to 64 KB
+    ComboBox_SetCurSel(m_packetSizeCombo, 0);  // Default to tuning while copying
+
+    // Create queue depth dropdown
+    CreateWindow(
+        L"STATIC", L"Queue Depth:",
+        WS_CHILD | WS_VISIBLE,
+        280, 435, 90, 20,
+        hwnd, nullptr, m_hInstance, nullptr);
+
+    m_queueDepthCombo = CreateWindow(
+        L"COMBOBOX", L"",
+        WS_CHILD | WS_VISIBLE | CBS_DROPDOWNLIST | WS_VSCROLL,
+        375, 435, 80, 200,
+        hwnd, (HMENU)ID_QUEUE_DEPTH_COMBO, m_hInstance, nullptr);
+
+    // Add queue depth options
+    ComboBox_AddString(m_queueDepthCombo, L"1");
+    ComboBox_AddString(m_queueDepthCombo, L"2");
+    ComboBox_AddString(m_queueDepthCombo, L"4");
+    ComboBox_AddString(m_queueDepthCombo, L"8");
+    ComboBox_AddString(m_queueDepthCombo, L"16");
+    ComboBox_AddString(m_queueDepthCombo, L"32");
+    ComboBox_AddString(m_queueDepthCombo, L"64");
+    ComboBox_SetCurSel(m_queueDepthCombo, 3);  // Default to 8
+
+    // Create worker thread count dropdown
+    CreateWindow(
+        L"STATIC", L"Threads:",
+        WS_CHILD | WS_VISIBLE,
+        470, 435, 60, 20,
+        hwnd, nullptr, m_hInstance, nullptr);
+
+    m_threadCountCombo = CreateWindow(
+        L"COMBOBOX", L"",
+        WS_CHILD | WS_VISIBLE | CBS_DROPDOWNLIST | WS_VSCROLL,
+        530, 435, 80, 200,
+        hwnd, (HMENU)ID_THREAD_COUNT_COMBO, m_hInstance, nullptr);
+
+    // Add thread count options
+    ComboBox_AddString(m_threadCountCombo, L"Auto");
+    ComboBox_AddString(m_threadCountCombo, L"1");
+    ComboBox_AddString(m_threadCountCombo, L"2");
+    ComboBox_AddString(m_threadCountCombo, L"4");
+    ComboBox_AddString(m_threadCountCombo, L"8");
+    ComboBox_AddString(m_threadCountCombo, L"16");
+    ComboBox_SetCurSel(m_threadCountCombo, 0);  // Default to one per source device
+
+    // Create replica mode check box
+    m_replicaCheck = CreateWindow(
+        L"BUTTON", L"Combine replicas",
+        WS_CHILD | WS_VISIBLE | BS_AUTOCHECKBOX,
+        625, 435, 145, 20,
+        hwnd, (HMENU)ID_REPLICA_CHECK, m_hInstance, nullptr);
+
+    // Create direct I/O check box
+    m_directIoCheck = CreateWindow(
+        L"BUTTON", L"Direct I/O",
+        WS_CHILD | WS_VISIBLE | BS_AUTOCHECKBOX,
+        625, 457, 145, 20,
+        hwnd, (HMENU)ID_DIRECT_IO_CHECK, m_hInstance, nullptr);
+
+    // Create delta sync check box
+    m_deltaSyncCheck = CreateWindow(
+        L"BUTTON", L"Only changed blocks",
+        WS_CHILD | WS_VISIBLE | BS_AUTOCHECKBOX,
+        470, 457, 150, 20,
+        hwnd, (HMENU)ID_DELTA_SYNC_CHECK, m_hInstance, nullptr);
+
+    // Create zero block check box
+    m_zeroBlocksCheck = CreateWindow(
+        L"BUTTON", L"Skip zero blocks",
+        WS_CHILD | WS_VISIBLE | BS_AUTOCHECKBOX,
+        315, 457, 150, 20,
+        hwnd, (HMENU)ID_ZERO_BLOCKS_CHECK, m_hInstance, nullptr);
 
     // Create progress bar group
     CreateWindow(
         L"BUTTON", L"Progress",
         WS_CHILD | WS_VISIBLE | BS_GROUPBOX,
-        10, 480, 760, 40,
+        10, 495, 760, 40,
         hwnd, nullptr, m_hInstance, nullptr);
 
     // Create progress bar
     m_progressBar = CreateWindowEx(
         0, PROGRESS_CLASS, L"",
         WS_CHILD | WS_VISIBLE,
-        20, 500, 740, 30,
+        20, 515, 740, 30,
         hwnd, (HMENU)ID_PROGRESS_BAR, m_hInstance, nullptr);
 
     // Initialize progress bar range (0-100)
@@ -333,13 +416,13 @@ void MainWindow::CreateControls(HWND hwnd)
     CreateWindow(
         L"BUTTON", L"Start Copy",
         WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
-        280, 530, 120, 30,
+        280, 545, 120, 30,
         hwnd, (HMENU)ID_START_BUTTON, m_hInstance, nullptr);
 
     HWND hCancelButton = CreateWindow(
         L"BUTTON", L"Cancel",
         WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON | WS_DISABLED,
-        410, 530, 120, 30,
+        410, 545, 120, 30,
         hwnd, (HMENU)ID_CANCEL_BUTTON, m_hInstance, nullptr);
 
     // Status bar at the bottom
@@ -365,8 +448,8 @@ void MainWindow::ResizeControls(HWND hwnd)
     // Resize and reposition groups
     SetWindowPos(GetDlgItem(hwnd, 0), nullptr, 10, 10, width - 20, 320, SWP_NOZORDER);
     SetWindowPos(GetDlgItem(hwnd, 0), nullptr, 10, 340, width - 20, 60, SWP_NOZORDER);
-    SetWindowPos(GetDlgItem(hwnd, 0), nullptr, 10, 410, width - 20, 60, SWP_NOZORDER);
-    SetWindowPos(GetDlgItem(hwnd, 0), nullptr, 10, 480, width - 20, 40, SWP_NOZORDER);
+    SetWindowPos(GetDlgItem(hwnd, 0), nullptr, 10, 410, width - 20, 75, SWP_NOZORDER);
+    SetWindowPos(GetDlgItem(hwnd, 0), nullptr, 10, 495, width - 20, 40, SWP_NOZORDER);
 
     // Resize list view
     SetWindowPos(m_sourceListView, nullptr, 20, 30, width - 40, 250, SWP_NOZORDER);
@@ -378,11 +461,11 @@ void MainWindow::ResizeControls(HWND hwnd)
     SetWindowPos(GetDlgItem(hwnd, ID_BROWSE_BUTTON), nullptr, width - 110, 365, 90, 25, SWP_NOZORDER);
 
     // Update progress bar width
-    SetWindowPos(m_progressBar, nullptr, 20, 500, width - 40, 15, SWP_NOZORDER);
+    SetWindowPos(m_progressBar, nullptr, 20, 515, width - 40, 15, SWP_NOZORDER);
 
     // Update action buttons position
-    SetWindowPos(GetDlgItem(hwnd, ID_START_BUTTON), nullptr, (width / 2) - 130, 530, 120, 30, SWP_NOZORDER);
-    SetWindowPos(GetDlgItem(hwnd, ID_CANCEL_BUTTON), nullptr, (width / 2) + 10, 530, 120, 30, SWP_NOZORDER);
+    SetWindowPos(GetDlgItem(hwnd, ID_START_BUTTON), nullptr, (width / 2) - 130, 545, 120, 30, SWP_NOZORDER);
+    SetWindowPos(GetDlgItem(hwnd, ID_CANCEL_BUTTON), nullptr, (width / 2) + 10, 545, 120, 30, SWP_NOZORDER);
 
     // Position status bar
     SendMessage(m_statusBar, WM_SIZE, 0, 0);
@@ -449,19 +532,47 @@ void MainWindow::EnableCopyControls(bool enable)
     EnableWindow(GetDlgItem(m_hwnd, ID_START_BUTTON), enable);
     EnableWindow(GetDlgItem(m_hwnd, ID_BROWSE_BUTTON), enable);
     EnableWindow(m_packetSizeCombo, enable);
+    EnableWindow(m_queueDepthCombo, enable);
+    EnableWindow(m_threadCountCombo, enable);
+    EnableWindow(m_replicaCheck, enable);
+    EnableWindow(m_directIoCheck, enable);
+    EnableWindow(m_deltaSyncCheck, enable);
+    EnableWindow(m_zeroBlocksCheck, enable);
     EnableWindow(GetDlgItem(m_hwnd, ID_CANCEL_BUTTON), !enable);
 }
 
-// Get selected packet size in bytes
+// Get selected packet size in bytes (AUTO_PACKET_SIZE for automatic)
 int MainWindow::GetSelectedPacketSize()
 {
     int index = ComboBox_GetCurSel(m_packetSizeCombo);
-    if (index == CB_ERR)
-        return 64 * 1024; // Default to 64 KB
+    if (index == CB_ERR || index == 0)
+        return AUTO_PACKET_SIZE; // Tune while copying
 
     // Calculate packet size based on selection
-    // 16KB * 2^index
-    return 16 * 1024 * (1 << index);
+    // 16KB * 2^(index - 1)
+    return 16 * 1024 * (1 << (index - 1));
+}
+
+// Get selected queue depth (packets in flight)
+int MainWindow::GetSelectedQueueDepth()
+{
+    int index = ComboBox_GetCurSel(m_queueDepthCombo);
+    if (index == CB_ERR)
+        return 8; // Default to 8
+
+    // 1 << index
+    return 1 << index;
+}
+
+// Get selected worker thread count (0 = one per source device)
+int MainWindow::GetSelectedThreadCount()
+{
+    int index = ComboBox_GetCurSel(m_threadCountCombo);
+    if (index == CB_ERR || index == 0)
+        return 0; // Auto
+
+    // 1 << (index - 1)
+    return 1 << (index - 1);
 }
 
 // Add source button click handler
@@ -601,32 +712,35 @@ void MainWindow::OnMeasureSpeeds()
 
     // Create a list of paths to measure
     std::vector<std::wstring> paths;
-    std::map<std::wstring, long long> speedMap;
+    std::map<std::wstring, SourceInfo> infoMap;
 
     for (const auto& source : sources)
     {
         paths.push_back(source.path);
+        infoMap[source.path] = source;
     }
 
-    // Measure and sort the sources
-    if (m_speedMeasure.MeasureAndSortSources(paths))
+    // Probe every source once, all devices at the same time, and sort them
+    std::vector<SourceSpeed> speeds;
+    if (m_speedMeasure.MeasureAndSortSources(paths, speeds))
     {
-        // Get the speeds for each path
-        for (const auto& path : paths)
-        {
-            long long speed = m_speedMeasure.MeasureSourceSpeed(path);
-            speedMap[path] = speed;
-        }
-
         // Clear existing sources and add them back in sorted order with speeds
         m_fileCopier.ClearSources();
-        for (const auto& path : paths)
+        for (size_t i = 0; i < paths.size(); i++)
         {
-            // Add source with speed information
-            SourceInfo info;
-            info.path = path;
+            // Add source with speed information, keeping its group and relative path
+            SourceInfo info = infoMap[paths[i]];
             info.status = L"Ready";
-            info.speed = speedMap[path];
+            info.speed = speeds[i].speed;
+
+            // The spread and first-byte latency go in the status column
+            if (speeds[i].speed >= 0)
+            {
+                WCHAR statusText[96];
+                StringCchPrintf(statusText, 96, L"Ready (+/-%.2f Mbps, first byte %.1f ms)",
+                    speeds[i].speedSpread / 1000.0, speeds[i].latency * 1000.0);
+                info.status = statusText;
+            }
 
             // Add directly to the FileCopier's sources
             m_fileCopier.AddSourceWithInfo(info);
@@ -674,6 +788,20 @@ void MainWindow::OnStartCopy()
     // Get packet size from combo box
     int packetSize = GetSelectedPacketSize();
 
+    // Read each file from all of its replicas if requested
+    m_fileCopier.SetReplicaMode(Button_GetCheck(m_replicaCheck) == BST_CHECKED);
+
+    // Number of packets kept in flight
+    m_fileCopier.SetQueueDepth(GetSelectedQueueDepth());
+
+    // Number of worker threads sharing the packets
+    m_fileCopier.SetThreadCount(GetSelectedThreadCount());
+
+    // Keep huge copies out of the page cache if requested
+    m_fileCopier.SetDirectIo(Button_GetCheck(m_directIoCheck) == BST_CHECKED);
+    m_fileCopier.SetDeltaSync(Button_GetCheck(m_deltaSyncCheck) == BST_CHECKED);
+    m_fileCopier.SetSkipZeroBlocks(Button_GetCheck(m_zeroBlocksCheck) == BST_CHECKED);
+
     // Start the copy operation
     if (!m_fileCopier.StartCopy(destinationPath, ProgressCallback, this, packetSize))
     {
@@ -706,22 +834,37 @@ void MainWindow::OnCopyComplete(bool success)
     EnableCopyControls(true);
 }
 
+// Show a progress sample (UI thread)
+void MainWindow::OnProgress(const ProgressSample& sample)
+{
+    // Calculate percentage
+    int percent = (sample.total > 0) ? static_cast<int>((sample.completed * 100) / sample.total) : 0;
+    SetProgress(percent);
+
+    // Update status text, with the file rate for trees of small files
+    WCHAR statusText[128];
+    StringCchPrintf(statusText, 128, L"Copying: %lld of %lld packets (%d%%), %lld of %lld files, %.0f files/s",
+        sample.completed, sample.total, percent, sample.progress.filesDone, sample.progress.filesTotal,
+        sample.progress.filesPerSecond);
+    UpdateStatusText(statusText);
+}
+
 // Progress callback function (static)
-void MainWindow::ProgressCallback(int completed, int total, void* userData)
+void MainWindow::ProgressCallback(long long completed, long long total, void* userData)
 {
     MainWindow* pThis = static_cast<MainWindow*>(userData);
     if (pThis)
     {
-        // Calculate percentage
-        int percent = (total > 0) ? (completed * 100) / total : 0;
-
-        // Update UI (thread-safe using messages)
-        PostMessage(pThis->m_hwnd, WM_UPDATE_PROGRESS, (WPARAM)percent, 0);
-
-        // Update status text
-        WCHAR statusText[128];
-        StringCchPrintf(statusText, 128, L"Copying: %d of %d packets (%d%%)", completed, total, percent);
-        SendMessage(pThis->m_statusBar, SB_SETTEXT, 0, (LPARAM)statusText);
+        // Update UI (thread-safe using messages): the controls are only
+        // touched on the UI thread, so a busy window never holds the copy up
+        std::unique_ptr<ProgressSample> sample(new ProgressSample());
+        sample->completed = completed;
+        sample->total = total;
+        sample->progress = pThis->m_fileCopier.GetProgress();
+        if (PostMessage(pThis->m_hwnd, WM_UPDATE_PROGRESS, 0, reinterpret_cast<LPARAM>(sample.get())))
+        {
+            sample.release();
+        }
 
         // If completed, send completion message
         if (completed >= total)
@@ -0,0 +1,155 @@
+#include "../include/IoBackend.h"
+#include <boost/chrono.hpp>
+
+// Native backend: the platform's filesystem through FileIo
+class NativeIoBackend : public IoBackend {
+public:
+    const wchar_t* GetName() const override
+    {
+#ifdef _WIN32
+        return L"win32";
+#else
+        return L"posix";
+#endif
+    }
+
+    bool IsNative() const override
+    {
+        return true;
+    }
+
+    double GetTime() const override
+    {
+        return boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    FileHandle OpenForRead(const std::wstring& path, bool unbuffered) override
+    {
+        return FileIo::OpenForRead(path, unbuffered);
+    }
+
+    FileHandle CreateForWrite(const std::wstring& path, bool unbuffered) override
+    {
+        return FileIo::CreateForWrite(path, unbuffered);
+    }
+
+    FileHandle OpenForUpdate(const std::wstring& path, bool unbuffered) override
+    {
+        return FileIo::OpenForUpdate(path, unbuffered);
+    }
+
+    void Close(FileHandle handle) override
+    {
+        FileIo::Close(handle);
+    }
+
+    bool GetIoAlignment(const std::wstring& path, uint32_t* alignment) override
+    {
+        return FileIo::GetIoAlignment(path, alignment);
+    }
+
+    bool ReadAt(FileHandle handle, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead) override
+    {
+        return FileIo::ReadAt(handle, offset, buffer, length, bytesRead);
+    }
+
+    bool WriteAt(FileHandle handle, long long offset, const void* buffer, uint32_t length, uint32_t* bytesWritten) override
+    {
+        return FileIo::WriteAt(handle, offset, buffer, length, bytesWritten);
+    }
+
+    bool Flush(FileHandle handle) override
+    {
+        return FileIo::Flush(handle);
+    }
+
+    bool DropCache(FileHandle handle, long long offset, long long length) override
+    {
+        return FileIo::DropCache(handle, offset, length);
+    }
+
+    bool SetSize(FileHandle handle, long long size) override
+    {
+        return FileIo::SetSize(handle, size);
+    }
+
+    bool SetSparse(FileHandle handle) override
+    {
+        return FileIo::SetSparse(handle);
+    }
+
+    bool PunchHole(FileHandle handle, long long offset, long long length) override
+    {
+        return FileIo::PunchHole(handle, offset, length);
+    }
+
+    bool GetDataRanges(const std::wstring& path, long long fileSize, std::vector<FileRange>& ranges) override
+    {
+        return FileIo::GetDataRanges(path, fileSize, ranges);
+    }
+
+    bool GetSize(const std::wstring& path, long long* size) override
+    {
+        return FileIo::GetSize(path, size);
+    }
+
+    bool GetModifiedTime(const std::wstring& path, long long* time) override
+    {
+        return FileIo::GetModifiedTime(path, time);
+    }
+
+    bool GetDeviceId(const std::wstring& path, unsigned long long* deviceId) override
+    {
+        return FileIo::GetDeviceId(path, deviceId);
+    }
+
+    DeviceKind GetDeviceKind(const std::wstring& path) override
+    {
+        return FileIo::GetDeviceKind(path);
+    }
+
+    bool ListDirectory(const std::wstring& path, std::vector<DirectoryEntry>& entries) override
+    {
+        return FileIo::ListDirectory(path, entries);
+    }
+
+    bool CreateDirectoryPath(const std::wstring& path) override
+    {
+        return FileIo::CreateDirectoryPath(path);
+    }
+
+    bool Delete(const std::wstring& path) override
+    {
+        return FileIo::Delete(path);
+    }
+
+    bool Rename(const std::wstring& from, const std::wstring& to) override
+    {
+        return FileIo::Rename(from, to);
+    }
+
+    KernelCopyMethod GetKernelCopyMethod() override
+    {
+        return FileIo::GetKernelCopyMethod();
+    }
+
+    KernelCopyResult CopyRange(KernelCopyMethod method,
+        FileHandle source, long long sourceOffset,
+        FileHandle destination, long long destinationOffset,
+        uint32_t length, uint32_t* bytesCopied) override
+    {
+        return FileIo::CopyRange(method, source, sourceOffset, destination, destinationOffset, length, bytesCopied);
+    }
+
+    bool CloneFile(const std::wstring& sourcePath, const std::wstring& destinationPath) override
+    {
+        return FileIo::CloneFile(sourcePath, destinationPath);
+    }
+};
+
+// The platform's filesystem, through FileIo
+std::shared_ptr<IoBackend> IoBackend::GetNative()
+{
+    static std::shared_ptr<IoBackend> native = std::make_shared<NativeIoBackend>();
+    return native;
+}
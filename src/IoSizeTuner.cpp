@@ -0,0 +1,113 @@
+#include "../include/IoSizeTuner.h"
+#include <algorithm>
+
+// Round down to a power of two (at least 1)
+static uint32_t FloorPowerOfTwo(uint32_t value)
+{
+    uint32_t result = 1;
+    while (result <= value / 2)
+        result *= 2;
+    return result;
+}
+
+// Constructor
+IoSizeTuner::IoSizeTuner(uint32_t minSize, uint32_t maxSize, uint32_t initialSize)
+    : m_growing(true),
+    m_windowReads(0),
+    m_windowBytes(0.0),
+    m_windowSeconds(0.0),
+    m_lastThroughput(0.0),
+    m_flatWindows(0)
+{
+    m_minSize = FloorPowerOfTwo(minSize);
+    m_maxSize = (std::max)(m_minSize, FloorPowerOfTwo(maxSize));
+    m_size = (std::min)((std::max)(FloorPowerOfTwo(initialSize), m_minSize), m_maxSize);
+}
+
+// Destructor
+IoSizeTuner::~IoSizeTuner()
+{
+}
+
+// Size to use for the next read
+uint32_t IoSizeTuner::GetIoSize() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_size;
+}
+
+// Report a finished read
+void IoSizeTuner::OnReadFinished(bool success, uint32_t bytes, double seconds)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    // Back off straight away on errors (multiplicative decrease)
+    if (!success)
+    {
+        m_size = (std::max)(m_minSize, m_size / 2);
+        m_growing = true;
+        m_lastThroughput = 0.0;
+        m_windowReads = 0;
+        m_windowBytes = 0.0;
+        m_windowSeconds = 0.0;
+        return;
+    }
+
+    m_windowReads++;
+    m_windowBytes += bytes;
+    m_windowSeconds += (std::max)(seconds, 1e-6);
+    if (m_windowReads < WINDOW_READS)
+        return;
+
+    double throughput = m_windowBytes / m_windowSeconds;
+    m_windowReads = 0;
+    m_windowBytes = 0.0;
+    m_windowSeconds = 0.0;
+
+    if (m_lastThroughput == 0.0)
+    {
+        // First window at this size: nothing to compare against yet
+        m_lastThroughput = throughput;
+        Step();
+        return;
+    }
+
+    if (throughput > m_lastThroughput * (1.0 + THRESHOLD))
+    {
+        // Better: keep going the same way
+        m_flatWindows = 0;
+        m_lastThroughput = throughput;
+        Step();
+    }
+    else if (throughput < m_lastThroughput * (1.0 - THRESHOLD))
+    {
+        // Worse: undo the last step and compare against the level seen
+        // there before; the next probe goes the other way
+        m_flatWindows = 0;
+        m_growing = !m_growing;
+        Step();
+    }
+    else if (++m_flatWindows >= FLAT_WINDOWS_BEFORE_PROBE)
+    {
+        // Settled for a while: probe one step to see if things changed
+        m_flatWindows = 0;
+        m_lastThroughput = throughput;
+        Step();
+    }
+    else
+    {
+        // Settled: track the current level
+        m_lastThroughput = throughput;
+    }
+}
+
+// Move to the next size in the current direction
+void IoSizeTuner::Step()
+{
+    if (m_growing && m_size >= m_maxSize)
+        m_growing = false;
+    else if (!m_growing && m_size <= m_minSize)
+        m_growing = true;
+
+    m_size = m_growing ? (std::min)(m_maxSize, m_size * 2) : (std::max)(m_minSize, m_size / 2);
+}
@@ -0,0 +1,119 @@
+#include "../include/PacketScheduler.h"
+#include <algorithm>
+
+// Constructor
+PacketScheduler::PacketScheduler(int workerCount, int grain)
+    : m_grain((std::max)(1, grain)),
+    m_steals(0)
+{
+    workerCount = (std::max)(1, workerCount);
+    for (int i = 0; i < workerCount; i++)
+    {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+}
+
+// Destructor
+PacketScheduler::~PacketScheduler()
+{
+}
+
+// Add a range to a worker's own deque
+void PacketScheduler::Push(int worker, const PacketRange& range)
+{
+    if (range.packetCount <= 0)
+        return;
+
+    WorkerQueue& queue = *m_queues[worker % m_queues.size()];
+    boost::mutex::scoped_lock lock(queue.mutex);
+    queue.ranges.push_back(range);
+}
+
+// Get the next range for a worker
+bool PacketScheduler::Pop(int worker, PacketRange* range)
+{
+    WorkerQueue& queue = *m_queues[worker % m_queues.size()];
+
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(queue.mutex);
+            if (!queue.ranges.empty())
+            {
+                // Take a bite from the start of the newest range, so the file is
+                // still read front to back, and leave the rest stealable
+                PacketRange& back = queue.ranges.back();
+                if (back.packetCount > m_grain)
+                {
+                    range->fileIndex = back.fileIndex;
+                    range->firstPacket = back.firstPacket;
+                    range->packetCount = m_grain;
+                    back.firstPacket += m_grain;
+                    back.packetCount -= m_grain;
+                }
+                else
+                {
+                    *range = back;
+                    queue.ranges.pop_back();
+                }
+                return true;
+            }
+        }
+
+        // Own deque is empty; stolen work goes into it so it can be stolen again
+        PacketRange stolen;
+        if (!Steal(worker, &stolen))
+            return false;
+
+        Push(worker, stolen);
+    }
+}
+
+// Take work from another worker's deque
+bool PacketScheduler::Steal(int thief, PacketRange* range)
+{
+    int count = static_cast<int>(m_queues.size());
+
+    // Try each other worker once, starting with the next one
+    for (int i = 1; i < count; i++)
+    {
+        WorkerQueue& victim = *m_queues[(thief + i) % count];
+        boost::mutex::scoped_lock lock(victim.mutex);
+        if (victim.ranges.empty())
+            continue;
+
+        // Take the oldest range, or the back half of it if it's large, so
+        // the victim carries on where it was and the thief starts further in
+        PacketRange& front = victim.ranges.front();
+        if (front.packetCount > m_grain * 2)
+        {
+            int half = front.packetCount / 2;
+            range->fileIndex = front.fileIndex;
+            range->firstPacket = front.firstPacket + front.packetCount - half;
+            range->packetCount = half;
+            front.packetCount -= half;
+        }
+        else
+        {
+            *range = front;
+            victim.ranges.pop_front();
+        }
+
+        m_steals++;
+        return true;
+    }
+
+    return false;
+}
+
+// Number of workers
+int PacketScheduler::GetWorkerCount() const
+{
+    return static_cast<int>(m_queues.size());
+}
+
+// Number of successful steals
+long long PacketScheduler::GetStealCount() const
+{
+    return m_steals;
+}
@@ -0,0 +1,53 @@
+#include "../include/ProgressCounters.h"
+
+// Constructor
+ProgressCounters::ProgressCounters()
+{
+    Reset();
+}
+
+// Destructor
+ProgressCounters::~ProgressCounters()
+{
+}
+
+// Zero every count
+void ProgressCounters::Reset()
+{
+    for (Shard& shard : m_shards)
+    {
+        shard.packets.store(0, std::memory_order_relaxed);
+        shard.logicalBytes.store(0, std::memory_order_relaxed);
+        shard.physicalBytes.store(0, std::memory_order_relaxed);
+        shard.files.store(0, std::memory_order_relaxed);
+    }
+}
+
+// Add to the counts of a thread's shard
+void ProgressCounters::Add(size_t shard, long long packets, long long logicalBytes, long long physicalBytes, long long files)
+{
+    // Only the owning thread (usually) writes a shard; nothing is ordered by these counts
+    Shard& counts = m_shards[shard % SHARD_COUNT];
+    if (packets)
+        counts.packets.fetch_add(packets, std::memory_order_relaxed);
+    if (logicalBytes)
+        counts.logicalBytes.fetch_add(logicalBytes, std::memory_order_relaxed);
+    if (physicalBytes)
+        counts.physicalBytes.fetch_add(physicalBytes, std::memory_order_relaxed);
+    if (files)
+        counts.files.fetch_add(files, std::memory_order_relaxed);
+}
+
+// Sum the shards
+ProgressCounters::Totals ProgressCounters::Sample() const
+{
+    Totals totals = { 0, 0, 0, 0 };
+    for (const Shard& shard : m_shards)
+    {
+        totals.packets += shard.packets.load(std::memory_order_relaxed);
+        totals.logicalBytes += shard.logicalBytes.load(std::memory_order_relaxed);
+        totals.physicalBytes += shard.physicalBytes.load(std::memory_order_relaxed);
+        totals.files += shard.files.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
@@ -0,0 +1,202 @@
+#include "../include/RateLimiter.h"
+#include "../include/FileIo.h"
+#include <boost/chrono.hpp>
+#include <algorithm>
+
+// Seconds on a monotonic clock
+static double Now()
+{
+    return boost::chrono::duration<double>(boost::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Constructor
+TokenBucket::TokenBucket(long long bytesPerSecond)
+    : m_rate((std::max)(bytesPerSecond, 0LL)),
+    m_ready(Now())
+{
+}
+
+// Destructor
+TokenBucket::~TokenBucket()
+{
+}
+
+// Set the rate
+void TokenBucket::SetRate(long long bytesPerSecond)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    // A bucket that was unlimited starts with no credit and no debt
+    if (m_rate <= 0)
+        m_ready = Now();
+    m_rate = (std::max)(bytesPerSecond, 0LL);
+}
+
+// Get the rate
+long long TokenBucket::GetRate() const
+{
+    return m_rate;
+}
+
+// Take bytes from the bucket
+double TokenBucket::Reserve(long long bytes)
+{
+    if (m_rate <= 0)
+        return 0.0;
+
+    double now = Now();
+    boost::mutex::scoped_lock lock(m_mutex);
+    long long rate = m_rate;
+    if (rate <= 0)
+        return 0.0;
+
+    // The transfer starts once everything taken before it is paid off;
+    // an idle bucket lets through a little more at once, but no more
+    double start = (std::max)(m_ready, now - BURST_SECONDS);
+    m_ready = start + static_cast<double>(bytes) / rate;
+    return (std::max)(0.0, start - now);
+}
+
+// Seconds until the bucket has paid off its debt
+double TokenBucket::GetWait() const
+{
+    if (m_rate <= 0)
+        return 0.0;
+
+    double now = Now();
+    boost::mutex::scoped_lock lock(m_mutex);
+    return (std::max)(0.0, m_ready - now);
+}
+
+// Constructor
+RateLimiter::RateLimiter()
+{
+}
+
+// Destructor
+RateLimiter::~RateLimiter()
+{
+}
+
+// Cap on every read
+TokenBucket& RateLimiter::GetReadBucket()
+{
+    return m_readBucket;
+}
+
+// Cap on every write
+TokenBucket& RateLimiter::GetWriteBucket()
+{
+    return m_writeBucket;
+}
+
+// Cap on every read
+const TokenBucket& RateLimiter::GetReadBucket() const
+{
+    return m_readBucket;
+}
+
+// Cap on every write
+const TokenBucket& RateLimiter::GetWriteBucket() const
+{
+    return m_writeBucket;
+}
+
+// Set the cap of a source file or directory
+void RateLimiter::SetSourceRate(const std::wstring& path, long long bytesPerSecond)
+{
+    std::wstring key = FileIo::GetPathKey(path);
+    while (key.size() > 1 && key.back() == PATH_SEPARATOR)
+        key.pop_back();
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    std::shared_ptr<TokenBucket>& bucket = m_sourceBuckets[key];
+    if (!bucket)
+        bucket = std::make_shared<TokenBucket>();
+    bucket->SetRate(bytesPerSecond);
+}
+
+// Get the cap of a source file or directory
+long long RateLimiter::GetSourceRate(const std::wstring& path) const
+{
+    std::wstring key = FileIo::GetPathKey(path);
+    while (key.size() > 1 && key.back() == PATH_SEPARATOR)
+        key.pop_back();
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    auto it = m_sourceBuckets.find(key);
+    return it != m_sourceBuckets.end() ? it->second->GetRate() : 0;
+}
+
+// Bucket of the closest limited source holding path
+std::shared_ptr<TokenBucket> RateLimiter::FindSourceBucket(const std::wstring& path) const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_sourceBuckets.empty())
+        return std::shared_ptr<TokenBucket>();
+
+    // The file itself, then each directory above it
+    std::wstring key = FileIo::GetPathKey(path);
+    while (true)
+    {
+        auto it = m_sourceBuckets.find(key);
+        if (it != m_sourceBuckets.end())
+            return it->second;
+
+        // Step up to the parent directory; the root keeps its separator
+        size_t separator = key.find_last_of(PATH_SEPARATOR);
+        if (separator == std::wstring::npos || key.size() == 1)
+            break;
+        key.resize((std::max)(separator, static_cast<size_t>(1)));
+    }
+    return std::shared_ptr<TokenBucket>();
+}
+
+// Set the cap of a device
+void RateLimiter::SetDeviceRate(unsigned long long deviceId, long long bytesPerSecond)
+{
+    GetDeviceBucket(deviceId)->SetRate(bytesPerSecond);
+}
+
+// Get the cap of a device
+long long RateLimiter::GetDeviceRate(unsigned long long deviceId) const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    auto it = m_deviceBuckets.find(deviceId);
+    return it != m_deviceBuckets.end() ? it->second->GetRate() : 0;
+}
+
+// Bucket of a device
+std::shared_ptr<TokenBucket> RateLimiter::GetDeviceBucket(unsigned long long deviceId)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    std::shared_ptr<TokenBucket>& bucket = m_deviceBuckets[deviceId];
+    if (!bucket)
+        bucket = std::make_shared<TokenBucket>();
+    return bucket;
+}
+
+// Take bytes from several buckets
+double RateLimiter::Reserve(TokenBucket* const* buckets, size_t count, long long bytes)
+{
+    // Every bucket is charged; the transfer waits for the slowest
+    double wait = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (buckets[i])
+            wait = (std::max)(wait, buckets[i]->Reserve(bytes));
+    }
+    return wait;
+}
+
+// Seconds until every one of several buckets lets a transfer through
+double RateLimiter::GetWait(TokenBucket* const* buckets, size_t count)
+{
+    double wait = 0.0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (buckets[i])
+            wait = (std::max)(wait, buckets[i]->GetWait());
+    }
+    return wait;
+}
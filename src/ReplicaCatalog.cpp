@@ -0,0 +1,146 @@
+#include "../include/ReplicaCatalog.h"
+#include "../include/ReplicaVerifier.h"
+#include "../include/IoBackend.h"
+#include <algorithm>
+
+// End of a destination's chain of versions
+static const size_t NO_VERSION = static_cast<size_t>(-1);
+
+// Constructor
+ReplicaCatalog::ReplicaCatalog()
+    : m_fileCount(0)
+{
+}
+
+// Destructor
+ReplicaCatalog::~ReplicaCatalog()
+{
+}
+
+// Add a source file
+bool ReplicaCatalog::Add(const std::wstring& path, const std::wstring& relativePath, long long size,
+    uint64_t fingerprint, const std::wstring& group)
+{
+    // Replicas share an explicit group, or a relative path, size and fingerprint
+    std::wstring key;
+    if (!group.empty())
+    {
+        key = L"group:" + group;
+    }
+    else
+    {
+        key = FileIo::GetPathKey(relativePath);
+        key += L"|" + std::to_wstring(size) + L"|" + std::to_wstring(fingerprint);
+    }
+
+    auto it = m_groupIndex.find(key);
+    if (it != m_groupIndex.end())
+    {
+        // An explicitly grouped file with a different size can't be a replica
+        ReplicaGroup& existing = m_groups[it->second];
+        if (existing.fileSize != size)
+            return false;
+
+        existing.paths.push_back(path);
+        m_fileCount++;
+        return true;
+    }
+
+    ReplicaGroup newGroup;
+    newGroup.fileName = relativePath;
+    newGroup.fileSize = size;
+    newGroup.paths.push_back(path);
+
+    size_t index = m_groups.size();
+    m_groupIndex[key] = index;
+    m_groups.push_back(newGroup);
+    m_nextVersion.push_back(NO_VERSION);
+    m_fileCount++;
+
+    // Chain it behind the other versions of the same destination
+    auto destination = m_destinations.insert(std::make_pair(FileIo::GetPathKey(relativePath), index));
+    if (!destination.second)
+    {
+        size_t last = destination.first->second;
+        while (m_nextVersion[last] != NO_VERSION)
+            last = m_nextVersion[last];
+        m_nextVersion[last] = index;
+    }
+    return true;
+}
+
+// Take the logical files, one per destination
+std::vector<ReplicaGroup> ReplicaCatalog::TakeGroups(std::vector<std::wstring>* rejected)
+{
+    std::vector<ReplicaGroup> groups;
+    std::vector<bool> seen(m_groups.size(), false);
+    for (size_t i = 0; i < m_groups.size(); i++)
+    {
+        if (seen[i])
+            continue;
+
+        // The version with the most replicas wins; the first one on a tie
+        size_t best = i;
+        for (size_t v = i; v != NO_VERSION; v = m_nextVersion[v])
+        {
+            seen[v] = true;
+            if (m_groups[v].paths.size() > m_groups[best].paths.size())
+                best = v;
+        }
+
+        for (size_t v = i; v != NO_VERSION; v = m_nextVersion[v])
+        {
+            if (v != best && rejected)
+                rejected->insert(rejected->end(), m_groups[v].paths.begin(), m_groups[v].paths.end());
+        }
+        groups.push_back(std::move(m_groups[best]));
+    }
+
+    Clear();
+    return groups;
+}
+
+// Forget every file
+void ReplicaCatalog::Clear()
+{
+    m_groups.clear();
+    m_groupIndex.clear();
+    m_destinations.clear();
+    m_nextVersion.clear();
+    m_fileCount = 0;
+}
+
+// Number of files added
+size_t ReplicaCatalog::GetFileCount() const
+{
+    return m_fileCount;
+}
+
+// Fingerprint a file's content from its sampled blocks
+uint64_t ReplicaCatalog::Fingerprint(IoBackend& backend, const std::wstring& path, long long size)
+{
+    FileHandle handle = backend.OpenForRead(path);
+    if (handle == INVALID_FILE_HANDLE)
+        return 0;
+
+    std::vector<uint8_t> buffer(ReplicaVerifier::SAMPLE_SIZE);
+    uint64_t hashes[ReplicaVerifier::SAMPLE_COUNT] = {};
+    bool success = true;
+    for (int sample = 0; sample < ReplicaVerifier::SAMPLE_COUNT && success; sample++)
+    {
+        long long offset = ReplicaVerifier::GetSampleOffset(size, sample);
+        uint32_t length = static_cast<uint32_t>((std::min)((std::max)(size - offset, 0LL), static_cast<long long>(buffer.size())));
+
+        uint32_t bytesRead = 0;
+        success = length == 0 || (backend.ReadAt(handle, offset, buffer.data(), length, &bytesRead) && bytesRead == length);
+        hashes[sample] = ReplicaVerifier::Hash(buffer.data(), length);
+    }
+    backend.Close(handle);
+
+    if (!success)
+        return 0;
+
+    // 0 is kept for files that weren't fingerprinted
+    uint64_t fingerprint = ReplicaVerifier::Hash(hashes, sizeof(hashes));
+    return fingerprint != 0 ? fingerprint : 1;
+}
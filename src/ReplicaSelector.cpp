@@ -0,0 +1,186 @@
+#include "../include/ReplicaSelector.h"
+#include <algorithm>
+
+// Constructor
+ReplicaSelector::ReplicaSelector(size_t sourceCount)
+    : m_sources(std::make_unique<SourceStats[]>(sourceCount)),
+    m_sourceCount(sourceCount),
+    m_selections(0),
+    m_probes(0)
+{
+    for (size_t i = 0; i < m_sourceCount; i++)
+    {
+        m_sources[i].throughput = 0.0;
+        m_sources[i].latency = 0.0;
+        m_sources[i].inFlight = 0;
+        m_sources[i].samples = 0;
+        m_sources[i].lastChosen = 0;
+        m_sources[i].recentNext = 0;
+        for (std::atomic<float>& latency : m_sources[i].recent)
+        {
+            latency = 0.0f;
+        }
+    }
+}
+
+// Destructor
+ReplicaSelector::~ReplicaSelector()
+{
+}
+
+// Seed a source's throughput estimate
+void ReplicaSelector::SetPrior(size_t source, double bytesPerSecond)
+{
+    if (source >= m_sourceCount || bytesPerSecond <= 0.0)
+        return;
+
+    if (m_sources[source].samples == 0)
+        m_sources[source].throughput = bytesPerSecond;
+}
+
+// Choose a source for the next packet
+size_t ReplicaSelector::Select(const std::vector<size_t>& candidates)
+{
+    if (candidates.empty())
+        return 0;
+
+    long long selection = ++m_selections;
+
+    // Best known throughput, used as an optimistic guess for unknown sources
+    double bestKnown = 0.0;
+    for (size_t source : candidates)
+    {
+        bestKnown = (std::max)(bestKnown, m_sources[source].throughput.load());
+    }
+
+    // Score every candidate by the share of its throughput a new read
+    // would get, given the reads already queued on it
+    size_t best = candidates.size();
+    double bestScore = -1.0;
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        SourceStats& stats = m_sources[candidates[i]];
+
+        // Try every source at least once before trusting the estimates
+        if (stats.samples == 0 && stats.inFlight == 0)
+        {
+            best = i;
+            break;
+        }
+
+        double throughput = stats.throughput;
+        if (throughput <= 0.0)
+            throughput = bestKnown > 0.0 ? bestKnown : 1.0;
+
+        double score = throughput / (stats.inFlight + 1);
+        if (score > bestScore)
+        {
+            bestScore = score;
+            best = i;
+        }
+    }
+
+    // Spend a small budget re-probing the source that has gone unused the
+    // longest, as long as it isn't already busy
+    if (selection % PROBE_INTERVAL == 0 && candidates.size() > 1)
+    {
+        size_t stale = candidates.size();
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            SourceStats& stats = m_sources[candidates[i]];
+            if (i == best || stats.inFlight > 0)
+                continue;
+            if (stale == candidates.size() || stats.lastChosen < m_sources[candidates[stale]].lastChosen)
+                stale = i;
+        }
+
+        if (stale != candidates.size())
+        {
+            best = stale;
+            m_probes++;
+        }
+    }
+
+    m_sources[candidates[best]].lastChosen = selection;
+    return best;
+}
+
+// A read was queued on a source
+void ReplicaSelector::OnReadStarted(size_t source)
+{
+    m_sources[source].inFlight++;
+}
+
+// A read finished
+void ReplicaSelector::OnReadFinished(size_t source, bool success, uint32_t bytes, double seconds)
+{
+    SourceStats& stats = m_sources[source];
+    stats.inFlight--;
+
+    if (!success || bytes == 0)
+        return;
+
+    // Guard against clock resolution on very fast reads
+    seconds = (std::max)(seconds, 1e-6);
+
+    bool first = stats.samples++ == 0;
+    Update(stats.throughput, bytes / seconds, first);
+    Update(stats.latency, seconds, first);
+
+    // Keep a window of raw latencies for percentiles
+    unsigned slot = stats.recentNext++ % RECENT_LATENCIES;
+    stats.recent[slot] = static_cast<float>(seconds);
+}
+
+// Latency percentile of a source's recent reads
+double ReplicaSelector::GetLatencyPercentile(size_t source, double percentile) const
+{
+    if (source >= m_sourceCount)
+        return 0.0;
+
+    const SourceStats& stats = m_sources[source];
+    if (stats.samples < MIN_PERCENTILE_SAMPLES)
+        return 0.0;
+
+    size_t count = static_cast<size_t>((std::min)(stats.samples.load(), static_cast<long long>(RECENT_LATENCIES)));
+
+    float latencies[RECENT_LATENCIES];
+    for (size_t i = 0; i < count; i++)
+    {
+        latencies[i] = stats.recent[i];
+    }
+
+    size_t rank = (std::min)(count - 1, static_cast<size_t>(percentile * count));
+    std::nth_element(latencies, latencies + rank, latencies + count);
+    return latencies[rank];
+}
+
+// Current throughput estimate
+double ReplicaSelector::GetThroughput(size_t source) const
+{
+    return source < m_sourceCount ? m_sources[source].throughput.load() : 0.0;
+}
+
+// Current latency estimate
+double ReplicaSelector::GetLatency(size_t source) const
+{
+    return source < m_sourceCount ? m_sources[source].latency.load() : 0.0;
+}
+
+// Number of probe selections
+long long ReplicaSelector::GetProbeCount() const
+{
+    return m_probes;
+}
+
+// Fold a sample into an EWMA
+void ReplicaSelector::Update(std::atomic<double>& average, double sample, bool first)
+{
+    double current = average;
+    double next;
+    do
+    {
+        // The first real sample replaces the prior outright
+        next = first ? sample : current + EWMA_WEIGHT * (sample - current);
+    } while (!average.compare_exchange_weak(current, next));
+}
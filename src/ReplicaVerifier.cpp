@@ -0,0 +1,263 @@
+#include "../include/ReplicaVerifier.h"
+#include "../include/IoBackend.h"
+#include <algorithm>
+#include <map>
+#include <cstring>
+
+// Constructor
+ReplicaVerifier::ReplicaVerifier(long long fileSize)
+    : m_fileSize(fileSize)
+{
+    // Split the samples into blocks, skipping any overlap between them
+    long long covered = 0;
+    for (int i = 0; i < SAMPLE_COUNT; i++)
+    {
+        long long start = (std::max)(GetSampleOffset(fileSize, i), covered);
+        long long end = (std::min)(GetSampleOffset(fileSize, i) + SAMPLE_SIZE, fileSize);
+        for (long long offset = start; offset < end; offset += BLOCK_SIZE)
+        {
+            Block block = { offset, static_cast<uint32_t>((std::min)(end - offset, static_cast<long long>(BLOCK_SIZE))) };
+            m_blocks.push_back(block);
+        }
+        covered = (std::max)(covered, end);
+    }
+}
+
+// Destructor
+ReplicaVerifier::~ReplicaVerifier()
+{
+}
+
+// Hash the sampled blocks of every replica and find the ones that disagree
+std::vector<bool> ReplicaVerifier::Verify(IoBackend& backend, const std::vector<std::wstring>& paths)
+{
+    std::vector<bool> diverged(paths.size(), false);
+    if (m_blocks.empty())
+        return diverged;
+
+    std::vector<std::vector<uint64_t>> hashes(paths.size());
+    std::vector<bool> readable(paths.size(), false);
+    std::vector<uint8_t> buffer(SAMPLE_SIZE);
+    for (size_t r = 0; r < paths.size(); r++)
+    {
+        readable[r] = HashReplica(backend, paths[r], hashes[r], buffer);
+    }
+
+    // Count the replicas holding each version of the data
+    std::map<std::vector<uint64_t>, int> votes;
+    for (size_t r = 0; r < paths.size(); r++)
+    {
+        if (readable[r])
+            votes[hashes[r]]++;
+    }
+
+    // The most common version wins; ties go to the replica listed first
+    size_t winner = paths.size();
+    for (size_t r = 0; r < paths.size(); r++)
+    {
+        if (readable[r] && (winner == paths.size() || votes[hashes[r]] > votes[hashes[winner]]))
+            winner = r;
+    }
+
+    if (winner == paths.size())
+        return diverged;
+
+    m_hashes = hashes[winner];
+    for (size_t r = 0; r < paths.size(); r++)
+    {
+        diverged[r] = readable[r] && hashes[r] != m_hashes;
+    }
+    return diverged;
+}
+
+// Check data read during the copy against the majority's hashes
+bool ReplicaVerifier::CheckRange(long long offset, const uint8_t* data, uint32_t length) const
+{
+    if (m_hashes.empty())
+        return true;
+
+    // Blocks are in file order; find the first one starting inside the range
+    auto block = std::lower_bound(m_blocks.begin(), m_blocks.end(), offset,
+        [](const Block& b, long long value) { return b.offset < value; });
+
+    for (; block != m_blocks.end() && block->offset + block->length <= offset + length; ++block)
+    {
+        if (Hash(data + (block->offset - offset), block->length) != m_hashes[block - m_blocks.begin()])
+            return false;
+    }
+    return true;
+}
+
+// Offset of one of the samples of a file
+long long ReplicaVerifier::GetSampleOffset(long long fileSize, int sample)
+{
+    // Small files are sampled from the start
+    if (fileSize <= static_cast<long long>(SAMPLE_SIZE) * 3)
+        return 0;
+
+    // Spread the samples across the file, avoiding the very beginning and end
+    long long position = (fileSize / 4) * (sample + 1);
+    position = (std::min)(position, fileSize - static_cast<long long>(SAMPLE_SIZE) * 2);
+
+    // Start on a block boundary so packet-aligned reads cover whole blocks
+    return position - position % BLOCK_SIZE;
+}
+
+// Hash the sampled blocks of one replica
+bool ReplicaVerifier::HashReplica(IoBackend& backend, const std::wstring& path, std::vector<uint64_t>& hashes, std::vector<uint8_t>& buffer) const
+{
+    // A replica of the wrong size can't hold the same data
+    long long size = 0;
+    if (!backend.GetSize(path, &size))
+        return false;
+    if (size != m_fileSize)
+    {
+        hashes.assign(m_blocks.size(), 0);
+        hashes.push_back(static_cast<uint64_t>(size));
+        return true;
+    }
+
+    FileHandle handle = backend.OpenForRead(path);
+    if (handle == INVALID_FILE_HANDLE)
+        return false;
+
+    // Read each run of consecutive blocks (one sample) in one go
+    bool success = true;
+    hashes.clear();
+    size_t first = 0;
+    while (success && first < m_blocks.size())
+    {
+        size_t last = first;
+        while (last + 1 < m_blocks.size() &&
+            m_blocks[last + 1].offset == m_blocks[last].offset + m_blocks[last].length &&
+            m_blocks[last + 1].offset + m_blocks[last + 1].length - m_blocks[first].offset <= SAMPLE_SIZE)
+        {
+            last++;
+        }
+
+        uint32_t length = static_cast<uint32_t>(m_blocks[last].offset + m_blocks[last].length - m_blocks[first].offset);
+        uint32_t done = 0;
+        while (done < length)
+        {
+            uint32_t bytesRead = 0;
+            if (!backend.ReadAt(handle, m_blocks[first].offset + done, buffer.data() + done, length - done, &bytesRead) ||
+                bytesRead == 0)
+            {
+                success = false;
+                break;
+            }
+            done += bytesRead;
+        }
+
+        for (size_t b = first; success && b <= last; b++)
+        {
+            hashes.push_back(Hash(buffer.data() + (m_blocks[b].offset - m_blocks[first].offset), m_blocks[b].length));
+        }
+        first = last + 1;
+    }
+
+    backend.Close(handle);
+    return success;
+}
+
+// xxHash64 constants
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t RotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t Read64(const uint8_t* data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Read32(const uint8_t* data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t Round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * PRIME2;
+    return RotateLeft(accumulator, 31) * PRIME1;
+}
+
+static inline uint64_t MergeRound(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= Round(0, accumulator);
+    return hash * PRIME1 + PRIME4;
+}
+
+// 64-bit hash of a block of data
+uint64_t ReplicaVerifier::Hash(const void* data, size_t length)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + length;
+    uint64_t hash;
+
+    if (length >= 32)
+    {
+        // Four independent lanes keep the multipliers busy
+        uint64_t v1 = PRIME1 + PRIME2;
+        uint64_t v2 = PRIME2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - PRIME1;
+        const uint8_t* limit = end - 32;
+        do
+        {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+        hash = MergeRound(hash, v1);
+        hash = MergeRound(hash, v2);
+        hash = MergeRound(hash, v3);
+        hash = MergeRound(hash, v4);
+    }
+    else
+    {
+        hash = PRIME5;
+    }
+
+    hash += length;
+
+    // Fold in the tail
+    for (; p + 8 <= end; p += 8)
+    {
+        hash ^= Round(0, Read64(p));
+        hash = RotateLeft(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        hash ^= Read32(p) * PRIME1;
+        hash = RotateLeft(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        hash ^= *p * PRIME5;
+        hash = RotateLeft(hash, 11) * PRIME1;
+    }
+
+    // Final mix
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
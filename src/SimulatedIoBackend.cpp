@@ -0,0 +1,832 @@
+#include "../include/SimulatedIoBackend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <boost/thread/thread.hpp>
+
+// Handle numbers start here, so they never look like a standard stream or
+// a null handle
+static const size_t HANDLE_BASE = 0x10000;
+
+// Turn a handle number into a FileHandle
+static FileHandle ToHandle(size_t index)
+{
+#ifdef _WIN32
+    return reinterpret_cast<HANDLE>(static_cast<uintptr_t>(index + HANDLE_BASE));
+#else
+    return static_cast<int>(index + HANDLE_BASE);
+#endif
+}
+
+// Turn a FileHandle back into a handle number (SIZE_MAX if it isn't one)
+static size_t FromHandle(FileHandle handle)
+{
+#ifdef _WIN32
+    uintptr_t value = reinterpret_cast<uintptr_t>(handle);
+#else
+    if (handle < 0)
+        return SIZE_MAX;
+    size_t value = static_cast<size_t>(handle);
+#endif
+    if (value < HANDLE_BASE)
+        return SIZE_MAX;
+    return static_cast<size_t>(value - HANDLE_BASE);
+}
+
+// SplitMix64 step: a well-mixed 64-bit hash of a 64-bit value
+static uint64_t Mix(uint64_t value)
+{
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+// FNV-1a hash of a path
+static uint64_t HashPath(const std::wstring& path)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (wchar_t c : path)
+    {
+        hash ^= static_cast<uint64_t>(c);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Fill a buffer with the pattern of a seed, as found at offset
+static void FillWords(uint64_t seed, long long offset, uint8_t* buffer, uint32_t length)
+{
+    uint32_t done = 0;
+    while (done < length)
+    {
+        long long position = offset + done;
+        uint64_t word = Mix(seed ^ static_cast<uint64_t>(position / 8));
+        uint32_t skip = static_cast<uint32_t>(position % 8);
+        uint32_t chunk = std::min<uint32_t>(8 - skip, length - done);
+        memcpy(buffer + done, reinterpret_cast<const uint8_t*>(&word) + skip, chunk);
+        done += chunk;
+    }
+}
+
+SimulatedIoBackend::SimulatedIoBackend(uint64_t seed)
+    : m_seed(seed),
+      m_now(0.0),
+      m_activity(0)
+{
+    // The default device: unlimited, never fails
+    SimulatedDeviceProfile profile = {};
+    profile.kind = DEVICE_KIND_SOLID_STATE;
+    m_devices.push_back(MakeDevice(std::wstring(), profile));
+}
+
+SimulatedIoBackend::~SimulatedIoBackend()
+{
+}
+
+// Mount a device at a root path
+int SimulatedIoBackend::AddDevice(const std::wstring& root, const SimulatedDeviceProfile& profile)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    m_devices.push_back(MakeDevice(Normalize(root), profile));
+    AddDirectory(m_devices.back().root);
+    return static_cast<int>(m_devices.size() - 1);
+}
+
+// Change a device's behaviour
+void SimulatedIoBackend::SetDeviceProfile(int device, const SimulatedDeviceProfile& profile)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (device >= 0 && device < static_cast<int>(m_devices.size()))
+        m_devices[device].profile = profile;
+}
+
+// Schedule a stall on a device
+void SimulatedIoBackend::AddStall(int device, double start, double seconds)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (device >= 0 && device < static_cast<int>(m_devices.size()))
+        m_devices[device].stalls.push_back(std::make_pair(start, start + seconds));
+}
+
+// Schedule a device's death
+void SimulatedIoBackend::FailDevice(int device, double time)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (device >= 0 && device < static_cast<int>(m_devices.size()))
+        m_devices[device].failTime = time;
+}
+
+// Unmount every device but the default one
+void SimulatedIoBackend::ClearDevices()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_devices.resize(1);
+}
+
+// Counters of a device
+SimulatedDeviceStats SimulatedIoBackend::GetDeviceStats(int device) const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (device < 0 || device >= static_cast<int>(m_devices.size()))
+        return SimulatedDeviceStats();
+
+    SimulatedDeviceStats stats = m_devices[device].stats;
+    stats.readLatency = m_devices[device].readLatency->GetSnapshot();
+    stats.writeLatency = m_devices[device].writeLatency->GetSnapshot();
+    return stats;
+}
+
+// Add a file made of a seed's pattern
+bool SimulatedIoBackend::AddFile(const std::wstring& path, long long size, uint64_t seed, const std::vector<FileRange>* dataRanges)
+{
+    std::wstring key = Normalize(path);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_directories.count(key) != 0)
+        return false;
+
+    auto file = std::make_shared<File>();
+    file->size = size;
+    file->pattern = true;
+    file->seed = seed;
+    if (dataRanges)
+        file->ranges = *dataRanges;
+    file->modifiedTime = static_cast<long long>(GetTime() * 1000000);
+    file->key = HashPath(key);
+
+    AddDirectory(GetParent(key));
+    m_files[key] = file;
+    return true;
+}
+
+// Read a file's data without delay
+bool SimulatedIoBackend::Peek(const std::wstring& path, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead)
+{
+    std::shared_ptr<File> file;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        auto it = m_files.find(Normalize(path));
+        if (it == m_files.end())
+            return false;
+        file = it->second;
+    }
+
+    boost::mutex::scoped_lock lock(file->mutex);
+    *bytesRead = ReadContent(*file, offset, buffer, length);
+    return true;
+}
+
+// Virtual seconds since creation
+double SimulatedIoBackend::GetTime() const
+{
+    return m_now;
+}
+
+const wchar_t* SimulatedIoBackend::GetName() const
+{
+    return L"simulated";
+}
+
+bool SimulatedIoBackend::IsNative() const
+{
+    return false;
+}
+
+FileHandle SimulatedIoBackend::OpenForRead(const std::wstring& path, bool)
+{
+    return Open(path, false, false);
+}
+
+FileHandle SimulatedIoBackend::CreateForWrite(const std::wstring& path, bool)
+{
+    return Open(path, true, true);
+}
+
+FileHandle SimulatedIoBackend::OpenForUpdate(const std::wstring& path, bool)
+{
+    return Open(path, true, false);
+}
+
+// Release a handle
+void SimulatedIoBackend::Close(FileHandle handle)
+{
+    size_t index = FromHandle(handle);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (index >= m_handles.size() || !m_handles[index].open)
+        return;
+
+    m_handles[index].open = false;
+    m_handles[index].file.reset();
+    m_handles[index].path.clear();
+    m_freeHandles.push_back(index);
+}
+
+bool SimulatedIoBackend::GetIoAlignment(const std::wstring&, uint32_t* alignment)
+{
+    *alignment = IO_ALIGNMENT;
+    return true;
+}
+
+// Read through the file's device
+bool SimulatedIoBackend::ReadAt(FileHandle handle, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead)
+{
+    std::wstring path;
+    std::shared_ptr<File> file = GetFile(handle, &path);
+    if (!file)
+        return false;
+
+    long long available;
+    {
+        boost::mutex::scoped_lock lock(file->mutex);
+        available = std::max(0LL, std::min<long long>(length, file->size - offset));
+    }
+
+    return Serve(path, *file, REQUEST_READ, offset, available, [&]() {
+        boost::mutex::scoped_lock lock(file->mutex);
+        *bytesRead = ReadContent(*file, offset, buffer, length);
+    });
+}
+
+// Write through the file's device
+bool SimulatedIoBackend::WriteAt(FileHandle handle, long long offset, const void* buffer, uint32_t length, uint32_t* bytesWritten)
+{
+    std::wstring path;
+    std::shared_ptr<File> file = GetFile(handle, &path);
+    if (!file)
+        return false;
+
+    bool written = Serve(path, *file, REQUEST_WRITE, offset, length, [&]() {
+        boost::mutex::scoped_lock lock(file->mutex);
+        Materialize(*file);
+        long long end = offset + length;
+        if (end > file->size)
+        {
+            file->data.resize(static_cast<size_t>(end));
+            file->size = end;
+        }
+        memcpy(file->data.data() + offset, buffer, length);
+        *bytesWritten = length;
+    });
+    if (!written)
+        return false;
+
+    boost::mutex::scoped_lock lock(file->mutex);
+    file->modifiedTime = static_cast<long long>(GetTime() * 1000000);
+    return true;
+}
+
+// Nothing is cached, so there is nothing to flush
+bool SimulatedIoBackend::Flush(FileHandle handle)
+{
+    return GetFile(handle, nullptr) != nullptr;
+}
+
+// Nothing is cached, so every read already comes from the device
+bool SimulatedIoBackend::DropCache(FileHandle handle, long long, long long)
+{
+    return GetFile(handle, nullptr) != nullptr;
+}
+
+// Set a file's length
+bool SimulatedIoBackend::SetSize(FileHandle handle, long long size)
+{
+    std::shared_ptr<File> file = GetFile(handle, nullptr);
+    if (!file || size < 0)
+        return false;
+
+    boost::mutex::scoped_lock lock(file->mutex);
+    if (size == file->size)
+        return true;
+
+    Materialize(*file);
+    file->data.resize(static_cast<size_t>(size));
+    file->size = size;
+    return true;
+}
+
+bool SimulatedIoBackend::SetSparse(FileHandle handle)
+{
+    return GetFile(handle, nullptr) != nullptr;
+}
+
+// Zero a range (holes aren't tracked once a file is written)
+bool SimulatedIoBackend::PunchHole(FileHandle handle, long long offset, long long length)
+{
+    std::shared_ptr<File> file = GetFile(handle, nullptr);
+    if (!file)
+        return false;
+
+    boost::mutex::scoped_lock lock(file->mutex);
+    Materialize(*file);
+    long long end = std::min(offset + length, file->size);
+    if (offset < end)
+        memset(file->data.data() + offset, 0, static_cast<size_t>(end - offset));
+    return true;
+}
+
+// Data ranges: those of a sparse pattern file, otherwise the whole file
+bool SimulatedIoBackend::GetDataRanges(const std::wstring& path, long long fileSize, std::vector<FileRange>& ranges)
+{
+    ranges.clear();
+
+    std::shared_ptr<File> file;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        auto it = m_files.find(Normalize(path));
+        if (it == m_files.end())
+            return false;
+        file = it->second;
+    }
+
+    boost::mutex::scoped_lock lock(file->mutex);
+    if (file->pattern && !file->ranges.empty())
+    {
+        for (const FileRange& range : file->ranges)
+        {
+            long long end = std::min(range.offset + range.length, fileSize);
+            if (range.offset < end)
+                ranges.push_back({ range.offset, end - range.offset });
+        }
+    }
+    else if (fileSize > 0)
+    {
+        ranges.push_back({ 0, fileSize });
+    }
+    return true;
+}
+
+bool SimulatedIoBackend::GetSize(const std::wstring& path, long long* size)
+{
+    std::shared_ptr<File> file;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        auto it = m_files.find(Normalize(path));
+        if (it == m_files.end())
+            return false;
+        file = it->second;
+    }
+
+    boost::mutex::scoped_lock lock(file->mutex);
+    *size = file->size;
+    return true;
+}
+
+bool SimulatedIoBackend::GetModifiedTime(const std::wstring& path, long long* time)
+{
+    std::shared_ptr<File> file;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        auto it = m_files.find(Normalize(path));
+        if (it == m_files.end())
+            return false;
+        file = it->second;
+    }
+
+    boost::mutex::scoped_lock lock(file->mutex);
+    *time = file->modifiedTime;
+    return true;
+}
+
+// Device identifier: the index of the device, plus one
+bool SimulatedIoBackend::GetDeviceId(const std::wstring& path, unsigned long long* deviceId)
+{
+    std::wstring key = Normalize(path);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_files.count(key) == 0 && m_directories.count(key) == 0)
+        return false;
+
+    *deviceId = FindDevice(key) + 1;
+    return true;
+}
+
+DeviceKind SimulatedIoBackend::GetDeviceKind(const std::wstring& path)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_devices[FindDevice(Normalize(path))].profile.kind;
+}
+
+// List a directory: subdirectories, then files, each in name order
+bool SimulatedIoBackend::ListDirectory(const std::wstring& path, std::vector<DirectoryEntry>& entries)
+{
+    entries.clear();
+    std::wstring key = Normalize(path);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_directories.count(key) == 0)
+        return false;
+
+    std::wstring prefix = key;
+    if (prefix.empty() || prefix.back() != PATH_SEPARATOR)
+        prefix += PATH_SEPARATOR;
+
+    // Only direct children: nothing past the prefix may hold a separator
+    for (auto it = m_directories.lower_bound(prefix); it != m_directories.end() && it->compare(0, prefix.size(), prefix) == 0; ++it)
+    {
+        std::wstring name = it->substr(prefix.size());
+        if (!name.empty() && name.find(PATH_SEPARATOR) == std::wstring::npos)
+            entries.push_back({ name, true });
+    }
+    for (auto it = m_files.lower_bound(prefix); it != m_files.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+    {
+        std::wstring name = it->first.substr(prefix.size());
+        if (name.find(PATH_SEPARATOR) == std::wstring::npos)
+            entries.push_back({ name, false });
+    }
+    return true;
+}
+
+// Create a directory, and any missing parents
+bool SimulatedIoBackend::CreateDirectoryPath(const std::wstring& path)
+{
+    std::wstring key = Normalize(path);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_files.count(key) != 0)
+        return false;
+
+    AddDirectory(key);
+    return true;
+}
+
+// Delete a file (open handles keep its content)
+bool SimulatedIoBackend::Delete(const std::wstring& path)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_files.erase(Normalize(path)) != 0;
+}
+
+// Rename a file, replacing the target
+bool SimulatedIoBackend::Rename(const std::wstring& from, const std::wstring& to)
+{
+    std::wstring fromKey = Normalize(from);
+    std::wstring toKey = Normalize(to);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    auto it = m_files.find(fromKey);
+    if (it == m_files.end() || m_directories.count(GetParent(toKey)) == 0 || m_directories.count(toKey) != 0)
+        return false;
+
+    std::shared_ptr<File> file = it->second;
+    m_files.erase(it);
+    m_files[toKey] = file;
+    return true;
+}
+
+// Everything goes through the engine's buffers
+KernelCopyMethod SimulatedIoBackend::GetKernelCopyMethod()
+{
+    return KERNEL_COPY_NONE;
+}
+
+KernelCopyResult SimulatedIoBackend::CopyRange(KernelCopyMethod, FileHandle, long long, FileHandle, long long, uint32_t, uint32_t*)
+{
+    return KERNEL_COPY_UNSUPPORTED;
+}
+
+bool SimulatedIoBackend::CloneFile(const std::wstring&, const std::wstring&)
+{
+    return false;
+}
+
+// Strip trailing separators, keeping a lone one
+std::wstring SimulatedIoBackend::Normalize(const std::wstring& path)
+{
+    size_t end = path.size();
+    while (end > 1 && path[end - 1] == PATH_SEPARATOR)
+        end--;
+    return path.substr(0, end);
+}
+
+// Directory holding a path
+std::wstring SimulatedIoBackend::GetParent(const std::wstring& path)
+{
+    size_t separator = path.rfind(PATH_SEPARATOR);
+    if (separator == std::wstring::npos || path.size() == 1)
+        return std::wstring();
+    if (separator == 0)
+        return path.substr(0, 1);
+    return path.substr(0, separator);
+}
+
+// Uniform number in [0, 1) from a hash of the inputs
+double SimulatedIoBackend::Draw(uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+    uint64_t hash = Mix(Mix(Mix(Mix(a) ^ b) ^ c) ^ d);
+    return static_cast<double>(hash >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Content of a pattern file: the seed's pattern in its data ranges, zeros elsewhere
+void SimulatedIoBackend::FillPattern(const File& file, long long offset, uint8_t* buffer, uint32_t length)
+{
+    if (file.ranges.empty())
+    {
+        FillWords(file.seed, offset, buffer, length);
+        return;
+    }
+
+    memset(buffer, 0, length);
+    long long end = offset + length;
+    for (const FileRange& range : file.ranges)
+    {
+        long long start = std::max(offset, range.offset);
+        long long stop = std::min(end, range.offset + range.length);
+        if (start < stop)
+            FillWords(file.seed, start, buffer + (start - offset), static_cast<uint32_t>(stop - start));
+    }
+}
+
+// Store a pattern file's content, so it can be changed
+void SimulatedIoBackend::Materialize(File& file)
+{
+    if (!file.pattern)
+        return;
+
+    file.data.resize(static_cast<size_t>(file.size));
+    if (file.size > 0)
+        FillPattern(file, 0, file.data.data(), static_cast<uint32_t>(file.size));
+    file.pattern = false;
+    file.ranges.clear();
+}
+
+// Copy content out of a file
+uint32_t SimulatedIoBackend::ReadContent(const File& file, long long offset, void* buffer, uint32_t length)
+{
+    long long available = std::max(0LL, std::min<long long>(length, file.size - offset));
+    uint32_t count = static_cast<uint32_t>(available);
+    if (count == 0)
+        return 0;
+
+    if (file.pattern)
+        FillPattern(file, offset, static_cast<uint8_t*>(buffer), count);
+    else
+        memcpy(buffer, file.data.data() + offset, count);
+    return count;
+}
+
+// Device a path lives on: the one with the longest root above it
+size_t SimulatedIoBackend::FindDevice(const std::wstring& path) const
+{
+    size_t found = 0;
+    size_t foundLength = 0;
+    for (size_t i = 1; i < m_devices.size(); i++)
+    {
+        const std::wstring& root = m_devices[i].root;
+        if (root.size() < foundLength || path.compare(0, root.size(), root) != 0)
+            continue;
+        if (path.size() == root.size() || root.back() == PATH_SEPARATOR || path[root.size()] == PATH_SEPARATOR)
+        {
+            found = i;
+            foundLength = root.size();
+        }
+    }
+    return found;
+}
+
+// Create a directory and its parents
+void SimulatedIoBackend::AddDirectory(const std::wstring& path)
+{
+    std::wstring directory = path;
+    while (!directory.empty() && m_directories.insert(directory).second)
+        directory = GetParent(directory);
+}
+
+// Hand out a handle
+FileHandle SimulatedIoBackend::AddHandle(const std::shared_ptr<File>& file, const std::wstring& path)
+{
+    size_t index;
+    if (!m_freeHandles.empty())
+    {
+        index = m_freeHandles.back();
+        m_freeHandles.pop_back();
+    }
+    else
+    {
+        index = m_handles.size();
+        m_handles.push_back(OpenFile());
+    }
+
+    m_handles[index].file = file;
+    m_handles[index].path = path;
+    m_handles[index].open = true;
+    return ToHandle(index);
+}
+
+// File behind a handle
+std::shared_ptr<SimulatedIoBackend::File> SimulatedIoBackend::GetFile(FileHandle handle, std::wstring* path)
+{
+    size_t index = FromHandle(handle);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (index >= m_handles.size() || !m_handles[index].open)
+        return nullptr;
+
+    if (path)
+        *path = m_handles[index].path;
+    return m_handles[index].file;
+}
+
+// Open a file; opening takes the device's latency too
+FileHandle SimulatedIoBackend::Open(const std::wstring& path, bool create, bool truncate)
+{
+    std::wstring key = Normalize(path);
+    std::shared_ptr<File> file;
+    FileHandle handle;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        auto it = m_files.find(key);
+        if (it != m_files.end())
+        {
+            file = it->second;
+        }
+        else
+        {
+            // New files need their directory, and can't take a directory's place
+            if (!create || m_directories.count(GetParent(key)) == 0 || m_directories.count(key) != 0)
+                return INVALID_FILE_HANDLE;
+
+            file = std::make_shared<File>();
+            file->size = 0;
+            file->pattern = false;
+            file->seed = 0;
+            file->modifiedTime = static_cast<long long>(GetTime() * 1000000);
+            file->key = HashPath(key);
+            m_files[key] = file;
+        }
+        handle = AddHandle(file, key);
+    }
+
+    if (truncate)
+    {
+        boost::mutex::scoped_lock lock(file->mutex);
+        file->pattern = false;
+        file->ranges.clear();
+        file->data.clear();
+        file->size = 0;
+        file->modifiedTime = static_cast<long long>(GetTime() * 1000000);
+    }
+
+    if (!Serve(key, *file, REQUEST_OPEN, 0, 0))
+    {
+        Close(handle);
+        return INVALID_FILE_HANDLE;
+    }
+    return handle;
+}
+
+// Reserve the device for a request and wait until it completes.
+// Transfers queue one after another on the device; latency and jitter are
+// added after the transfer, so they overlap between requests in flight
+bool SimulatedIoBackend::Serve(const std::wstring& path, const File& file, RequestKind kind, long long offset, long long bytes,
+    const std::function<void()>& transfer)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    double now = m_now;
+    double finish;
+    bool failed = false;
+
+    size_t index = FindDevice(path);
+    Device& device = m_devices[index];
+    const SimulatedDeviceProfile& profile = device.profile;
+
+    // Each block fails or not on its own, and a block that failed draws
+    // afresh on its next attempt; the rest is drawn for the block the
+    // request starts in
+    long long firstBlock = offset / FAULT_BLOCK_SIZE;
+    long long endBlock = bytes > 0 ? (offset + bytes - 1) / FAULT_BLOCK_SIZE + 1 : firstBlock + 1;
+    auto attempts = [&](long long block) -> uint64_t {
+        auto previous = m_failedAttempts.find(std::make_pair(file.key, block));
+        return previous != m_failedAttempts.end() ? previous->second : 0;
+    };
+    uint64_t fileKey = Mix(file.key ^ (static_cast<uint64_t>(kind) << 56));
+    uint64_t request = fileKey ^ (attempts(firstBlock) << 40);
+    uint64_t deviceKey = m_seed ^ (static_cast<uint64_t>(index) << 32);
+
+    if (now >= device.failTime)
+    {
+        // A dead device answers every request with an error
+        finish = now + profile.latency;
+        failed = true;
+    }
+    else
+    {
+        double start = std::max(now, device.ready);
+        for (const auto& stall : device.stalls)
+        {
+            if (start >= stall.first && start < stall.second)
+            {
+                start = stall.second;
+                device.stats.stalls++;
+            }
+        }
+        if (profile.stallRate > 0 && Draw(deviceKey, request, firstBlock, 1) < profile.stallRate)
+        {
+            start += profile.stallSeconds;
+            device.stats.stalls++;
+        }
+
+        double transfer = profile.bytesPerSecond > 0 ? static_cast<double>(bytes) / profile.bytesPerSecond : 0;
+        device.ready = start + transfer;
+
+        finish = device.ready + profile.latency;
+        if (profile.jitter > 0)
+            finish -= profile.jitter * std::log(1.0 - Draw(deviceKey, request, firstBlock, 2));
+
+        for (long long block = firstBlock; kind != REQUEST_OPEN && profile.failureRate > 0 && block < endBlock; block++)
+        {
+            uint64_t attempt = attempts(block);
+            if (Draw(deviceKey, fileKey ^ (attempt << 40), block, 3) < profile.failureRate)
+            {
+                failed = true;
+                m_failedAttempts[std::make_pair(file.key, block)] = attempt + 1;
+            }
+        }
+    }
+
+    if (failed)
+    {
+        device.stats.failures++;
+    }
+    else if (kind == REQUEST_READ)
+    {
+        device.stats.reads++;
+        device.stats.bytesRead += bytes;
+        device.readLatency->Record(finish - now);
+    }
+    else if (kind == REQUEST_WRITE)
+    {
+        device.stats.writes++;
+        device.stats.bytesWritten += bytes;
+        device.writeLatency->Record(finish - now);
+    }
+
+    std::multiset<double>::iterator waiting = m_pending.insert(finish);
+    m_activity++;
+    m_clockChanged.notify_all();
+
+    // The request is in the pending set, so the clock can't pass it while
+    // its data moves
+    if (!failed && transfer)
+    {
+        lock.unlock();
+        transfer();
+        lock.lock();
+    }
+
+    WaitUntil(lock, finish);
+
+    m_pending.erase(waiting);
+    m_activity++;
+    m_clockChanged.notify_all();
+    return !failed;
+}
+
+// A device with a profile, idle and healthy
+SimulatedIoBackend::Device SimulatedIoBackend::MakeDevice(const std::wstring& root, const SimulatedDeviceProfile& profile)
+{
+    Device device = {};
+    device.root = root;
+    device.profile = profile;
+    device.ready = 0;
+    device.failTime = std::numeric_limits<double>::infinity();
+    device.readLatency = std::make_shared<LatencyHistogram>();
+    device.writeLatency = std::make_shared<LatencyHistogram>();
+    return device;
+}
+
+// Block until the virtual clock reaches a time. The request that completes
+// first keeps the clock: once a quiet spell passes without a request
+// coming or going, nothing can arrive before it any more, and the clock
+// jumps to it
+void SimulatedIoBackend::WaitUntil(boost::mutex::scoped_lock& lock, double time)
+{
+    // Not an interruption point: a request in flight completes like real I/O
+    boost::this_thread::disable_interruption uninterruptible;
+
+    boost::chrono::steady_clock::duration quiet =
+        boost::chrono::duration_cast<boost::chrono::steady_clock::duration>(boost::chrono::duration<double>(QUIET_SECONDS));
+    while (m_now < time)
+    {
+        if (*m_pending.begin() < time)
+        {
+            m_clockChanged.wait(lock);
+            continue;
+        }
+
+        uint64_t activity = m_activity;
+        boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + quiet;
+        while (m_activity == activity && m_now < time &&
+            m_clockChanged.wait_until(lock, deadline) == boost::cv_status::no_timeout)
+        {
+        }
+        if (m_activity == activity && m_now < time)
+        {
+            m_now = time;
+            m_clockChanged.notify_all();
+        }
+    }
+}
@@ -0,0 +1,109 @@
+#include "../include/SourceHandlePool.h"
+
+// Take ownership of an open handle
+PooledHandle::PooledHandle(FileHandle handle, const std::shared_ptr<IoBackend>& backend)
+    : m_handle(handle),
+    m_backend(backend)
+{
+}
+
+// Close the handle once nobody uses it any more
+PooledHandle::~PooledHandle()
+{
+    m_backend->Close(m_handle);
+}
+
+// Constructor
+SourceHandlePool::SourceHandlePool()
+    : m_backend(IoBackend::GetNative()),
+    m_openCount(0),
+    m_unbuffered(false)
+{
+}
+
+// Destructor
+SourceHandlePool::~SourceHandlePool()
+{
+    CloseAll();
+}
+
+// Open sources bypassing the page cache
+void SourceHandlePool::SetUnbuffered(bool unbuffered)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_unbuffered = unbuffered;
+}
+
+// Open and read sources through a backend
+void SourceHandlePool::SetBackend(const std::shared_ptr<IoBackend>& backend)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_backend = backend ? backend : IoBackend::GetNative();
+}
+
+// Get the open handle for a source, opening it on first use
+std::shared_ptr<PooledHandle> SourceHandlePool::Acquire(const std::wstring& path, bool* opened)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    auto it = m_handles.find(path);
+    bool found = it != m_handles.end();
+    if (opened)
+        *opened = !found;
+    if (found)
+        return it->second;
+
+    // Open outside the map so a failed open isn't cached
+    FileHandle handle = m_backend->OpenForRead(path, m_unbuffered);
+    if (handle == INVALID_FILE_HANDLE)
+        return nullptr;
+
+    std::shared_ptr<PooledHandle> pooled = std::make_shared<PooledHandle>(handle, m_backend);
+    m_handles[path] = pooled;
+    m_openCount++;
+
+    return pooled;
+}
+
+// Read from a source at an absolute offset
+bool SourceHandlePool::ReadAt(const std::wstring& path, long long offset, void* buffer, uint32_t length, uint32_t* bytesRead)
+{
+    std::shared_ptr<PooledHandle> pooled = Acquire(path);
+    if (!pooled)
+        return false;
+
+    if (!pooled->GetBackend()->ReadAt(pooled->Get(), offset, buffer, length, bytesRead))
+    {
+        // The handle may be stale (e.g. a dropped network share), reopen next time
+        // Only drop it if another reader hasn't already replaced it
+        boost::mutex::scoped_lock lock(m_mutex);
+        auto it = m_handles.find(path);
+        if (it != m_handles.end() && it->second == pooled)
+            m_handles.erase(it);
+        return false;
+    }
+
+    return true;
+}
+
+// Drop a source's handle
+void SourceHandlePool::Invalidate(const std::wstring& path)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_handles.erase(path);
+}
+
+// Drop every handle
+void SourceHandlePool::CloseAll()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_handles.clear();
+    m_openCount = 0;
+}
+
+// Number of times a source has been opened since the last CloseAll
+long long SourceHandlePool::GetOpenCount() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_openCount;
+}
@@ -1,163 +1,239 @@
 #include "../include/SpeedMeasure.h"
+#include "../include/AlignedBufferPool.h"
 #include <algorithm>
 #include <map>
+#include <cmath>
+#include <boost/thread/thread.hpp>
+
+// Smallest read timed for the first-byte latency
+static const uint32_t LATENCY_READ_SIZE = 4096;
+
+// Median and interquartile range of a set of timings
+static void Summarize(std::vector<double>& values, double* median, double* spread)
+{
+    std::sort(values.begin(), values.end());
+    size_t count = values.size();
+    *median = count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+    *spread = values[(count * 3) / 4] - values[count / 4];
+}
 
 SpeedMeasure::SpeedMeasure()
+    : m_backend(IoBackend::GetNative())
 {
-    // Allocate the measurement buffer
-    m_buffer = std::make_unique<BYTE[]>(SAMPLE_SIZE);
 }
 
 SpeedMeasure::~SpeedMeasure()
 {
-    // Buffer will be automatically cleaned up by unique_ptr
 }
 
-// Measure speed of a single source file
-long long SpeedMeasure::MeasureSourceSpeed(const std::wstring& sourcePath)
+// Probe a single source file
+SourceSpeed SpeedMeasure::ProbeSource(const std::wstring& sourcePath)
 {
-    // Open the file
-    HANDLE hFile = CreateFile(
-        sourcePath.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        NULL,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS,
-        NULL);
-
-    if (hFile == INVALID_HANDLE_VALUE)
+    SourceSpeed failed = SourceSpeed();
+    failed.speed = -1;
+
+    long long fileSize = 0;
+    if (!m_backend->GetSize(sourcePath, &fileSize) || fileSize <= 0)
     {
-        return -1;  // Error opening file
+        return failed;  // Error reading the file's size, or nothing to read
     }
 
-    // Measure the file speed
-    long long speed = MeasureFileSpeed(hFile);
+    // Unbuffered reads need aligned offsets and lengths
+    uint32_t alignment = 0;
+    if (!m_backend->GetIoAlignment(sourcePath, &alignment) || alignment == 0)
+    {
+        alignment = LATENCY_READ_SIZE;
+    }
 
-    // Close the file
-    CloseHandle(hFile);
+    // Bypass the cache if the filesystem allows it; otherwise each range is
+    // evicted before it is read
+    bool unbuffered = true;
+    FileHandle file = m_backend->OpenForRead(sourcePath, true);
+    if (file == INVALID_FILE_HANDLE)
+    {
+        unbuffered = false;
+        file = m_backend->OpenForRead(sourcePath);
+    }
+    if (file == INVALID_FILE_HANDLE)
+    {
+        return failed;  // Error opening file
+    }
 
-    return speed;
+    SourceSpeed result = ProbeFile(file, fileSize, alignment, unbuffered);
+    m_backend->Close(file);
+    return result;
 }
 
-// Measure speeds of a list of sources and sort by speed
-bool SpeedMeasure::MeasureAndSortSources(std::vector<std::wstring>& sources)
+// Measure speed of a single source file
+long long SpeedMeasure::MeasureSourceSpeed(const std::wstring& sourcePath)
+{
+    return ProbeSource(sourcePath).speed;
+}
+
+// Probe a list of sources and sort them by speed
+bool SpeedMeasure::MeasureAndSortSources(std::vector<std::wstring>& sources, std::vector<SourceSpeed>& speeds)
 {
+    speeds.clear();
     if (sources.empty())
     {
         return false;
     }
 
-    // Map of source paths to their speeds
-    std::map<std::wstring, long long> sourceSpeedMap;
+    // One thread per device: sources on different devices are probed at
+    // once, those sharing a device one after another so they don't skew
+    // each other's timings
+    std::map<unsigned long long, std::vector<size_t>> devices;
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        unsigned long long deviceId = 0;
+        if (!m_backend->GetDeviceId(sources[i], &deviceId))
+        {
+            deviceId = ~0ULL - i;  // Unknown device: a group of its own
+        }
+        devices[deviceId].push_back(i);
+    }
 
-    // Measure each source
-    for (const auto& path : sources)
+    std::vector<SourceSpeed> results(sources.size());
+    boost::thread_group threads;
+    for (const auto& device : devices)
     {
-        long long speed = MeasureSourceSpeed(path);
-        sourceSpeedMap[path] = speed;
+        const std::vector<size_t>& indices = device.second;
+        threads.create_thread([this, &sources, &results, &indices]() {
+            for (size_t index : indices)
+            {
+                results[index] = ProbeSource(sources[index]);
+            }
+        });
     }
+    threads.join_all();
 
     // Sort the sources by speed (descending)
-    std::sort(sources.begin(), sources.end(),
-        [&sourceSpeedMap](const std::wstring& a, const std::wstring& b) {
-            return sourceSpeedMap[a] > sourceSpeedMap[b];
+    std::vector<size_t> order(sources.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&results](size_t a, size_t b) {
+            return results[a].speed > results[b].speed;
         });
 
-    return true;
+    std::vector<std::wstring> sorted;
+    bool anyMeasured = false;
+    for (size_t index : order)
+    {
+        sorted.push_back(sources[index]);
+        speeds.push_back(results[index]);
+        anyMeasured = anyMeasured || results[index].speed >= 0;
+    }
+    sources.swap(sorted);
+
+    return anyMeasured;
 }
 
-// Read a sample of data to measure speed
-long long SpeedMeasure::MeasureFileSpeed(HANDLE hFile)
+// Backend the sources are read through
+void SpeedMeasure::SetIoBackend(const std::shared_ptr<IoBackend>& backend)
 {
-    if (!m_buffer)
-    {
-        return -1;  // Buffer not available
-    }
+    m_backend = backend ? backend : IoBackend::GetNative();
+}
 
-    // Try multiple measurements and take the average for more accuracy
-    const int NUM_MEASUREMENTS = 3;
-    long long totalSpeed = 0;
-    int validMeasurements = 0;
+// Time rounds of cold reads, growing them until the timings agree
+SourceSpeed SpeedMeasure::ProbeFile(FileHandle file, long long fileSize, uint32_t alignment, bool unbuffered)
+{
+    SourceSpeed result = SourceSpeed();
+    result.speed = -1;
 
-    for (int i = 0; i < NUM_MEASUREMENTS; i++)
+    uint32_t latencySize = static_cast<uint32_t>(AlignedBufferPool::AlignUp(LATENCY_READ_SIZE, alignment));
+    AlignedBufferPool buffers(MAX_SAMPLE_SIZE + latencySize, alignment);
+    uint8_t* buffer = buffers.Acquire();
+    if (!buffer)
     {
-        // Choose a different position in the file for each measurement
-        LARGE_INTEGER fileSize;
-        if (!GetFileSizeEx(hFile, &fileSize))
-        {
-            return -1;
-        }
+        return result;  // Out of memory
+    }
 
-        // Skip this measurement if file is too small
-        if (fileSize.QuadPart < SAMPLE_SIZE)
+    double probeStart = m_backend->GetTime();
+    uint32_t sampleSize = MIN_SAMPLE_SIZE;
+    int sample = 0;
+    for (;;)
+    {
+        // Never read past the file by more than alignment needs
+        long long fileEnd = AlignedBufferPool::AlignUp(fileSize, alignment);
+        uint32_t readSize = static_cast<uint32_t>(std::min<long long>(sampleSize, std::max<long long>(fileEnd - latencySize, 0)));
+        bool wholeFile = latencySize + static_cast<long long>(readSize) >= fileSize;
+
+        std::vector<double> speeds;
+        std::vector<double> latencies;
+        double shortestRead = 1e9;
+        bool uncached = unbuffered;
+        for (int i = 0; i < SAMPLES_PER_ROUND; i++)
         {
-            if (i == 0)
+            // Spread the reads over the file in golden-ratio steps, which
+            // don't come back to the same place for a long while
+            double fraction = std::fmod(sample++ * 0.6180339887498949, 1.0);
+            long long room = std::max<long long>(fileSize - latencySize - readSize, 0);
+            long long offset = static_cast<long long>(room * fraction);
+            offset -= offset % alignment;
+
+            if (!unbuffered)
             {
-                // If first measurement, try to read what we can
-                SetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+                uncached = m_backend->DropCache(file, offset, latencySize + readSize) && uncached;
             }
-            else
-            {
-                // Otherwise skip this measurement
-                continue;
-            }
-        }
-        else
-        {
-            // Find a suitable random position, avoiding the very beginning and end
-            // Use a simple algorithm to distribute the positions across the file
-            LONGLONG position = 0;
-            if (fileSize.QuadPart > SAMPLE_SIZE * 3)
+
+            // The first block's read is mostly waiting for the device to
+            // answer; the read after it is mostly transfer
+            double start = m_backend->GetTime();
+            uint32_t latencyBytes = 0;
+            if (!m_backend->ReadAt(file, offset, buffer, latencySize, &latencyBytes) || latencyBytes == 0)
             {
-                position = (fileSize.QuadPart / 4) * (i + 1);
-                position = min(position, fileSize.QuadPart - SAMPLE_SIZE * 2);
+                return result;
             }
+            double firstByte = m_backend->GetTime();
 
-            // Set the file pointer to the calculated position
-            LARGE_INTEGER distanceToMove;
-            distanceToMove.QuadPart = position;
-            if (!SetFilePointerEx(hFile, distanceToMove, NULL, FILE_BEGIN))
+            uint32_t bytesRead = 0;
+            if (readSize > 0 && !m_backend->ReadAt(file, offset + latencySize, buffer + latencySize, readSize, &bytesRead))
             {
-                return -1;
+                return result;
             }
-        }
-
-        // Get starting time with high precision
-        LARGE_INTEGER frequency, startTime, endTime;
-        QueryPerformanceFrequency(&frequency);
-        QueryPerformanceCounter(&startTime);
+            double end = m_backend->GetTime();
 
-        // Read a sample from the file
-        DWORD bytesRead = 0;
-        BOOL result = ReadFile(hFile, m_buffer.get(), SAMPLE_SIZE, &bytesRead, NULL);
-
-        // Get ending time
-        QueryPerformanceCounter(&endTime);
-
-        // Calculate speed
-        if (result && bytesRead > 0)
-        {
-            // Calculate elapsed time in seconds
-            double elapsedSeconds = static_cast<double>(endTime.QuadPart - startTime.QuadPart) /
-                static_cast<double>(frequency.QuadPart);
+            double latency = firstByte - start;
+            double transfer = end - firstByte;
 
-            if (elapsedSeconds > 0.0)
+            // A file too small for a second read is timed as a whole
+            if (bytesRead == 0)
             {
-                // Calculate speed in Kbps (kilobits per second)
-                // 8 bits per byte, 1000 bits per Kbit
-                long long speedKbps = static_cast<long long>((bytesRead * 8) / (elapsedSeconds * 1000));
-                totalSpeed += speedKbps;
-                validMeasurements++;
+                bytesRead = latencyBytes;
+                transfer = latency;
             }
+            transfer = std::max(transfer, 1e-9);
+
+            latencies.push_back(latency);
+            speeds.push_back(bytesRead * 8.0 / (transfer * 1000));  // Kbps: 8 bits per byte, 1000 bits per Kbit
+            shortestRead = std::min(shortestRead, transfer);
         }
-    }
 
-    // Calculate average speed
-    if (validMeasurements > 0)
-    {
-        return totalSpeed / validMeasurements;
+        double speed, speedSpread, latency, latencySpread;
+        Summarize(speeds, &speed, &speedSpread);
+        Summarize(latencies, &latency, &latencySpread);
+        result.speed = static_cast<long long>(speed);
+        result.speedSpread = static_cast<long long>(speedSpread);
+        result.latency = latency;
+        result.latencySpread = latencySpread;
+        result.sampleSize = readSize;
+        result.sampleCount = SAMPLES_PER_ROUND;
+        result.uncached = uncached;
+
+        // Stop once the timings agree, or the reads can't grow any more
+        bool stable = shortestRead >= MIN_READ_SECONDS && shortestRead >= LATENCY_SHARE * latency &&
+            speedSpread <= MAX_SPREAD * speed;
+        double elapsed = m_backend->GetTime() - probeStart;
+        if (stable || wholeFile || sampleSize >= MAX_SAMPLE_SIZE || elapsed >= TIME_BUDGET)
+        {
+            break;
+        }
+        sampleSize *= 2;
     }
 
-    return -1;  // No valid measurements
-}
\ No newline at end of file
+    buffers.Release(buffer);
+    return result;
+}
@@ -0,0 +1,156 @@
+#include "../include/ZeroDetector.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define ZERO_DETECT_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define ZERO_DETECT_NEON
+#include <arm_neon.h>
+#endif
+
+// Portable fallback, also used for the bytes left over by the vector loops
+static bool IsZeroScalar(const uint8_t* data, size_t length)
+{
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        bits |= word;
+    }
+    for (; i < length; i++)
+    {
+        bits |= data[i];
+    }
+    return bits == 0;
+}
+
+#ifdef ZERO_DETECT_X64
+
+// 64 bytes per step; SSE2 is always there on x64
+static bool IsZeroSse2(const uint8_t* data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48));
+        __m128i bits = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+        // Stop at the first step with a nonzero byte
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+    return IsZeroScalar(data + i, length - i);
+}
+
+// 128 bytes per step
+TARGET_AVX2 static bool IsZeroAvx2(const uint8_t* data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 64));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 96));
+        __m256i bits = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+        if (!_mm256_testz_si256(bits, bits))
+            return false;
+    }
+    return IsZeroSse2(data + i, length - i);
+}
+
+// Check if the CPU and OS support AVX2
+static bool HasAvx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // The OS must save the YMM registers (OSXSAVE and XCR0 bits 1-2)
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+#ifdef ZERO_DETECT_NEON
+
+// 64 bytes per step
+static bool IsZeroNeon(const uint8_t* data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        uint8x16_t a = vld1q_u8(data + i);
+        uint8x16_t b = vld1q_u8(data + i + 16);
+        uint8x16_t c = vld1q_u8(data + i + 32);
+        uint8x16_t d = vld1q_u8(data + i + 48);
+        uint8x16_t bits = vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d));
+
+        if (vmaxvq_u8(bits) != 0)
+            return false;
+    }
+    return IsZeroScalar(data + i, length - i);
+}
+
+#endif
+
+typedef bool (*IsZeroFunc)(const uint8_t* data, size_t length);
+
+// Implementation picked for this CPU
+struct ZeroImplementation {
+    IsZeroFunc func;
+    const wchar_t* name;
+};
+
+// Pick the implementation once
+static const ZeroImplementation& GetImplementation()
+{
+    static const ZeroImplementation implementation = []() {
+#if defined(ZERO_DETECT_X64)
+        if (HasAvx2())
+            return ZeroImplementation{ IsZeroAvx2, L"avx2" };
+        return ZeroImplementation{ IsZeroSse2, L"sse2" };
+#elif defined(ZERO_DETECT_NEON)
+        return ZeroImplementation{ IsZeroNeon, L"neon" };
+#else
+        return ZeroImplementation{ IsZeroScalar, L"scalar" };
+#endif
+    }();
+    return implementation;
+}
+
+// Check if every byte of a buffer is zero
+bool ZeroDetector::IsZero(const void* data, size_t length)
+{
+    return GetImplementation().func(static_cast<const uint8_t*>(data), length);
+}
+
+// Name of the implementation in use
+const wchar_t* ZeroDetector::GetImplementationName()
+{
+    return GetImplementation().name;
+}